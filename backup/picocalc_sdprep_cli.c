@@ -1,7 +1,12 @@
 #define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <linux/fs.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -10,12 +15,281 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
-static void die(const char *msg) { perror(msg); exit(EXIT_FAILURE); }
-static void xdie(const char *msg) { fprintf(stderr, "Error: %s\n", msg); exit(EXIT_FAILURE); }
+#include "sdbmap.h"
+#include "sdcap.h"
+#include "sdclus.h"
+#include "sddb.h"
+#include "sddup.h"
+#include "sdenum.h"
+#include "sdfat.h"
+#include "sdfsck.h"
+#include "sdhash.h"
+#include "sdinhibit.h"
+#include "sdman.h"
+#include "sdmetrics.h"
+#include "sdplan.h"
+#include "sdpool.h"
+#include "sdresume.h"
+#include "sdscan.h"
+#include "sdsweep.h"
+#include "sdimg.h"
+#include "sdio.h"
+
+#define EXIT_ABORTED 130
+#define CLUSTER_AUTO UINT32_MAX   // --cluster auto: measure, or this model's cached size
+
+// Abort: SIGINT/SIGTERM raise cancel_flag, which every device carries;
+// the engine stops at its next request and the failing call reports
+// where the current stage got to. An external command gets the signal.
+static volatile sig_atomic_t cancel_flag;
+static volatile sig_atomic_t started;
+static volatile pid_t cmd_pid;
+static const char *stage = "startup";
+static sdio_dev *stage_dev;
+
+static void on_signal(int sig) {
+    cancel_flag = 1;
+    if (!started) {
+        static const char msg[] = "\nAborted: nothing was written.\n";
+        ssize_t rc = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+        (void)rc;
+        _exit(EXIT_ABORTED);
+    }
+    if (cmd_pid > 0) kill(cmd_pid, sig);
+}
+
+static void install_abort_handler(void) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+}
+
+// Card history: the job's record collects stage times as they pass and
+// is appended when the process exits, however it exits. The station
+// metrics (if SDPREP_METRICS_DIR is set) follow the same record.
+#define SPEED_MIN (64 * SDIO_MIB)   // a stage must move this much to time the card
+
+static sddb_rec rec;
+static bool rec_on;
+static sdio_dev *rec_dev;           // the job's device, for model and parameters
+static const char *rec_path;
+static const char *rec_stage;
+static sdio_dev *rec_stage_dev;
+static double rec_t0, rec_stage_t0;
+static uint64_t rec_stage_bytes, rec_bulk;
+static double rec_bulk_sec;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// JSON lines (--json): one object per stage and per card on the real
+// stdout, for orchestration; text meant for people goes to stderr.
+static FILE *json_out;
+static const char *job_dev;        // device(s) the stage events belong to
+static double t_start;
+
+static void json_str(const char *s) {
+    fputc('"', json_out);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') fprintf(json_out, "\\%c", c);
+        else if (c == '\n') fputs("\\n", json_out);
+        else if (c < 0x20) fprintf(json_out, "\\u%04x", c);
+        else fputc(c, json_out);
+    }
+    fputc('"', json_out);
+}
+
+static void json_begin(const char *event) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    fputs("{\"event\":", json_out);
+    json_str(event);
+    fprintf(json_out, ",\"time\":%lld.%03ld,\"device\":", (long long)ts.tv_sec,
+            ts.tv_nsec / 1000000);
+    json_str(job_dev ? job_dev : "");
+}
+
+static void json_end(void) {
+    fputs("}\n", json_out);
+    fflush(json_out);
+}
+
+// "skipped…" means the card needed nothing; "ok" is the only success
+static bool outcome_ok(const char *outcome) {
+    return strcmp(outcome, "ok") == 0 || strncmp(outcome, "skipped", 7) == 0;
+}
+
+// A card's final result; with r, its bytes, speed and stage times
+static void json_result(const char *dev, const char *job, const char *outcome,
+                        double seconds, const sddb_rec *r) {
+    if (!json_out) return;
+    const char *saved = job_dev;
+    job_dev = dev;
+    json_begin("result");
+    job_dev = saved;
+    fputs(",\"job\":", json_out);
+    json_str(job);
+    fputs(",\"outcome\":", json_out);
+    json_str(outcome);
+    fprintf(json_out, ",\"ok\":%s,\"seconds\":%.3f", outcome_ok(outcome) ? "true" : "false",
+            seconds);
+    if (r) {
+        fprintf(json_out, ",\"bytes\":%llu,\"mbps\":%.2f,\"stages\":{",
+                (unsigned long long)r->bytes, r->mbps);
+        for (int i = 0; i < r->ntimes; i++) {
+            fputs(i ? "," : "", json_out);
+            json_str(r->times[i].name);
+            fprintf(json_out, ":%.3f", r->times[i].seconds);
+        }
+        fputc('}', json_out);
+    }
+    json_end();
+}
+
+static void rec_close_stage(void) {
+    if (!rec_on || !rec_stage) return;
+    double dt = now_sec() - rec_stage_t0;
+    sddb_stage(&rec, rec_stage, dt);
+    if (rec_stage_dev && dt > 0) {
+        uint64_t b = rec_stage_dev->stats.written - rec_stage_bytes;
+        if (b >= SPEED_MIN && b > rec_bulk) {
+            rec_bulk = b;
+            rec_bulk_sec = dt;
+            rec.mbps = (double)b / dt / 1e6;
+            rec.params = rec_stage_dev->params;
+        }
+    }
+    rec_stage = NULL;
+}
+
+// "ok", "aborted" or "failed" for the metrics; a mismatch is a failure
+static const char *outcome_class(const char *outcome) {
+    if (strcmp(outcome, "ok") == 0 || strcmp(outcome, "aborted") == 0) return outcome;
+    return "failed";
+}
+
+// Called on every normal return; atexit() catches die() and friends,
+// which exit from inside the job while its device is still in scope.
+static void rec_finish(void) {
+    if (!rec_on) return;
+    rec_close_stage();
+    rec.seconds = now_sec() - rec_t0;
+    if (rec_dev) {
+        snprintf(rec.model, sizeof(rec.model), "%.95s", rec_dev->ident);
+        rec.size = rec_dev->size;
+        if (!rec_bulk) rec.params = rec_dev->params;
+        rec.bytes = rec_dev->stats.written;
+    }
+    rec_on = false;
+    if (sddb_append(&rec) != 0)
+        fprintf(stderr, "Note: card history not updated: %s\n", strerror(errno));
+
+    sdmetrics_bytes(rec.id.reader[0] ? rec.id.reader : rec.model, rec.bytes, rec_bulk_sec);
+    sdmetrics_card(outcome_class(rec.outcome));
+    sdmetrics_close();
+    json_result(rec_path, rec.job, rec.outcome[0] ? rec.outcome : "failed", rec.seconds, &rec);
+}
+
+static void rec_begin(const char *job, const char *dev) {
+    sdmetrics_open(job, dev);
+    rec_path = job_dev = dev;
+    sddb_begin(&rec, dev, job);
+    rec_on = true;
+    rec_t0 = now_sec();
+    atexit(rec_finish);
+}
+
+__attribute__((format(printf, 1, 2)))
+static void rec_outcome(const char *fmt, ...) {
+    if (!rec_on) return;
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(rec.outcome, sizeof(rec.outcome), fmt, ap);
+    va_end(ap);
+}
+
+// Name the step now running (and the device it works on, if the engine
+// does the I/O); printed so a front end can follow along.
+static void set_stage(const char *name, sdio_dev *dev) {
+    stage = name;
+    stage_dev = dev;
+    if (dev) dev->cancel = &cancel_flag;
+    if (rec_on) {
+        rec_close_stage();
+        rec_stage = name;
+        rec_stage_dev = dev;
+        rec_stage_bytes = dev ? dev->stats.written : 0;
+        rec_stage_t0 = now_sec();
+    }
+    sdmetrics_stage(name);
+    started = 1;
+    printf("Stage: %s\n", name);
+    fflush(stdout);
+    if (json_out) {
+        json_begin("stage");
+        fputs(",\"stage\":", json_out);
+        json_str(name);
+        json_end();
+    }
+}
+
+// Failures outside a card's job (bad arguments, a device that will not
+// open before the job starts) as an "error" event
+static void json_error(const char *msg) {
+    if (!json_out || rec_on) return;
+    json_begin("error");
+    fputs(",\"message\":", json_out);
+    json_str(msg);
+    json_end();
+}
+
+static void report_abort(bool have_offset) {
+    rec_outcome("aborted");
+    fflush(stdout);
+    if (have_offset && stage_dev)
+        fprintf(stderr, "\nAborted: %s stopped at byte %llu (%llu MiB) of %s\n", stage,
+                (unsigned long long)stage_dev->reached,
+                (unsigned long long)(stage_dev->reached / SDIO_MIB), stage_dev->path);
+    else
+        fprintf(stderr, "\nAborted: during %s\n", stage);
+    exit(EXIT_ABORTED);
+}
+
+static void die(const char *msg) {
+    if (cancel_flag) report_abort(errno == ECANCELED);
+    int e = errno;
+    rec_outcome("failed: %s: %s", msg, strerror(e));
+    if (json_out && !rec_on) {
+        char full[256];
+        snprintf(full, sizeof(full), "%s: %s", msg, strerror(e));
+        json_error(full);
+    }
+    errno = e;
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+static void xdie(const char *msg) {
+    if (cancel_flag) report_abort(false);
+    rec_outcome("failed: %s", msg);
+    json_error(msg);
+    fprintf(stderr, "Error: %s\n", msg);
+    exit(EXIT_FAILURE);
+}
 
 static int run_cmd(char *const argv[]) {
     pid_t pid = fork();
@@ -25,8 +299,14 @@ static int run_cmd(char *const argv[]) {
         perror("execvp");
         _exit(127);
     }
+    cmd_pid = pid;
+    if (cancel_flag) kill(pid, SIGTERM);
     int st = 0;
-    if (waitpid(pid, &st, 0) < 0) die("waitpid");
+    pid_t w;
+    while ((w = waitpid(pid, &st, 0)) < 0 && errno == EINTR) {}
+    cmd_pid = 0;
+    if (w < 0) die("waitpid");
+    if (cancel_flag) report_abort(false);
     if (!WIFEXITED(st) || WEXITSTATUS(st) != 0) {
         fprintf(stderr, "Command failed:");
         for (int i = 0; argv[i]; ++i) fprintf(stderr, " %s", argv[i]);
@@ -36,15 +316,6 @@ static int run_cmd(char *const argv[]) {
     return 0;
 }
 
-static int64_t get_dev_size_bytes(const char *dev) {
-    int fd = open(dev, O_RDONLY | O_CLOEXEC);
-    if (fd < 0) die("open device");
-    uint64_t bytes = 0;
-    if (ioctl(fd, BLKGETSIZE64, &bytes) < 0) die("ioctl BLKGETSIZE64");
-    close(fd);
-    return (int64_t)bytes;
-}
-
 static bool is_block_device(const char *path) {
     struct stat st;
     if (stat(path, &st) != 0) return false;
@@ -55,12 +326,6 @@ static void require_root() {
     if (geteuid() != 0) xdie("Run as root (sudo).");
 }
 
-static bool ends_with_digit(const char *s) {
-    size_t n = strlen(s);
-    if (n == 0) return false;
-    return (s[n-1] >= '0' && s[n-1] <= '9');
-}
-
 static void unmount_all(const char *dev) {
     // best-effort: use `lsblk -rno MOUNTPOINT`
     char cmd[512];
@@ -80,6 +345,764 @@ static void unmount_all(const char *dev) {
     pclose(fp);
 }
 
+// Keep the desktop from mounting the targets again (or the partitions we
+// create) until this process is gone; one unmount pass is then enough
+static void inhibit_automount(char **devs, int n) {
+    if (sdinhibit_begin(devs, n) != 0) {
+        fprintf(stderr, "Note: automounting not inhibited: %s\n", strerror(errno));
+        return;
+    }
+    atexit(sdinhibit_end);
+}
+
+// Basic root-device guard: ensure target is not root's parent device
+// (best-effort, user must still confirm exact path). Looked up once.
+static bool is_root_device(const char *dev) {
+    static char parent[300];
+    static bool looked;
+    if (!looked) {
+        looked = true;
+        FILE *fp = popen("df --output=source / | tail -1", "r");
+        if (!fp) return false;
+        char src[512] = {0};
+        if (fgets(src, sizeof(src), fp)) {
+            src[strcspn(src, "\n")] = 0;
+            // Get parent disk of root
+            char cmd[600];
+            snprintf(cmd, sizeof(cmd), "lsblk -no PKNAME %s 2>/dev/null", src);
+            FILE *fp2 = popen(cmd, "r");
+            if (fp2) {
+                char pk[256] = {0};
+                if (fgets(pk, sizeof(pk), fp2)) {
+                    pk[strcspn(pk, "\n")] = 0;
+                    if (pk[0]) snprintf(parent, sizeof(parent), "/dev/%s", pk);
+                }
+                pclose(fp2);
+            }
+        }
+        pclose(fp);
+    }
+    return parent[0] && strcmp(parent, dev) == 0;
+}
+
+static void refuse_root_device(const char *dev) {
+    if (is_root_device(dev)) {
+        fprintf(stderr, "Error: %s appears to contain the root filesystem.\n", dev);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// The whole disk a block device belongs to: a partition's parent in sysfs
+static dev_t whole_disk(dev_t rdev) {
+    char path[96];
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/partition", major(rdev), minor(rdev));
+    if (access(path, F_OK) != 0) return rdev;
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../dev", major(rdev), minor(rdev));
+    FILE *fp = fopen(path, "r");
+    if (!fp) return rdev;
+    unsigned maj, min;
+    dev_t disk = fscanf(fp, "%u:%u", &maj, &min) == 2 ? makedev(maj, min) : rdev;
+    fclose(fp);
+    return disk;
+}
+
+// A source card must never also be a target (or one of its partitions).
+// Compared by device number, so /dev/sdaa is not /dev/sda.
+static bool is_same_disk(const char *src, const char *dev) {
+    struct stat a, b;
+    if (stat(src, &a) != 0 || stat(dev, &b) != 0) return false;
+    if (!S_ISBLK(a.st_mode) || !S_ISBLK(b.st_mode)) return false;
+    return whole_disk(a.st_rdev) == whole_disk(b.st_rdev);
+}
+
+static void log_line(void *ctx, const char *msg) {
+    printf("%s: %s\n", (const char *)ctx, msg);
+    fflush(stdout);
+}
+
+static void show_progress(void *ctx, uint64_t done, uint64_t total) {
+    (void)ctx;
+    sdmetrics_progress(done, total);
+    static time_t last;
+    time_t now = time(NULL);
+    if (now == last && done < total) return;
+    last = now;
+    fprintf(stderr, "\r  %llu / %llu MiB", (unsigned long long)(done / SDIO_MIB),
+            (unsigned long long)(total / SDIO_MIB));
+    if (done >= total) fputc('\n', stderr);
+}
+
+// Record what was provisioned in the reserved partition 2 (at its end if
+// payload bytes lead it). Blocks the manifest itself lands on are left
+// out of it.
+static void record_manifest(sdio_dev *io, const char *name, uint64_t id,
+                            sdhash_list *hl, uint64_t payload, bool force) {
+    set_stage("manifest", io);
+    sdman m;
+    memset(&m, 0, sizeof(m));
+    snprintf(m.name, sizeof(m.name), "%s", name);
+    m.image_id = id;
+    m.payload = payload;
+
+    sdfat_part part[4];
+    sdfat_bpb bpb;
+    if (sdfat_read_mbr(io, part) == 0) {
+        m.p1_start = part[0].start;
+        m.p1_size = part[0].size;
+        m.p2_start = part[1].start;
+        m.p2_size = part[1].size;
+        if (part[0].type && sdfat_read_bpb(io, part[0].start, &bpb) == 0)
+            memcpy(m.label, bpb.label, sizeof(m.label));
+    }
+
+    sdio_extent self = { sdman_offset(m.p2_start, m.p2_size, payload, hl->n), sdman_size(hl->n) };
+    for (size_t i = 0; i < hl->n; i++) {
+        uint64_t off = (uint64_t)i * hl->block_size;
+        if (off < self.off + self.len && off + hl->block_size > self.off) hl->h[i] = 0;
+    }
+    m.hashes = *hl;
+
+    if (sdman_write(io, &m, force) == 0)
+        printf("Manifest written to partition 2 (%zu block hashes)\n", sdhash_recorded(hl));
+    else if (errno == ENOENT)
+        puts("No manifest: the card has no partition 2.");
+    else if (errno == EEXIST)
+        puts("No manifest: partition 2 holds other data.");
+    else if (errno == E2BIG)
+        puts("No manifest: no room in partition 2.");
+    else if (errno == ECANCELED)
+        die("manifest");
+    else
+        printf("No manifest: %s\n", strerror(errno));
+}
+
+static const char *base_name(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+// Hash list for delta writes: given, the sidecar, or built from the image
+static void load_hashes(const char *image, const char *path, sdhash_list *hl) {
+    char *side = path ? NULL : sdhash_sidecar(image);
+    if (!path) path = side;
+    if (sdhash_list_load(path, hl) == 0) {
+        printf("Hash list %s: %zu blocks of %u KiB\n", path, hl->n, hl->block_size / 1024);
+        free(side);
+        return;
+    }
+    if (errno != ENOENT) die("load hash list");
+
+    printf("No hash list at %s, hashing the image...\n", path);
+    sdimg *im = sdimg_open(image, 0);
+    if (!im) die("open image");
+    if (sdhash_list_build(im, sdimg_size(im), SDHASH_BLOCK, hl) != 0) die("hash image");
+    sdimg_close(im);
+    if (sdhash_list_save(path, hl) != 0)
+        fprintf(stderr, "Warning: could not save %s: %s\n", path, strerror(errno));
+    free(side);
+}
+
+// Delta re-provisioning: hash what the card holds, write what differs
+static void flash_delta(sdio_dev *io, const char *image, const char *hashes_path,
+                        bool trust_manifest) {
+    sdhash_list hl;
+    load_hashes(image, hashes_path, &hl);
+    if (hl.image_size > io->size) xdie("image is larger than the device");
+
+    sdimg *im = sdimg_open(image, 0);
+    if (!im) die("open image");
+    uint64_t size = sdimg_size(im);
+    if (size && size != hl.image_size) xdie("hash list does not match the image size");
+
+    // A manifest that survives a spot check saves reading the whole card,
+    // but cannot see changes made since; only for cards known untouched
+    sdman m;
+    const sdhash_list *known = NULL;
+    if (trust_manifest && sdman_read(io, &m) == 0) {
+        size_t checked, bad;
+        if (sdhash_sample(io, &m.hashes, 32, 4, &checked, &bad) == 0 && bad == 0) {
+            printf("Manifest on card: %s, %zu sampled blocks match\n", m.name, checked);
+            known = &m.hashes;
+        } else {
+            printf("Manifest on card does not match its contents, ignoring it\n");
+            sdman_free(&m);
+        }
+    }
+
+    set_stage("compare", io);
+    printf("Comparing %llu MiB of %s with the image...\n",
+           (unsigned long long)(hl.image_size / SDIO_MIB), io->path);
+    sdio_extent *diff = NULL;
+    size_t ndiff = 0;
+    uint64_t diff_bytes = 0;
+    if (sdhash_diff(io, &hl, known, 4, &diff, &ndiff, &diff_bytes) != 0) die("read device");
+    if (known) sdman_free(&m);
+    printf("%llu of %llu MiB differ in %zu range%s\n",
+           (unsigned long long)(diff_bytes / SDIO_MIB),
+           (unsigned long long)(hl.image_size / SDIO_MIB), ndiff, ndiff == 1 ? "" : "s");
+
+    if (ndiff > 0) {
+        set_stage("write changes", io);
+        sdio_sparse sp = { .map = diff, .nmap = ndiff, .skip_zero = true, .keep = true };
+        if (sdio_write_sparse(io, 0, hl.image_size, sdimg_fill, im, &sp) != 0) die("write image");
+        printf("Wrote %llu MiB, device-zeroed %llu MiB, kept %llu MiB unchanged\n",
+               (unsigned long long)(io->stats.written / SDIO_MIB),
+               (unsigned long long)(io->stats.zeroed / SDIO_MIB),
+               (unsigned long long)(io->stats.skipped / SDIO_MIB));
+    } else {
+        puts("Card already matches the image.");
+    }
+    if (sdio_flush(io) != 0) die("flush");
+    record_manifest(io, base_name(image), sdman_image_id(&hl), &hl, 0, false);
+
+    free(diff);
+    sdhash_list_free(&hl);
+    sdimg_close(im);
+}
+
+// Where an image write starts: 0, or the card's checkpoint for this image
+// once the image prefix hashes the same and the card still holds it. The
+// prefix is consumed through tee; on a mismatch the image is reopened.
+static uint64_t resume_point(sdio_dev *io, sdimg **im, const char *image, sdhash_tee *tee,
+                             const char *card, const char *key, const sdbmap *bm,
+                             bool restart) {
+    sdhash_list ck;
+    if (!sdresume_load(card, key, &ck)) return 0;
+    if (restart || ck.image_size >= io->size) {
+        sdhash_list_free(&ck);
+        sdresume_drop(card);
+        return 0;
+    }
+
+    printf("Checkpoint at %llu MiB for this card and image, checking...\n",
+           (unsigned long long)(ck.image_size / SDIO_MIB));
+    fflush(stdout);
+    set_stage("resume check", io);
+    sdio_progress_fn progress = io->progress;
+    io->progress = NULL;   // a few blocks, no progress line
+    int bad = sdresume_check(io, &ck, bm->ext, bm->n);
+    io->progress = progress;
+    if (bad < 0) die("read device");
+    uint64_t from = 0;
+    if (bad > 0) {
+        printf("The card no longer holds the checkpointed data; writing from the start.\n");
+    } else if (!sdresume_skip(tee, &ck)) {
+        printf("The image changed since the checkpoint; writing from the start.\n");
+        sdhash_list_free(&tee->hl);
+        sdimg_close(*im);
+        if (!(*im = sdimg_open(image, 0))) die("open image");
+        if (sdhash_tee_init(tee, sdimg_fill, *im, SDHASH_BLOCK) != 0) die("hash");
+    } else {
+        from = ck.image_size;
+        printf("Resuming at %llu MiB.\n", (unsigned long long)(from / SDIO_MIB));
+    }
+    if (!from) sdresume_drop(card);
+    sdhash_list_free(&ck);
+    return from;
+}
+
+static void flash_image(sdio_dev *io, const char *image, const char *bmap_path, bool restart) {
+    sdimg *im = sdimg_open(image, 0);
+    if (!im) die("open image");
+
+    // Block map: explicit, or a sidecar next to the image
+    char *found = bmap_path ? NULL : sdbmap_find_sidecar(image);
+    if (found) bmap_path = found;
+    sdbmap bm = {0};
+    if (bmap_path && sdbmap_load(bmap_path, &bm) != 0) die("load block map");
+
+    uint64_t size = sdimg_size(im);
+    if (bmap_path) {
+        if (size && size != bm.image_size) xdie("block map does not match the image size");
+        size = bm.image_size;
+    }
+    if (size > io->size) xdie("image is larger than the device");
+
+    printf("Writing %s (%s, %d decoder thread%s", image,
+           sdimg_format_name(sdimg_format_of(im)), sdimg_threads(im),
+           sdimg_threads(im) == 1 ? "" : "s");
+    if (size) printf(", %llu MiB", (unsigned long long)(size / SDIO_MIB));
+    printf(")...\n");
+    if (bmap_path)
+        printf("Block map %s: %llu of %llu MiB mapped\n", bmap_path,
+               (unsigned long long)(bm.mapped / SDIO_MIB),
+               (unsigned long long)(bm.image_size / SDIO_MIB));
+
+    // The data is hashed on its way through for the manifest and for
+    // checkpoints, so an interrupted write can carry on from the last
+    sdhash_tee tee;
+    if (sdhash_tee_init(&tee, sdimg_fill, im, SDHASH_BLOCK) != 0) die("hash");
+    char card[512], key[4096];
+    sdresume_card_key(io, card, sizeof(card));
+    sdresume_image_key(image, bmap_path, key, sizeof(key));
+    uint64_t from = resume_point(io, &im, image, &tee, card, key, &bm, restart);
+
+    // Unknown decoded size: stream until the image or the device ends
+    set_stage("write image", io);
+    sdio_sparse sp = { .map = bm.ext, .nmap = bm.n, .skip_zero = true };
+    if (sdresume_write(io, from, size ? size - from : 0, &tee, &sp, card, key) != 0) {
+        if (errno == ECANCELED && card[0])
+            fprintf(stderr, "\nThe write resumes from its last checkpoint on the next run.\n");
+        die("write image");
+    }
+    if (!size) {
+        char extra;
+        ssize_t n = sdimg_fill(im, 0, &extra, 1);
+        if (n < 0) die("read image");
+        if (n > 0) xdie("image is larger than the device");
+    }
+
+    printf("Wrote %llu MiB, device-zeroed %llu MiB, skipped %llu MiB unmapped\n",
+           (unsigned long long)(io->stats.written / SDIO_MIB),
+           (unsigned long long)(io->stats.zeroed / SDIO_MIB),
+           (unsigned long long)(io->stats.skipped / SDIO_MIB));
+
+    // Unmapped blocks were discarded, so their contents are not recorded
+    sdhash_list hl;
+    if (sdhash_tee_finish(&tee, &hl) != 0) die("hash");
+    uint64_t id = sdman_image_id(&hl);
+    if (bmap_path) sdhash_list_mask(&hl, bm.ext, bm.n);
+    if (sdio_flush(io) != 0) die("flush");
+    record_manifest(io, base_name(image), id, &hl, 0, false);
+    sdhash_list_free(&hl);
+    sdresume_drop(card);
+
+    sdbmap_free(&bm);
+    free(found);
+    sdimg_close(im);
+}
+
+// A duplicate target's own history record; the cards ran side by side
+static void rec_target(const char *dev, const sdio_dev *io, const sddup_target *t,
+                       time_t when, double dt) {
+    sddb_rec r;
+    sddb_begin(&r, dev, "duplicate");
+    r.when = when;
+    snprintf(r.model, sizeof(r.model), "%.95s", io->ident);
+    r.size = io->size;
+    r.params = io->params;
+    r.bytes = t->done;
+    r.seconds = dt;
+    sddb_stage(&r, "duplicate", dt);
+    if (!t->err && t->done >= SPEED_MIN && dt > 0) r.mbps = (double)t->done / dt / 1e6;
+    if (!t->err) snprintf(r.outcome, sizeof(r.outcome), "ok");
+    else if (t->err == ECANCELED) snprintf(r.outcome, sizeof(r.outcome), "aborted");
+    else snprintf(r.outcome, sizeof(r.outcome), "failed: %s",
+                  t->stalled ? "stalled" : strerror(t->err));
+    if (sddb_append(&r) != 0)
+        fprintf(stderr, "Note: card history not updated: %s\n", strerror(errno));
+
+    sdmetrics_bytes(r.id.reader[0] ? r.id.reader : r.model, r.bytes, r.mbps > 0 ? dt : 0);
+    sdmetrics_card(outcome_class(r.outcome));
+    json_result(dev, "duplicate", r.outcome, dt, &r);
+}
+
+static char *join_devices(char **devs, int n) {
+    size_t len = 1;
+    for (int i = 0; i < n; i++) len += strlen(devs[i]) + 1;
+    char *s = malloc(len);
+    if (!s) return NULL;
+    s[0] = 0;
+    for (int i = 0; i < n; i++) {
+        if (i) strcat(s, ",");
+        strcat(s, devs[i]);
+    }
+    return s;
+}
+
+// One source, many cards: each chunk is read (and decoded) once
+static int duplicate_image(const char *image, char **devs, int n) {
+    sdimg *im = sdimg_open(image, 0);
+    if (!im) die("open image");
+
+    sdio_dev *io = calloc((size_t)n, sizeof(*io));
+    sddup_target *t = calloc((size_t)n, sizeof(*t));
+    if (!io || !t) die("calloc");
+    for (int i = 0; i < n; i++) {
+        io[i].log = log_line;
+        io[i].log_ctx = devs[i];
+        io[i].cancel = &cancel_flag;
+        if (sdio_open(&io[i], devs[i]) != 0) {
+            fprintf(stderr, "%s: %s\n", devs[i], strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        t[i].dev = &io[i];
+    }
+
+    uint64_t size = sdimg_size(im);
+    printf("Duplicating %s (%s", image, sdimg_format_name(sdimg_format_of(im)));
+    if (size) printf(", %llu MiB", (unsigned long long)(size / SDIO_MIB));
+    printf(") to %d devices...\n", n);
+    fflush(stdout);
+
+    char *joined = join_devices(devs, n);
+    job_dev = joined ? joined : devs[0];
+    sdmetrics_open("duplicate", job_dev);
+    set_stage("duplicate", NULL);
+    sddup_opts o = {0};
+    o.stall_sec = 30;
+    o.progress = show_progress;
+    time_t when = time(NULL);
+    double t0 = now_sec();
+    int ok = sddup_run(im, size, t, n, &o);
+    if (ok < 0) die("read image");
+    double dt = now_sec() - t0;
+
+    for (int i = 0; i < n; i++) {
+        if (t[i].err == ECANCELED && t[i].reached != UINT64_MAX)
+            printf("%s: ABORTED, complete up to byte %llu (%llu MiB)\n", devs[i],
+                   (unsigned long long)t[i].reached,
+                   (unsigned long long)(t[i].reached / SDIO_MIB));
+        else if (t[i].err)
+            printf("%s: FAILED after %llu MiB: %s\n", devs[i],
+                   (unsigned long long)(t[i].done / SDIO_MIB),
+                   t[i].stalled ? "stalled" : strerror(t[i].err));
+        else
+            printf("%s: OK, %llu MiB\n", devs[i], (unsigned long long)(t[i].done / SDIO_MIB));
+        rec_target(devs[i], &io[i], &t[i], when, dt);
+        sdio_close(&io[i]);
+    }
+    sdmetrics_close();
+    job_dev = NULL;
+    free(joined);
+    free(t);
+    free(io);
+    sdimg_close(im);
+    return ok;
+}
+
+// Fingerprint check: layout, FAT32 boot sector, FSInfo and label only
+static int check_card(const char *dev, const char *label) {
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    sdio_dev io = {0};
+    if (sdio_open_read(&io, dev) != 0) die("open device");
+    char why[128];
+    bool match = sdfat_is_provisioned(&io, label, why, sizeof(why));
+    sdio_close(&io);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+    if (match) printf("%s: matches, skip (%.1f ms)\n", dev, ms);
+    else printf("%s: needs formatting: %s (%.1f ms)\n", dev, why, ms);
+    if (json_out) {
+        char outcome[160];
+        snprintf(outcome, sizeof(outcome), "needs formatting: %s", why);
+        json_result(dev, "check", match ? "ok" : outcome, ms / 1e3, NULL);
+    }
+    return match ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Check p1's filesystem in place of fsck.fat -n and narrow hl to the
+// blocks it uses, plus everything outside p1. false if p1 is not FAT32.
+// Free clusters can be skipped safely: the FAT's own blocks are among
+// those checked, so a card whose allocation differs from the image's
+// fails on them.
+static bool verify_fs(sdio_dev *io, sdhash_list *hl, sdfsck_report *fr) {
+    sdfat_part part[4];
+    sdfat_bpb bpb;
+    if (sdfat_read_mbr(io, part) != 0 || (part[0].type != 0x0b && part[0].type != 0x0c) ||
+        sdfat_read_bpb(io, part[0].start, &bpb) != 0)
+        return false;
+
+    sdio_extent *used;
+    size_t nused;
+    if (sdfsck_check(io, part[0].start, &bpb, fr, &used, &nused) != 0) die("read filesystem");
+
+    sdio_extent *keep = malloc((nused + 2) * sizeof(*keep));
+    if (!keep) die("verify");
+    size_t n = 0;
+    uint64_t p1_end = part[0].start + part[0].size;
+    keep[n++] = (sdio_extent){ 0, part[0].start };
+    for (size_t i = 0; i < nused; i++)
+        if (used[i].off < p1_end) keep[n++] = used[i];
+    if (io->size > p1_end) keep[n++] = (sdio_extent){ p1_end, io->size - p1_end };
+    sdhash_list_keep(hl, keep, n);
+    free(keep);
+    free(used);
+    return true;
+}
+
+// Read the manifest, check p1's filesystem and spot-check the blocks it
+// uses against the manifest
+static int verify_card(const char *dev, bool full) {
+    sdio_dev io = {0};
+    io.log = log_line;
+    io.log_ctx = (void *)dev;
+    io.progress = show_progress;
+    rec_begin("verify", dev);
+    rec_dev = &io;
+    if (sdio_open_read(&io, dev) != 0) die("open device");
+    set_stage("verify", &io);
+
+    sdman m;
+    if (sdman_read(&io, &m) != 0) {
+        printf("%s: no manifest (%s)\n", dev,
+               errno == ENOENT ? "no partition 2" :
+               errno == ENODATA ? "partition 2 is empty" : strerror(errno));
+        rec_outcome("failed: no manifest");
+        rec_finish();
+        sdio_close(&io);
+        return EXIT_FAILURE;
+    }
+
+    time_t when = (time_t)m.created;
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M", localtime(&when));
+    printf("Provisioned %s with %s (id %016llx)\n", stamp, m.name,
+           (unsigned long long)m.image_id);
+    printf("Layout: p1 %llu+%llu MiB \"%s\", p2 %llu+%llu MiB\n",
+           (unsigned long long)(m.p1_start / SDIO_MIB), (unsigned long long)(m.p1_size / SDIO_MIB),
+           m.label, (unsigned long long)(m.p2_start / SDIO_MIB),
+           (unsigned long long)(m.p2_size / SDIO_MIB));
+    if (m.payload)
+        printf("Payload: %llu KiB at the start of p2\n", (unsigned long long)(m.payload / 1024));
+
+    size_t recorded = sdhash_recorded(&m.hashes), kept = 0;
+    sdfsck_report fr;
+    if (verify_fs(&io, &m.hashes, &fr)) {
+        kept = sdhash_recorded(&m.hashes);
+        printf("p1: %llu files, %llu directories, %llu of %llu clusters in use: %s\n",
+               (unsigned long long)fr.files, (unsigned long long)fr.dirs,
+               (unsigned long long)fr.allocated, (unsigned long long)fr.clusters,
+               fr.problems ? "inconsistent" : "consistent");
+        if (fr.problems) printf("%u filesystem problem%s, the first: %s\n", fr.problems,
+                                fr.problems == 1 ? "" : "s", fr.first);
+        if (kept < recorded)
+            printf("Skipping %zu recorded blocks that hold only free clusters\n", recorded - kept);
+    } else {
+        fr.problems = 0;
+        puts("p1 is not FAT32: no filesystem check");
+    }
+
+    size_t checked, bad;
+    if (sdhash_sample(&io, &m.hashes, full ? 0 : 64, 4, &checked, &bad) != 0) die("read device");
+    printf("%zu of %zu checked blocks match\n", checked - bad, checked);
+    if (bad) rec_outcome("mismatch: %zu of %zu blocks", bad, checked);
+    else if (fr.problems) rec_outcome("filesystem: %s", fr.first);
+    else rec_outcome("ok");
+    rec_finish();
+
+    sdman_free(&m);
+    sdio_close(&io);
+    return bad == 0 && fr.problems == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Golden image from a reference card: only what its filesystem uses
+static int capture_card(const char *dev, const char *out, bool with_p2) {
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    sdio_dev io = {0};
+    io.log = log_line;
+    io.log_ctx = (void *)dev;
+    io.progress = show_progress;
+    if (sdio_open_read(&io, dev) != 0) die("open device");
+
+    set_stage("capture", &io);
+    sdcap_plan plan;
+    if (sdcap_plan_build(&io, with_p2, &plan) != 0) {
+        if (errno == EBADMSG) xdie("card has no FAT32 first partition; nothing to capture by cluster");
+        die("read layout");
+    }
+    printf("Capturing %s: %llu of %llu MiB in use, image %llu MiB%s\n", dev,
+           (unsigned long long)(plan.mapped / SDIO_MIB), (unsigned long long)(io.size / SDIO_MIB),
+           (unsigned long long)(plan.image_size / SDIO_MIB), with_p2 ? " (with p2)" : "");
+    fflush(stdout);
+
+    int fd = open(out, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) die(out);
+    if (sdcap_copy(&io, &plan, fd) != 0) {
+        int e = errno;
+        unlink(out);   // a partial golden image is worse than none
+        errno = e;
+        die("capture");
+    }
+    close(fd);
+
+    char bmap[PATH_MAX];
+    snprintf(bmap, sizeof(bmap), "%s.bmap", out);
+    if (sdbmap_save(bmap, plan.image_size, 4096, plan.map, plan.n) != 0) die(bmap);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("Wrote %s and %s in %.1f s\n", out, bmap, sec);
+
+    sdcap_plan_free(&plan);
+    sdio_close(&io);
+    return EXIT_SUCCESS;
+}
+
+static const char *const scan_flag_name[] = {
+    [SDSCAN_UNREADABLE] = "unreadable",
+    [SDSCAN_UNWRITABLE] = "unwritable",
+    [SDSCAN_MISMATCH]   = "reads back wrong",
+    [SDSCAN_SLOW]       = "slow",
+};
+
+static void print_histogram(const char *what, const uint64_t *hist) {
+    int lo = -1, hi = -1;
+    uint64_t most = 0;
+    for (int i = 0; i < SDSCAN_BUCKETS; i++) {
+        if (!hist[i]) continue;
+        if (lo < 0) lo = i;
+        hi = i;
+        if (hist[i] > most) most = hist[i];
+    }
+    if (lo < 0) return;
+    printf("%s latency:\n", what);
+    for (int i = lo; i <= hi; i++) {
+        char edge[32];
+        if (i == SDSCAN_BUCKETS - 1) snprintf(edge, sizeof(edge), ">= %g ms", sdscan_bucket_ms(i - 1));
+        else snprintf(edge, sizeof(edge), "< %g ms", sdscan_bucket_ms(i));
+        int bar = (int)((hist[i] * 40 + most - 1) / most);
+        printf("  %12s %8llu %.*s\n", edge, (unsigned long long)hist[i], bar,
+               "########################################");
+    }
+}
+
+// Surface check before anything is written: a spread-out sample of
+// regions or all of them, several in flight, each one timed. Fails the
+// job if any region cannot be read (or written and read back intact).
+static bool scan_card(sdio_dev *io, bool full, bool write) {
+    set_stage("scan", io);
+    printf("Scanning %s: %s, %s...\n", io->path, full ? "every region" : "a sample",
+           write ? "write and read back" : "read only");
+    fflush(stdout);
+
+    sdscan_opts o = {0};
+    o.full = full;
+    o.write = write;
+    sdscan_result r;
+    if (sdscan_run(io, &o, &r) != 0) die("scan");
+
+    printf("%zu regions, %llu MiB in %.1f s (%.1f MB/s)\n", r.regions,
+           (unsigned long long)(r.bytes / SDIO_MIB), r.seconds, r.mbps);
+    printf("Read per region: median %.1f ms, p99 %.1f ms, max %.1f ms\n",
+           r.median_ms, r.p99_ms, r.max_ms);
+    print_histogram("Read", r.hist);
+    if (write) print_histogram("Write", r.write_hist);
+
+    const size_t show = 20;
+    for (size_t i = 0; i < r.nflagged && i < show; i++) {
+        const sdscan_region *f = &r.flagged[i];
+        printf("  %s at byte %llu (MiB %llu): %s", f->flag == SDSCAN_SLOW ? "warn" : "BAD ",
+               (unsigned long long)f->off, (unsigned long long)(f->off / SDIO_MIB),
+               scan_flag_name[f->flag]);
+        if (f->flag == SDSCAN_UNREADABLE || f->flag == SDSCAN_UNWRITABLE)
+            printf(" (%s)", strerror(f->err));
+        else
+            printf(" (%.1f ms)", f->ms);
+        putchar('\n');
+    }
+    if (r.nflagged > show) printf("  ... and %zu more\n", r.nflagged - show);
+
+    bool ok = r.bad == 0;
+    printf("Surface scan: %s, %zu bad, %zu slow region%s\n", ok ? "OK" : "FAILED",
+           r.bad, r.slow, r.slow == 1 ? "" : "s");
+    sdscan_free(&r);
+    return ok;
+}
+
+// The formatter's layout: p1 from 1 MiB, p2 the last 32 MiB (and change).
+// A device under 33 MiB gets an empty p1, which layout_geometry() refuses.
+static uint64_t p2_offset(uint64_t size) {
+    if (size < 33 * SDIO_MIB) return SDFAT_P1_START;
+    return (size / SDIO_MIB - 32) * SDIO_MIB;
+}
+
+static uint64_t p1_bytes(uint64_t size) {
+    return p2_offset(size) - SDFAT_P1_START;
+}
+
+// p1's FAT32 geometry, or a clear refusal (cluster 0 = the default)
+static void layout_geometry(uint64_t size, uint32_t cluster, sdfat_bpb *b) {
+    uint64_t p1 = p1_bytes(size);
+    if (p1 && sdfat_geometry(p1, cluster, b) == 0) return;
+    char msg[160];
+    if (p1 && errno == EINVAL)
+        snprintf(msg, sizeof(msg), "%u-byte clusters leave fewer than %u clusters in p1: "
+                 "not FAT32; use a smaller --cluster", cluster, SDFAT_MIN_CLUSTERS);
+    else
+        snprintf(msg, sizeof(msg), "device too small for FAT32 (p1 needs %u clusters "
+                 "of 512 bytes)", SDFAT_MIN_CLUSTERS);
+    xdie(msg);
+}
+
+// What fits at the start of p2 beside a manifest of the whole card
+static uint64_t payload_room(uint64_t size) {
+    uint64_t room = size - p2_offset(size), man = sdman_size((size_t)(size / SDHASH_BLOCK + 1)) + 4096;
+    return room > man ? room - man : 0;
+}
+
+// --payload: the raw recovery image for p2, read into memory (p2 is 32 MiB)
+// and queued on the layout sweep
+static uint64_t queue_payload(sdsweep *sw, const sdio_dev *io, const char *path) {
+    sdimg *im = sdimg_open(path, 0);
+    if (!im) die("open payload");
+    uint64_t room = payload_room(io->size);
+    unsigned char *buf = malloc(room + 1);
+    if (!buf) die("payload");
+    uint64_t len = 0;
+    for (;;) {
+        ssize_t n = sdimg_fill(im, len, buf + len, (size_t)(room + 1 - len));
+        if (n < 0) die("read payload");
+        if (n == 0) break;
+        len += (uint64_t)n;
+        if (len > room) xdie("payload does not fit in partition 2");
+    }
+    if (len == 0) xdie("payload is empty");
+    printf("Payload %s (%s): %llu KiB for partition 2\n", path,
+           sdimg_format_name(sdimg_format_of(im)), (unsigned long long)(len / 1024));
+    if (sdsweep_add(sw, p2_offset(io->size), buf, (size_t)len, false) != 0) die("payload");
+    free(buf);
+    sdimg_close(im);
+    return len;
+}
+
+// --cluster auto: this model's cached size, or the workload replayed at
+// every candidate in what will be p1 (the wipe just cleared it)
+static uint32_t choose_cluster(sdio_dev *io, sdclus_profile workload) {
+    uint32_t c;
+    sdfat_bpb b;
+    // The same model on a smaller card may not fit the cached size
+    if (sdclus_cached(io->ident, workload, &c) && sdfat_geometry(p1_bytes(io->size), c, &b) == 0) {
+        printf("Cluster size: %u KiB (measured before on %s, %s files)\n",
+               c / 1024, io->ident, sdclus_profile_name(workload));
+        return c;
+    }
+
+    set_stage("cluster bench", io);
+    uint64_t vol = p1_bytes(io->size);
+    sdclus_result r;
+    printf("Measuring cluster sizes (%s files)...\n", sdclus_profile_name(workload));
+    fflush(stdout);
+    if (sdclus_bench(io, SDFAT_P1_START, vol, vol, workload, &r) != 0) die("cluster benchmark");
+    for (int i = 0; i < r.ntrials; i++)
+        printf("  %3u KiB  %7.3f s  %8.1f files/s%s\n", r.trials[i].cluster / 1024,
+               r.trials[i].seconds, r.trials[i].files_per_sec,
+               r.trials[i].cluster == r.best ? "  <- chosen" : "");
+    return r.best;   // 0 if no candidate fits: the default size
+}
+
+// --scan-only without writing: nothing to confirm
+static int scan_only_card(const char *dev, bool full) {
+    sdio_dev io = {0};
+    io.log = log_line;
+    io.log_ctx = (void *)dev;
+    io.progress = show_progress;
+    rec_begin("scan", dev);
+    rec_dev = &io;
+    if (sdio_open_read(&io, dev) != 0) die("open device");
+    bool ok = scan_card(&io, full, false);
+    if (ok) rec_outcome("ok");
+    else rec_outcome("failed: surface scan");
+    rec_finish();
+    sdio_close(&io);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 static void show_layout(const char *dev) {
     char *argv1[] = {"fdisk", "-l", (char*)dev, NULL};
     run_cmd(argv1); // ignore failures
@@ -87,120 +1110,807 @@ static void show_layout(const char *dev) {
     run_cmd(argv2);
 }
 
+// Dry run: each card's plan from its size and the layout, timed with the
+// model's cached throughput. Nothing is opened for writing. The batch
+// time follows how the real run schedules: duplication runs every card
+// at once, anything else at most `jobs` at a time.
+static int plan_batch(char **devs, int n, int jobs, bool erase, const char *image,
+                      const char *bmap_path, bool delta, bool verify, bool full,
+                      uint32_t cluster, sdclus_profile workload, uint64_t payload) {
+    uint64_t size = 0;
+    sdbmap bm = {0};
+    char *found = NULL;
+    if (image) {
+        sdimg *im = sdimg_open(image, 1);
+        if (!im) die("open image");
+        size = sdimg_size(im);
+        sdimg_close(im);
+        if (!bmap_path && !delta && n == 1) found = sdbmap_find_sidecar(image);
+        if (found) bmap_path = found;
+        if (bmap_path) {
+            if (sdbmap_load(bmap_path, &bm) != 0) die("load block map");
+            size = bm.image_size;
+        }
+    }
+
+    int ok = 0;
+    double secs[n];
+    for (int i = 0; i < n; i++) {
+        secs[i] = 0.0;
+        sdplan p;
+        int rc = sdplan_init(&p, devs[i]);
+        if (rc == 0) {
+            if (verify) rc = sdplan_verify(&p, full);
+            else if (image) rc = sdplan_image(&p, size, bmap_path ? bm.ext : NULL, bm.n, delta);
+            else {
+                p.cluster = cluster;
+                p.payload = payload;
+                if (cluster == CLUSTER_AUTO && !sdclus_cached(p.dev.ident, workload, &p.cluster)) {
+                    uint32_t cand[SDCLUS_MAX_TRIALS];
+                    int nc = p.dev.size > 33 * SDIO_MIB ? sdclus_candidates(p1_bytes(p.dev.size), cand) : 0;
+                    p.cluster = 0;
+                    p.bench_bytes = sdclus_bench_bytes(workload) * (uint64_t)nc;
+                }
+                rc = sdplan_format(&p, erase);
+            }
+            // Duplication records no manifest
+            if (rc == 0 && image && !verify && n == 1) rc = sdplan_manifest(&p, size);
+        }
+        if (rc != 0) {
+            printf("%s: cannot plan: %s\n", devs[i],
+                   errno == EFBIG ? "image is larger than the device" :
+                   errno == ENOSPC ? "device too small for the layout" :
+                   errno == EINVAL ? "cluster size leaves too few clusters for FAT32" :
+                   strerror(errno));
+            sdplan_free(&p);
+            continue;
+        }
+        sdplan_print(&p, stdout, 8);
+        secs[i] = sdplan_seconds(&p);
+        sdplan_free(&p);
+        ok++;
+    }
+
+    if (n > 1) {
+        // As run_workers does: the next card takes the first lane to come
+        // free. Duplication has a lane per card, so the slowest one sets
+        // the pace.
+        int lanes = image || jobs > n ? n : jobs;
+        double lane[lanes], total = 0.0;
+        for (int l = 0; l < lanes; l++) lane[l] = 0.0;
+        for (int i = 0; i < n; i++) {
+            int first = 0;
+            for (int l = 1; l < lanes; l++)
+                if (lane[l] < lane[first]) first = l;
+            lane[first] += secs[i];
+            if (lane[first] > total) total = lane[first];
+        }
+        char eta[32];
+        sdplan_eta_str(total, eta, sizeof(eta));
+        if (lanes == n)
+            printf("\nBatch: %d of %d cards planned, in parallel, about %s\n", ok, n, eta);
+        else
+            printf("\nBatch: %d of %d cards planned, %d at a time, about %s\n", ok, n, lanes, eta);
+    }
+    sdbmap_free(&bm);
+    free(found);
+    return ok == n ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Cards found in sysfs (at most this many are looked at)
+#define MAX_CARDS 256
+
+// --all: every card slot or removable disk with media that holds no
+// system mount
+static int eligible_devices(char ***out) {
+    static sdenum_dev found[MAX_CARDS];
+    int total = sdenum_scan(NULL, found, MAX_CARDS, NULL);
+    if (total < 0) return -1;
+    char **devs = NULL;
+    int n = 0;
+    for (int i = 0; i < total && i < MAX_CARDS; i++) {
+        const sdenum_dev *d = &found[i];
+        if ((!d->removable && d->bus != SDENUM_MMC) || !d->size || d->system) continue;
+        char path[64];
+        snprintf(path, sizeof(path), "/dev/%.31s", d->name);
+        if (!is_block_device(path)) continue;
+        char **nd = realloc(devs, (size_t)(n + 1) * sizeof(*nd));
+        if (!nd || !(nd[n] = strdup(path))) die("out of memory");
+        devs = nd;
+        n++;
+    }
+    *out = devs;
+    return n;
+}
+
+// --list: what sysfs offers as cards, and what finding them cost
+static int list_devices(void) {
+    static sdenum_dev found[MAX_CARDS];
+    sdenum_stats st;
+    double t0 = now_sec();
+    int total = sdenum_scan(NULL, found, MAX_CARDS, &st);
+    double ms = (now_sec() - t0) * 1000.0;
+    if (total < 0) die("sysfs");
+
+    for (int i = 0; i < total && i < MAX_CARDS; i++) {
+        const sdenum_dev *d = &found[i];
+        char desc[160];
+        sdenum_describe(d, desc, sizeof(desc));
+        bool eligible = (d->removable || d->bus == SDENUM_MMC) && d->size && !d->system;
+        printf("%s  %s%s%s\n", eligible ? "*" : " ", desc, d->ro ? "  [read-only]" : "",
+               d->system ? "  [system]" : !d->size ? "  [no media]" : "");
+    }
+    printf("%d of %zu block devices could be cards (%zu dropped by major number) in %.2f ms\n"
+           "* = taken by --all\n", total, st.seen, st.dropped, ms);
+    return EXIT_SUCCESS;
+}
+
+// Several devices, one job each: every card runs in its own worker
+// process (this program again, with --worker), at most `jobs` at a
+// time. Workers speak JSON lines on a pipe; they are passed through
+// with --json, otherwise summarised one line per event.
+typedef struct {
+    const char *dev;
+    pid_t pid;
+    int fd;               // worker's stdout, -1 once closed
+    char buf[4096];
+    size_t len;
+    bool result;          // the worker reported its own result
+    double t0;
+} worker;
+
+// A string or number field of a flat JSON line (enough for our own events)
+static bool json_get(const char *line, const char *key, char *out, size_t outsz) {
+    char pat[64];
+    snprintf(pat, sizeof(pat), "\"%s\":", key);
+    const char *p = strstr(line, pat);
+    if (!p) return false;
+    p += strlen(pat);
+    size_t j = 0;
+    if (*p == '"') {
+        for (p++; *p && *p != '"' && j + 1 < outsz; p++) {
+            if (*p == '\\' && p[1]) p++;
+            out[j++] = *p;
+        }
+    } else {
+        while (*p && *p != ',' && *p != '}' && j + 1 < outsz) out[j++] = *p++;
+    }
+    out[j] = 0;
+    return true;
+}
+
+static void worker_line(worker *w, const char *line) {
+    char event[16] = "", text[192] = "", secs[32] = "";
+    json_get(line, "event", event, sizeof(event));
+    if (strcmp(event, "result") == 0) w->result = true;
+    if (json_out) {
+        fprintf(json_out, "%s\n", line);
+        fflush(json_out);
+        return;
+    }
+    if (strcmp(event, "stage") == 0 && json_get(line, "stage", text, sizeof(text)))
+        printf("%s: %s\n", w->dev, text);
+    else if (strcmp(event, "result") == 0 && json_get(line, "outcome", text, sizeof(text))) {
+        json_get(line, "seconds", secs, sizeof(secs));
+        printf("%s: %s (%.1f s)\n", w->dev, text, atof(secs));
+    } else if (strcmp(event, "error") == 0 && json_get(line, "message", text, sizeof(text)))
+        printf("%s: error: %s\n", w->dev, text);
+    fflush(stdout);
+}
+
+// A result for a worker that could not give one
+static void worker_result(const char *dev, const char *job, const char *outcome, double secs) {
+    if (json_out) json_result(dev, job, outcome, secs, NULL);
+    else printf("%s: %s\n", dev, outcome);
+    fflush(stdout);
+}
+
+static pid_t spawn_worker(const char *prog, char **opts, int nopts, const char *dev, int *fd) {
+    int p[2];
+    if (pipe2(p, O_CLOEXEC) != 0) die("pipe");
+    pid_t pid = fork();
+    if (pid < 0) die("fork");
+    if (pid == 0) {
+        dup2(p[1], STDOUT_FILENO);
+        char **argv = calloc((size_t)nopts + 4, sizeof(*argv));
+        if (!argv) _exit(127);
+        int k = 0;
+        argv[k++] = (char *)prog;
+        argv[k++] = "--worker";
+        for (int i = 0; i < nopts; i++) argv[k++] = opts[i];
+        argv[k++] = (char *)dev;
+        execv("/proc/self/exe", argv);
+        perror("execv");
+        _exit(127);
+    }
+    close(p[1]);
+    *fd = p[0];
+    return pid;
+}
+
+static int run_workers(const char *prog, char **opts, int nopts, char **devs, int n,
+                       int jobs, const char *job) {
+    worker *w = calloc((size_t)n, sizeof(*w));
+    struct pollfd *pfd = calloc((size_t)n, sizeof(*pfd));
+    if (!w || !pfd) die("calloc");
+    int next = 0, running = 0, ok = 0;
+    bool stopped = false;
+    for (int i = 0; i < n; i++) w[i].fd = -1;
+    started = 1;
+
+    while ((next < n && !stopped) || running) {
+        if (cancel_flag && !stopped) {
+            stopped = true;
+            for (int i = 0; i < next; i++)
+                if (w[i].pid > 0) kill(w[i].pid, SIGTERM);
+            for (int i = next; i < n; i++) worker_result(devs[i], job, "aborted: not started", 0);
+        }
+        while (!cancel_flag && next < n && running < jobs) {
+            w[next].dev = devs[next];
+            w[next].t0 = now_sec();
+            w[next].pid = spawn_worker(prog, opts, nopts, devs[next], &w[next].fd);
+            next++;
+            running++;
+        }
+
+        int np = 0;
+        for (int i = 0; i < next; i++) {
+            if (w[i].fd < 0) continue;
+            pfd[np].fd = w[i].fd;
+            pfd[np].events = POLLIN;
+            np++;
+        }
+        if (!np) break;
+        if (poll(pfd, (nfds_t)np, -1) < 0) {
+            if (errno == EINTR) continue;
+            die("poll");
+        }
+
+        for (int i = 0, k = 0; i < next; i++) {
+            if (w[i].fd < 0) continue;
+            struct pollfd *q = &pfd[k++];
+            if (!(q->revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+            ssize_t got = read(w[i].fd, w[i].buf + w[i].len, sizeof(w[i].buf) - 1 - w[i].len);
+            if (got < 0 && errno == EINTR) continue;
+            if (got > 0) {
+                w[i].len += (size_t)got;
+                w[i].buf[w[i].len] = 0;
+                char *line = w[i].buf, *nl;
+                while ((nl = strchr(line, '\n'))) {
+                    *nl = 0;
+                    if (*line) worker_line(&w[i], line);
+                    line = nl + 1;
+                }
+                w[i].len = strlen(line);
+                memmove(w[i].buf, line, w[i].len + 1);
+                if (w[i].len == sizeof(w[i].buf) - 1) w[i].len = 0;   // overlong line
+                continue;
+            }
+
+            // End of output: the worker is done
+            close(w[i].fd);
+            w[i].fd = -1;
+            int st = 0;
+            while (waitpid(w[i].pid, &st, 0) < 0 && errno == EINTR) {}
+            w[i].pid = 0;
+            running--;
+            bool good = WIFEXITED(st) && WEXITSTATUS(st) == 0;
+            if (good) ok++;
+            if (!w[i].result) {
+                char why[64];
+                if (WIFEXITED(st) && WEXITSTATUS(st) == EXIT_ABORTED) snprintf(why, sizeof(why), "aborted");
+                else if (WIFSIGNALED(st)) snprintf(why, sizeof(why), "failed: killed by signal %d", WTERMSIG(st));
+                else if (good) snprintf(why, sizeof(why), "ok");
+                else snprintf(why, sizeof(why), "failed: exit status %d", WEXITSTATUS(st));
+                worker_result(w[i].dev, job, why, now_sec() - w[i].t0);
+            }
+        }
+    }
+    free(pfd);
+    free(w);
+    return ok;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [--erase] [--image FILE [--bmap FILE]] /dev/sdX|/dev/mmcblk0|/dev/nvme0n1\n"
+            "       %s --image FILE DEVICE DEVICE...\n"
+            "       %s --verify [--full] DEVICE\n"
+            "       %s --check [--label NAME] DEVICE\n"
+            "       %s --capture FILE [--with-p2] DEVICE\n"
+            "       %s [--erase|--verify|--check|--scan MODE --scan-only] DEVICE... | --all\n"
+            "  --erase        zero the whole device before partitioning\n"
+            "  --label NAME   FAT32 volume label (default PICO_DATA)\n"
+            "  --skip-provisioned  leave a card alone if --check says it matches\n"
+            "  --cluster SIZE FAT32 cluster size, a power of two from 512 to 64K that\n"
+            "                 leaves p1 at least 65525 clusters; or auto: measure the\n"
+            "                 candidates on the card, once per card model\n"
+            "  --workload W   what --cluster auto measures: small, large or mixed\n"
+            "                 files (default mixed)\n"
+            "  --payload FILE raw image (raw, .xz or .zst) for the start of the\n"
+            "                 reserved partition 2, written in the same pass\n"
+            "  --image FILE   write an image (raw, .xz or .zst) instead of partitioning\n"
+            "  --bmap FILE    block map for --image (default: X.img.bmap sidecar)\n"
+            "  --delta        with --image: rewrite only blocks that differ\n"
+            "  --restart      with --image: ignore the card's checkpoint and write\n"
+            "                 from the start (an interrupted write otherwise resumes)\n"
+            "  --hashes FILE  hash list for --delta (default: X.img.hashes sidecar,\n"
+            "                 created from the image if missing)\n"
+            "With several devices, --image (a file or a source card) is read once\n"
+            "and written to all of them in parallel.\n"
+            "  --trust-manifest  with --delta: take unchanged blocks from the card's\n"
+            "                 manifest instead of reading them (cards not used since)\n"
+            "  --verify       check a card's FAT32 filesystem and the manifest in its\n"
+            "                 partition 2 (a sample of blocks; --full reads every\n"
+            "                 block the filesystem uses)\n"
+            "  --check        is the card already prepared with this layout and label?\n"
+            "                 (exit status 0 if so; reads a few sectors)\n"
+            "  --capture FILE save a reference card as a sparse image FILE plus\n"
+            "                 FILE.bmap, reading only allocated FAT32 clusters\n"
+            "  --with-p2      with --capture: include the reserved partition 2\n"
+            "  --mem-max SIZE I/O buffer memory ceiling for this run (e.g. 512M;\n"
+            "                 default 1G or $SDPREP_MEM_MAX)\n"
+            "  --hugepages    back large I/O buffers with hugepages\n"
+            "  --dry-run      print what would be written, discarded and read on\n"
+            "                 each device, with an estimated time; touches nothing\n"
+            "  --history [DEVICE]  card history: per reader and card lot, or the\n"
+            "                 runs of the card in DEVICE\n"
+            "  --scan MODE    surface scan before writing, MODE sample or full;\n"
+            "                 stops if a region is unreadable\n"
+            "  --scan-write   with --scan: write a pattern and read it back\n"
+            "  --scan-only    with --scan: just scan (no confirmation unless\n"
+            "                 --scan-write)\n"
+            "  --metrics DIR  keep Prometheus metrics in DIR/sdprep.prom (for\n"
+            "                 node_exporter; default $SDPREP_METRICS_DIR)\n"
+            "Automation:\n"
+            "  --all          every card slot and removable disk with media\n"
+            "                 (not the root disk) instead of naming devices\n"
+            "  --list         the devices sysfs offers as cards and how long finding\n"
+            "                 them took (no root needed)\n"
+            "  --jobs N       with several devices and no --image: cards worked\n"
+            "                 on at once, each in its own process (default 4)\n"
+            "  --yes          no confirmation prompt: the devices given are meant\n"
+            "  --json         JSON lines on stdout, one per stage and one result\n"
+            "                 per card; human output goes to stderr\n",
+            prog, prog, prog, prog, prog, prog);
+}
+
 int main(int argc, char **argv) {
-    require_root();
+    t_start = now_sec();
+    static const struct option longopts[] = {
+        { "erase", no_argument,       NULL, 'e' },
+        { "image", required_argument, NULL, 'i' },
+        { "bmap",  required_argument, NULL, 'b' },
+        { "delta", no_argument,       NULL, 'd' },
+        { "hashes", required_argument, NULL, 'H' },
+        { "restart", no_argument,     NULL, 'R' },
+        { "verify", no_argument,      NULL, 'V' },
+        { "full",  no_argument,       NULL, 'F' },
+        { "trust-manifest", no_argument, NULL, 'T' },
+        { "label", required_argument, NULL, 'L' },
+        { "check", no_argument,       NULL, 'C' },
+        { "skip-provisioned", no_argument, NULL, 'S' },
+        { "cluster", required_argument, NULL, 'K' },
+        { "workload", required_argument, NULL, 'k' },
+        { "payload", required_argument, NULL, 'p' },
+        { "capture", required_argument, NULL, 'c' },
+        { "with-p2", no_argument,     NULL, 'P' },
+        { "mem-max", required_argument, NULL, 'm' },
+        { "hugepages", no_argument,   NULL, 'G' },
+        { "dry-run", no_argument,     NULL, 'n' },
+        { "history", no_argument,     NULL, 'Y' },
+        { "scan",  required_argument, NULL, 'U' },
+        { "scan-write", no_argument,  NULL, 'W' },
+        { "scan-only", no_argument,   NULL, 'O' },
+        { "metrics", required_argument, NULL, 'M' },
+        { "all",   no_argument,       NULL, 'A' },
+        { "list",  no_argument,       NULL, 'l' },
+        { "jobs",  required_argument, NULL, 'j' },
+        { "yes",   no_argument,       NULL, 'y' },
+        { "json",  no_argument,       NULL, 'J' },
+        { "worker", no_argument,      NULL, 'w' },   // one card of run_workers()
+        { "help",  no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    bool erase = false;
+    bool delta = false, verify = false, full = false, trust = false, restart = false;
+    bool check = false, skip_done = false, dry_run = false, history = false;
+    const char *scan = NULL;
+    bool scan_write = false, scan_only = false;
+    bool all = false, list = false, yes = false, json = false, worker_mode = false;
+    int jobs = 4;
+    const char *label = "PICO_DATA";
+    const char *cluster_arg = NULL, *payload = NULL;
+    sdclus_profile workload = SDCLUS_MIXED;
+    const char *image = NULL, *bmap = NULL, *hashes = NULL, *capture = NULL;
+    bool with_p2 = false;
+    const char *mem_max = NULL;
+    const char *huge_env = getenv("SDPREP_HUGEPAGES");
+    bool hugepages = huge_env && *huge_env == '1';
+    int opt;
+    while ((opt = getopt_long(argc, argv, "ei:b:dH:RVFTL:CSK:k:p:c:Pm:GnYU:WOM:Alj:yJwh", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'e': erase = true; break;
+        case 'i': image = optarg; break;
+        case 'b': bmap = optarg; break;
+        case 'd': delta = true; break;
+        case 'H': hashes = optarg; break;
+        case 'R': restart = true; break;
+        case 'V': verify = true; break;
+        case 'F': full = true; break;
+        case 'T': trust = true; break;
+        case 'L': label = optarg; break;
+        case 'C': check = true; break;
+        case 'S': skip_done = true; break;
+        case 'K': cluster_arg = optarg; break;
+        case 'p': payload = optarg; break;
+        case 'k':
+            if (sdclus_parse_profile(optarg, &workload) != 0) xdie("--workload takes small, large or mixed.");
+            break;
+        case 'c': capture = optarg; break;
+        case 'P': with_p2 = true; break;
+        case 'm': mem_max = optarg; break;
+        case 'G': hugepages = true; break;
+        case 'n': dry_run = true; break;
+        case 'Y': history = true; break;
+        case 'U': scan = optarg; break;
+        case 'W': scan_write = true; break;
+        case 'O': scan_only = true; break;
+        case 'M': setenv("SDPREP_METRICS_DIR", optarg, 1); break;
+        case 'A': all = true; break;
+        case 'l': list = true; break;
+        case 'j': jobs = atoi(optarg); break;
+        case 'y': yes = true; break;
+        case 'J': json = true; break;
+        case 'w': worker_mode = yes = json = true; break;
+        default:  usage(argv[0]); return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
 
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s /dev/sdX|/dev/mmcblk0|/dev/nvme0n1\n", argv[0]);
-        return EXIT_FAILURE;
+    if (list) {
+        if (argc > optind) xdie("--list takes no devices.");
+        return list_devices();
     }
 
-    const char *DEVICE = argv[1];
-    if (!is_block_device(DEVICE)) xdie("Not a block device.");
+    if (history) {
+        if (argc - optind > 1) xdie("--history takes at most one device.");
+        sddb_id id;
+        if (optind < argc) sddb_identify(argv[optind], &id);
+        sddb_report(stdout, optind < argc ? &id : NULL);
+        return EXIT_SUCCESS;
+    }
 
-    // Basic root-device guard: ensure target is not root's parent device
-    // (best-effort, user must still confirm exact path)
-    {
-        FILE *fp = popen("df --output=source / | tail -1", "r");
-        if (fp) {
-            char src[512] = {0};
-            if (fgets(src, sizeof(src), fp)) {
-                src[strcspn(src, "\n")] = 0;
-                // Get parent disk of root
-                char cmd[512];
-                snprintf(cmd, sizeof(cmd), "lsblk -no PKNAME %s 2>/dev/null", src);
-                FILE *fp2 = popen(cmd, "r");
-                if (fp2) {
-                    char pk[256] = {0};
-                    if (fgets(pk, sizeof(pk), fp2)) {
-                        pk[strcspn(pk, "\n")] = 0;
-                        char parent[300];
-                        snprintf(parent, sizeof(parent), "/dev/%s", pk);
-                        if (strcmp(parent, DEVICE) == 0) {
-                            pclose(fp2); pclose(fp);
-                            xdie("Refusing: target appears to contain root filesystem.");
-                        }
-                    }
-                    pclose(fp2);
+    // JSON lines own stdout; everything printed for people (and by the
+    // commands we run) goes to stderr
+    if (json) {
+        int fd = dup(STDOUT_FILENO);
+        if (fd < 0 || !(json_out = fdopen(fd, "w"))) die("dup stdout");
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+
+    // A dry run reads only sysfs and the tuning cache
+    if (!dry_run) require_root();
+    install_abort_handler();
+
+    if (mem_max || hugepages) {
+        sdpool_config pc = { 0, hugepages };
+        if (mem_max && (pc.limit = sdpool_parse_size(mem_max)) == 0) xdie("bad --mem-max size");
+        if (!mem_max) {
+            const char *env = getenv("SDPREP_MEM_MAX");
+            pc.limit = env ? sdpool_parse_size(env) : 0;
+        }
+        sdpool_configure(&pc);
+    }
+
+    uint32_t cluster = 0;
+    if (cluster_arg) {
+        if (strcmp(cluster_arg, "auto") == 0) {
+            cluster = CLUSTER_AUTO;
+        } else {
+            uint64_t c = sdpool_parse_size(cluster_arg);
+            if (c < 512 || c > 64 * 1024 || (c & (c - 1))) xdie("--cluster takes a power of two from 512 to 64K, or auto.");
+            cluster = (uint32_t)c;
+        }
+        if (image || verify || check || capture) xdie("--cluster goes with formatting.");
+    }
+    uint64_t payload_size = 0;
+    if (payload) {
+        if (image || verify || check || capture || scan_only) xdie("--payload goes with formatting.");
+        sdimg *im = sdimg_open(payload, 1);
+        if (!im) die("open payload");
+        struct stat st;
+        payload_size = sdimg_size(im);
+        if (!payload_size && stat(payload, &st) == 0) payload_size = (uint64_t)st.st_size;
+        sdimg_close(im);
+    }
+
+    int ndev = argc - optind;
+    char **devs = &argv[optind];
+    if (all && !worker_mode) {
+        if (ndev) xdie("--all takes no devices.");
+        ndev = eligible_devices(&devs);
+        if (ndev < 0) die("/sys/block");
+        if (ndev == 0) xdie("no eligible devices.");
+    } else if (ndev == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (jobs < 1) xdie("--jobs takes a positive number.");
+    if (worker_mode && ndev != 1) xdie("--worker takes one device.");
+
+    // Several devices without an image: one worker process per card (a
+    // dry run plans the same batch)
+    bool batch = ndev > 1 && !image && !capture;
+    bool fan_out = batch && !dry_run;
+    bool scan_full = false;
+    if ((scan_write || scan_only) && !scan) xdie("--scan-write and --scan-only need --scan MODE.");
+    if (scan) {
+        if (strcmp(scan, "full") == 0) scan_full = true;
+        else if (strcmp(scan, "sample") != 0 && strcmp(scan, "quick") != 0)
+            xdie("--scan takes sample or full.");
+        if ((ndev != 1 && !fan_out) || verify || check || capture || dry_run)
+            xdie("--scan takes one device, before formatting or writing an image.");
+        if (scan_write && delta) xdie("--scan-write would destroy what --delta keeps.");
+        if (scan_only && (image || erase)) xdie("--scan-only does not write an image or erase.");
+        if (!is_block_device(devs[0])) xdie("Not a block device.");
+        if (scan_only && !scan_write && !fan_out) return scan_only_card(devs[0], scan_full);
+    }
+    if (fan_out) {
+        if (check && (erase || verify)) xdie("--check takes no --erase or --verify.");
+        if (verify && erase) xdie("--verify takes no --erase.");
+        if (bmap || delta || restart) xdie("--bmap, --delta and --restart go with --image.");
+        for (int i = 0; i < ndev; i++) {
+            if (!is_block_device(devs[i])) {
+                fprintf(stderr, "Error: %s is not a block device.\n", devs[i]);
+                return EXIT_FAILURE;
+            }
+            refuse_root_device(devs[i]);
+            for (int j = 0; j < i; j++)
+                if (is_same_disk(devs[j], devs[i])) {
+                    fprintf(stderr, "Error: %s given twice.\n", devs[i]);
+                    return EXIT_FAILURE;
                 }
+        }
+
+        bool destructive = !verify && !check && !(scan_only && !scan_write);
+        if (destructive && !yes) {
+            printf("THIS WILL DESTROY ALL DATA ON %d DEVICES\n\n", ndev);
+            char *lsblk_argv[ndev + 2];
+            lsblk_argv[0] = "lsblk";
+            for (int i = 0; i < ndev; i++) lsblk_argv[i + 1] = devs[i];
+            lsblk_argv[ndev + 1] = NULL;
+            run_cmd(lsblk_argv);
+
+            printf("\nType the number of target devices to proceed (%d): ", ndev);
+            fflush(stdout);
+            char confirm[64] = {0};
+            if (!fgets(confirm, sizeof(confirm), stdin)) xdie("stdin read");
+            if (atoi(confirm) != ndev) xdie("Confirmation mismatch. Aborting.");
+        }
+
+        const char *job = verify ? "verify" : check ? "check" : scan_only ? "scan"
+                        : erase ? "erase" : "format";
+        // getopt_long moved the options in front of the devices
+        int ok = run_workers(argv[0], &argv[1], optind - 1, devs, ndev, jobs, job);
+        if (!json) printf("\n%d of %d devices done.\n", ok, ndev);
+        if (cancel_flag) exit(EXIT_ABORTED);
+        return ok == ndev ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (dry_run && (check || capture)) xdie("--dry-run plans formatting, --image and --verify.");
+    if (check) {
+        if (ndev != 1 || image || erase || verify) xdie("--check takes one device.");
+        if (!is_block_device(devs[0])) xdie("Not a block device.");
+        return check_card(devs[0], label);
+    }
+    if (capture) {
+        if (ndev != 1 || image || erase || verify) xdie("--capture takes one device.");
+        if (!is_block_device(devs[0])) xdie("Not a block device.");
+        return capture_card(devs[0], capture, with_p2);
+    }
+    if (verify) {
+        if ((ndev != 1 && !batch) || image || erase) xdie("--verify takes one device and nothing else.");
+        for (int i = 0; i < ndev; i++)
+            if (!is_block_device(devs[i])) xdie("Not a block device.");
+        if (dry_run) return plan_batch(devs, ndev, jobs, false, NULL, NULL, false, true, full, 0, workload, 0);
+        return verify_card(devs[0], full);
+    }
+    if (batch && (bmap || delta || restart)) xdie("--bmap, --delta and --restart go with --image.");
+    if (ndev > 1 && !batch && (erase || bmap || delta || restart))
+        xdie("--erase, --bmap, --delta and --restart take a single device.");
+    if (delta && !image) xdie("--delta needs --image.");
+    if (restart && (!image || delta)) xdie("--restart goes with --image (not --delta).");
+    if (delta && (erase || bmap)) xdie("--delta cannot be combined with --erase or --bmap.");
+
+    for (int i = 0; i < ndev; i++) {
+        if (!is_block_device(devs[i])) {
+            fprintf(stderr, "Error: %s is not a block device.\n", devs[i]);
+            return EXIT_FAILURE;
+        }
+        refuse_root_device(devs[i]);
+        if (image && is_same_disk(image, devs[i])) {
+            fprintf(stderr, "Error: %s is the source.\n", devs[i]);
+            return EXIT_FAILURE;
+        }
+        for (int j = 0; j < i; j++) {
+            if (is_same_disk(devs[j], devs[i])) {
+                fprintf(stderr, "Error: %s given twice.\n", devs[i]);
+                return EXIT_FAILURE;
             }
-            pclose(fp);
         }
     }
 
-    printf("THIS WILL DESTROY ALL DATA ON %s\n\n", DEVICE);
-    char *lsblk_argv[] = {"lsblk", (char*)DEVICE, NULL};
-    run_cmd(lsblk_argv);
+    if (dry_run) return plan_batch(devs, ndev, jobs, erase, image, bmap, delta, false, false,
+                                   cluster, workload, payload_size);
 
-    printf("\nType the exact device path to proceed (%s): ", DEVICE);
-    fflush(stdout);
-    char confirm[512] = {0};
-    if (!fgets(confirm, sizeof(confirm), stdin)) xdie("stdin read");
-    confirm[strcspn(confirm, "\n")] = 0;
-    if (strcmp(confirm, DEVICE) != 0) xdie("Confirmation mismatch. Aborting.");
+    if (ndev > 1) {
+        if (!yes) {
+            printf("THIS WILL DESTROY ALL DATA ON %d DEVICES\n\n", ndev);
+            char *lsblk_argv[ndev + 2];
+            lsblk_argv[0] = "lsblk";
+            for (int i = 0; i < ndev; i++) lsblk_argv[i + 1] = devs[i];
+            lsblk_argv[ndev + 1] = NULL;
+            run_cmd(lsblk_argv);
+
+            printf("\nType the number of target devices to proceed (%d): ", ndev);
+            fflush(stdout);
+            char confirm[64] = {0};
+            if (!fgets(confirm, sizeof(confirm), stdin)) xdie("stdin read");
+            if (atoi(confirm) != ndev) xdie("Confirmation mismatch. Aborting.");
+        }
+
+        inhibit_automount(devs, ndev);
+        for (int i = 0; i < ndev; i++) unmount_all(devs[i]);
+        int ok = duplicate_image(image, devs, ndev);
+        printf("\n%d of %d devices written.\n", ok, ndev);
+        if (cancel_flag) report_abort(false);
+        return ok == ndev ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    const char *DEVICE = devs[0];
 
+    // Station mode: a card that already carries the layout is left alone
+    if (skip_done && !image && !erase) {
+        FILE *saved = json_out;
+        json_out = NULL;   // the skip is the result, not the check
+        bool done = check_card(DEVICE, label) == EXIT_SUCCESS;
+        json_out = saved;
+        if (done) {
+            json_result(DEVICE, "format", "skipped: already prepared", now_sec() - t_start, NULL);
+            return EXIT_SUCCESS;
+        }
+    }
+
+    if (!yes) {
+        printf("THIS WILL DESTROY ALL DATA ON %s\n\n", DEVICE);
+        char *lsblk_argv[] = {"lsblk", (char*)DEVICE, NULL};
+        run_cmd(lsblk_argv);
+
+        printf("\nType the exact device path to proceed (%s): ", DEVICE);
+        fflush(stdout);
+        char confirm[512] = {0};
+        if (!fgets(confirm, sizeof(confirm), stdin)) xdie("stdin read");
+        confirm[strcspn(confirm, "\n")] = 0;
+        if (strcmp(confirm, DEVICE) != 0) xdie("Confirmation mismatch. Aborting.");
+    }
+
+    inhibit_automount(devs, 1);
     unmount_all(DEVICE);
+    rec_begin(scan_only ? "scan" : image ? (delta ? "delta" : "image") : erase ? "erase" : "format",
+              DEVICE);
 
-    // wipefs -a DEVICE
-    char *wipe_argv[] = {"wipefs", "-a", (char*)DEVICE, NULL};
-    if (run_cmd(wipe_argv) != 0) xdie("wipefs failed");
-
-    // parted mklabel msdos
-    char *mklabel_argv[] = {"parted", "-s", (char*)DEVICE, "mklabel", "msdos", NULL};
-    if (run_cmd(mklabel_argv) != 0) xdie("parted mklabel failed");
-
-    int64_t bytes = get_dev_size_bytes(DEVICE);
-    if (bytes <= 0) xdie("device size unknown");
-    const int64_t MIB = 1024LL * 1024LL;
-    int64_t size_mib = bytes / MIB;
-    const int64_t reserved_mib = 32;
-    const int64_t start_mib = 1;
-    int64_t end1_mib = size_mib - reserved_mib;
-
-    if (end1_mib <= start_mib + 8) xdie("device too small for requested layout");
-
-    // parted mkpart p1 fat32 1MiB end1MiB
-    char end1_str[64];
-    snprintf(end1_str, sizeof(end1_str), "%ldMiB", (long)end1_mib);
-    char *mkpart1_argv[] = {"parted", "-s", (char*)DEVICE, "mkpart", "primary", "fat32", "1MiB", end1_str, NULL};
-    if (run_cmd(mkpart1_argv) != 0) xdie("parted mkpart p1 failed");
-
-    // parted mkpart p2 end1MiB 100%
-    char *mkpart2_argv[] = {"parted", "-s", (char*)DEVICE, "mkpart", "primary", (char*)end1_str, "100%", NULL};
-    if (run_cmd(mkpart2_argv) != 0) xdie("parted mkpart p2 failed");
-
-    // partprobe + udevadm settle
-    char *probe_argv[] = {"partprobe", (char*)DEVICE, NULL};
-    run_cmd(probe_argv); // best effort
-    char *settle_argv[] = {"udevadm", "settle", NULL};
-    run_cmd(settle_argv);
+    // All raw writes go through the tuned I/O engine
+    sdio_dev io = {0};
+    io.log = log_line;
+    io.log_ctx = (void *)DEVICE;
+    io.progress = show_progress;
+    rec_dev = &io;
+    if (sdio_open(&io, DEVICE) != 0) die("open device for writing");
+    io.cancel = &cancel_flag;
+    if (!sdio_tune(&io) && sddb_seed(&io, &rec.id))
+        log_line((void *)DEVICE, "io: parameters from this card's last run");
 
-    // Determine partition names
-    // If device name ends with a digit -> use p1/p2 suffix, else 1/2
-    char P1[512], P2[512];
-    if (ends_with_digit(DEVICE)) {
-        snprintf(P1, sizeof(P1), "%sp1", DEVICE);
-        snprintf(P2, sizeof(P2), "%sp2", DEVICE);
-    } else {
-        snprintf(P1, sizeof(P1), "%s1", DEVICE);
-        snprintf(P2, sizeof(P2), "%s2", DEVICE);
+    if (scan) {
+        if (!scan_card(&io, scan_full, scan_write)) xdie("card failed the surface scan");
+        if (scan_only) {
+            sdio_close(&io);
+            rec_outcome("ok");
+            rec_finish();
+            return EXIT_SUCCESS;
+        }
     }
 
-    // Wait briefly for nodes to appear
-    for (int i = 0; i < 20; ++i) {
-        if (is_block_device(P1) && is_block_device(P2)) break;
-        usleep(250000);
+    if (image) {
+        if (delta) flash_delta(&io, image, hashes, trust);
+        else flash_image(&io, image, bmap, restart);
+        if (sdio_flush(&io) != 0) die("flush");
+        sdio_close(&io);
+        rec_outcome("ok");
+        rec_finish();
+        puts("\nSuccess.");
+        return EXIT_SUCCESS;
     }
-    if (!is_block_device(P1) || !is_block_device(P2)) xdie("partitions not detected by kernel");
 
-    // mkfs.fat -F32 -I -n PICO_DATA P1
-    char *mkfs_argv[] = {"mkfs.fat", "-F32", "-v", "-I", "-n", "PICO_DATA", P1, NULL};
-    if (run_cmd(mkfs_argv) != 0) xdie("mkfs.fat failed");
+    sdfat_bpb bpb;
+    layout_geometry(io.size, cluster == CLUSTER_AUTO ? 0 : cluster, &bpb);   // before the wipe
+    if (payload_size > payload_room(io.size)) xdie("payload does not fit in partition 2");
+
+    // Erase: whole device on request, otherwise just the partition table
+    // and filesystem signatures at both ends (what wipefs -a would hit)
+    set_stage(erase ? "erase" : "wipe", &io);
+    if (erase) {
+        printf("Erasing %s...\n", DEVICE);
+        if (sdio_zero(&io, 0, io.size) != 0) die("erase");
+    } else {
+        uint64_t tail = io.size > SDIO_MIB ? io.size - SDIO_MIB : 0;
+        if (sdio_zero(&io, 0, io.size < SDIO_MIB ? io.size : SDIO_MIB) != 0 ||
+            sdio_zero(&io, tail, io.size - tail) != 0) die("wipe signatures");
+    }
+    // Nothing on the card looks valid from here until the commit
+    if (sdio_flush(&io) != 0) die("flush");
+    if (cluster == CLUSTER_AUTO) cluster = choose_cluster(&io, workload);
+
+    // The whole layout is built in memory: partition table, FAT32, the
+    // payload and the manifest. It goes out in one ascending sweep; the
+    // partition table and boot sectors follow once that is on the media.
+    set_stage("layout", &io);
+    uint64_t p2 = p2_offset(io.size);
+    layout_geometry(io.size, cluster, &bpb);
+    sdfat_sanitize_label(label, bpb.label);
+    bpb.volume_id = (uint32_t)time(NULL) ^ (uint32_t)getpid() << 16;
+
+    sdsweep sw;
+    sdsweep_init(&sw);
+    uint64_t meta;
+    if (sdfat_build(&sw, io.size, &bpb, &meta) != 0) die("build layout");
+    printf("FAT32: %u KiB clusters, %u sectors per FAT, label %s\n",
+           (unsigned)(sdfat_cluster_bytes(&bpb) / 1024), (unsigned)bpb.fat_sectors, bpb.label);
+    uint64_t payload_len = payload ? queue_payload(&sw, &io, payload) : 0;
+
+    // The manifest: hashes of everything up to p1's root directory (and
+    // of the payload), taken from the sweep itself
+    sdman m;
+    memset(&m, 0, sizeof(m));
+    snprintf(m.name, sizeof(m.name), payload ? "fat32+%s" : "fat32", payload ? base_name(payload) : "");
+    m.p1_start = SDFAT_P1_START;
+    m.p1_size = p2 - SDFAT_P1_START;
+    m.p2_start = p2;
+    m.p2_size = io.size / 512 * 512 - p2;
+    memcpy(m.label, bpb.label, sizeof(m.label));
+    m.payload = payload_len;
+    if (sdsweep_hash(&sw, payload ? p2 + payload_len : meta, SDHASH_BLOCK, &m.hashes) != 0) die("hash layout");
+    m.image_id = sdman_image_id(&m.hashes);
+    unsigned char *man;
+    uint64_t man_off;
+    size_t man_len;
+    if (sdman_encode(&m, &man, &man_off, &man_len) != 0)
+        die(errno == E2BIG ? "no room for the manifest in partition 2" : "manifest");
+    if (sdsweep_add(&sw, man_off, man, man_len, false) != 0) die("manifest");
+    free(man);
+
+    uint64_t zeroed = io.stats.zeroed;
+    if (sdsweep_write(&io, &sw) != 0) die("write layout");
+    printf("Wrote the layout in one sweep: %llu KiB, %llu KiB of it zeroed by the device\n",
+           (unsigned long long)(sdsweep_bytes(&sw) / 1024),
+           (unsigned long long)((io.stats.zeroed - zeroed) / 1024));
+    printf("Manifest written to partition 2 (%zu block hashes)\n", sdhash_recorded(&m.hashes));
+    sdman_free(&m);
+    sdsweep_free(&sw);
+
+    // Leave P2 unformatted intentionally (reserved), apart from the
+    // payload and the manifest. The kernel picks up the new partitions.
+    if (ioctl(io.fd, BLKRRPART) != 0 && errno != EINVAL)
+        log_line((void *)DEVICE, "partition table not re-read; replug the card");
+    sdio_close(&io);
+    char *settle_argv[] = {"udevadm", "settle", NULL};
+    run_cmd(settle_argv);
 
-    // Leave P2 unformatted intentionally (reserved)
     printf("\nFinal layout:\n");
     show_layout(DEVICE);
 
+    rec_outcome("ok");
+    rec_finish();
     puts("\nSuccess.");
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,174 @@
+#!/bin/bash
+# dmbench – sdprep-cli against slow and failing cards, no drawer of bad
+# cards needed. A sparse loop file gets device-mapper targets in front
+# (see "Testing against slow and failing cards" in the README):
+#
+#   slow   dm-delay, READ_MS per read and WRITE_MS per write
+#   bad    dm-error, 1 MiB of errors at 512 MiB
+#   flaky  dm-flakey, every request failing once its up interval is over
+#
+# and each check passes or fails:
+#
+#   format on slow     finishes within FORMAT_MAX seconds
+#   abort on slow      SIGINT mid-write exits 130 within ABORT_MAX seconds
+#                      with "Aborted: … stopped at byte N"
+#   erase on bad       exits 1 naming the stage it failed in
+#   format on flaky    the same
+#
+# Usage: sudo bench/dmbench.sh [path/to/sdprep-cli]    (make bench)
+# Without root or device-mapper it says so and exits 0.
+
+set -u
+
+CLI=${1:-./sdprep-cli}
+SIZE_MB=${SIZE_MB:-2048}
+IMAGE_MB=${IMAGE_MB:-256}
+READ_MS=${READ_MS:-5}
+WRITE_MS=${WRITE_MS:-50}
+FORMAT_MAX=${FORMAT_MAX:-60}
+ABORT_MAX=${ABORT_MAX:-2}
+
+skip() { echo "dmbench: skipped: $*"; exit 0; }
+
+[ "$(id -u)" -eq 0 ] || skip "needs root (sudo make bench)"
+for t in losetup blockdev dmsetup; do
+    command -v $t >/dev/null || skip "$t not found"
+done
+[ -x "$CLI" ] || { echo "dmbench: $CLI not found (make sdprep-cli)" >&2; exit 2; }
+dmsetup targets >/dev/null 2>&1 || skip "no device-mapper in this kernel"
+
+WORK=$(mktemp -d /tmp/dmbench.XXXXXX)
+LOOP=
+NAMES=()
+fails=0
+
+cleanup() {
+    for n in ${NAMES[@]+"${NAMES[@]}"}; do dmsetup remove --retry "$n" 2>/dev/null; done
+    [ -n "$LOOP" ] && losetup -d "$LOOP" 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap 'exit 130' INT TERM
+
+# Its own state directory: no tuning cache, history or checkpoint of
+# the real cards is read or changed.
+export SDPREP_STATE_DIR=$WORK/state
+
+pass() { echo "  PASS  $*"; }
+fail() { echo "  FAIL  $*"; fails=$((fails + 1)); }
+
+now() { date +%s.%N; }
+elapsed() { awk -v a="$1" -v b="$(now)" 'BEGIN { printf "%.2f", b - a }'; }
+within() { awk -v a="$1" -v b="$2" 'BEGIN { exit !(a <= b) }'; }
+
+# dm_create NAME TABLE: DEV is the target's node; false if the kernel
+# lacks that target type
+dm_create() {
+    local name=sdbench-$1-$$
+    echo "$2" | dmsetup create "$name" 2>"$WORK/dm.err" || {
+        echo "  SKIP  $1: $(head -n1 "$WORK/dm.err")"
+        return 1
+    }
+    NAMES+=("$name")
+    udevadm settle 2>/dev/null
+    DEV=/dev/mapper/$name
+}
+
+# The last message in a log, past the progress line's carriage returns
+last_line() { tr '\r' '\n' <"$1" | grep -v '^ *$' | tail -n1; }
+
+# The stage a run last announced ("Stage: NAME" on stdout)
+last_stage() { sed -n 's/^Stage: //p' "$1" | tail -n1; }
+
+# expect_failure WHAT OUT ERR RC: exit 1 with the failing stage named
+# in the error, not an abort and never "Success"
+expect_failure() {
+    local what=$1 out=$2 err=$3 rc=$4 st
+    st=$(last_stage "$out")
+    if [ "$rc" -ne 1 ]; then
+        fail "$what: exit $rc, expected 1"
+    elif [ -z "$st" ] || ! grep -q -- "$st" "$err"; then
+        fail "$what: error does not name the stage (${st:-none}): $(last_line "$err")"
+    elif grep -q "Success" "$err"; then
+        fail "$what: error reported as Success"
+    else
+        pass "$what: exit 1 in stage $st: $(last_line "$err")"
+    fi
+}
+
+truncate -s "${SIZE_MB}M" "$WORK/card.img"
+LOOP=$(losetup -f --show "$WORK/card.img") || { echo "dmbench: losetup failed" >&2; exit 2; }
+S=$(blockdev --getsz "$LOOP")
+echo "dmbench: $CLI on $LOOP (${SIZE_MB} MiB), state in $SDPREP_STATE_DIR"
+
+# --- slow card: total time, then abort latency -----------------------
+echo "slow (${READ_MS} ms read, ${WRITE_MS} ms write):"
+if dm_create slow "0 $S delay $LOOP 0 $READ_MS $LOOP 0 $WRITE_MS"; then
+    SLOW=$DEV
+    t0=$(now)
+    "$CLI" --yes "$SLOW" >"$WORK/slow.out" 2>"$WORK/slow.err"
+    rc=$?
+    dt=$(elapsed "$t0")
+    if [ $rc -ne 0 ]; then
+        fail "format: exit $rc: $(last_line "$WORK/slow.err")"
+    elif within "$dt" "$FORMAT_MAX"; then
+        pass "format: $dt s (limit $FORMAT_MAX s)"
+    else
+        fail "format: $dt s, over the $FORMAT_MAX s limit"
+    fi
+
+    # Random data, so no block is skipped as zero and the write lasts
+    head -c "${IMAGE_MB}M" /dev/urandom >"$WORK/abort.img"
+    "$CLI" --yes --restart --image "$WORK/abort.img" "$SLOW" \
+        >"$WORK/abort.out" 2>"$WORK/abort.err" &
+    pid=$!
+    for _ in $(seq 100); do
+        grep -q "^Stage: write image" "$WORK/abort.out" 2>/dev/null && break
+        kill -0 $pid 2>/dev/null || break
+        sleep 0.1
+    done
+    sleep 1   # well into the write
+    if ! kill -0 $pid 2>/dev/null; then
+        wait $pid
+        fail "abort: the image write ended before the signal (exit $?); raise IMAGE_MB"
+    else
+        t0=$(now)
+        kill -INT $pid
+        wait $pid
+        rc=$?
+        dt=$(elapsed "$t0")
+        if [ $rc -ne 130 ]; then
+            fail "abort: exit $rc, expected 130: $(last_line "$WORK/abort.err")"
+        elif ! grep -q "^Aborted: .* stopped at byte [0-9]" "$WORK/abort.err"; then
+            fail "abort: no \"stopped at byte\" line: $(last_line "$WORK/abort.err")"
+        elif ! within "$dt" "$ABORT_MAX"; then
+            fail "abort: exit after $dt s, over the $ABORT_MAX s limit"
+        else
+            pass "abort: exit 130 after $dt s: $(grep "^Aborted:" "$WORK/abort.err")"
+        fi
+    fi
+    rm -f "$WORK/abort.img"
+fi
+
+# --- bad block: --erase runs into it ---------------------------------
+echo "bad (1 MiB of errors at 512 MiB):"
+if dm_create bad "0 1048576 linear $LOOP 0
+1048576 2048 error
+1050624 $((S - 1050624)) linear $LOOP 1050624"; then
+    "$CLI" --yes --erase "$DEV" >"$WORK/bad.out" 2>"$WORK/bad.err"
+    expect_failure "erase" "$WORK/bad.out" "$WORK/bad.err" $?
+fi
+
+# --- flaky card: up for 1 s, then down for longer than a format ------
+echo "flaky (up 1 s, then down):"
+if dm_create flaky "0 $S flakey $LOOP 0 1 $((FORMAT_MAX + 60))"; then
+    sleep 2
+    "$CLI" --yes "$DEV" >"$WORK/flaky.out" 2>"$WORK/flaky.err"
+    expect_failure "format" "$WORK/flaky.out" "$WORK/flaky.err" $?
+fi
+
+if [ $fails -ne 0 ]; then
+    echo "dmbench: $fails check(s) failed"
+    exit 1
+fi
+echo "dmbench: all checks passed"
@@ -0,0 +1,101 @@
+#!/bin/bash
+# enumbench – device enumeration on a host with many block devices. A
+# generated sysfs tree (SDPREP_SYSFS) holds N loop, dm, zram and nvme
+# devices plus two USB readers and an MMC slot:
+#
+#   sdb       USB reader with a card     (taken by --all)
+#   sdc       USB reader, no media
+#   mmcblk0   built-in slot with a card  (taken by --all)
+#
+# `sdprep-cli --list` runs on the tree at each size in SIZES. Each size
+# must find those three, and the time per device must not grow by more
+# than MAX_GROWTH from one size to the next: the pass is linear in the
+# number of devices, and a card costs the same on any host.
+#
+# Usage: bench/enumbench.sh [path/to/sdprep-cli]    (make bench)
+# Needs no root.
+
+set -u
+
+CLI=${1:-./sdprep-cli}
+SIZES=${SIZES:-100 1000 4000}
+RUNS=${RUNS:-5}
+MAX_GROWTH=${MAX_GROWTH:-2}
+
+[ -x "$CLI" ] || { echo "enumbench: $CLI not found (make sdprep-cli)" >&2; exit 2; }
+
+WORK=$(mktemp -d /tmp/enumbench.XXXXXX)
+trap 'rm -rf "$WORK"' EXIT
+trap 'exit 130' INT TERM
+fails=0
+
+pass() { echo "  PASS  $*"; }
+fail() { echo "  FAIL  $*"; fails=$((fails + 1)); }
+
+# dev ROOT NAME MAJOR MINOR SECTORS REMOVABLE PARENT [MODEL]
+dev() {
+    local d="$1/devices/$7/block/$2"
+    mkdir -p "$d/device"
+    echo "$3:$4" >"$d/dev"
+    echo "$5" >"$d/size"
+    echo "$6" >"$d/removable"
+    echo 0 >"$d/ro"
+    echo "${8:-}" >"$d/device/model"
+    ln -s "../devices/$7/block/$2" "$1/block/$2"
+}
+
+# mkfake ROOT N: N loop/dm/zram/nvme devices, 2 readers, 1 slot
+mkfake() {
+    rm -rf "$1"
+    mkdir -p "$1/block"
+    local i
+    for ((i = 0; i < $2; i++)); do
+        case $((i % 4)) in
+        0) dev "$1" loop$i 7 $i 0 0 virtual ;;
+        1) dev "$1" dm-$i 253 $i 2097152 0 virtual ;;
+        2) dev "$1" zram$i 252 $i 8388608 0 virtual ;;
+        3) dev "$1" nvme${i}n1 259 $i 1000215216 0 pci0000:00/nvme$i ;;
+        esac
+    done
+    dev "$1" sdb 8 16 62333952 1 pci0000:00/usb2/2-1/host6/6:0:0:0 "STORAGE DEVICE"
+    dev "$1" sdc 8 32 0 1 pci0000:00/usb2/2-2/host7/7:0:0:0 "Card Reader"
+    dev "$1" mmcblk0 179 0 31116288 0 platform/mmc0/mmc0:0001
+}
+
+echo "enumbench: $CLI --list, best of $RUNS runs per size"
+prev_n=
+prev_us=
+for n in $SIZES; do
+    mkfake "$WORK/sys" "$n"
+    best=
+    for ((r = 0; r < RUNS; r++)); do
+        SDPREP_SYSFS=$WORK/sys "$CLI" --list >"$WORK/list.out" 2>&1 || {
+            fail "$n devices: --list exited $?: $(tail -n1 "$WORK/list.out")"
+            continue 2
+        }
+        # "3 of 1003 block devices could be cards (… dropped …) in 7.12 ms"
+        ms=$(sed -n 's/.* could be cards .* in \([0-9.]*\) ms$/\1/p' "$WORK/list.out")
+        best=$(awk -v a="${best:-$ms}" -v b="$ms" 'BEGIN { print (b < a ? b : a) }')
+    done
+    total=$((n + 3))
+    us=$(awk -v ms="$best" -v t="$total" 'BEGIN { printf "%.2f", ms * 1000 / t }')
+
+    if ! grep -q "^3 of $total block devices" "$WORK/list.out"; then
+        fail "$n devices: expected 3 of $total: $(grep "could be cards" "$WORK/list.out")"
+    elif ! grep -q '^\*.*mmcblk0' "$WORK/list.out" || ! grep -q '^\*.*sdb' "$WORK/list.out"; then
+        fail "$n devices: sdb and mmcblk0 not both taken by --all"
+    elif [ -n "$prev_us" ] &&
+         ! awk -v a="$us" -v b="$prev_us" -v g="$MAX_GROWTH" 'BEGIN { exit !(a <= b * g) }'; then
+        fail "$total devices: $best ms, $us µs per device, over ${MAX_GROWTH}x the $prev_us µs at $prev_n"
+    else
+        pass "$total devices: $best ms, $us µs per device"
+    fi
+    prev_n=$total
+    prev_us=$us
+done
+
+if [ $fails -ne 0 ]; then
+    echo "enumbench: $fails check(s) failed"
+    exit 1
+fi
+echo "enumbench: all checks passed"
@@ -0,0 +1,245 @@
+#define _GNU_SOURCE
+#include "sdbmap.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Only the fields the writer needs are read:
+
+     <ImageSize> 821752 </ImageSize>
+     <BlockSize> 4096 </BlockSize>
+     <BlockMap>
+         <Range chksum="..."> 0-1 </Range>
+         <Range chksum="..."> 5 </Range>
+     </BlockMap>
+
+   Per-range checksums are ignored. */
+
+static char *slurp(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) return NULL;
+
+    size_t cap = 64 * 1024, len = 0;
+    char *buf = malloc(cap);
+    while (buf) {
+        size_t n = fread(buf + len, 1, cap - len - 1, fp);
+        len += n;
+        if (len < cap - 1) break;
+        cap *= 2;
+        char *nb = realloc(buf, cap);
+        if (!nb) { free(buf); buf = NULL; }
+        else buf = nb;
+    }
+    int e = ferror(fp) ? EIO : ENOMEM;
+    fclose(fp);
+    if (!buf) { errno = e; return NULL; }
+    buf[len] = 0;
+    return buf;
+}
+
+static int tag_u64(const char *doc, const char *tag, uint64_t *out) {
+    char open[64];
+    snprintf(open, sizeof(open), "<%s>", tag);
+    const char *p = strstr(doc, open);
+    if (!p) return -1;
+    char *end = NULL;
+    errno = 0;
+    unsigned long long v = strtoull(p + strlen(open), &end, 10);
+    if (errno || end == p + strlen(open)) return -1;
+    *out = v;
+    return 0;
+}
+
+static int ext_cmp(const void *a, const void *b) {
+    const sdio_extent *x = a, *y = b;
+    return x->off < y->off ? -1 : x->off > y->off;
+}
+
+int sdbmap_load(const char *path, sdbmap *bm) {
+    memset(bm, 0, sizeof(*bm));
+    char *doc = slurp(path);
+    if (!doc) return -1;
+
+    uint64_t bs = 0;
+    if (!strstr(doc, "<bmap") ||
+        tag_u64(doc, "ImageSize", &bm->image_size) != 0 ||
+        tag_u64(doc, "BlockSize", &bs) != 0 ||
+        bs == 0 || bs % 512 || bs > (1u << 24)) {
+        free(doc);
+        errno = EBADMSG;
+        return -1;
+    }
+    bm->block_size = (uint32_t)bs;
+
+    /* Allocated even for an empty map: a NULL map means "all mapped". */
+    size_t cap = 256;
+    bm->ext = malloc(cap * sizeof(*bm->ext));
+    if (!bm->ext) {
+        free(doc);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    const char *p = strstr(doc, "<BlockMap>");
+    while (p && (p = strstr(p, "<Range")) != NULL) {
+        const char *gt = strchr(p, '>');
+        if (!gt) break;
+        char *end = NULL;
+        uint64_t first = strtoull(gt + 1, &end, 10), last = first;
+        if (end == gt + 1) goto bad;
+        while (*end == ' ' || *end == '\t') end++;
+        if (*end == '-') {
+            const char *q = end + 1;
+            last = strtoull(q, &end, 10);
+            if (end == q || last < first) goto bad;
+        }
+        p = end;
+
+        uint64_t off = first * bs;
+        if (off >= bm->image_size) continue;
+        uint64_t len = (last - first + 1) * bs;
+        if (len > bm->image_size - off) len = bm->image_size - off;
+
+        if (bm->n == cap) {
+            cap *= 2;
+            sdio_extent *ne = realloc(bm->ext, cap * sizeof(*ne));
+            if (!ne) {
+                free(doc);
+                sdbmap_free(bm);
+                errno = ENOMEM;
+                return -1;
+            }
+            bm->ext = ne;
+        }
+        bm->ext[bm->n].off = off;
+        bm->ext[bm->n].len = len;
+        bm->n++;
+    }
+    free(doc);
+
+    /* Sort and merge so the writer can binary-search. */
+    qsort(bm->ext, bm->n, sizeof(*bm->ext), ext_cmp);
+    size_t w = 0;
+    for (size_t i = 0; i < bm->n; i++) {
+        if (w && bm->ext[i].off <= bm->ext[w - 1].off + bm->ext[w - 1].len) {
+            uint64_t e = bm->ext[i].off + bm->ext[i].len;
+            if (e > bm->ext[w - 1].off + bm->ext[w - 1].len)
+                bm->ext[w - 1].len = e - bm->ext[w - 1].off;
+        } else {
+            bm->ext[w++] = bm->ext[i];
+        }
+    }
+    bm->n = w;
+    for (size_t i = 0; i < bm->n; i++) bm->mapped += bm->ext[i].len;
+    return 0;
+
+bad:
+    free(doc);
+    sdbmap_free(bm);
+    errno = EBADMSG;
+    return -1;
+}
+
+void sdbmap_free(sdbmap *bm) {
+    free(bm->ext);
+    bm->ext = NULL;
+    bm->n = 0;
+}
+
+int sdbmap_save(const char *path, uint64_t image_size, uint32_t block_size,
+                const sdio_extent *map, size_t n) {
+    uint64_t bs = block_size, blocks = (image_size + bs - 1) / bs;
+
+    /* Ranges in blocks; neighbours that touch once widened are joined. */
+    uint64_t *first = malloc((n ? n : 1) * sizeof(*first));
+    uint64_t *last = malloc((n ? n : 1) * sizeof(*last));
+    size_t nr = 0;
+    uint64_t mapped = 0;
+    if (!first || !last) {
+        free(first);
+        free(last);
+        errno = ENOMEM;
+        return -1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (!map[i].len || map[i].off >= image_size) continue;
+        uint64_t a = map[i].off / bs, b = (map[i].off + map[i].len - 1) / bs;
+        if (b >= blocks) b = blocks - 1;
+        if (nr && a <= last[nr - 1] + 1) {
+            if (b > last[nr - 1]) last[nr - 1] = b;
+        } else {
+            first[nr] = a;
+            last[nr] = b;
+            nr++;
+        }
+    }
+    for (size_t i = 0; i < nr; i++) mapped += last[i] - first[i] + 1;
+
+    /* Format 1.2: the last one without mandatory checksums. */
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        free(first);
+        free(last);
+        return -1;
+    }
+    fprintf(fp, "<?xml version=\"1.0\" ?>\n<bmap version=\"1.2\">\n");
+    fprintf(fp, "    <ImageSize> %llu </ImageSize>\n", (unsigned long long)image_size);
+    fprintf(fp, "    <BlockSize> %u </BlockSize>\n", block_size);
+    fprintf(fp, "    <BlocksCount> %llu </BlocksCount>\n", (unsigned long long)blocks);
+    fprintf(fp, "    <MappedBlocksCount> %llu </MappedBlocksCount>\n", (unsigned long long)mapped);
+    fprintf(fp, "    <BlockMap>\n");
+    for (size_t i = 0; i < nr; i++) {
+        if (first[i] == last[i])
+            fprintf(fp, "        <Range> %llu </Range>\n", (unsigned long long)first[i]);
+        else
+            fprintf(fp, "        <Range> %llu-%llu </Range>\n",
+                    (unsigned long long)first[i], (unsigned long long)last[i]);
+    }
+    fprintf(fp, "    </BlockMap>\n</bmap>\n");
+    free(first);
+    free(last);
+
+    int e = ferror(fp) ? EIO : 0;
+    if (fclose(fp) != 0 && !e) e = errno;
+    if (e) {
+        errno = e;
+        return -1;
+    }
+    return 0;
+}
+
+char *sdbmap_find_sidecar(const char *image) {
+    static const char *const packed[] = { ".xz", ".zst", ".gz", NULL };
+
+    size_t n = strlen(image);
+    for (int i = 0; packed[i]; i++) {
+        size_t k = strlen(packed[i]);
+        if (n > k && strcmp(image + n - k, packed[i]) == 0) {
+            n -= k;
+            break;
+        }
+    }
+
+    char *path = malloc(n + 6);
+    if (!path) return NULL;
+
+    /* X.img.bmap */
+    memcpy(path, image, n);
+    strcpy(path + n, ".bmap");
+    if (access(path, R_OK) == 0) return path;
+
+    /* X.bmap */
+    const char *dot = memrchr(image, '.', n);
+    const char *slash = memrchr(image, '/', n);
+    if (dot && (!slash || dot > slash)) {
+        size_t stem = (size_t)(dot - image);
+        strcpy(path + stem, ".bmap");
+        if (access(path, R_OK) == 0) return path;
+    }
+
+    free(path);
+    return NULL;
+}
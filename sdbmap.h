@@ -0,0 +1,35 @@
+#ifndef SDBMAP_H
+#define SDBMAP_H
+
+/* ============================================================
+   sdbmap – block-map sidecars (bmaptool XML format)
+   Lists which blocks of an image carry data; everything else
+   is free space the writer may skip.
+   ============================================================ */
+
+#include <stdint.h>
+
+#include "sdio.h"
+
+typedef struct {
+    uint64_t     image_size;
+    uint32_t     block_size;
+    sdio_extent *ext;       /* sorted, merged, in bytes; never NULL once loaded */
+    size_t       n;
+    uint64_t     mapped;    /* bytes covered by ext */
+} sdbmap;
+
+/* Parse a .bmap file. Returns -1 with errno set (EBADMSG if malformed). */
+int  sdbmap_load(const char *path, sdbmap *bm);
+void sdbmap_free(sdbmap *bm);
+
+/* Write a .bmap for an image_size-byte image whose data lies in map
+   (sorted, merged), widened to whole block_size blocks. */
+int  sdbmap_save(const char *path, uint64_t image_size, uint32_t block_size,
+                 const sdio_extent *map, size_t n);
+
+/* Look for the sidecar of an image: "X.img.zst" -> "X.img.bmap", then
+   "X.bmap". Returns a malloc'd path, or NULL if there is none. */
+char *sdbmap_find_sidecar(const char *image);
+
+#endif /* SDBMAP_H */
@@ -0,0 +1,131 @@
+#define _GNU_SOURCE
+#include "sdcap.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sdfat.h"
+#include "sdpool.h"
+
+#define ALIGN   4096ULL
+#define CHUNK   (4 * 1024 * 1024)
+#define HOLE    (64 * 1024)   /* zero runs this long stay holes */
+
+static int push(sdcap_plan *p, size_t *cap, uint64_t off, uint64_t end) {
+    /* Widen to 4 KiB so every read can go through O_DIRECT. */
+    off = off / ALIGN * ALIGN;
+    end = (end + ALIGN - 1) / ALIGN * ALIGN;
+    if (end > p->image_size) end = p->image_size;
+    if (end <= off) return 0;
+
+    if (p->n && off <= p->map[p->n - 1].off + p->map[p->n - 1].len) {
+        sdio_extent *e = &p->map[p->n - 1];
+        if (end > e->off + e->len) e->len = end - e->off;
+        return 0;
+    }
+    if (p->n == *cap) {
+        size_t nc = *cap ? *cap * 2 : 256;
+        sdio_extent *ne = realloc(p->map, nc * sizeof(*ne));
+        if (!ne) {
+            errno = ENOMEM;
+            return -1;
+        }
+        p->map = ne;
+        *cap = nc;
+    }
+    p->map[p->n].off = off;
+    p->map[p->n].len = end - off;
+    p->n++;
+    return 0;
+}
+
+int sdcap_plan_build(sdio_dev *d, bool with_p2, sdcap_plan *p) {
+    memset(p, 0, sizeof(*p));
+
+    sdfat_part part[4];
+    sdfat_bpb b;
+    if (sdfat_read_mbr(d, part) != 0) return -1;
+    if (part[0].type == 0 || part[0].start + part[0].size > d->size) {
+        errno = EBADMSG;
+        return -1;
+    }
+    if (sdfat_read_bpb(d, part[0].start, &b) != 0) return -1;
+
+    p->image_size = part[0].start + part[0].size;
+    if (with_p2 && part[1].type && part[1].start >= p->image_size &&
+        part[1].start + part[1].size <= d->size)
+        p->image_size = part[1].start + part[1].size;
+
+    sdio_extent *fat = NULL;
+    size_t nfat = 0, cap = 0;
+    uint64_t used;
+    if (sdfat_used_map(d, part[0].start, &b, &fat, &nfat, &used) != 0) return -1;
+
+    /* MBR and the gap before p1 (boot code may live there), the volume,
+       then p2 whole: the manifest and any raw payload. */
+    int rc = push(p, &cap, 0, part[0].start);
+    for (size_t i = 0; rc == 0 && i < nfat; i++)
+        rc = push(p, &cap, fat[i].off, fat[i].off + fat[i].len);
+    if (rc == 0 && p->image_size > part[0].start + part[0].size)
+        rc = push(p, &cap, part[1].start, part[1].start + part[1].size);
+    free(fat);
+    if (rc != 0) {
+        sdcap_plan_free(p);
+        return -1;
+    }
+
+    for (size_t i = 0; i < p->n; i++) p->mapped += p->map[i].len;
+    return 0;
+}
+
+void sdcap_plan_free(sdcap_plan *p) {
+    free(p->map);
+    p->map = NULL;
+    p->n = 0;
+}
+
+int sdcap_copy(sdio_dev *d, const sdcap_plan *p, int fd) {
+    if (ftruncate(fd, 0) != 0 || ftruncate(fd, (off_t)p->image_size) != 0) return -1;
+
+    void *buf = sdpool_get(CHUNK);
+    if (!buf) return -1;
+
+    uint64_t done = 0;
+    for (size_t i = 0; i < p->n; i++) {
+        for (uint64_t pos = 0; pos < p->map[i].len; ) {
+            uint64_t left = p->map[i].len - pos;
+            size_t len = left < CHUNK ? (size_t)left : CHUNK;
+            uint64_t off = p->map[i].off + pos;
+            if (sdio_read_at(d, buf, len, off) != 0) goto fail;
+
+            /* The file is already all holes; only data needs writing. */
+            for (size_t k = 0; k < len; k += HOLE) {
+                size_t l = len - k < HOLE ? len - k : HOLE;
+                const char *s = (const char *)buf + k;
+                if (sdio_is_zero(s, l)) continue;
+                for (size_t w = 0; w < l; ) {
+                    ssize_t r = pwrite(fd, s + w, l - w, (off_t)(off + k + w));
+                    if (r < 0) {
+                        if (errno == EINTR) continue;
+                        goto fail;
+                    }
+                    w += (size_t)r;
+                }
+            }
+
+            pos += len;
+            done += len;
+            if (d->progress) d->progress(d->progress_ctx, done, p->mapped);
+        }
+    }
+    sdpool_put(buf, CHUNK);
+    return fsync(fd);
+
+fail:;
+    int e = errno;
+    sdpool_put(buf, CHUNK);
+    errno = e;
+    return -1;
+}
@@ -0,0 +1,34 @@
+#ifndef SDCAP_H
+#define SDCAP_H
+
+/* ============================================================
+   sdcap – golden image capture from a reference card
+   Only what the card actually holds is read: the area before
+   p1, the FAT32 metadata, allocated clusters and optionally
+   p2. The result is a sparse raw image plus a block map, so
+   time and size follow the content, not the capacity.
+   ============================================================ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sdio.h"
+
+typedef struct {
+    uint64_t     image_size;   /* end of p1, or of p2 with it */
+    sdio_extent *map;          /* sorted, merged, 4 KiB aligned (malloc'd) */
+    size_t       n;
+    uint64_t     mapped;       /* bytes covered by map */
+} sdcap_plan;
+
+/* Work out what to capture from the card's MBR and p1's FAT. EBADMSG if
+   the card has no partition table or p1 is not FAT32. */
+int  sdcap_plan_build(sdio_dev *d, bool with_p2, sdcap_plan *p);
+void sdcap_plan_free(sdcap_plan *p);
+
+/* Copy the planned ranges to fd (a regular file), leaving everything else,
+   and all-zero runs inside the ranges, as holes. Reports progress through
+   d->progress in mapped bytes. */
+int  sdcap_copy(sdio_dev *d, const sdcap_plan *p, int fd);
+
+#endif /* SDCAP_H */
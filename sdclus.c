@@ -0,0 +1,289 @@
+#define _GNU_SOURCE
+#include "sdclus.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sdfat.h"
+#include "sdpool.h"
+
+/* The scratch range is laid out like a small FAT volume: 1 MiB of FAT,
+   1 MiB of directory, file data from 4 MiB (an allocation unit on most
+   cards). A file is written as its driver would write it: one request
+   per cluster (the tail only up to its last sector), then the FAT
+   sectors its chain touched and its directory sector. Reading back
+   goes directory, FAT, clusters. Every candidate runs ROUNDS times,
+   interleaved, and keeps its best time. */
+
+#define FAT_AREA     (1 * SDIO_MIB)
+#define DIR_AREA     (1 * SDIO_MIB)
+#define DATA_START   (4 * SDIO_MIB)
+#define MIN_CLUSTER  (4 * 1024)
+#define MAX_CLUSTER  (64 * 1024)
+#define ROUNDS       2
+#define NEAR_BEST    1.05         /* within 5%: the smaller cluster wins */
+#define MAX_FILES    160
+
+static const char *profile_names[] = { "small", "large", "mixed" };
+
+int sdclus_parse_profile(const char *s, sdclus_profile *p) {
+    for (int i = 0; i < 3; i++)
+        if (strcmp(s, profile_names[i]) == 0) {
+            *p = (sdclus_profile)i;
+            return 0;
+        }
+    errno = EINVAL;
+    return -1;
+}
+
+const char *sdclus_profile_name(sdclus_profile p) {
+    return profile_names[p];
+}
+
+/* File sizes of a profile; the same every run. */
+static size_t workload(sdclus_profile p, uint32_t sizes[MAX_FILES]) {
+    size_t nsmall = p == SDCLUS_SMALL ? 128 : p == SDCLUS_MIXED ? 96 : 0;
+    size_t nlarge = p == SDCLUS_LARGE ? 4 : p == SDCLUS_MIXED ? 2 : 0;
+    uint64_t x = 0x5D5EED5D5EEDULL;
+    size_t n = 0;
+    for (size_t i = 0; i < nsmall; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        sizes[n++] = 1024 + (uint32_t)(x % (23 * 1024));   /* 1 to 24 KiB */
+    }
+    for (size_t i = 0; i < nlarge; i++) sizes[n++] = 2 * SDIO_MIB;
+    return n;
+}
+
+uint64_t sdclus_bench_bytes(sdclus_profile p) {
+    uint32_t sizes[MAX_FILES];
+    size_t n = workload(p, sizes);
+    uint64_t b = 0;
+    for (size_t i = 0; i < n; i++) b += sizes[i];
+    return 2 * b * ROUNDS;   /* written and read back */
+}
+
+int sdclus_candidates(uint64_t vol, uint32_t out[SDCLUS_MAX_TRIALS]) {
+    int n = 0;
+    sdfat_bpb b;
+    for (uint32_t c = MIN_CLUSTER; c <= MAX_CLUSTER && n < SDCLUS_MAX_TRIALS; c *= 2)
+        if (sdfat_geometry(vol, c, &b) == 0) out[n++] = c;
+    return n;
+}
+
+/* ------------------------------------------------------------
+   Cache: "ident<TAB>profile<TAB>cluster" per line
+   ------------------------------------------------------------ */
+static void cache_path(char *out, size_t outsz) {
+    const char *dir = getenv("SDPREP_STATE_DIR");
+    if (!dir || !*dir) dir = SDIO_STATE_DIR;
+    snprintf(out, outsz, "%s/clusters.tsv", dir);
+}
+
+bool sdclus_cached(const char *ident, sdclus_profile p, uint32_t *cluster) {
+    char path[512];
+    cache_path(path, sizeof(path));
+    FILE *fp = fopen(path, "r");
+    if (!fp) return false;
+
+    bool found = false;
+    char line[512];
+    while (fgets(line, sizeof(line), fp)) {
+        char *t1 = strchr(line, '\t');
+        char *t2 = t1 ? strchr(t1 + 1, '\t') : NULL;
+        if (!t2) continue;
+        *t1 = *t2 = 0;
+        if (strcmp(line, ident) != 0 || strcmp(t1 + 1, profile_names[p]) != 0) continue;
+        unsigned long c = strtoul(t2 + 1, NULL, 10);
+        if (c < MIN_CLUSTER || c > MAX_CLUSTER || (c & (c - 1))) continue;
+        *cluster = (uint32_t)c;
+        found = true;
+    }
+    fclose(fp);
+    return found;
+}
+
+/* Locked, with a tmp file per process, like the tuning cache: --jobs
+   workers may store at the same time. */
+static void cache_store(sdio_dev *d, sdclus_profile p, uint32_t cluster) {
+    char path[512], tmp[540], lock[528];
+    cache_path(path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    snprintf(lock, sizeof(lock), "%s.lock", path);
+
+    char dir[512];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash) {
+        *slash = 0;
+        if (mkdir(dir, 0755) != 0 && errno != EEXIST) return;
+    }
+
+    int lfd = open(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lfd < 0) return;
+    while (flock(lfd, LOCK_EX) != 0 && errno == EINTR) {}
+
+    FILE *out = fopen(tmp, "w");
+    if (!out) {
+        close(lfd);
+        return;
+    }
+
+    /* Carry over every other model and profile unchanged. */
+    char key[300];
+    int klen = snprintf(key, sizeof(key), "%s\t%s\t", d->ident, profile_names[p]);
+    FILE *in = fopen(path, "r");
+    if (in) {
+        char line[512];
+        while (fgets(line, sizeof(line), in))
+            if (strncmp(line, key, (size_t)klen) != 0) fputs(line, out);
+        fclose(in);
+    }
+    fprintf(out, "%s%u\n", key, cluster);
+
+    if (fclose(out) != 0 || rename(tmp, path) != 0) unlink(tmp);
+    close(lfd);   /* drops the lock */
+}
+
+/* ------------------------------------------------------------
+   Benchmark
+   ------------------------------------------------------------ */
+typedef struct {
+    sdio_dev      *d;
+    uint64_t       off;
+    unsigned char *buf;      /* MAX_CLUSTER bytes */
+    uint64_t       done;
+    uint64_t       total;
+    bool           dry;      /* count the bytes, move none */
+} bench;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t round_up(uint64_t v, uint64_t to) {
+    return (v + to - 1) / to * to;
+}
+
+static int io(bench *b, bool write, uint64_t off, size_t len) {
+    if (b->dry) {
+        b->total += len;
+        return 0;
+    }
+    int rc = write ? sdio_write_at(b->d, b->buf, len, off)
+                   : sdio_read_at(b->d, b->buf, len, off);
+    if (rc != 0) return -1;
+    b->done += len;
+    if (b->d->progress) b->d->progress(b->d->progress_ctx, b->done, b->total);
+    return 0;
+}
+
+/* One pass of the workload at cluster size c: writes, flush, reads. */
+static int run(bench *b, const uint32_t *sizes, size_t n, uint32_t c, double *sec) {
+    unsigned sec_sz = b->d->sector > 512 ? b->d->sector : 512;
+    uint64_t fat = b->off, dir = b->off + FAT_AREA, data = b->off + DATA_START;
+    double t0 = now_sec();
+
+    for (int write = 1; write >= 0; write--) {
+        uint64_t pos = data, cl = 2;   /* clusters 0 and 1 are reserved */
+        for (size_t i = 0; i < n; i++) {
+            uint64_t nclus = (sizes[i] + c - 1) / c;
+            uint64_t fat_first = (cl * 4 / sec_sz) * sec_sz;
+            uint64_t fat_last = ((cl + nclus - 1) * 4 / sec_sz) * sec_sz;
+            uint64_t dirent = (i * 32 / sec_sz) * sec_sz;
+
+            if (!write) {
+                if (io(b, false, dir + dirent % DIR_AREA, sec_sz) != 0 ||
+                    io(b, false, fat + fat_first % FAT_AREA, sec_sz) != 0) return -1;
+            }
+            uint64_t left = sizes[i];
+            for (uint64_t k = 0; k < nclus; k++) {
+                size_t len = (size_t)(left < c ? round_up(left, sec_sz) : c);
+                if (io(b, write, pos, len) != 0) return -1;
+                pos += c;
+                left -= left < c ? left : c;
+            }
+            if (write) {
+                for (uint64_t f = fat_first; f <= fat_last; f += sec_sz)
+                    if (io(b, true, fat + f % FAT_AREA, sec_sz) != 0) return -1;
+                if (io(b, true, dir + dirent % DIR_AREA, sec_sz) != 0) return -1;
+            }
+            cl += nclus;
+        }
+        if (write && !b->dry && sdio_flush(b->d) != 0) return -1;
+    }
+    *sec = now_sec() - t0;
+    return 0;
+}
+
+int sdclus_bench(sdio_dev *d, uint64_t off, uint64_t len, uint64_t vol,
+                 sdclus_profile p, sdclus_result *r) {
+    memset(r, 0, sizeof(*r));
+    uint32_t cand[SDCLUS_MAX_TRIALS];
+    int nc = sdclus_candidates(vol, cand);
+    if (nc == 0) return 0;
+
+    uint32_t sizes[MAX_FILES];
+    size_t n = workload(p, sizes);
+    uint64_t need = 0;
+    for (size_t i = 0; i < n; i++) need += round_up(sizes[i], MAX_CLUSTER);
+    if (len < DATA_START + need || off > d->size || len > d->size - off) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    bench b = { d, off, sdpool_get(MAX_CLUSTER), 0, 0, true };
+    if (!b.buf) return -1;
+    for (size_t i = 0; i < MAX_CLUSTER; i++) b.buf[i] = (unsigned char)(i * 131 + 7);
+
+    /* Time the card, not the page cache. */
+    bool direct = d->params.direct;
+    if (d->dfd >= 0) d->params.direct = true;
+
+    for (int i = 0; i < nc; i++) {
+        r->trials[i].cluster = cand[i];
+        r->trials[i].seconds = -1.0;
+    }
+    r->ntrials = nc;
+    /* A dry pass per candidate counts the bytes for progress. */
+    double sec;
+    for (int i = 0; i < nc; i++) run(&b, sizes, n, cand[i], &sec);
+    b.total *= ROUNDS;
+    b.dry = false;
+
+    int rc = 0;
+    for (int round = 0; round < ROUNDS && rc == 0; round++) {
+        for (int i = 0; i < nc; i++) {
+            if ((rc = run(&b, sizes, n, cand[i], &sec)) != 0) break;
+            sdclus_trial *t = &r->trials[i];
+            if (t->seconds < 0 || sec < t->seconds) t->seconds = sec;
+        }
+    }
+    d->params.direct = direct;
+    sdpool_put(b.buf, MAX_CLUSTER);
+    if (rc != 0) return -1;
+
+    double fastest = -1.0;
+    for (int i = 0; i < nc; i++) {
+        sdclus_trial *t = &r->trials[i];
+        t->files_per_sec = t->seconds > 0 ? (double)n / t->seconds : 0.0;
+        if (fastest < 0 || t->seconds < fastest) fastest = t->seconds;
+    }
+    for (int i = 0; i < nc; i++)   /* candidates ascend */
+        if (r->trials[i].seconds <= fastest * NEAR_BEST) {
+            r->best = r->trials[i].cluster;
+            break;
+        }
+    cache_store(d, p, r->best);
+    return 0;
+}
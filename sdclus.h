@@ -0,0 +1,62 @@
+#ifndef SDCLUS_H
+#define SDCLUS_H
+
+/* ============================================================
+   sdclus – FAT32 cluster size chosen by measurement
+   Replays a short synthetic file workload at each candidate
+   cluster size on the card itself: file data in cluster-sized
+   requests, the FAT and directory sector updates a FAT driver
+   makes, then reading the files back. The fastest size wins
+   and is cached per card model, so later cards of the same
+   model are formatted without the benchmark.
+   ============================================================ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sdio.h"
+
+#define SDCLUS_MAX_TRIALS 8
+
+typedef enum {
+    SDCLUS_SMALL,    /* many small files: scripts, configuration */
+    SDCLUS_LARGE,    /* a few large files: images, sound, firmware */
+    SDCLUS_MIXED     /* both, the default */
+} sdclus_profile;
+
+typedef struct {
+    uint32_t cluster;    /* bytes */
+    double   seconds;    /* whole workload */
+    double   files_per_sec;
+} sdclus_trial;
+
+typedef struct {
+    uint32_t     best;       /* bytes, 0 = no candidate fits the volume */
+    bool         cached;     /* from the cache, no trials run */
+    sdclus_trial trials[SDCLUS_MAX_TRIALS];
+    int          ntrials;
+} sdclus_result;
+
+/* "small", "large" or "mixed". */
+int         sdclus_parse_profile(const char *s, sdclus_profile *p);
+const char *sdclus_profile_name(sdclus_profile p);
+
+/* Cluster sizes that make FAT32 on a volume of vol bytes:
+   4 KiB to 64 KiB, at least 65525 clusters. Returns the count. */
+int  sdclus_candidates(uint64_t vol, uint32_t out[SDCLUS_MAX_TRIALS]);
+
+/* Bytes the benchmark moves per candidate, for time estimates. */
+uint64_t sdclus_bench_bytes(sdclus_profile p);
+
+/* The size cached for this model and profile. */
+bool sdclus_cached(const char *ident, sdclus_profile p, uint32_t *cluster);
+
+/* Run the workload at every candidate for a volume of vol bytes, inside
+   [off, off + len) of d, which is overwritten. The winner is cached
+   under d->ident. Progress goes through d->progress; ECANCELED on abort,
+   ENOSPC if the scratch range is too small. */
+int  sdclus_bench(sdio_dev *d, uint64_t off, uint64_t len, uint64_t vol,
+                  sdclus_profile p, sdclus_result *r);
+
+#endif /* SDCLUS_H */
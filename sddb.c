@@ -0,0 +1,357 @@
+#define _GNU_SOURCE
+#include "sddb.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+/* cards.tsv: one line per card per job, tab separated, "-" for empty:
+
+     when card lot serial reader model size job
+     block_size queue_depth direct mbps bytes seconds stages outcome
+
+   About 200 bytes a line; lines are only ever appended. */
+
+#define NFIELDS      16
+#define TREND_MIN    6      /* speed samples before a trend is shown */
+#define TREND_RECENT 5      /* the latest runs, against all before them */
+#define SLOWER       0.75   /* recent below this x earlier is flagged */
+
+static void db_path(char *out, size_t outsz) {
+    const char *dir = getenv("SDPREP_STATE_DIR");
+    if (!dir || !*dir) dir = SDIO_STATE_DIR;
+    snprintf(out, outsz, "%s/cards.tsv", dir);
+}
+
+/* One sysfs attribute, whitespace squeezed so it stays one field. */
+static void read_attr(const char *dir, const char *name, char *out, size_t outsz) {
+    char path[PATH_MAX];
+    out[0] = 0;
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE *fp = fopen(path, "r");
+    if (!fp) return;
+    char buf[256];
+    if (fgets(buf, sizeof(buf), fp)) {
+        size_t j = 0;
+        bool prev_space = true;
+        for (size_t i = 0; buf[i] && j + 1 < outsz; i++) {
+            unsigned char c = (unsigned char)buf[i];
+            if (isspace(c)) {
+                if (!prev_space) out[j++] = ' ';
+                prev_space = true;
+            } else {
+                out[j++] = (char)c;
+                prev_space = false;
+            }
+        }
+        while (j > 0 && out[j - 1] == ' ') j--;
+        out[j] = 0;
+    }
+    fclose(fp);
+}
+
+void sddb_identify(const char *path, sddb_id *id) {
+    memset(id, 0, sizeof(*id));
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISBLK(st.st_mode)) return;
+
+    char link[128];
+    snprintf(link, sizeof(link), "/sys/dev/block/%u:%u/device",
+             major(st.st_rdev), minor(st.st_rdev));
+    char *dev = realpath(link, NULL);
+    if (!dev) return;
+
+    /* MMC/SD slot: the card's CID register is visible. */
+    char cid[64];
+    read_attr(dev, "cid", cid, sizeof(cid));
+    if (cid[0]) {
+        char manfid[16], oemid[16], name[16], date[16];
+        read_attr(dev, "manfid", manfid, sizeof(manfid));
+        read_attr(dev, "oemid", oemid, sizeof(oemid));
+        read_attr(dev, "name", name, sizeof(name));
+        read_attr(dev, "date", date, sizeof(date));
+        read_attr(dev, "serial", id->serial, sizeof(id->serial));
+        snprintf(id->card, sizeof(id->card), "cid:%.32s", cid);
+        snprintf(id->lot, sizeof(id->lot), "%s:%s:%s:%s", manfid, oemid, name, date);
+        snprintf(id->reader, sizeof(id->reader), "mmc");
+        free(dev);
+        return;
+    }
+
+    /* USB reader: walk up from the SCSI device to the USB device. */
+    for (;;) {
+        char vid[8];
+        read_attr(dev, "idVendor", vid, sizeof(vid));
+        if (vid[0]) {
+            char pid[8], serial[64];
+            read_attr(dev, "idProduct", pid, sizeof(pid));
+            read_attr(dev, "serial", serial, sizeof(serial));
+            snprintf(id->reader, sizeof(id->reader), "usb:%s:%s:%s", vid, pid, serial);
+            break;
+        }
+        char *slash = strrchr(dev, '/');
+        if (!slash || slash == dev || strcmp(dev, "/sys/devices") == 0) break;
+        *slash = 0;
+    }
+    free(dev);
+}
+
+void sddb_begin(sddb_rec *r, const char *path, const char *job) {
+    memset(r, 0, sizeof(*r));
+    r->when = time(NULL);
+    sddb_identify(path, &r->id);
+    snprintf(r->job, sizeof(r->job), "%s", job);
+    snprintf(r->outcome, sizeof(r->outcome), "failed");
+}
+
+void sddb_stage(sddb_rec *r, const char *name, double seconds) {
+    size_t len = strlen(r->stages);
+    snprintf(r->stages + len, sizeof(r->stages) - len, "%s%s=%.1f",
+             len ? "," : "", name, seconds);
+    if (r->ntimes < SDDB_STAGES) {
+        sddb_time *t = &r->times[r->ntimes++];
+        snprintf(t->name, sizeof(t->name), "%s", name);
+        t->seconds = seconds;
+    }
+}
+
+static const char *field(const char *s) { return *s ? s : "-"; }
+
+int sddb_append(const sddb_rec *r) {
+    char path[512];
+    db_path(path, sizeof(path));
+    char dir[512];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash) {
+        *slash = 0;
+        if (mkdir(dir, 0755) != 0 && errno != EEXIST) return -1;
+    }
+
+    char line[1024];
+    int len = snprintf(line, sizeof(line),
+                       "%lld\t%s\t%s\t%s\t%s\t%s\t%llu\t%s\t%zu\t%d\t%d\t%.1f\t%llu\t%.1f\t%s\t%s\n",
+                       (long long)r->when, field(r->id.card), field(r->id.lot),
+                       field(r->id.serial), field(r->id.reader), field(r->model),
+                       (unsigned long long)r->size, field(r->job), r->params.block_size,
+                       r->params.queue_depth, r->params.direct ? 1 : 0, r->mbps,
+                       (unsigned long long)r->bytes, r->seconds, field(r->stages),
+                       field(r->outcome));
+    if (len < 0 || (size_t)len >= sizeof(line)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    for (int i = 0; i < len - 1; i++)
+        if (line[i] == '\n' || line[i] == '\r') line[i] = ' ';
+
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    ssize_t n = write(fd, line, (size_t)len);
+    int e = errno;
+    close(fd);
+    if (n != len) {
+        errno = n < 0 ? e : EIO;
+        return -1;
+    }
+    return 0;
+}
+
+static void copy_field(char *out, size_t outsz, const char *in) {
+    snprintf(out, outsz, "%s", strcmp(in, "-") == 0 ? "" : in);
+}
+
+static bool parse_line(char *line, sddb_rec *r) {
+    char *f[NFIELDS];
+    line[strcspn(line, "\n")] = 0;
+    for (int i = 0; i < NFIELDS; i++) {
+        f[i] = strsep(&line, "\t");
+        if (!f[i]) return false;
+    }
+
+    memset(r, 0, sizeof(*r));
+    r->when = (time_t)strtoll(f[0], NULL, 10);
+    copy_field(r->id.card, sizeof(r->id.card), f[1]);
+    copy_field(r->id.lot, sizeof(r->id.lot), f[2]);
+    copy_field(r->id.serial, sizeof(r->id.serial), f[3]);
+    copy_field(r->id.reader, sizeof(r->id.reader), f[4]);
+    copy_field(r->model, sizeof(r->model), f[5]);
+    r->size = strtoull(f[6], NULL, 10);
+    copy_field(r->job, sizeof(r->job), f[7]);
+    r->params.block_size = strtoull(f[8], NULL, 10);
+    r->params.queue_depth = atoi(f[9]);
+    r->params.direct = atoi(f[10]) != 0;
+    r->mbps = strtod(f[11], NULL);
+    r->params.mbps = r->mbps;
+    r->bytes = strtoull(f[12], NULL, 10);
+    r->seconds = strtod(f[13], NULL);
+    copy_field(r->stages, sizeof(r->stages), f[14]);
+    copy_field(r->outcome, sizeof(r->outcome), f[15]);
+    return r->when > 0;
+}
+
+int sddb_load(sddb_rec **recs, size_t *n) {
+    *recs = NULL;
+    *n = 0;
+    char path[512];
+    db_path(path, sizeof(path));
+    FILE *fp = fopen(path, "r");
+    if (!fp) return errno == ENOENT ? 0 : -1;
+
+    size_t cap = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), fp)) {
+        if (*n == cap) {
+            size_t nc = cap ? cap * 2 : 64;
+            sddb_rec *nr = realloc(*recs, nc * sizeof(*nr));
+            if (!nr) {
+                free(*recs);
+                *recs = NULL;
+                *n = 0;
+                fclose(fp);
+                errno = ENOMEM;
+                return -1;
+            }
+            *recs = nr;
+            cap = nc;
+        }
+        if (parse_line(line, &(*recs)[*n])) (*n)++;
+    }
+    fclose(fp);
+    return 0;
+}
+
+bool sddb_last(const sddb_id *id, sddb_rec *out) {
+    if (!id->card[0]) return false;
+    sddb_rec *recs;
+    size_t n;
+    if (sddb_load(&recs, &n) != 0) return false;
+    bool found = false;
+    for (size_t i = n; i-- > 0;) {
+        const sddb_rec *r = &recs[i];
+        if (strcmp(r->id.card, id->card) == 0 && strcmp(r->outcome, "ok") == 0 &&
+            r->mbps > 0 && r->params.block_size) {
+            *out = *r;
+            found = true;
+            break;
+        }
+    }
+    free(recs);
+    return found;
+}
+
+bool sddb_seed(sdio_dev *d, const sddb_id *id) {
+    sddb_rec last;
+    if (d->tuned || !sddb_last(id, &last)) return false;
+    const sdio_params *p = &last.params;
+    if (p->block_size < 4096 || p->block_size % 4096 || p->queue_depth < 1 || p->queue_depth > 64)
+        return false;
+    d->params = *p;
+    if (d->dfd < 0) d->params.direct = false;
+    d->tuned = true;
+    return true;
+}
+
+/* ------------------------------------------------------------
+   Summaries
+   ------------------------------------------------------------ */
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double mean(const double *v, size_t n) {
+    double s = 0.0;
+    for (size_t i = 0; i < n; i++) s += v[i];
+    return n ? s / (double)n : 0.0;
+}
+
+/* One line for every record whose key (reader or lot) equals key. */
+static void report_group(FILE *out, const sddb_rec *recs, size_t n, const char *key, bool by_lot) {
+    size_t runs = 0, failed = 0, ns = 0;
+    double *speeds = malloc((n ? n : 1) * sizeof(*speeds));
+    if (!speeds) return;
+    for (size_t i = 0; i < n; i++) {
+        const char *k = by_lot ? recs[i].id.lot : recs[i].id.reader;
+        if (strcmp(k, key) != 0) continue;
+        runs++;
+        if (strncmp(recs[i].outcome, "failed", 6) == 0) failed++;
+        if (recs[i].mbps > 0 && strcmp(recs[i].outcome, "ok") == 0) speeds[ns++] = recs[i].mbps;
+    }
+
+    fprintf(out, "  %-40s %4zu run%s, %zu failed", key, runs, runs == 1 ? "" : "s", failed);
+    if (ns) {
+        /* Trend in run order, median from a sorted copy. */
+        double recent = 0.0, earlier = 0.0;
+        if (ns >= TREND_MIN) {
+            recent = mean(speeds + ns - TREND_RECENT, TREND_RECENT);
+            earlier = mean(speeds, ns - TREND_RECENT);
+        }
+        qsort(speeds, ns, sizeof(*speeds), cmp_double);
+        double med = ns % 2 ? speeds[ns / 2] : (speeds[ns / 2 - 1] + speeds[ns / 2]) / 2;
+        fprintf(out, ", median %.1f MB/s", med);
+        if (earlier > 0)
+            fprintf(out, ", recent %+.0f%%%s", (recent / earlier - 1.0) * 100.0,
+                    recent < earlier * SLOWER ? "  <- slower" : "");
+    }
+    if (runs >= 5 && failed * 5 >= runs) fprintf(out, "  <- failures");
+    fputc('\n', out);
+    free(speeds);
+}
+
+static void report_keys(FILE *out, const sddb_rec *recs, size_t n, bool by_lot) {
+    size_t keyed = 0;
+    for (size_t i = 0; i < n; i++) keyed += *(by_lot ? recs[i].id.lot : recs[i].id.reader) != 0;
+    fprintf(out, "%s:\n", by_lot ? "Card lots" : "Readers");
+    if (!keyed) fprintf(out, "  none identified (%zu run%s)\n", n, n == 1 ? "" : "s");
+    for (size_t i = 0; i < n; i++) {
+        const char *k = by_lot ? recs[i].id.lot : recs[i].id.reader;
+        if (!*k) continue;
+        bool seen = false;
+        for (size_t j = 0; j < i && !seen; j++)
+            seen = strcmp(k, by_lot ? recs[j].id.lot : recs[j].id.reader) == 0;
+        if (!seen) report_group(out, recs, n, k, by_lot);
+    }
+}
+
+void sddb_report(FILE *out, const sddb_id *id) {
+    sddb_rec *recs;
+    size_t n;
+    if (sddb_load(&recs, &n) != 0) {
+        fprintf(out, "Card history unreadable: %s\n", strerror(errno));
+        return;
+    }
+    if (n == 0) {
+        fprintf(out, "No card history yet.\n");
+        return;
+    }
+
+    if (id) {
+        /* A card without a CID is only known by its reader. */
+        const char *key = id->card[0] ? id->card : id->reader;
+        bool by_card = id->card[0] != 0;
+        size_t shown = 0;
+        for (size_t i = 0; i < n; i++) {
+            const sddb_rec *r = &recs[i];
+            if (!*key || strcmp(by_card ? r->id.card : r->id.reader, key) != 0) continue;
+            char stamp[32];
+            strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M", localtime(&r->when));
+            fprintf(out, "%s  %-9s %7.1f MB/s %7.1f s  %s\n", stamp, r->job, r->mbps,
+                    r->seconds, r->outcome);
+            if (r->stages[0]) fprintf(out, "                  %s\n", r->stages);
+            shown++;
+        }
+        if (!shown) fprintf(out, "No history for %s.\n", *key ? key : "this device");
+        free(recs);
+        return;
+    }
+
+    report_keys(out, recs, n, false);
+    report_keys(out, recs, n, true);
+    free(recs);
+}
@@ -0,0 +1,83 @@
+#ifndef SDDB_H
+#define SDDB_H
+
+/* ============================================================
+   sddb – per-card history
+   Every job appends one line per card to a small text file
+   next to the tuning cache: who the card (and reader) was,
+   what was done, at which parameters and speed, how long each
+   stage took and how it ended. Plans reuse a card's last
+   speed; summaries show readers and card lots going bad.
+   ============================================================ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "sdio.h"
+
+/* Who a card is, as far as sysfs can tell. A card in a built-in slot
+   shows its CID; behind a USB reader only the reader is known and
+   card and lot stay empty. */
+typedef struct {
+    char card[40];     /* "cid:" + 32 hex digits */
+    char lot[96];      /* manfid:oemid:name:date – one production batch */
+    char serial[16];   /* the card's own serial number */
+    char reader[128];  /* "usb:vid:pid:serial", "mmc" for a slot, "" if neither */
+} sddb_id;
+
+#define SDDB_STAGES 16
+
+typedef struct {
+    char   name[24];
+    double seconds;
+} sddb_time;
+
+typedef struct {
+    time_t      when;
+    sddb_id     id;
+    char        model[96];    /* tuning cache key (sdio_dev.ident) */
+    uint64_t    size;
+    char        job[16];      /* format, erase, image, delta, duplicate, verify */
+    sdio_params params;       /* parameters in use at the end */
+    double      mbps;         /* measured over the bulk stage, 0 if too short */
+    uint64_t    bytes;        /* written to the card */
+    double      seconds;      /* whole job */
+    char        stages[256];  /* "name=sec,name=sec" */
+    char        outcome[64];  /* "ok", "aborted" or "failed: why" */
+    sddb_time   times[SDDB_STAGES];  /* this run's stages unrounded; not stored */
+    int         ntimes;
+} sddb_rec;
+
+/* Identify the card in a block device (any path; regular files and
+   devices without sysfs identity give an empty id). */
+void sddb_identify(const char *path, sddb_id *id);
+
+/* A blank record for a job about to run on path. */
+void sddb_begin(sddb_rec *r, const char *path, const char *job);
+
+/* Append "name=seconds" to r->stages, and the exact time to r->times. */
+void sddb_stage(sddb_rec *r, const char *name, double seconds);
+
+/* Append to the history file (SDPREP_STATE_DIR/cards.tsv). One write
+   with O_APPEND, so concurrent jobs do not interleave lines. */
+int  sddb_append(const sddb_rec *r);
+
+/* Every record, oldest first (malloc'd). A missing file is no records. */
+int  sddb_load(sddb_rec **recs, size_t *n);
+
+/* The latest successful record for this card with a measured speed.
+   False when the card cannot be told apart from others (no CID). */
+bool sddb_last(const sddb_id *id, sddb_rec *out);
+
+/* For a model the tuning cache does not know: take the parameters this
+   very card last ran well with, so the job skips calibration. */
+bool sddb_seed(sdio_dev *d, const sddb_id *id);
+
+/* Per reader and per card lot: runs, failures, median speed and the
+   recent runs against the earlier ones. With id, that card's records. */
+void sddb_report(FILE *out, const sddb_id *id);
+
+#endif /* SDDB_H */
@@ -0,0 +1,340 @@
+#define _GNU_SOURCE
+#include "sddup.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sdpool.h"
+
+/* ============================================================
+   Fan-out ring
+   The reader publishes chunk seq in ring[seq % ring]. Each
+   live target claims chunks in order; a claimed chunk's buffer
+   stays pinned by a reference until that target's write
+   returns, so a target's lag is bounded by the ring and
+   in-flight writes never block buffer reuse elsewhere.
+
+   When the slowest target holds the reader back for longer
+   than stall_sec without progress it is dropped: the chunks it
+   had not claimed are released and everyone else continues.
+   ============================================================ */
+
+#define MAX_QD 16
+
+typedef struct dup_buf {
+    void           *data;
+    int             refs;
+    struct dup_buf *next;      /* free list */
+} dup_buf;
+
+typedef struct {
+    size_t   len;
+    dup_buf *buf;
+} dup_slot;
+
+typedef struct dup_ctx dup_ctx;
+
+typedef struct {
+    dup_ctx      *ctx;
+    sddup_target *t;
+    uint64_t      next;        /* next chunk to claim */
+    bool          dropped;
+    double        last_progress;
+} dup_tgt;
+
+struct dup_ctx {
+    pthread_mutex_t mu;
+    pthread_cond_t  cv;
+
+    size_t    chunk;
+    int       ring;
+    dup_slot *slots;
+    dup_buf  *bufs;
+    dup_buf  *free_bufs;
+
+    uint64_t  published;       /* chunks published so far */
+    bool      eof;
+    dup_tgt  *tgts;
+    int       ntgts;
+    int       live;
+};
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Called locked. */
+static void buf_put(dup_ctx *c, dup_buf *b) {
+    if (--b->refs == 0) {
+        b->next = c->free_bufs;
+        c->free_bufs = b;
+    }
+}
+
+/* Called locked: release what the target never claimed. */
+static void drop_target(dup_ctx *c, dup_tgt *g, int err, bool stalled) {
+    if (g->dropped) return;
+    g->dropped = true;
+    g->t->err = err;
+    g->t->stalled = stalled;
+    for (uint64_t s = g->next; s < c->published; s++)
+        buf_put(c, c->slots[s % (uint64_t)c->ring].buf);
+    c->live--;
+    pthread_cond_broadcast(&c->cv);
+}
+
+static void *target_worker(void *arg) {
+    dup_tgt *g = arg;
+    dup_ctx *c = g->ctx;
+
+    pthread_mutex_lock(&c->mu);
+    for (;;) {
+        while (!g->dropped && g->next >= c->published && !c->eof)
+            pthread_cond_wait(&c->cv, &c->mu);
+        if (g->dropped || g->next >= c->published) break;
+
+        uint64_t seq = g->next++;
+        dup_slot *sl = &c->slots[seq % (uint64_t)c->ring];
+        dup_buf *b = sl->buf;
+        size_t len = sl->len;
+        g->last_progress = now_sec();
+        pthread_cond_broadcast(&c->cv);
+        pthread_mutex_unlock(&c->mu);
+
+        int rc = sdio_write_at(g->t->dev, b->data, len, seq * c->chunk);
+        int e = errno;
+
+        pthread_mutex_lock(&c->mu);
+        buf_put(c, b);
+        g->last_progress = now_sec();
+        if (rc != 0 && e == ECANCELED && seq * c->chunk < g->t->reached)
+            g->t->reached = seq * c->chunk;
+        if (rc != 0) drop_target(c, g, e ? e : EIO, false);
+        else g->t->done += len;
+        pthread_cond_broadcast(&c->cv);
+    }
+    pthread_mutex_unlock(&c->mu);
+    return NULL;
+}
+
+/* One per target: runs queue_depth workers, then flushes the card. */
+static void *target_main(void *arg) {
+    dup_tgt *g = arg;
+    int qd = g->t->dev->params.queue_depth;
+    if (qd < 1) qd = 1;
+    if (qd > MAX_QD) qd = MAX_QD;
+
+    pthread_t helpers[MAX_QD];
+    int started = 0;
+    for (int i = 1; i < qd; i++) {
+        if (pthread_create(&helpers[started], NULL, target_worker, g) == 0) started++;
+    }
+    target_worker(g);
+    for (int i = 0; i < started; i++) pthread_join(helpers[i], NULL);
+
+    pthread_mutex_lock(&g->ctx->mu);
+    bool ok = !g->dropped;
+    pthread_mutex_unlock(&g->ctx->mu);
+
+    if (ok && sdio_flush(g->t->dev) != 0) {
+        int e = errno;
+        pthread_mutex_lock(&g->ctx->mu);
+        drop_target(g->ctx, g, e, false);
+        pthread_mutex_unlock(&g->ctx->mu);
+    }
+    return NULL;
+}
+
+/* Called locked: may the reader reuse ring position seq? */
+static dup_tgt *blocking_target(dup_ctx *c, uint64_t seq) {
+    if (seq < (uint64_t)c->ring) return NULL;
+    for (int i = 0; i < c->ntgts; i++) {
+        dup_tgt *g = &c->tgts[i];
+        if (!g->dropped && g->next <= seq - (uint64_t)c->ring) return g;
+    }
+    return NULL;
+}
+
+static uint64_t slowest_done(dup_ctx *c) {
+    uint64_t min = UINT64_MAX;
+    for (int i = 0; i < c->ntgts; i++) {
+        if (!c->tgts[i].dropped && c->tgts[i].t->done < min) min = c->tgts[i].t->done;
+    }
+    return min == UINT64_MAX ? 0 : min;
+}
+
+int sddup_run(sdimg *src, uint64_t size, sddup_target *t, int n,
+              const sddup_opts *opts) {
+    sddup_opts o = { 0, 0, 0, NULL, NULL };
+    if (opts) o = *opts;
+    if (!o.chunk) o.chunk = SDIO_MIB;
+    if (!o.ring) o.ring = 32;
+    if (n <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Each target may pin up to its queue depth beyond the ring. */
+    int pinned = 0;
+    for (int i = 0; i < n; i++) {
+        sdio_tune(t[i].dev);
+        int qd = t[i].dev->params.queue_depth;
+        pinned += qd > MAX_QD ? MAX_QD : qd;
+        t[i].err = 0;
+        t[i].stalled = false;
+        t[i].done = 0;
+        t[i].reached = UINT64_MAX;
+    }
+
+    /* Stay within half the memory ceiling; the decoder needs its share. */
+    uint64_t fit = sdpool_limit() / 2 / sdpool_size(o.chunk);
+    if ((uint64_t)(o.ring + pinned) > fit)
+        o.ring = fit > (uint64_t)pinned + 2 ? (int)(fit - (uint64_t)pinned) : 2;
+    int nbufs = o.ring + pinned;
+
+    dup_ctx c;
+    memset(&c, 0, sizeof(c));
+    c.chunk = o.chunk;
+    c.ring = o.ring;
+    c.ntgts = n;
+    c.live = n;
+    c.slots = calloc((size_t)o.ring, sizeof(*c.slots));
+    c.bufs = calloc((size_t)nbufs, sizeof(*c.bufs));
+    c.tgts = calloc((size_t)n, sizeof(*c.tgts));
+    pthread_t *tids = calloc((size_t)n, sizeof(*tids));
+    void **data = calloc((size_t)nbufs, sizeof(*data));
+
+    int rc = -1, err = ENOMEM, started = 0;
+    bool pooled = false;
+    if (!c.slots || !c.bufs || !c.tgts || !tids || !data) goto out;
+    if (sdpool_get_many(data, nbufs, o.chunk) != 0) goto out;
+    pooled = true;
+    for (int i = 0; i < nbufs; i++) {
+        c.bufs[i].data = data[i];
+        c.bufs[i].next = c.free_bufs;
+        c.free_bufs = &c.bufs[i];
+    }
+
+    pthread_mutex_init(&c.mu, NULL);
+    pthread_cond_init(&c.cv, NULL);
+
+    double t0 = now_sec();
+    for (int i = 0; i < n; i++) {
+        c.tgts[i].ctx = &c;
+        c.tgts[i].t = &t[i];
+        c.tgts[i].last_progress = t0;
+        if (size > t[i].dev->size) {
+            c.tgts[i].dropped = true;
+            t[i].err = ENOSPC;
+            c.live--;
+        }
+    }
+    for (; started < n; started++) {
+        if (pthread_create(&tids[started], NULL, target_main, &c.tgts[started]) != 0) break;
+    }
+
+    /* Reader */
+    uint64_t pos = 0, limit = size ? size : UINT64_MAX;
+    err = started == n ? 0 : EAGAIN;
+    pthread_mutex_lock(&c.mu);
+    if (err) {
+        for (int i = started; i < n; i++) drop_target(&c, &c.tgts[i], EAGAIN, false);
+    }
+
+    while (c.live > 0 && pos < limit) {
+        uint64_t seq = c.published;
+        dup_tgt *slow;
+        while (c.live > 0 && ((slow = blocking_target(&c, seq)) != NULL || !c.free_bufs)) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += 1;
+            pthread_cond_timedwait(&c.cv, &c.mu, &ts);
+
+            slow = blocking_target(&c, seq);
+            if (slow && o.stall_sec > 0 && now_sec() - slow->last_progress > o.stall_sec)
+                drop_target(&c, slow, ETIMEDOUT, true);
+        }
+        if (c.live == 0) break;
+
+        dup_buf *b = c.free_bufs;
+        c.free_bufs = b->next;
+        pthread_mutex_unlock(&c.mu);
+
+        size_t want = limit - pos < o.chunk ? (size_t)(limit - pos) : o.chunk;
+        ssize_t got = sdimg_fill(src, pos, b->data, want);
+
+        pthread_mutex_lock(&c.mu);
+        if (got <= 0) {
+            b->next = c.free_bufs;
+            c.free_bufs = b;
+            if (got < 0) err = errno ? errno : EIO;
+            break;
+        }
+
+        /* Targets too small for what is coming are dropped here. */
+        for (int i = 0; i < n; i++) {
+            dup_tgt *g = &c.tgts[i];
+            if (!g->dropped && pos + (uint64_t)got > g->t->dev->size)
+                drop_target(&c, g, ENOSPC, false);
+        }
+        if (c.live == 0) {
+            b->next = c.free_bufs;
+            c.free_bufs = b;
+            break;
+        }
+
+        b->refs = c.live;
+        dup_slot *sl = &c.slots[seq % (uint64_t)c.ring];
+        sl->len = (size_t)got;
+        sl->buf = b;
+        c.published++;
+        pos += (uint64_t)got;
+        pthread_cond_broadcast(&c.cv);
+
+        if (o.progress) {
+            uint64_t done = slowest_done(&c);
+            pthread_mutex_unlock(&c.mu);
+            o.progress(o.progress_ctx, done, size ? size : pos);
+            pthread_mutex_lock(&c.mu);
+        }
+        if ((size_t)got < want) break;
+    }
+
+    if (err) {
+        for (int i = 0; i < n; i++) drop_target(&c, &c.tgts[i], err, false);
+    }
+    c.eof = true;
+    pthread_cond_broadcast(&c.cv);
+    pthread_mutex_unlock(&c.mu);
+
+    for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+    if (o.progress && !err) o.progress(o.progress_ctx, slowest_done(&c), pos);
+
+    pthread_cond_destroy(&c.cv);
+    pthread_mutex_destroy(&c.mu);
+
+    if (err) {
+        rc = -1;
+    } else {
+        rc = 0;
+        for (int i = 0; i < n; i++) {
+            if (!t[i].err) rc++;
+        }
+    }
+
+out:
+    if (pooled) sdpool_put_many(data, nbufs, o.chunk);
+    free(data);
+    free(c.bufs);
+    free(c.slots);
+    free(c.tgts);
+    free(tids);
+    if (rc < 0) errno = err;
+    return rc;
+}
@@ -0,0 +1,43 @@
+#ifndef SDDUP_H
+#define SDDUP_H
+
+/* ============================================================
+   sddup – one source, many cards
+   Each chunk of the source is read once into a shared,
+   reference-counted aligned buffer and written to every
+   target from there.
+   ============================================================ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sdimg.h"
+#include "sdio.h"
+
+typedef struct {
+    sdio_dev *dev;        /* opened by the caller */
+
+    /* results */
+    int      err;         /* 0, or errno of the failure that dropped it */
+    bool     stalled;     /* dropped for making no progress */
+    uint64_t done;        /* bytes written */
+    uint64_t reached;     /* aborted (ECANCELED): all below this was written */
+} sddup_target;
+
+typedef struct {
+    size_t chunk;         /* bytes per chunk, 0 = 1 MiB */
+    int    ring;          /* max chunks a fast target may run ahead, 0 = 32 */
+    int    stall_sec;     /* drop a target stuck this long, 0 = never */
+
+    sdio_progress_fn progress;   /* reports the slowest live target */
+    void            *progress_ctx;
+} sddup_opts;
+
+/* Copy size bytes of src (0 = until it ends) to all n targets at offset 0.
+   A failing or stalled target is dropped and the others carry on.
+   Returns the number of targets that completed; -1 with errno set if the
+   source itself failed. */
+int sddup_run(sdimg *src, uint64_t size, sddup_target *t, int n,
+              const sddup_opts *opts);
+
+#endif /* SDDUP_H */
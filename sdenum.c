@@ -0,0 +1,183 @@
+#define _GNU_SOURCE
+#include "sdenum.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+/* Majors from Documentation/admin-guide/devices.txt: SCSI disks are 8,
+   65-71 and 128-135, MMC block devices 179. Loop (7), md (9), nbd (43),
+   and the dynamic ones (dm, zram, nvme's 259) are all something else. */
+#define MMC_MAJOR     179
+#define MAX_SYSTEM    16
+
+static const char *system_mounts[] = {
+    "/", "/boot", "/boot/efi", "/usr", "/var",
+    "/opt", "/snap", "/recovery", NULL
+};
+
+static bool card_major(unsigned m) {
+    return m == 8 || (m >= 65 && m <= 71) || (m >= 128 && m <= 135) || m == MMC_MAJOR;
+}
+
+/* A sysfs attribute relative to dfd, trailing whitespace cut. */
+static ssize_t read_attr(int dfd, const char *rel, char *buf, size_t sz) {
+    int fd = openat(dfd, rel, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = read(fd, buf, sz - 1);
+    close(fd);
+    if (n < 0) return -1;
+    while (n > 0 && isspace((unsigned char)buf[n - 1])) n--;
+    buf[n] = 0;
+    return n;
+}
+
+/* The whole disk under a device: through device-mapper layers (slaves)
+   and from a partition to its disk. */
+static bool whole_disk(const char *sysfs, unsigned maj, unsigned min, unsigned dev[2]) {
+    char link[PATH_MAX + 272], path[PATH_MAX], sub[PATH_MAX + 16];
+    snprintf(link, sizeof(link), "%s/dev/block/%u:%u", sysfs, maj, min);
+    if (!realpath(link, path)) return false;
+
+    for (int depth = 0; depth < 8; depth++) {
+        snprintf(sub, sizeof(sub), "%s/slaves", path);
+        DIR *dir = opendir(sub);
+        struct dirent *de = NULL;
+        while (dir && (de = readdir(dir)) && de->d_name[0] == '.') {}
+        if (de) {
+            snprintf(link, sizeof(link), "%s/%s", sub, de->d_name);
+            closedir(dir);
+            if (!realpath(link, path)) return false;
+            continue;
+        }
+        if (dir) closedir(dir);
+
+        snprintf(sub, sizeof(sub), "%s/partition", path);
+        if (access(sub, F_OK) == 0) {
+            char *slash = strrchr(path, '/');
+            if (!slash) return false;
+            *slash = 0;
+        }
+        char buf[32];
+        int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        ssize_t n = fd >= 0 ? read_attr(fd, "dev", buf, sizeof(buf)) : -1;
+        if (fd >= 0) close(fd);
+        return n > 0 && sscanf(buf, "%u:%u", &dev[0], &dev[1]) == 2;
+    }
+    return false;
+}
+
+/* Disks behind the system mounts, from mountinfo. A filesystem without
+   a block device of its own (btrfs, 0:N) is looked up by its source. */
+static int system_disks(const char *sysfs, unsigned out[MAX_SYSTEM][2]) {
+    FILE *fp = fopen("/proc/self/mountinfo", "r");
+    if (!fp) return 0;
+    int n = 0;
+    char line[4096];
+    while (n < MAX_SYSTEM && fgets(line, sizeof(line), fp)) {
+        unsigned maj, min;
+        char mp[256], src[256] = "";
+        if (sscanf(line, "%*d %*d %u:%u %*s %255s", &maj, &min, mp) != 3) continue;
+        bool sys = false;
+        for (int i = 0; system_mounts[i] && !sys; i++) sys = strcmp(mp, system_mounts[i]) == 0;
+        if (!sys) continue;
+
+        const char *sep = strstr(line, " - ");
+        if (maj == 0 && sep && sscanf(sep + 3, "%*s %255s", src) == 1) {
+            struct stat st;
+            if (strncmp(src, "/dev/", 5) != 0 || stat(src, &st) != 0 || !S_ISBLK(st.st_mode))
+                continue;
+            maj = major(st.st_rdev);
+            min = minor(st.st_rdev);
+        }
+        if (whole_disk(sysfs, maj, min, out[n])) n++;
+    }
+    fclose(fp);
+    return n;
+}
+
+int sdenum_scan(const char *sysfs, sdenum_dev *out, size_t max, sdenum_stats *st) {
+    if (!sysfs) {
+        sysfs = getenv("SDPREP_SYSFS");
+        if (!sysfs || !*sysfs) sysfs = "/sys";
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/block", sysfs);
+    DIR *dir = opendir(path);
+    if (!dir) return -1;
+    int dfd = dirfd(dir);
+
+    unsigned sys[MAX_SYSTEM][2];
+    int nsys = system_disks(sysfs, sys);
+
+    sdenum_stats s = { 0, 0 };
+    int n = 0;
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+        const char *name = de->d_name;
+        if (name[0] == '.') continue;
+        s.seen++;
+
+        char rel[NAME_MAX + 32], buf[128];
+        unsigned maj, min;
+        snprintf(rel, sizeof(rel), "%s/dev", name);
+        if (read_attr(dfd, rel, buf, sizeof(buf)) <= 0 ||
+            sscanf(buf, "%u:%u", &maj, &min) != 2 || !card_major(maj)) {
+            s.dropped++;
+            continue;
+        }
+        if (maj == MMC_MAJOR && (strstr(name, "boot") || strstr(name, "rpmb"))) continue;
+
+        sdenum_dev d;
+        memset(&d, 0, sizeof(d));
+        snprintf(d.name, sizeof(d.name), "%.31s", name);
+        d.major = maj;
+        d.minor = min;
+
+        snprintf(rel, sizeof(rel), "%s/size", name);
+        if (read_attr(dfd, rel, buf, sizeof(buf)) > 0) d.size = strtoull(buf, NULL, 10) * 512;
+        snprintf(rel, sizeof(rel), "%s/removable", name);
+        d.removable = read_attr(dfd, rel, buf, sizeof(buf)) > 0 && buf[0] == '1';
+        snprintf(rel, sizeof(rel), "%s/ro", name);
+        d.ro = read_attr(dfd, rel, buf, sizeof(buf)) > 0 && buf[0] == '1';
+
+        /* /sys/block entries link to the device's place in the tree */
+        char target[PATH_MAX];
+        ssize_t tl = readlinkat(dfd, name, target, sizeof(target) - 1);
+        if (tl > 0) target[tl] = 0;
+        if (maj == MMC_MAJOR) d.bus = SDENUM_MMC;
+        else if (tl > 0 && strstr(target, "/usb")) d.bus = SDENUM_USB;
+
+        snprintf(rel, sizeof(rel), "%s/device/%s", name, maj == MMC_MAJOR ? "name" : "model");
+        if (read_attr(dfd, rel, d.model, sizeof(d.model)) < 0) d.model[0] = 0;
+
+        for (int i = 0; i < nsys; i++)
+            if (sys[i][0] == maj && sys[i][1] == min) d.system = true;
+
+        if ((size_t)n < max) out[n] = d;
+        n++;
+    }
+    closedir(dir);
+    if (st) *st = s;
+    return n;
+}
+
+void sdenum_describe(const sdenum_dev *d, char *out, size_t outsz) {
+    static const char units[] = "BKMGTP";
+    double v = (double)d->size;
+    int u = 0;
+    while (v >= 1024.0 && u < 5) {
+        v /= 1024.0;
+        u++;
+    }
+    static const char *bus[] = { "-", "mmc", "usb" };
+    snprintf(out, outsz, u ? "%s  %.1f%c  %s  %s" : "%s  %.0f%c  %s  %s", d->name, v, units[u],
+             bus[d->bus], d->model[0] ? d->model : "-");
+}
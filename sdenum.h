@@ -0,0 +1,48 @@
+#ifndef SDENUM_H
+#define SDENUM_H
+
+/* ============================================================
+   sdenum – block devices that could hold a card, from sysfs
+   One pass over /sys/block. Each entry's major number is read
+   first and anything that is not a SCSI disk (USB readers) or
+   an MMC slot is dropped there, so hosts with hundreds of
+   loop, dm, zram and nvme devices cost one small read each.
+   Nothing is allocated per device and nothing is spawned.
+   ============================================================ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+    SDENUM_OTHER,
+    SDENUM_MMC,     /* card slot */
+    SDENUM_USB      /* behind a USB reader */
+} sdenum_bus;
+
+typedef struct {
+    char       name[32];    /* "sdb", "mmcblk0" */
+    unsigned   major, minor;
+    uint64_t   size;        /* bytes, 0 = no media */
+    bool       removable;
+    bool       ro;
+    bool       system;      /* holds /, /boot, /usr or another system mount */
+    sdenum_bus bus;
+    char       model[64];   /* "" if sysfs has none */
+} sdenum_dev;
+
+typedef struct {
+    size_t seen;       /* entries in sysfs/block */
+    size_t dropped;    /* dropped on the major number alone */
+} sdenum_stats;
+
+/* Whole disks under sysfs/block (NULL: $SDPREP_SYSFS, else /sys) with a
+   card's major number, the eMMC boot and RPMB areas left out. Up to max
+   go into out; returns how many there are, -1 if sysfs cannot be read.
+   st may be NULL. */
+int sdenum_scan(const char *sysfs, sdenum_dev *out, size_t max, sdenum_stats *st);
+
+/* "sdb  29.7G  usb  Generic STORAGE DEVICE" for logs and lists. */
+void sdenum_describe(const sdenum_dev *d, char *out, size_t outsz);
+
+#endif /* SDENUM_H */
@@ -0,0 +1,475 @@
+#define _GNU_SOURCE
+#include "sdfat.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sdpool.h"
+
+static uint16_t le16(const unsigned char *p) { return (uint16_t)(p[0] | p[1] << 8); }
+static uint32_t le32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put16(unsigned char *p, uint16_t v) { p[0] = (unsigned char)v; p[1] = (unsigned char)(v >> 8); }
+static void put32(unsigned char *p, uint32_t v) { for (int i = 0; i < 4; i++) p[i] = (unsigned char)(v >> (8 * i)); }
+
+static size_t sector_len(const sdio_dev *d) { return d->sector > 512 ? d->sector : 512; }
+
+/* One aligned sector, so the read can go through O_DIRECT. Give it back
+   with put_sector(). */
+static unsigned char *read_sector(sdio_dev *d, uint64_t off) {
+    size_t len = sector_len(d);
+    void *buf = sdpool_get(len);
+    if (!buf) return NULL;
+    if (sdio_read_at(d, buf, len, off) != 0) {
+        int e = errno;
+        sdpool_put(buf, len);
+        errno = e;
+        return NULL;
+    }
+    return buf;
+}
+
+static void put_sector(const sdio_dev *d, unsigned char *s) { sdpool_put(s, sector_len(d)); }
+
+int sdfat_read_mbr(sdio_dev *d, sdfat_part part[4]) {
+    unsigned char *s = read_sector(d, 0);
+    if (!s) return -1;
+    if (s[510] != 0x55 || s[511] != 0xAA) {
+        put_sector(d, s);
+        errno = EBADMSG;
+        return -1;
+    }
+    for (int i = 0; i < 4; i++) {
+        const unsigned char *e = s + 446 + 16 * i;
+        part[i].boot = e[0] == 0x80;
+        part[i].type = e[4];
+        part[i].start = (uint64_t)le32(e + 8) * 512;
+        part[i].size = (uint64_t)le32(e + 12) * 512;
+    }
+    put_sector(d, s);
+    return 0;
+}
+
+int sdfat_read_bpb(sdio_dev *d, uint64_t off, sdfat_bpb *b) {
+    unsigned char *s = read_sector(d, off);
+    if (!s) return -1;
+
+    memset(b, 0, sizeof(*b));
+    b->bytes_per_sector = le16(s + 11);
+    b->sectors_per_cluster = s[13];
+    b->reserved = le16(s + 14);
+    b->nfats = s[16];
+    unsigned root_entries = le16(s + 17);
+    unsigned fat16_size = le16(s + 22);
+    b->total_sectors = le16(s + 19) ? le16(s + 19) : le32(s + 32);
+    b->fat_sectors = le32(s + 36);
+    b->root_cluster = le32(s + 44);
+    b->fsinfo_sector = le16(s + 48);
+    b->volume_id = le32(s + 67);
+    memcpy(b->label, s + 71, 11);
+    for (int i = 10; i >= 0 && b->label[i] == ' '; i--) b->label[i] = 0;
+
+    /* FAT32 has no fixed root directory and only the 32-bit FAT size. */
+    bool ok = s[510] == 0x55 && s[511] == 0xAA &&
+              (b->bytes_per_sector == 512 || b->bytes_per_sector == 1024 ||
+               b->bytes_per_sector == 2048 || b->bytes_per_sector == 4096) &&
+              b->sectors_per_cluster && !(b->sectors_per_cluster & (b->sectors_per_cluster - 1)) &&
+              b->reserved && b->nfats && root_entries == 0 && fat16_size == 0 &&
+              b->fat_sectors && b->root_cluster >= 2;
+    put_sector(d, s);
+    if (!ok) {
+        errno = EBADMSG;
+        return -1;
+    }
+    return 0;
+}
+
+uint64_t sdfat_data_offset(const sdfat_bpb *b) {
+    return ((uint64_t)b->reserved + (uint64_t)b->nfats * b->fat_sectors) * b->bytes_per_sector;
+}
+
+uint64_t sdfat_cluster_bytes(const sdfat_bpb *b) {
+    return (uint64_t)b->sectors_per_cluster * b->bytes_per_sector;
+}
+
+/* Append [off, off+len) to a sorted extent list, merging with the last. */
+static int add_extent(sdio_extent **map, size_t *n, size_t *cap, uint64_t off, uint64_t len) {
+    if (*n && (*map)[*n - 1].off + (*map)[*n - 1].len == off) {
+        (*map)[*n - 1].len += len;
+        return 0;
+    }
+    if (*n == *cap) {
+        size_t nc = *cap ? *cap * 2 : 256;
+        sdio_extent *ne = realloc(*map, nc * sizeof(*ne));
+        if (!ne) {
+            errno = ENOMEM;
+            return -1;
+        }
+        *map = ne;
+        *cap = nc;
+    }
+    (*map)[*n].off = off;
+    (*map)[*n].len = len;
+    (*n)++;
+    return 0;
+}
+
+int sdfat_used_map(sdio_dev *d, uint64_t off, const sdfat_bpb *b,
+                   sdio_extent **map, size_t *n, uint64_t *used) {
+    *map = NULL;
+    *n = 0;
+    *used = 0;
+
+    uint64_t data = sdfat_data_offset(b);
+    uint64_t cb = sdfat_cluster_bytes(b);
+    uint64_t vol = (uint64_t)b->total_sectors * b->bytes_per_sector;
+    if (vol <= data) {
+        errno = EBADMSG;
+        return -1;
+    }
+    uint64_t nclusters = (vol - data) / cb;
+    uint64_t fat_bytes = (uint64_t)b->fat_sectors * b->bytes_per_sector;
+    if ((nclusters + 2) * 4 > fat_bytes) nclusters = fat_bytes / 4 - 2;
+
+    size_t cap = 0;
+    if (add_extent(map, n, &cap, off, data) != 0) return -1;
+
+    /* Walk the first FAT a chunk at a time; a 32 GB card has a few MiB. */
+    const size_t chunk = 1024 * 1024;
+    unsigned char *buf = sdpool_get(chunk);
+    if (!buf) {
+        free(*map);
+        *map = NULL;
+        return -1;
+    }
+
+    uint64_t fat = off + (uint64_t)b->reserved * b->bytes_per_sector;
+    uint64_t entries = nclusters + 2, c = 0;
+    while (c < entries) {
+        uint64_t pos = c * 4;
+        size_t len = (size_t)(fat_bytes - pos < chunk ? fat_bytes - pos : chunk);
+        len = (len + b->bytes_per_sector - 1) / b->bytes_per_sector * b->bytes_per_sector;
+        if (sdio_read_at(d, buf, len, fat + pos) != 0) goto fail;
+
+        for (size_t i = 0; i < len / 4 && c < entries; i++, c++) {
+            if (c < 2) continue;
+            uint32_t v = le32(buf + 4 * i) & 0x0FFFFFFF;
+            if (v == 0 || v == 0x0FFFFFF7) continue;   /* free, bad */
+            if (add_extent(map, n, &cap, off + data + (c - 2) * cb, cb) != 0) goto fail;
+        }
+    }
+    sdpool_put(buf, chunk);
+
+    for (size_t i = 0; i < *n; i++) *used += (*map)[i].len;
+    return 0;
+
+fail:;
+    int e = errno;
+    sdpool_put(buf, chunk);
+    free(*map);
+    *map = NULL;
+    *n = 0;
+    errno = e;
+    return -1;
+}
+
+int sdfat_read_label(sdio_dev *d, uint64_t off, const sdfat_bpb *b, char label[12]) {
+    memcpy(label, b->label, 12);
+
+    /* First sector of the root directory; mkfs puts the label there. */
+    uint64_t root = off + sdfat_data_offset(b) +
+                    (uint64_t)(b->root_cluster - 2) * sdfat_cluster_bytes(b);
+    unsigned char *s = read_sector(d, root);
+    if (!s) return -1;
+    for (unsigned i = 0; i + 32 <= b->bytes_per_sector && i + 32 <= 512; i += 32) {
+        const unsigned char *e = s + i;
+        if (e[0] == 0x00) break;                 /* end of directory */
+        if (e[0] == 0xE5 || e[11] == 0x0F) continue;
+        if ((e[11] & 0x18) == 0x08) {            /* volume id, not a dir */
+            memcpy(label, e, 11);
+            label[11] = 0;
+            for (int k = 10; k >= 0 && label[k] == ' '; k--) label[k] = 0;
+            break;
+        }
+    }
+    put_sector(d, s);
+    return 0;
+}
+
+void sdfat_sanitize_label(const char *in, char out[12]) {
+    const char *fallback = "MICROPYTHON";
+    if (!in || !*in) in = fallback;
+
+    char tmp[128];
+    size_t k = 0;
+    bool prev_space = false;
+    for (size_t i = 0; in[i] && k < sizeof(tmp) - 1; i++) {
+        unsigned char c = (unsigned char)in[i];
+        if (c == '\n' || c == '\r' || c == '\t') c = ' ';
+        c = (unsigned char)toupper(c);
+        if (!((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+              c == '_' || c == '-' || c == ' ')) continue;
+        if (c == ' ') {
+            if (k == 0 || prev_space) continue;
+            prev_space = true;
+        } else {
+            prev_space = false;
+        }
+        tmp[k++] = (char)c;
+    }
+    while (k > 0 && tmp[k - 1] == ' ') k--;
+    tmp[k] = 0;
+    if (k == 0) strcpy(tmp, fallback);
+
+    memset(out, 0, 12);
+    memcpy(out, tmp, strnlen(tmp, 11));
+}
+
+/* ------------------------------------------------------------
+   Building
+   ------------------------------------------------------------ */
+#define FAT32_RESERVED   32
+#define BACKUP_BOOT      6
+#define FSINFO_BACKUP    7
+
+uint32_t sdfat_default_cluster(uint64_t vol) {
+    if (vol < 260 * SDIO_MIB) return 512;
+    if (vol < 8192 * SDIO_MIB) return 4 * SDIO_KIB;
+    if (vol < 16384 * SDIO_MIB) return 8 * SDIO_KIB;
+    if (vol < 32768 * SDIO_MIB) return 16 * SDIO_KIB;
+    return 32 * SDIO_KIB;
+}
+
+int sdfat_geometry(uint64_t vol, uint32_t cluster, sdfat_bpb *b) {
+    bool chosen = cluster == 0;
+    if (chosen) cluster = sdfat_default_cluster(vol);
+    if (cluster < 512 || cluster > 64 * SDIO_KIB || (cluster & (cluster - 1))) {
+        errno = EINVAL;
+        return -1;
+    }
+again:
+    memset(b, 0, sizeof(*b));
+    b->bytes_per_sector = 512;
+    b->sectors_per_cluster = cluster / 512;
+    b->nfats = 2;
+    b->root_cluster = 2;
+    b->fsinfo_sector = 1;
+    b->total_sectors = vol / 512 > UINT32_MAX ? UINT32_MAX : (uint32_t)(vol / 512);
+
+    /* The FAT grows with the clusters it maps and the clusters shrink
+       with the FAT: start small and grow until it covers them all. */
+    uint64_t spc = b->sectors_per_cluster, fat = 1, reserved, clusters;
+    for (;;) {
+        reserved = FAT32_RESERVED;
+        reserved += (spc - (reserved + 2 * fat) % spc) % spc;
+        if (reserved + 2 * fat + spc > b->total_sectors) {
+            errno = ENOSPC;
+            return -1;
+        }
+        clusters = (b->total_sectors - reserved - 2 * fat) / spc;
+        uint64_t need = ((clusters + 2) * 4 + 511) / 512;
+        if (need <= fat) break;
+        fat = need;
+    }
+    if (clusters < SDFAT_MIN_CLUSTERS) {
+        if (chosen && cluster > 512) {
+            cluster /= 2;
+            goto again;
+        }
+        errno = chosen || cluster == 512 ? ENOSPC : EINVAL;
+        return -1;
+    }
+    b->reserved = (unsigned)reserved;
+    b->fat_sectors = (uint32_t)fat;
+    return 0;
+}
+
+static void mbr_entry(unsigned char *mbr, int i, uint8_t type, uint64_t lba, uint64_t count) {
+    unsigned char *e = mbr + 446 + 16 * i;
+    /* CHS is past its limit on any card worth formatting: LBA only */
+    static const unsigned char chs[3] = { 0xFE, 0xFF, 0xFF };
+    memcpy(e + 1, chs, 3);
+    e[4] = type;
+    memcpy(e + 5, chs, 3);
+    put32(e + 8, (uint32_t)lba);
+    put32(e + 12, (uint32_t)count);
+}
+
+int sdfat_build(sdsweep *s, uint64_t size, const sdfat_bpb *b, uint64_t *end) {
+    uint64_t split = (size / SDFAT_P1_START) * SDFAT_P1_START - SDFAT_RESERVED;
+    uint64_t p1 = SDFAT_P1_START, bps = b->bytes_per_sector;
+    uint64_t cluster = sdfat_cluster_bytes(b), data = p1 + sdfat_data_offset(b);
+    if (size < SDFAT_RESERVED + 10 * SDFAT_P1_START || bps != 512 ||
+        p1 + (uint64_t)b->total_sectors * bps > split) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    char label[11];
+    memset(label, ' ', sizeof(label));
+    memcpy(label, b->label, strnlen(b->label, 11));
+
+    /* Partition table: p1 FAT32 (LBA), p2 as parted left it (0x83) */
+    unsigned char mbr[512] = { 0 };
+    put32(mbr + 440, b->volume_id ^ 0x5D5EED00u);
+    mbr_entry(mbr, 0, 0x0c, p1 / 512, (split - p1) / 512);
+    mbr_entry(mbr, 1, 0x83, split / 512, (size - split) / 512);
+    mbr[510] = 0x55;
+    mbr[511] = 0xAA;
+
+    unsigned char bs[512] = { 0 };
+    memcpy(bs, "\xEB\x58\x90" "MSWIN4.1", 11);
+    put16(bs + 11, (uint16_t)bps);
+    bs[13] = (unsigned char)b->sectors_per_cluster;
+    put16(bs + 14, (uint16_t)b->reserved);
+    bs[16] = (unsigned char)b->nfats;
+    bs[21] = 0xF8;                        /* fixed disk */
+    put16(bs + 24, 63);
+    put16(bs + 26, 255);
+    put32(bs + 28, (uint32_t)(p1 / 512)); /* hidden sectors */
+    put32(bs + 32, b->total_sectors);
+    put32(bs + 36, b->fat_sectors);
+    put32(bs + 44, b->root_cluster);
+    put16(bs + 48, (uint16_t)b->fsinfo_sector);
+    put16(bs + 50, BACKUP_BOOT);
+    bs[64] = 0x80;
+    bs[66] = 0x29;
+    put32(bs + 67, b->volume_id);
+    memcpy(bs + 71, label, 11);
+    memcpy(bs + 82, "FAT32   ", 8);
+    memcpy(bs + 90, "\xF4\xEB\xFD", 3);     /* not bootable: hlt, loop */
+    bs[510] = 0x55;
+    bs[511] = 0xAA;
+
+    /* Reserved sectors with FSInfo and its copy; the boot sector slots
+       stay zero until the commit */
+    uint64_t clusters = ((uint64_t)b->total_sectors - (data - p1) / bps) / b->sectors_per_cluster;
+    size_t rlen = (size_t)(b->reserved * bps);
+    unsigned char *res = calloc(1, rlen);
+    unsigned char *fat = calloc(1, 512);
+    unsigned char *root = calloc(1, cluster);
+    int rc = -1;
+    if (!res || !fat || !root) {
+        errno = ENOMEM;
+        goto out;
+    }
+    for (unsigned k = 0; k < 2; k++) {
+        unsigned char *fs = res + (k ? FSINFO_BACKUP : b->fsinfo_sector) * bps;
+        put32(fs, 0x41615252);
+        put32(fs + 484, 0x61417272);
+        put32(fs + 488, (uint32_t)(clusters - 1));   /* the root directory has one */
+        put32(fs + 492, b->root_cluster + 1);
+        put32(fs + 508, 0xAA550000);
+    }
+
+    /* Media byte, end-of-chain marker, the root directory's one cluster */
+    put32(fat, 0x0FFFFFF8);
+    put32(fat + 4, 0x0FFFFFFF);
+    put32(fat + 8, 0x0FFFFFFF);
+
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    memcpy(root, label, 11);
+    root[11] = 0x08;                      /* volume label */
+    put16(root + 22, (uint16_t)(tm.tm_hour << 11 | tm.tm_min << 5 | tm.tm_sec / 2));
+    put16(root + 24, (uint16_t)((tm.tm_year - 80) << 9 | (tm.tm_mon + 1) << 5 | tm.tm_mday));
+
+    uint64_t fat_off = p1 + (uint64_t)b->reserved * bps, fat_len = (uint64_t)b->fat_sectors * bps;
+    uint64_t meta = data + cluster;
+    *end = (meta + SDIO_MIB - 1) / SDIO_MIB * SDIO_MIB;
+    if (*end > split) *end = meta;
+    if (sdsweep_add(s, 0, mbr, sizeof(mbr), true) != 0 ||
+        sdsweep_zero(s, sizeof(mbr), p1 - sizeof(mbr)) != 0 ||
+        sdsweep_add(s, p1, res, rlen, false) != 0 ||
+        sdsweep_add(s, p1, bs, sizeof(bs), true) != 0 ||
+        sdsweep_add(s, p1 + BACKUP_BOOT * bps, bs, sizeof(bs), true) != 0)
+        goto out;
+    for (unsigned k = 0; k < b->nfats; k++)
+        if (sdsweep_add(s, fat_off + k * fat_len, fat, 512, false) != 0 ||
+            sdsweep_zero(s, fat_off + k * fat_len + 512, fat_len - 512) != 0)
+            goto out;
+    if (sdsweep_add(s, data, root, cluster, false) != 0 ||
+        sdsweep_zero(s, meta, *end - meta) != 0)
+        goto out;
+    rc = 0;
+
+out:
+    free(res);
+    free(fat);
+    free(root);
+    return rc;
+}
+
+bool sdfat_is_provisioned(sdio_dev *d, const char *label, char *why, size_t whysz) {
+    sdfat_part part[4];
+    sdfat_bpb b;
+    why[0] = 0;
+
+    if (sdfat_read_mbr(d, part) != 0) {
+        snprintf(why, whysz, "no partition table");
+        return false;
+    }
+
+    /* Same arithmetic as the formatter: whole MiB, 32 reserved at the end. */
+    uint64_t split = (d->size / SDFAT_P1_START) * SDFAT_P1_START - SDFAT_RESERVED;
+    if (part[0].start != SDFAT_P1_START || part[0].start + part[0].size != split) {
+        snprintf(why, whysz, "p1 is not 1 MiB .. %llu MiB",
+                 (unsigned long long)(split / SDFAT_P1_START));
+        return false;
+    }
+    if (part[0].type != 0x0b && part[0].type != 0x0c) {
+        snprintf(why, whysz, "p1 type is 0x%02x, not FAT32", part[0].type);
+        return false;
+    }
+    if (part[1].type == 0 || part[1].start != split ||
+        part[1].start + part[1].size > d->size ||
+        d->size - (part[1].start + part[1].size) >= SDFAT_P1_START) {
+        snprintf(why, whysz, "p2 does not cover the last %llu MiB",
+                 (unsigned long long)(SDFAT_RESERVED / SDFAT_P1_START));
+        return false;
+    }
+    if (part[2].type || part[3].type) {
+        snprintf(why, whysz, "extra partitions");
+        return false;
+    }
+
+    if (sdfat_read_bpb(d, part[0].start, &b) != 0) {
+        snprintf(why, whysz, "p1 is not FAT32");
+        return false;
+    }
+    if ((uint64_t)b.total_sectors * b.bytes_per_sector > part[0].size) {
+        snprintf(why, whysz, "FAT32 is larger than p1");
+        return false;
+    }
+
+    /* FSInfo: lead, struct and trail signatures. */
+    unsigned char *fs = read_sector(d, part[0].start + (uint64_t)b.fsinfo_sector * b.bytes_per_sector);
+    bool fs_ok = fs && b.fsinfo_sector && b.fsinfo_sector < b.reserved &&
+                 le32(fs) == 0x41615252 && le32(fs + 484) == 0x61417272 &&
+                 le32(fs + 508) == 0xAA550000;
+    put_sector(d, fs);
+    if (!fs_ok) {
+        snprintf(why, whysz, "FSInfo sector missing or damaged");
+        return false;
+    }
+
+    char want[12], have[12];
+    sdfat_sanitize_label(label, want);
+    for (int k = 10; k >= 0 && (want[k] == ' ' || want[k] == 0); k--) want[k] = 0;
+    if (sdfat_read_label(d, part[0].start, &b, have) != 0) {
+        snprintf(why, whysz, "root directory unreadable");
+        return false;
+    }
+    if (strcmp(want, have) != 0) {
+        snprintf(why, whysz, "label is \"%s\", not \"%s\"", have, want);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,95 @@
+#ifndef SDFAT_H
+#define SDFAT_H
+
+/* ============================================================
+   sdfat – on-card layout: MBR partition table and the FAT32
+   boot sector, read straight from the device, and built in
+   memory for a write sweep when formatting.
+   ============================================================ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sdio.h"
+#include "sdsweep.h"
+
+/* The layout SDPrep creates: p1 FAT32 from 1 MiB up to 32 MiB before the
+   end of the card, p2 (reserved, unformatted) after it. */
+#define SDFAT_P1_START   (1ULL * 1024 * 1024)
+#define SDFAT_RESERVED   (32ULL * 1024 * 1024)
+
+/* Fewer data clusters and FatFs, Windows and mkfs.fat take the volume
+   for FAT16. */
+#define SDFAT_MIN_CLUSTERS 65525
+
+typedef struct {
+    uint8_t  type;       /* 0 = unused slot */
+    bool     boot;
+    uint64_t start;      /* bytes */
+    uint64_t size;       /* bytes */
+} sdfat_part;
+
+/* FAT32 BIOS parameter block (the fields SDPrep uses). */
+typedef struct {
+    unsigned bytes_per_sector;
+    unsigned sectors_per_cluster;
+    unsigned reserved;          /* sectors before the first FAT */
+    unsigned nfats;
+    uint32_t fat_sectors;       /* per FAT */
+    uint32_t total_sectors;
+    uint32_t root_cluster;
+    unsigned fsinfo_sector;
+    uint32_t volume_id;
+    char     label[12];         /* boot-sector label, trailing spaces cut */
+} sdfat_bpb;
+
+/* Primary partitions from sector 0. EBADMSG without a 55AA signature. */
+int  sdfat_read_mbr(sdio_dev *d, sdfat_part part[4]);
+
+/* Boot sector of the FAT32 volume at byte offset off. EBADMSG if it is
+   not FAT32. */
+int  sdfat_read_bpb(sdio_dev *d, uint64_t off, sdfat_bpb *b);
+
+/* Bytes from the volume start to cluster 2 (end of the FATs). */
+uint64_t sdfat_data_offset(const sdfat_bpb *b);
+
+uint64_t sdfat_cluster_bytes(const sdfat_bpb *b);
+
+/* Byte ranges on the device (sorted, merged, malloc'd) that the FAT32
+   volume at off actually uses: boot sector, reserved sectors and FATs,
+   then every cluster the first FAT marks allocated. used is their total. */
+int  sdfat_used_map(sdio_dev *d, uint64_t off, const sdfat_bpb *b,
+                    sdio_extent **map, size_t *n, uint64_t *used);
+
+/* Volume label: the root-directory entry, else the boot sector's. */
+int  sdfat_read_label(sdio_dev *d, uint64_t off, const sdfat_bpb *b, char label[12]);
+
+/* Upper-case, keep [A-Z0-9_- ], squeeze and trim spaces, cut to 11,
+   "MICROPYTHON" if nothing is left (same rules as the GUI). */
+void sdfat_sanitize_label(const char *in, char out[12]);
+
+/* mkfs.fat's FAT32 cluster size for a volume of vol bytes. */
+uint32_t sdfat_default_cluster(uint64_t vol);
+
+/* FAT32 geometry for a volume of vol bytes with cluster bytes per cluster
+   (0 = the default, halved until the volume has SDFAT_MIN_CLUSTERS): 512-byte
+   sectors, two FATs, FSInfo in sector 1, the reserved sectors padded so
+   the data area starts cluster aligned. Label and volume id are left for
+   the caller. EINVAL for a cluster size that is not a power of two from
+   512 to 64 KiB or leaves fewer than SDFAT_MIN_CLUSTERS, ENOSPC if vol is
+   too small for FAT32 even with 512-byte clusters. */
+int  sdfat_geometry(uint64_t vol, uint32_t cluster, sdfat_bpb *b);
+
+/* Queue the SDPrep layout for a card of size bytes on s: the partition
+   table and p1 formatted as b (reserved sectors, both FATs, the root
+   directory with the label), zeros up to p1 and after the root directory
+   up to the next MiB. The partition table and both boot sectors are
+   commit pieces. *end is where the queued part of p1 stops. */
+int  sdfat_build(sdsweep *s, uint64_t size, const sdfat_bpb *b, uint64_t *end);
+
+/* Is the card already prepared: SDPrep layout, valid FAT32 with an
+   intact FSInfo, and this (sanitised) label? Reads a handful of
+   sectors. When not, why says what differs. */
+bool sdfat_is_provisioned(sdio_dev *d, const char *label, char *why, size_t whysz);
+
+#endif /* SDFAT_H */
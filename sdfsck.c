@@ -0,0 +1,361 @@
+#define _GNU_SOURCE
+#include "sdfsck.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdpool.h"
+
+/* The whole first FAT is held in memory, 4 bytes per cluster: 8 MiB for
+   a 64 GB card with 32 KiB clusters. Copies are compared a chunk at a
+   time against it. Directories are walked breadth first from a queue,
+   and a chain is marked as it is walked, so a loop or a cross-link ends
+   the walk instead of repeating it. */
+
+#define FAT_CHUNK   (1024 * 1024)
+#define MAX_LOGGED  20
+#define FAT_BAD     0x0FFFFFF7u
+#define FAT_EOC     0x0FFFFFF8u   /* and above */
+
+typedef struct {
+    uint32_t start;
+    uint64_t len;              /* clusters walk() marked */
+} dir_chain;
+
+typedef struct {
+    sdio_dev        *d;
+    const sdfat_bpb *b;
+    uint64_t         off;      /* volume on the device */
+    uint64_t         cb;       /* cluster bytes */
+    uint32_t         last;     /* highest cluster number */
+    uint32_t        *fat;      /* entries 0..last, top nibble cut */
+    unsigned char   *seen;     /* bit per cluster, set by walk() */
+    dir_chain       *queue;    /* directories still to read */
+    size_t           nq, capq;
+    sdfsck_report   *r;
+} fsck;
+
+static uint16_t le16(const unsigned char *p) { return (uint16_t)(p[0] | p[1] << 8); }
+static uint32_t le32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void problem(fsck *f, const char *fmt, ...) {
+    char msg[160];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    if (f->r->problems == 0) snprintf(f->r->first, sizeof(f->r->first), "%s", msg);
+    if (f->r->problems < MAX_LOGGED && f->d->log) {
+        char line[176];
+        snprintf(line, sizeof(line), "fsck: %s", msg);
+        f->d->log(f->d->log_ctx, line);
+    }
+    f->r->problems++;
+}
+
+static bool seen(const fsck *f, uint32_t c) { return f->seen[c / 8] & (1u << (c % 8)); }
+static void mark(fsck *f, uint32_t c) { f->seen[c / 8] |= (unsigned char)(1u << (c % 8)); }
+
+static uint64_t cluster_off(const fsck *f, uint32_t c) {
+    return f->off + sdfat_data_offset(f->b) + (uint64_t)(c - 2) * f->cb;
+}
+
+/* "NAME.EXT" from a directory entry. */
+static void entry_name(const unsigned char *e, char out[13]) {
+    size_t k = 0;
+    for (int i = 0; i < 8 && e[i] != ' '; i++) out[k++] = (char)(i == 0 && e[i] == 0x05 ? 0xE5 : e[i]);
+    if (e[8] != ' ') out[k++] = '.';
+    for (int i = 8; i < 11 && e[i] != ' '; i++) out[k++] = (char)e[i];
+    out[k] = 0;
+}
+
+/* Boot sector against its backup, and FSInfo. free_count is what the
+   FAT says, to hold FSInfo's hint against. */
+static int check_reserved(fsck *f, uint64_t free_count) {
+    size_t bps = f->b->bytes_per_sector;
+    unsigned char *s = sdpool_get(bps);
+    unsigned char *t = sdpool_get(bps);
+    int rc = -1;
+    if (!s || !t) goto out;
+
+    if (sdio_read_at(f->d, s, bps, f->off) != 0) goto out;
+    unsigned backup = le16(s + 50);
+    if (s[21] != (f->fat[0] & 0xFF) || (f->fat[0] | 0xFF) != 0x0FFFFFFF)
+        problem(f, "FAT starts with %08x, media byte is %02x", f->fat[0], s[21]);
+    if (backup && backup != 0xFFFF) {
+        if (backup >= f->b->reserved) problem(f, "backup boot sector %u is past the reserved area", backup);
+        else if (sdio_read_at(f->d, t, bps, f->off + (uint64_t)backup * bps) != 0) goto out;
+        else if (memcmp(s, t, 512) != 0) problem(f, "boot sector and its backup differ");
+    }
+
+    if (!f->b->fsinfo_sector || f->b->fsinfo_sector >= f->b->reserved) {
+        problem(f, "no FSInfo sector");
+    } else {
+        if (sdio_read_at(f->d, s, bps, f->off + (uint64_t)f->b->fsinfo_sector * bps) != 0) goto out;
+        uint32_t hint = le32(s + 488), next = le32(s + 492);
+        if (le32(s) != 0x41615252 || le32(s + 484) != 0x61417272 || le32(s + 508) != 0xAA550000)
+            problem(f, "FSInfo signatures damaged");
+        else if (hint != 0xFFFFFFFF && hint != free_count)
+            problem(f, "FSInfo counts %u free clusters, the FAT %llu", hint,
+                    (unsigned long long)free_count);
+        else if (next != 0xFFFFFFFF && (next < 2 || next > f->last))
+            problem(f, "FSInfo next-free hint %u is outside the volume", next);
+    }
+    rc = 0;
+
+out:;
+    int e = errno;
+    if (s) sdpool_put(s, bps);
+    if (t) sdpool_put(t, bps);
+    errno = e;
+    return rc;
+}
+
+/* Load the first FAT and hold every other copy against it. */
+static int load_fats(fsck *f) {
+    size_t bps = f->b->bytes_per_sector;
+    uint64_t fat_bytes = (uint64_t)f->b->fat_sectors * bps;
+    uint64_t want = ((uint64_t)f->last + 1) * 4;
+    unsigned char *buf = sdpool_get(FAT_CHUNK);
+    if (!buf) return -1;
+
+    bool differs = false;
+    for (unsigned k = 0; k < f->b->nfats; k++) {
+        uint64_t base = f->off + ((uint64_t)f->b->reserved + (uint64_t)k * f->b->fat_sectors) * bps;
+        for (uint64_t pos = 0; pos < want && !(k && differs); pos += FAT_CHUNK) {
+            size_t len = (size_t)(fat_bytes - pos < FAT_CHUNK ? fat_bytes - pos : FAT_CHUNK);
+            if (sdio_read_at(f->d, buf, len, base + pos) != 0) {
+                int e = errno;
+                sdpool_put(buf, FAT_CHUNK);
+                errno = e;
+                return -1;
+            }
+            size_t n = (size_t)((want - pos) / 4 < len / 4 ? (want - pos) / 4 : len / 4);
+            uint32_t c0 = (uint32_t)(pos / 4);
+            for (size_t i = 0; i < n; i++) {
+                uint32_t v = le32(buf + 4 * i) & 0x0FFFFFFF;
+                if (k == 0) {
+                    f->fat[c0 + i] = v;
+                } else if (c0 + i >= 2 && v != f->fat[c0 + i]) {
+                    problem(f, "FAT %u differs from the first at cluster %zu", k + 1, c0 + i);
+                    differs = true;
+                    break;
+                }
+            }
+        }
+        differs = false;
+    }
+    sdpool_put(buf, FAT_CHUNK);
+
+    for (uint32_t c = 2; c <= f->last; c++) {
+        uint32_t v = f->fat[c];
+        if (v == 1 || (v > f->last && v < FAT_BAD))
+            problem(f, "cluster %u points to %u, outside the volume", c, v);
+    }
+    return 0;
+}
+
+/* Follow a chain from start, marking it; its length in clusters. */
+static uint64_t walk(fsck *f, uint32_t start, const char *name) {
+    uint64_t len = 0;
+    uint32_t c = start;
+    if (c < 2 || c > f->last) {
+        problem(f, "%s starts at cluster %u, outside the volume", name, c);
+        return 0;
+    }
+    for (;;) {
+        if (seen(f, c)) {
+            problem(f, "%s: cluster %u is already in a chain (loop or cross-link)", name, c);
+            break;
+        }
+        mark(f, c);
+        len++;
+        uint32_t v = f->fat[c];
+        if (v >= FAT_EOC) break;
+        if (v == 0) {
+            problem(f, "%s: chain runs into free cluster %u", name, c);
+            break;
+        }
+        if (v == FAT_BAD) {
+            problem(f, "%s: chain runs into bad cluster %u", name, c);
+            break;
+        }
+        if (v < 2 || v > f->last) break;   /* load_fats() said so */
+        c = v;
+    }
+    return len;
+}
+
+static int enqueue(fsck *f, uint32_t start, uint64_t len) {
+    if (!len) return 0;
+    if (f->nq == f->capq) {
+        size_t nc = f->capq ? f->capq * 2 : 64;
+        dir_chain *nq = realloc(f->queue, nc * sizeof(*nq));
+        if (!nq) {
+            errno = ENOMEM;
+            return -1;
+        }
+        f->queue = nq;
+        f->capq = nc;
+    }
+    f->queue[f->nq++] = (dir_chain){ start, len };
+    return 0;
+}
+
+/* Entries of the directory whose chain starts at start, as far as walk()
+   got: len clusters, none of them in another chain. */
+static int read_dir(fsck *f, uint32_t start, uint64_t len, unsigned char *buf) {
+    uint32_t c = start;
+    for (uint64_t i = 0; i < len; i++, c = f->fat[c]) {
+        if (sdio_read_at(f->d, buf, (size_t)f->cb, cluster_off(f, c)) != 0) return -1;
+        for (size_t k = 0; k + 32 <= f->cb; k += 32) {
+            const unsigned char *e = buf + k;
+            if (e[0] == 0x00) return 0;                /* end of directory */
+            if (e[0] == 0xE5 || e[11] == 0x0F || (e[11] & 0x08) || e[0] == '.') continue;
+
+            char name[13];
+            entry_name(e, name);
+            uint32_t first = (uint32_t)le16(e + 20) << 16 | le16(e + 26);
+            uint32_t size = le32(e + 28);
+            if (e[11] & 0x10) {
+                f->r->dirs++;
+                if (!first) {
+                    problem(f, "directory %s has no cluster", name);
+                } else if (enqueue(f, first, walk(f, first, name)) != 0) {
+                    return -1;
+                }
+            } else {
+                f->r->files++;
+                uint64_t want = (size + f->cb - 1) / f->cb;
+                uint64_t n = first ? walk(f, first, name) : 0;
+                if (!first && size) problem(f, "%s holds %u bytes but no cluster", name, size);
+                else if (n && n != want)
+                    problem(f, "%s holds %u bytes in %llu clusters, not %llu", name, size,
+                            (unsigned long long)n, (unsigned long long)want);
+            }
+        }
+    }
+    return 0;
+}
+
+static int walk_tree(fsck *f) {
+    unsigned char *buf = sdpool_get((size_t)f->cb);
+    if (!buf) return -1;
+    f->r->dirs++;
+    uint32_t root = f->b->root_cluster;
+    if (enqueue(f, root, walk(f, root, "root directory")) != 0) {
+        sdpool_put(buf, (size_t)f->cb);
+        return -1;
+    }
+
+    int rc = 0;
+    for (size_t q = 0; q < f->nq && rc == 0; q++)
+        rc = read_dir(f, f->queue[q].start, f->queue[q].len, buf);
+    int e = errno;
+    sdpool_put(buf, (size_t)f->cb);
+    errno = e;
+    return rc;
+}
+
+static int add_extent(sdio_extent **map, size_t *n, size_t *cap, uint64_t off, uint64_t len) {
+    if (*n && (*map)[*n - 1].off + (*map)[*n - 1].len == off) {
+        (*map)[*n - 1].len += len;
+        return 0;
+    }
+    if (*n == *cap) {
+        size_t nc = *cap ? *cap * 2 : 256;
+        sdio_extent *ne = realloc(*map, nc * sizeof(*ne));
+        if (!ne) {
+            errno = ENOMEM;
+            return -1;
+        }
+        *map = ne;
+        *cap = nc;
+    }
+    (*map)[*n].off = off;
+    (*map)[*n].len = len;
+    (*n)++;
+    return 0;
+}
+
+int sdfsck_check(sdio_dev *d, uint64_t off, const sdfat_bpb *b, sdfsck_report *r,
+                 sdio_extent **map, size_t *nmap) {
+    memset(r, 0, sizeof(*r));
+    if (map) {
+        *map = NULL;
+        *nmap = 0;
+    }
+
+    uint64_t data = sdfat_data_offset(b), cb = sdfat_cluster_bytes(b);
+    uint64_t vol = (uint64_t)b->total_sectors * b->bytes_per_sector;
+    uint64_t fat_bytes = (uint64_t)b->fat_sectors * b->bytes_per_sector;
+    if (vol <= data + cb) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    fsck f = { d, b, off, cb, 0, NULL, NULL, NULL, 0, 0, r };
+    r->clusters = (vol - data) / cb;
+    if ((r->clusters + 2) * 4 > fat_bytes) {
+        problem(&f, "the FAT maps %llu of %llu clusters", (unsigned long long)(fat_bytes / 4 - 2),
+                (unsigned long long)r->clusters);
+        r->clusters = fat_bytes / 4 - 2;
+    }
+    if (r->clusters > 0x0FFFFFF5) r->clusters = 0x0FFFFFF5;
+    f.last = (uint32_t)(r->clusters + 1);
+    f.fat = malloc(((size_t)f.last + 1) * sizeof(*f.fat));
+    f.seen = calloc((size_t)f.last / 8 + 1, 1);
+    int rc = -1;
+    if (!f.fat || !f.seen) {
+        errno = ENOMEM;
+        goto out;
+    }
+
+    if (load_fats(&f) != 0) goto out;
+    uint64_t free_count = 0, bad = 0;
+    for (uint32_t c = 2; c <= f.last; c++) {
+        free_count += f.fat[c] == 0;
+        bad += f.fat[c] == FAT_BAD;
+    }
+    r->allocated = r->clusters - free_count - bad;
+    if (check_reserved(&f, free_count) != 0 || walk_tree(&f) != 0) goto out;
+
+    uint64_t lost = 0;
+    for (uint32_t c = 2; c <= f.last; c++)
+        lost += f.fat[c] && f.fat[c] != FAT_BAD && !seen(&f, c);
+    if (lost) problem(&f, "%llu clusters are allocated but in no file", (unsigned long long)lost);
+
+    /* Metadata, then allocated clusters in cluster order */
+    size_t n = 0, cap = 0;
+    sdio_extent *m = NULL;
+    if (add_extent(&m, &n, &cap, off, data) != 0) goto out;
+    for (uint32_t c = 2; c <= f.last; c++) {
+        if (!f.fat[c] || f.fat[c] == FAT_BAD) continue;
+        if (add_extent(&m, &n, &cap, cluster_off(&f, c), cb) != 0) {
+            free(m);
+            goto out;
+        }
+    }
+    r->used = data + r->allocated * cb;
+    if (map) {
+        *map = m;
+        *nmap = n;
+    } else {
+        free(m);
+    }
+    rc = 0;
+
+out:;
+    int e = errno;
+    free(f.fat);
+    free(f.seen);
+    free(f.queue);
+    errno = e;
+    return rc;
+}
@@ -0,0 +1,38 @@
+#ifndef SDFSCK_H
+#define SDFSCK_H
+
+/* ============================================================
+   sdfsck – FAT32 consistency check, in process and read-only
+   What `fsck.fat -n` looks at on a provisioned volume: the
+   boot sector against its backup, FSInfo, every FAT copy,
+   and each cluster chain walked from the directory tree
+   (cross-links, loops, chains into free clusters, lengths
+   against file sizes, lost clusters). The FAT is read once;
+   the extents the volume uses fall out of the same pass.
+   ============================================================ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sdfat.h"
+#include "sdio.h"
+
+typedef struct {
+    uint64_t clusters;     /* data clusters in the volume */
+    uint64_t allocated;    /* of them marked in use (not free, not bad) */
+    uint64_t files;
+    uint64_t dirs;         /* root included */
+    uint64_t used;         /* bytes: metadata plus allocated clusters */
+    unsigned problems;     /* 0 = consistent */
+    char     first[160];   /* the first problem, "" if none */
+} sdfsck_report;
+
+/* Check the FAT32 volume at byte offset off with boot sector b. Each
+   problem goes to d->log (the first 20); a volume with problems is not
+   an error. When map is given it receives the byte ranges on the device
+   the volume uses, as sdfat_used_map() would (sorted, merged, malloc'd).
+   -1 with errno only if the volume cannot be read. */
+int sdfsck_check(sdio_dev *d, uint64_t off, const sdfat_bpb *b, sdfsck_report *r,
+                 sdio_extent **map, size_t *nmap);
+
+#endif /* SDFSCK_H */
@@ -0,0 +1,588 @@
+#define _GNU_SOURCE
+#include "sdhash.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sdpool.h"
+
+/* Hash list file:
+
+     sdprep-hashes 1
+     image_size 4294967296
+     block_size 1048576
+     9c1185a5c5e9fc54
+     ...
+
+   one lower-case hex XXH64 (seed 0) per block, in order. */
+
+#define HASH_MAGIC "sdprep-hashes 1"
+
+/* ------------------------------------------------------------
+   XXH64
+   ------------------------------------------------------------ */
+#define P1 0x9E3779B185EBCA87ULL
+#define P2 0xC2B2AE3D27D4EB4FULL
+#define P3 0x165667B19E3779F9ULL
+#define P4 0x85EBCA77C2B2AE63ULL
+#define P5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static inline uint64_t rd64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;   /* little-endian hosts only, like the rest of the tree */
+}
+
+static inline uint32_t rd32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint64_t xround(uint64_t acc, uint64_t in) {
+    acc += in * P2;
+    acc = rotl64(acc, 31);
+    return acc * P1;
+}
+
+static inline uint64_t xmerge(uint64_t acc, uint64_t v) {
+    acc ^= xround(0, v);
+    return acc * P1 + P4;
+}
+
+/* Remaining < 32 bytes, then the final mix. */
+static uint64_t tail_avalanche(uint64_t h, const unsigned char *p, size_t len) {
+    const unsigned char *end = p + len;
+    for (; p + 8 <= end; p += 8) {
+        h ^= xround(0, rd64(p));
+        h = rotl64(h, 27) * P1 + P4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)rd32(p) * P1;
+        h = rotl64(h, 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * P5;
+        h = rotl64(h, 11) * P1;
+    }
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t sdhash64(const void *buf, size_t len, uint64_t seed) {
+    const unsigned char *p = buf, *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + P1 + P2, v2 = seed + P2, v3 = seed, v4 = seed - P1;
+        const unsigned char *limit = end - 32;
+        do {
+            v1 = xround(v1, rd64(p));
+            v2 = xround(v2, rd64(p + 8));
+            v3 = xround(v3, rd64(p + 16));
+            v4 = xround(v4, rd64(p + 24));
+            p += 32;
+        } while (p <= limit);
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xmerge(h, v1);
+        h = xmerge(h, v2);
+        h = xmerge(h, v3);
+        h = xmerge(h, v4);
+    } else {
+        h = seed + P5;
+    }
+    return tail_avalanche(h + (uint64_t)len, p, (size_t)(end - p));
+}
+
+/* Streaming form, for data that arrives in arbitrary pieces. */
+void sdhash_init(sdhash_state *st, uint64_t seed) {
+    memset(st, 0, sizeof(*st));
+    st->seed = seed;
+    st->v[0] = seed + P1 + P2;
+    st->v[1] = seed + P2;
+    st->v[2] = seed;
+    st->v[3] = seed - P1;
+}
+
+void sdhash_update(sdhash_state *st, const void *buf, size_t len) {
+    const unsigned char *p = buf, *end = p + len;
+    st->total += len;
+
+    if (st->memlen + len < 32) {
+        memcpy(st->mem + st->memlen, p, len);
+        st->memlen += len;
+        return;
+    }
+    if (st->memlen) {
+        size_t k = 32 - st->memlen;
+        memcpy(st->mem + st->memlen, p, k);
+        for (int i = 0; i < 4; i++) st->v[i] = xround(st->v[i], rd64(st->mem + 8 * i));
+        p += k;
+        st->memlen = 0;
+    }
+    for (; p + 32 <= end; p += 32) {
+        for (int i = 0; i < 4; i++) st->v[i] = xround(st->v[i], rd64(p + 8 * i));
+    }
+    memcpy(st->mem, p, (size_t)(end - p));
+    st->memlen = (size_t)(end - p);
+}
+
+uint64_t sdhash_final(const sdhash_state *st) {
+    uint64_t h;
+    if (st->total >= 32) {
+        const uint64_t *v = st->v;
+        h = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) + rotl64(v[3], 18);
+        for (int i = 0; i < 4; i++) h = xmerge(h, v[i]);
+    } else {
+        h = st->seed + P5;
+    }
+    return tail_avalanche(h + st->total, st->mem, st->memlen);
+}
+
+/* ------------------------------------------------------------
+   Hash lists
+   ------------------------------------------------------------ */
+static size_t block_count(uint64_t size, uint32_t bs) {
+    return (size_t)((size + bs - 1) / bs);
+}
+
+static size_t block_len(uint64_t size, uint32_t bs, size_t blk) {
+    uint64_t off = (uint64_t)blk * bs;
+    return size - off < bs ? (size_t)(size - off) : bs;
+}
+
+int sdhash_tee_init(sdhash_tee *t, sdio_fill_fn fill, void *ctx, uint32_t block_size) {
+    memset(t, 0, sizeof(*t));
+    t->fill = fill;
+    t->ctx = ctx;
+    t->hl.block_size = block_size ? block_size : SDHASH_BLOCK;
+    t->cap = 1024;
+    t->hl.h = malloc(t->cap * sizeof(*t->hl.h));
+    if (!t->hl.h) {
+        errno = ENOMEM;
+        return -1;
+    }
+    sdhash_init(&t->st, 0);
+    return 0;
+}
+
+static int tee_push(sdhash_tee *t) {
+    if (t->hl.n == t->cap) {
+        uint64_t *nh = realloc(t->hl.h, t->cap * 2 * sizeof(*nh));
+        if (!nh) return -1;
+        t->hl.h = nh;
+        t->cap *= 2;
+    }
+    t->hl.h[t->hl.n++] = sdhash_final(&t->st);
+    sdhash_init(&t->st, 0);
+    t->in_block = 0;
+    return 0;
+}
+
+ssize_t sdhash_tee_fill(void *ctx, uint64_t off, void *buf, size_t len) {
+    sdhash_tee *t = ctx;
+    ssize_t got = t->fill(t->ctx, off, buf, len);
+    if (got <= 0) return got;
+
+    const char *p = buf;
+    size_t left = (size_t)got;
+    while (left > 0) {
+        size_t k = t->hl.block_size - t->in_block;
+        if (k > left) k = left;
+        sdhash_update(&t->st, p, k);
+        t->in_block += (uint32_t)k;
+        p += k;
+        left -= k;
+        if (t->in_block == t->hl.block_size && tee_push(t) != 0) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    t->hl.image_size += (uint64_t)got;
+    return got;
+}
+
+int sdhash_tee_finish(sdhash_tee *t, sdhash_list *hl) {
+    if (t->in_block && tee_push(t) != 0) {
+        sdhash_list_free(&t->hl);
+        errno = ENOMEM;
+        return -1;
+    }
+    *hl = t->hl;
+    memset(&t->hl, 0, sizeof(t->hl));
+    return 0;
+}
+
+int sdhash_list_build(sdimg *im, uint64_t size, uint32_t block_size, sdhash_list *hl) {
+    memset(hl, 0, sizeof(*hl));
+    sdhash_tee t;
+    if (sdhash_tee_init(&t, sdimg_fill, im, block_size) != 0) return -1;
+    void *buf = sdpool_get(SDIO_MIB);
+    if (!buf) {
+        sdhash_list_free(&t.hl);
+        return -1;
+    }
+
+    uint64_t limit = size ? size : UINT64_MAX;
+    ssize_t got = 0;
+    while (t.hl.image_size < limit) {
+        size_t want = limit - t.hl.image_size < SDIO_MIB
+                    ? (size_t)(limit - t.hl.image_size) : SDIO_MIB;
+        got = sdhash_tee_fill(&t, t.hl.image_size, buf, want);
+        if (got <= 0 || (size_t)got < want) break;
+    }
+    int e = errno;
+    sdpool_put(buf, SDIO_MIB);
+    if (got < 0) {
+        sdhash_list_free(&t.hl);
+        errno = e;
+        return -1;
+    }
+    if (size && t.hl.image_size != size) {
+        sdhash_list_free(&t.hl);
+        errno = EBADMSG;   /* image shorter than it claims */
+        return -1;
+    }
+    return sdhash_tee_finish(&t, hl);
+}
+
+void sdhash_list_mask(sdhash_list *hl, const sdio_extent *map, size_t nmap) {
+    size_t k = 0;
+    for (size_t i = 0; i < hl->n; i++) {
+        uint64_t off = (uint64_t)i * hl->block_size;
+        uint64_t end = off + block_len(hl->image_size, hl->block_size, i);
+        while (k < nmap && map[k].off + map[k].len <= off) k++;
+        bool covered = k < nmap && map[k].off <= off && map[k].off + map[k].len >= end;
+        if (!covered) hl->h[i] = 0;
+    }
+}
+
+size_t sdhash_recorded(const sdhash_list *hl) {
+    size_t n = 0;
+    for (size_t i = 0; i < hl->n; i++) n += hl->h[i] != 0;
+    return n;
+}
+
+void sdhash_list_keep(sdhash_list *hl, const sdio_extent *map, size_t nmap) {
+    size_t k = 0;
+    for (size_t i = 0; i < hl->n; i++) {
+        uint64_t off = (uint64_t)i * hl->block_size;
+        uint64_t end = off + block_len(hl->image_size, hl->block_size, i);
+        while (k < nmap && map[k].off + map[k].len <= off) k++;
+        if (k == nmap || map[k].off >= end) hl->h[i] = 0;
+    }
+}
+
+int sdhash_list_load(const char *path, sdhash_list *hl) {
+    memset(hl, 0, sizeof(*hl));
+    FILE *fp = fopen(path, "r");
+    if (!fp) return -1;
+
+    char line[128];
+    unsigned long long size = 0;
+    unsigned bs = 0;
+    int err = EBADMSG;
+    if (!fgets(line, sizeof(line), fp) || strncmp(line, HASH_MAGIC, strlen(HASH_MAGIC)) != 0 ||
+        !fgets(line, sizeof(line), fp) || sscanf(line, "image_size %llu", &size) != 1 ||
+        !fgets(line, sizeof(line), fp) || sscanf(line, "block_size %u", &bs) != 1 ||
+        bs == 0 || bs % 512 != 0)
+        goto fail;
+
+    hl->image_size = size;
+    hl->block_size = bs;
+    hl->n = block_count(size, bs);
+    hl->h = malloc((hl->n ? hl->n : 1) * sizeof(*hl->h));
+    if (!hl->h) {
+        err = ENOMEM;
+        goto fail;
+    }
+    for (size_t i = 0; i < hl->n; i++) {
+        unsigned long long v;
+        if (!fgets(line, sizeof(line), fp) || sscanf(line, "%16llx", &v) != 1) goto fail;
+        hl->h[i] = v;
+    }
+    fclose(fp);
+    return 0;
+
+fail:
+    fclose(fp);
+    sdhash_list_free(hl);
+    errno = err;
+    return -1;
+}
+
+int sdhash_list_save(const char *path, const sdhash_list *hl) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) return -1;
+
+    fprintf(fp, HASH_MAGIC "\nimage_size %llu\nblock_size %u\n",
+            (unsigned long long)hl->image_size, hl->block_size);
+    for (size_t i = 0; i < hl->n; i++)
+        fprintf(fp, "%016llx\n", (unsigned long long)hl->h[i]);
+
+    if (ferror(fp)) {
+        fclose(fp);
+        unlink(tmp);
+        errno = EIO;
+        return -1;
+    }
+    if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+        int e = errno;
+        unlink(tmp);
+        errno = e;
+        return -1;
+    }
+    return 0;
+}
+
+void sdhash_list_free(sdhash_list *hl) {
+    free(hl->h);
+    hl->h = NULL;
+    hl->n = 0;
+}
+
+char *sdhash_sidecar(const char *image) {
+    static const char *const packed[] = { ".xz", ".zst", ".gz", NULL };
+
+    size_t n = strlen(image);
+    for (int i = 0; packed[i]; i++) {
+        size_t k = strlen(packed[i]);
+        if (n > k && strcmp(image + n - k, packed[i]) == 0) {
+            n -= k;
+            break;
+        }
+    }
+
+    char *path = malloc(n + sizeof(".hashes"));
+    if (!path) return NULL;
+    memcpy(path, image, n);
+    strcpy(path + n, ".hashes");
+    return path;
+}
+
+/* ------------------------------------------------------------
+   Parallel read-back
+   Readers take blocks from a shared counter; O_DIRECT keeps the
+   card's contents out of the page cache.
+   ------------------------------------------------------------ */
+typedef struct {
+    sdio_dev     *d;
+    uint64_t      size;
+    uint32_t      bs;
+    const size_t *idx;       /* blocks to read, NULL = 0..n-1 */
+    size_t        n;
+    uint64_t     *out;       /* hash of each */
+    uint64_t      total;     /* bytes to read, for progress */
+    size_t        next;      /* atomic */
+    uint64_t      done;      /* atomic */
+    int           err;       /* atomic, first failure */
+} scan_ctx;
+
+static void set_err(scan_ctx *c, int e) {
+    int zero = 0;
+    __atomic_compare_exchange_n(&c->err, &zero, e, false,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static void scan_blocks(scan_ctx *c, bool report) {
+    void *buf = sdpool_get(c->bs);
+    if (!buf) {
+        set_err(c, ENOMEM);
+        return;
+    }
+
+    for (;;) {
+        if (__atomic_load_n(&c->err, __ATOMIC_RELAXED)) break;
+        size_t i = __atomic_fetch_add(&c->next, 1, __ATOMIC_RELAXED);
+        if (i >= c->n) break;
+
+        size_t blk = c->idx ? c->idx[i] : i;
+        size_t len = block_len(c->size, c->bs, blk);
+        if (sdio_read_at(c->d, buf, len, (uint64_t)blk * c->bs) != 0) {
+            set_err(c, errno ? errno : EIO);
+            break;
+        }
+        c->out[i] = sdhash64(buf, len, 0);
+
+        uint64_t done = __atomic_add_fetch(&c->done, len, __ATOMIC_RELAXED);
+        if (report && c->d->progress)
+            c->d->progress(c->d->progress_ctx, done, c->total);
+    }
+    sdpool_put(buf, c->bs);
+}
+
+static void *scan_worker(void *arg) {
+    scan_blocks(arg, false);
+    return NULL;
+}
+
+static int scan(sdio_dev *d, uint64_t size, uint32_t bs, const size_t *idx, size_t n,
+                uint64_t *out, int threads) {
+    if (size > d->size) {
+        errno = ENOSPC;
+        return -1;
+    }
+    if (threads < 1) threads = 1;
+    if (threads > 16) threads = 16;
+
+    scan_ctx c = { d, size, bs, idx, n, out, 0, 0, 0, 0 };
+    for (size_t i = 0; i < n; i++) c.total += block_len(size, bs, idx ? idx[i] : i);
+
+    pthread_t tids[16];
+    int started = 0;
+    for (int i = 1; i < threads; i++) {
+        if (pthread_create(&tids[started], NULL, scan_worker, &c) == 0) started++;
+    }
+    scan_blocks(&c, true);   /* the caller's thread reports progress */
+    for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+
+    if (c.err) {
+        errno = c.err;
+        return -1;
+    }
+    return 0;
+}
+
+int sdhash_read(sdio_dev *d, uint64_t size, uint32_t block_size, int threads,
+                sdhash_list *hl) {
+    memset(hl, 0, sizeof(*hl));
+    hl->image_size = size;
+    hl->block_size = block_size ? block_size : SDHASH_BLOCK;
+    hl->n = block_count(size, hl->block_size);
+    hl->h = malloc((hl->n ? hl->n : 1) * sizeof(*hl->h));
+    if (!hl->h) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (scan(d, size, hl->block_size, NULL, hl->n, hl->h, threads) != 0) {
+        int e = errno;
+        sdhash_list_free(hl);
+        errno = e;
+        return -1;
+    }
+    return 0;
+}
+
+static bool usable_known(const sdhash_list *hl, const sdhash_list *known) {
+    return known && known->block_size == hl->block_size &&
+           known->image_size >= hl->image_size;
+}
+
+int sdhash_diff(sdio_dev *d, const sdhash_list *hl, const sdhash_list *known, int threads,
+                sdio_extent **diff, size_t *ndiff, uint64_t *diff_bytes) {
+    *diff = NULL;
+    *ndiff = 0;
+    *diff_bytes = 0;
+
+    unsigned char *differs = calloc(hl->n ? hl->n : 1, 1);
+    size_t *idx = calloc(hl->n ? hl->n : 1, sizeof(*idx));
+    uint64_t *got = malloc((hl->n ? hl->n : 1) * sizeof(*got));
+    if (!differs || !idx || !got) {
+        free(differs); free(idx); free(got);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /* Blocks the card's own record vouches for are not read. The last
+       one is, unless both lists end in the same place. */
+    size_t nidx = 0;
+    bool use_known = usable_known(hl, known);
+    for (size_t i = 0; i < hl->n; i++) {
+        bool whole = (uint64_t)(i + 1) * hl->block_size <= hl->image_size ||
+                     (use_known && known->image_size == hl->image_size);
+        if (use_known && whole && known->h[i] != 0) differs[i] = known->h[i] != hl->h[i];
+        else idx[nidx++] = i;
+    }
+
+    if (scan(d, hl->image_size, hl->block_size, idx, nidx, got, threads) != 0) {
+        int e = errno;
+        free(differs); free(idx); free(got);
+        errno = e;
+        return -1;
+    }
+    for (size_t k = 0; k < nidx; k++) differs[idx[k]] = got[k] != hl->h[idx[k]];
+    free(idx);
+    free(got);
+
+    /* Merge differing blocks into extents. */
+    size_t n = 0;
+    for (size_t i = 0; i < hl->n; i++) {
+        if (differs[i] && (i == 0 || !differs[i - 1])) n++;
+    }
+    sdio_extent *ext = malloc((n ? n : 1) * sizeof(*ext));
+    if (!ext) {
+        free(differs);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    n = 0;
+    for (size_t i = 0; i < hl->n; i++) {
+        if (!differs[i]) continue;
+        uint64_t off = (uint64_t)i * hl->block_size;
+        uint64_t len = block_len(hl->image_size, hl->block_size, i);
+        if (n && ext[n - 1].off + ext[n - 1].len == off) {
+            ext[n - 1].len += len;
+        } else {
+            ext[n].off = off;
+            ext[n].len = len;
+            n++;
+        }
+        *diff_bytes += len;
+    }
+    free(differs);
+
+    *diff = ext;
+    *ndiff = n;
+    return 0;
+}
+
+int sdhash_sample(sdio_dev *d, const sdhash_list *hl, size_t max, int threads,
+                  size_t *checked, size_t *bad) {
+    *checked = *bad = 0;
+
+    size_t recorded = sdhash_recorded(hl);
+    if (recorded == 0) return 0;
+    if (max == 0 || max > recorded) max = recorded;
+
+    size_t *idx = malloc(max * sizeof(*idx));
+    uint64_t *got = malloc(max * sizeof(*got));
+    if (!idx || !got) {
+        free(idx); free(got);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /* Evenly spaced over the recorded blocks, first and last included. */
+    size_t n = 0, seen = 0;
+    for (size_t i = 0; i < hl->n && n < max; i++) {
+        if (hl->h[i] == 0) continue;
+        size_t want = max == 1 ? 0 : (size_t)((uint64_t)n * (recorded - 1) / (max - 1));
+        if (seen++ == want) idx[n++] = i;
+    }
+
+    int rc = scan(d, hl->image_size, hl->block_size, idx, n, got, threads);
+    if (rc == 0) {
+        for (size_t k = 0; k < n; k++) *bad += got[k] != hl->h[idx[k]];
+        *checked = n;
+    }
+    int e = errno;
+    free(idx);
+    free(got);
+    errno = e;
+    return rc;
+}
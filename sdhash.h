@@ -0,0 +1,100 @@
+#ifndef SDHASH_H
+#define SDHASH_H
+
+/* ============================================================
+   sdhash – per-block hash lists for delta re-provisioning
+   A hash list holds one 64-bit hash (XXH64) per fixed-size
+   block of an image. Hashing what a card already holds and
+   comparing tells which blocks need rewriting.
+   ============================================================ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sdimg.h"
+#include "sdio.h"
+
+#define SDHASH_BLOCK (1024 * 1024)   /* default block size */
+
+typedef struct {
+    uint64_t  image_size;
+    uint32_t  block_size;
+    uint64_t *h;        /* one per block, the last may be short; 0 = not recorded */
+    size_t    n;
+} sdhash_list;
+
+/* XXH64 of len bytes. */
+uint64_t sdhash64(const void *buf, size_t len, uint64_t seed);
+
+/* The same, fed in pieces. */
+typedef struct {
+    uint64_t      v[4];
+    unsigned char mem[32];
+    size_t        memlen;
+    uint64_t      total;
+    uint64_t      seed;
+} sdhash_state;
+
+void     sdhash_init(sdhash_state *st, uint64_t seed);
+void     sdhash_update(sdhash_state *st, const void *buf, size_t len);
+uint64_t sdhash_final(const sdhash_state *st);
+
+/* A fill function that hashes everything passing through it, so a hash
+   list falls out of a write at no extra read:
+
+     sdhash_tee t;
+     sdhash_tee_init(&t, sdimg_fill, im, 0);
+     sdio_write(dev, 0, 0, sdhash_tee_fill, &t);
+     sdhash_tee_finish(&t, &hl);
+ */
+typedef struct {
+    sdio_fill_fn fill;
+    void        *ctx;
+    sdhash_list  hl;
+    size_t       cap;
+    sdhash_state st;
+    uint32_t     in_block;
+} sdhash_tee;
+
+int     sdhash_tee_init(sdhash_tee *t, sdio_fill_fn fill, void *ctx, uint32_t block_size);
+ssize_t sdhash_tee_fill(void *t, uint64_t off, void *buf, size_t len);
+int     sdhash_tee_finish(sdhash_tee *t, sdhash_list *hl);
+
+/* Hash size bytes of im (0 = until it ends). Consumes the image. */
+int  sdhash_list_build(sdimg *im, uint64_t size, uint32_t block_size, sdhash_list *hl);
+
+/* Hash the first size bytes of a device with threads parallel readers. */
+int  sdhash_read(sdio_dev *d, uint64_t size, uint32_t block_size, int threads,
+                 sdhash_list *hl);
+
+/* Forget (zero) the hash of every block not wholly inside map. */
+void sdhash_list_mask(sdhash_list *hl, const sdio_extent *map, size_t nmap);
+
+/* Blocks whose hash is recorded (not 0). */
+size_t sdhash_recorded(const sdhash_list *hl);
+
+/* Forget the hash of every block map (sorted, merged) does not touch. */
+void sdhash_list_keep(sdhash_list *hl, const sdio_extent *map, size_t nmap);
+
+/* Text format, see sdhash.c. Load fails with EBADMSG if malformed. */
+int  sdhash_list_load(const char *path, sdhash_list *hl);
+int  sdhash_list_save(const char *path, const sdhash_list *hl);
+void sdhash_list_free(sdhash_list *hl);
+
+/* Sidecar path for an image: "X.img.zst" -> "X.img.hashes" (malloc'd,
+   whether or not it exists). */
+char *sdhash_sidecar(const char *image);
+
+/* Find the blocks of the device's first image_size bytes whose hash
+   differs from hl, merged into sorted extents (malloc'd, never NULL on
+   success). Blocks are read back with threads parallel readers, except
+   those known (hashes the card is trusted to hold, may be NULL) records. */
+int  sdhash_diff(sdio_dev *d, const sdhash_list *hl, const sdhash_list *known,
+                 int threads, sdio_extent **diff, size_t *ndiff, uint64_t *diff_bytes);
+
+/* Read back up to max recorded blocks spread over hl (0 = all) and count
+   those that no longer match. */
+int  sdhash_sample(sdio_dev *d, const sdhash_list *hl, size_t max, int threads,
+                   size_t *checked, size_t *bad);
+
+#endif /* SDHASH_H */
@@ -0,0 +1,550 @@
+#define _GNU_SOURCE
+#include "sdimg.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "sdpool.h"
+
+/* ============================================================
+   Decode ring
+   Chunk number seq lives in slots[seq % nslots]. Producers may
+   only fill seq once the consumer has drained seq - nslots, so
+   decoded data in memory never exceeds nslots buffers however
+   large the image is.
+
+   Raw and xz images (and single-frame zstd) are decoded by one
+   thread in SLOT_BYTES chunks; liblzma's own threaded decoder
+   handles multi-block xz. Multi-frame zstd (pzstd, zstd
+   --block-size/-B) gets one chunk per frame, decoded by a pool
+   of workers in parallel.
+   ============================================================ */
+
+#define SLOT_BYTES    (4u << 20)
+#define STREAM_SLOTS  8
+#define RING_MAX      16
+#define MEM_BUDGET    (256ull << 20)   /* decoded bytes held at most */
+#define MAX_THREADS   16
+#define IN_BYTES      (1u << 20)
+
+typedef struct {
+    void  *buf;
+    size_t cap;
+    size_t len;
+    size_t pos;      /* consumed */
+    bool   ready;
+} img_slot;
+
+typedef struct {
+    uint64_t off;    /* in the compressed file */
+    size_t   csize;
+    size_t   dsize;
+} zframe;
+
+struct sdimg {
+    sdimg_format fmt;
+    int      fd;
+    uint64_t size;
+    int      dec_threads;
+
+    const uint8_t *map;
+    size_t         map_len;
+    zframe        *frames;
+    size_t         nframes;
+
+    img_slot slots[RING_MAX];
+    int      nslots;
+
+    pthread_mutex_t mu;
+    pthread_cond_t  cv_space;
+    pthread_cond_t  cv_data;
+    pthread_t       threads[MAX_THREADS];
+    int             nthreads;
+
+    uint64_t next_seq;   /* frame pool: next chunk to claim */
+    uint64_t read_seq;   /* consumer position */
+    uint64_t nchunks;    /* UINT64_MAX until the producer finishes */
+    int      err;
+    bool     stop;
+};
+
+/* ------------------------------------------------------------
+   Ring helpers
+   ------------------------------------------------------------ */
+static img_slot *claim_slot(sdimg *im, uint64_t seq) {
+    pthread_mutex_lock(&im->mu);
+    while (!im->stop && seq >= im->read_seq + (uint64_t)im->nslots)
+        pthread_cond_wait(&im->cv_space, &im->mu);
+    img_slot *s = im->stop ? NULL : &im->slots[seq % (uint64_t)im->nslots];
+    pthread_mutex_unlock(&im->mu);
+    return s;
+}
+
+static void publish_slot(sdimg *im, img_slot *s, size_t len) {
+    pthread_mutex_lock(&im->mu);
+    s->len = len;
+    s->pos = 0;
+    s->ready = true;
+    pthread_cond_broadcast(&im->cv_data);
+    pthread_mutex_unlock(&im->mu);
+}
+
+static void finish(sdimg *im, uint64_t nchunks) {
+    pthread_mutex_lock(&im->mu);
+    im->nchunks = nchunks;
+    pthread_cond_broadcast(&im->cv_data);
+    pthread_mutex_unlock(&im->mu);
+}
+
+static void fail(sdimg *im, int err) {
+    pthread_mutex_lock(&im->mu);
+    if (!im->err) im->err = err;
+    im->stop = true;
+    pthread_cond_broadcast(&im->cv_data);
+    pthread_cond_broadcast(&im->cv_space);
+    pthread_mutex_unlock(&im->mu);
+}
+
+static int slot_reserve(img_slot *s, size_t cap) {
+    if (s->cap >= cap) return 0;
+    sdpool_put(s->buf, s->cap);
+    s->cap = 0;
+    s->buf = sdpool_get(cap);
+    if (!s->buf) return -1;
+    s->cap = sdpool_size(cap);
+    return 0;
+}
+
+/* ------------------------------------------------------------
+   Raw: plain read-ahead so reads overlap device writes
+   ------------------------------------------------------------ */
+static void *raw_thread(void *arg) {
+    sdimg *im = arg;
+
+    for (uint64_t seq = 0;; seq++) {
+        img_slot *s = claim_slot(im, seq);
+        if (!s) return NULL;
+        if (slot_reserve(s, SLOT_BYTES) != 0) { fail(im, ENOMEM); return NULL; }
+
+        size_t got = 0;
+        while (got < SLOT_BYTES) {
+            ssize_t n = read(im->fd, (char *)s->buf + got, SLOT_BYTES - got);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                fail(im, errno);
+                return NULL;
+            }
+            if (n == 0) break;
+            got += (size_t)n;
+        }
+
+        if (got) publish_slot(im, s, got);
+        if (got < SLOT_BYTES) {
+            finish(im, got ? seq + 1 : seq);
+            return NULL;
+        }
+    }
+}
+
+/* ------------------------------------------------------------
+   xz
+   ------------------------------------------------------------ */
+#ifdef HAVE_LZMA
+static void *xz_thread(void *arg) {
+    sdimg *im = arg;
+    lzma_stream strm = LZMA_STREAM_INIT;
+    lzma_ret ret;
+
+#if LZMA_VERSION >= 50040002
+    lzma_mt mt;
+    memset(&mt, 0, sizeof(mt));
+    mt.flags = LZMA_CONCATENATED;
+    mt.threads = (uint32_t)im->dec_threads;
+    mt.memlimit_threading = MEM_BUDGET;
+    mt.memlimit_stop = UINT64_MAX;
+    ret = lzma_stream_decoder_mt(&strm, &mt);
+#else
+    ret = lzma_stream_decoder(&strm, UINT64_MAX, LZMA_CONCATENATED);
+#endif
+    if (ret != LZMA_OK) {
+        fail(im, ENOMEM);
+        return NULL;
+    }
+
+    uint8_t *in = malloc(IN_BYTES);
+    if (!in) {
+        fail(im, ENOMEM);
+        lzma_end(&strm);
+        return NULL;
+    }
+
+    lzma_action action = LZMA_RUN;
+    for (uint64_t seq = 0;; seq++) {
+        img_slot *s = claim_slot(im, seq);
+        if (!s) break;
+        if (slot_reserve(s, SLOT_BYTES) != 0) { fail(im, ENOMEM); break; }
+
+        strm.next_out = s->buf;
+        strm.avail_out = SLOT_BYTES;
+        ret = LZMA_OK;
+
+        while (strm.avail_out > 0) {
+            if (strm.avail_in == 0 && action == LZMA_RUN) {
+                ssize_t n = read(im->fd, in, IN_BYTES);
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    fail(im, errno);
+                    goto out;
+                }
+                if (n == 0) action = LZMA_FINISH;
+                strm.next_in = in;
+                strm.avail_in = (size_t)n;
+            }
+            ret = lzma_code(&strm, action);
+            if (ret == LZMA_STREAM_END) break;
+            if (ret != LZMA_OK) {
+                fail(im, ret == LZMA_MEM_ERROR ? ENOMEM : EBADMSG);
+                goto out;
+            }
+        }
+
+        size_t got = SLOT_BYTES - strm.avail_out;
+        if (got) publish_slot(im, s, got);
+        if (ret == LZMA_STREAM_END) {
+            finish(im, got ? seq + 1 : seq);
+            break;
+        }
+    }
+
+out:
+    free(in);
+    lzma_end(&strm);
+    return NULL;
+}
+#endif
+
+/* ------------------------------------------------------------
+   zstd
+   ------------------------------------------------------------ */
+#ifdef HAVE_ZSTD
+static void *zstd_stream_thread(void *arg) {
+    sdimg *im = arg;
+    ZSTD_DStream *ds = ZSTD_createDStream();
+    if (!ds) {
+        fail(im, ENOMEM);
+        return NULL;
+    }
+    ZSTD_initDStream(ds);
+
+    ZSTD_inBuffer in = { im->map, im->map_len, 0 };
+    size_t last = 1;   /* 0 once the last frame is fully flushed */
+
+    for (uint64_t seq = 0;; seq++) {
+        if (in.pos == in.size && last == 0) {
+            finish(im, seq);
+            break;
+        }
+        img_slot *s = claim_slot(im, seq);
+        if (!s) break;
+        if (slot_reserve(s, SLOT_BYTES) != 0) { fail(im, ENOMEM); break; }
+
+        ZSTD_outBuffer out = { s->buf, SLOT_BYTES, 0 };
+        while (out.pos < out.size) {
+            last = ZSTD_decompressStream(ds, &out, &in);
+            if (ZSTD_isError(last)) {
+                fail(im, EBADMSG);
+                goto out;
+            }
+            /* Input used up and room to spare: nothing left to flush. */
+            if (in.pos == in.size && (last == 0 || out.pos < out.size)) break;
+        }
+
+        if (out.pos) publish_slot(im, s, out.pos);
+        if (in.pos == in.size && out.pos < out.size) {
+            if (last != 0) fail(im, EBADMSG);   /* truncated frame */
+            else finish(im, out.pos ? seq + 1 : seq);
+            break;
+        }
+    }
+
+out:
+    ZSTD_freeDStream(ds);
+    return NULL;
+}
+
+static void *zstd_frame_worker(void *arg) {
+    sdimg *im = arg;
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    if (!dctx) {
+        fail(im, ENOMEM);
+        return NULL;
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&im->mu);
+        while (!im->stop && im->next_seq < im->nframes &&
+               im->next_seq >= im->read_seq + (uint64_t)im->nslots)
+            pthread_cond_wait(&im->cv_space, &im->mu);
+        if (im->stop || im->next_seq >= im->nframes) {
+            pthread_mutex_unlock(&im->mu);
+            break;
+        }
+        uint64_t seq = im->next_seq++;
+        pthread_mutex_unlock(&im->mu);
+
+        img_slot *s = &im->slots[seq % (uint64_t)im->nslots];
+        const zframe *f = &im->frames[seq];
+        if (slot_reserve(s, f->dsize ? f->dsize : 1) != 0) { fail(im, ENOMEM); break; }
+
+        size_t n = ZSTD_decompressDCtx(dctx, s->buf, f->dsize, im->map + f->off, f->csize);
+        if (ZSTD_isError(n) || n != f->dsize) { fail(im, EBADMSG); break; }
+        publish_slot(im, s, n);
+    }
+
+    ZSTD_freeDCtx(dctx);
+    return NULL;
+}
+
+/* Index the frames. *parallel is set when they can be decoded
+   independently within the memory budget (several frames, all sizes
+   recorded). */
+static int zstd_scan(sdimg *im, bool *parallel) {
+    size_t cap = 0, maxd = 0;
+    bool sizes_known = true;
+    uint64_t total = 0;
+
+    for (size_t off = 0; off < im->map_len;) {
+        size_t cs = ZSTD_findFrameCompressedSize(im->map + off, im->map_len - off);
+        if (ZSTD_isError(cs)) { errno = EBADMSG; return -1; }
+        unsigned long long ds = ZSTD_getFrameContentSize(im->map + off, im->map_len - off);
+
+        if (im->nframes == cap) {
+            cap = cap ? cap * 2 : 256;
+            zframe *nf = realloc(im->frames, cap * sizeof(*nf));
+            if (!nf) { errno = ENOMEM; return -1; }
+            im->frames = nf;
+        }
+        zframe *f = &im->frames[im->nframes++];
+        f->off = off;
+        f->csize = cs;
+        f->dsize = 0;
+        if (ds == ZSTD_CONTENTSIZE_UNKNOWN || ds == ZSTD_CONTENTSIZE_ERROR || ds > SIZE_MAX) {
+            sizes_known = false;
+        } else {
+            f->dsize = (size_t)ds;
+            total += ds;
+            if (f->dsize > maxd) maxd = f->dsize;
+        }
+        off += cs;
+    }
+
+    im->size = sizes_known ? total : 0;
+    *parallel = sizes_known && im->nframes > 1 && maxd <= MEM_BUDGET / 4;
+    if (*parallel) {
+        uint64_t fit = maxd ? MEM_BUDGET / maxd : RING_MAX;
+        im->nslots = fit > RING_MAX ? RING_MAX : (int)fit;
+        if (im->nslots < 2) im->nslots = 2;
+    }
+    return 0;
+}
+#endif
+
+/* ------------------------------------------------------------
+   Open / close / read
+   ------------------------------------------------------------ */
+static int start_threads(sdimg *im, void *(*fn)(void *), int n) {
+    for (im->nthreads = 0; im->nthreads < n; im->nthreads++) {
+        if (pthread_create(&im->threads[im->nthreads], NULL, fn, im) != 0) break;
+    }
+    if (im->nthreads == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return 0;
+}
+
+sdimg *sdimg_open(const char *path, int threads) {
+    sdimg *im = calloc(1, sizeof(*im));
+    if (!im) return NULL;
+
+    pthread_mutex_init(&im->mu, NULL);
+    pthread_cond_init(&im->cv_space, NULL);
+    pthread_cond_init(&im->cv_data, NULL);
+    im->nchunks = UINT64_MAX;
+    im->nslots = STREAM_SLOTS;
+
+    if (threads <= 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = n > 0 ? (int)n : 1;
+    }
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+    im->dec_threads = 1;
+
+    struct stat st;
+    uint8_t magic[6] = {0};
+    im->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (im->fd < 0 || fstat(im->fd, &st) != 0) goto fail;
+    if (!S_ISREG(st.st_mode) && !S_ISBLK(st.st_mode)) {
+        errno = EINVAL;
+        goto fail;
+    }
+    ssize_t mn = pread(im->fd, magic, sizeof(magic), 0);
+    if (mn < 0) goto fail;
+
+    if (mn == 6 && memcmp(magic, "\xFD" "7zXZ\0", 6) == 0) im->fmt = SDIMG_XZ;
+    else if (mn >= 4 && memcmp(magic, "\x28\xB5\x2F\xFD", 4) == 0) im->fmt = SDIMG_ZSTD;
+    else im->fmt = SDIMG_RAW;
+
+    posix_fadvise(im->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    switch (im->fmt) {
+    case SDIMG_RAW:
+        if (S_ISBLK(st.st_mode)) {
+            if (ioctl(im->fd, BLKGETSIZE64, &im->size) != 0) goto fail;
+        } else {
+            im->size = (uint64_t)st.st_size;
+        }
+        if (start_threads(im, raw_thread, 1) != 0) goto fail;
+        break;
+
+    case SDIMG_XZ:
+#ifdef HAVE_LZMA
+        im->dec_threads = threads;
+        if (start_threads(im, xz_thread, 1) != 0) goto fail;
+        break;
+#else
+        errno = ENOTSUP;
+        goto fail;
+#endif
+
+    case SDIMG_ZSTD:
+#ifdef HAVE_ZSTD
+    {
+        if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+            errno = EINVAL;
+            goto fail;
+        }
+        im->map_len = (size_t)st.st_size;
+        void *m = mmap(NULL, im->map_len, PROT_READ, MAP_PRIVATE, im->fd, 0);
+        if (m == MAP_FAILED) goto fail;
+        im->map = m;
+        madvise(m, im->map_len, MADV_SEQUENTIAL);
+
+        bool parallel = false;
+        if (zstd_scan(im, &parallel) != 0) goto fail;
+        if (parallel) {
+            int n = threads;
+            if (n > im->nslots) n = im->nslots;
+            if ((size_t)n > im->nframes) n = (int)im->nframes;
+            im->nchunks = im->nframes;
+            if (start_threads(im, zstd_frame_worker, n) != 0) goto fail;
+            im->dec_threads = im->nthreads;
+        } else {
+            if (start_threads(im, zstd_stream_thread, 1) != 0) goto fail;
+        }
+        break;
+    }
+#else
+        errno = ENOTSUP;
+        goto fail;
+#endif
+    }
+    return im;
+
+fail:
+    {
+        int e = errno;
+        sdimg_close(im);
+        errno = e;
+    }
+    return NULL;
+}
+
+void sdimg_close(sdimg *im) {
+    if (!im) return;
+
+    pthread_mutex_lock(&im->mu);
+    im->stop = true;
+    pthread_cond_broadcast(&im->cv_space);
+    pthread_cond_broadcast(&im->cv_data);
+    pthread_mutex_unlock(&im->mu);
+    for (int i = 0; i < im->nthreads; i++) pthread_join(im->threads[i], NULL);
+
+    for (int i = 0; i < RING_MAX; i++) sdpool_put(im->slots[i].buf, im->slots[i].cap);
+    free(im->frames);
+    if (im->map) munmap((void *)im->map, im->map_len);
+    if (im->fd >= 0) close(im->fd);
+
+    pthread_cond_destroy(&im->cv_data);
+    pthread_cond_destroy(&im->cv_space);
+    pthread_mutex_destroy(&im->mu);
+    free(im);
+}
+
+sdimg_format sdimg_format_of(const sdimg *im) { return im->fmt; }
+uint64_t     sdimg_size(const sdimg *im)      { return im->size; }
+int          sdimg_threads(const sdimg *im)   { return im->dec_threads; }
+
+const char *sdimg_format_name(sdimg_format fmt) {
+    switch (fmt) {
+    case SDIMG_XZ:   return "xz";
+    case SDIMG_ZSTD: return "zstd";
+    default:         return "raw";
+    }
+}
+
+ssize_t sdimg_fill(void *ctx, uint64_t off, void *buf, size_t len) {
+    (void)off;
+    sdimg *im = ctx;
+    size_t got = 0;
+
+    pthread_mutex_lock(&im->mu);
+    while (got < len) {
+        if (im->err) {
+            int e = im->err;
+            pthread_mutex_unlock(&im->mu);
+            errno = e;
+            return -1;
+        }
+        if (im->read_seq >= im->nchunks) break;
+
+        img_slot *s = &im->slots[im->read_seq % (uint64_t)im->nslots];
+        if (!s->ready) {
+            pthread_cond_wait(&im->cv_data, &im->mu);
+            continue;
+        }
+
+        /* The slot is ours until we hand it back; copy unlocked. */
+        size_t n = s->len - s->pos;
+        if (n > len - got) n = len - got;
+        pthread_mutex_unlock(&im->mu);
+        memcpy((char *)buf + got, (const char *)s->buf + s->pos, n);
+        pthread_mutex_lock(&im->mu);
+
+        s->pos += n;
+        got += n;
+        if (s->pos == s->len) {
+            s->ready = false;
+            im->read_seq++;
+            pthread_cond_broadcast(&im->cv_space);
+        }
+    }
+    pthread_mutex_unlock(&im->mu);
+    return (ssize_t)got;
+}
@@ -0,0 +1,43 @@
+#ifndef SDIMG_H
+#define SDIMG_H
+
+/* ============================================================
+   sdimg – golden image sources for SDPrep
+   Raw, .xz and .zst images are decoded on background threads
+   into a bounded ring of aligned buffers; sdimg_fill() drains
+   the ring in order and plugs straight into sdio_write().
+   ============================================================ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef enum {
+    SDIMG_RAW,
+    SDIMG_XZ,
+    SDIMG_ZSTD
+} sdimg_format;
+
+typedef struct sdimg sdimg;
+
+/* Open an image, detecting the format from its magic bytes. threads <= 0
+   picks one per online CPU. Returns NULL with errno set (ENOTSUP for a
+   compressed format this build lacks). */
+sdimg *sdimg_open(const char *path, int threads);
+void   sdimg_close(sdimg *im);
+
+sdimg_format sdimg_format_of(const sdimg *im);
+const char  *sdimg_format_name(sdimg_format fmt);
+
+/* Decoded size in bytes, 0 if the container does not record it. */
+uint64_t sdimg_size(const sdimg *im);
+
+/* Decoder threads actually in use. */
+int sdimg_threads(const sdimg *im);
+
+/* sdio_fill_fn: next len bytes of decoded image (off is ignored, data is
+   strictly sequential). Short only at end; -1 with errno on decode error
+   (EBADMSG for corrupt input). */
+ssize_t sdimg_fill(void *im, uint64_t off, void *buf, size_t len);
+
+#endif /* SDIMG_H */
@@ -0,0 +1,192 @@
+#define _GNU_SOURCE
+#include "sdinhibit.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* One rule file per job, "90-sdprep-<pid>.rules": after udisks' own
+   80-udisks2.rules, so our properties win. The guardian holds the read
+   end of a pipe whose write end only the job has; EOF means the job is
+   gone, however it went. Rules of jobs killed together with their
+   guardian (a reboot clears /run anyway) are swept by the next job. */
+
+#define RULE_FMT "%s/90-sdprep-%ld.rules"
+
+static pid_t guardian = -1;
+static int   guard_fd = -1;
+static char  rule[PATH_MAX];
+static char **names;     /* kernel names, "sdb" */
+static int   nnames;
+
+static void run_quiet(char *const argv[]) {
+    pid_t pid = fork();
+    if (pid < 0) return;
+    if (pid == 0) {
+        int null = open("/dev/null", O_RDWR);
+        if (null >= 0) {
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    int st;
+    while (waitpid(pid, &st, 0) < 0 && errno == EINTR) {}
+}
+
+/* Load the rules and have udisks look at the devices again. */
+static void reload(void) {
+    char *ctl[] = { "udevadm", "control", "--reload", NULL };
+    run_quiet(ctl);
+    for (int i = 0; i < nnames; i++) {
+        char disk[64], parts[72];
+        snprintf(disk, sizeof(disk), "--sysname-match=%s", names[i]);
+        snprintf(parts, sizeof(parts), "--sysname-match=%s*", names[i]);
+        char *trig[] = { "udevadm", "trigger", "--action=change", disk, parts, NULL };
+        run_quiet(trig);
+    }
+    char *settle[] = { "udevadm", "settle", NULL };
+    run_quiet(settle);
+}
+
+/* Rules whose job no longer runs. */
+static void sweep(void) {
+    DIR *dir = opendir(SDINHIBIT_DIR);
+    if (!dir) return;
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+        long pid;
+        char tail[16];
+        if (sscanf(de->d_name, "90-sdprep-%ld.%15s", &pid, tail) != 2 ||
+            strcmp(tail, "rules") != 0 || pid <= 0)
+            continue;
+        if (kill((pid_t)pid, 0) == 0 || errno != ESRCH) continue;
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", SDINHIBIT_DIR, de->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+}
+
+static int write_rule(long pid) {
+    char tmp[PATH_MAX + 8];
+    snprintf(rule, sizeof(rule), RULE_FMT, SDINHIBIT_DIR, pid);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", rule);   /* udev reads only *.rules */
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) return -1;
+
+    fprintf(fp, "# sdprep job %ld: no automounting until it ends\n", pid);
+    for (int i = 0; i < nnames; i++) {
+        /* mmcblk0 -> mmcblk0p1, sdb -> sdb1 */
+        size_t len = strlen(names[i]);
+        bool digit = len && names[i][len - 1] >= '0' && names[i][len - 1] <= '9';
+        fprintf(fp, "SUBSYSTEM==\"block\", KERNEL==\"%s|%s%s[0-9]*\", "
+                    "ENV{UDISKS_AUTO}=\"0\", ENV{UDISKS_IGNORE}=\"1\"\n",
+                names[i], names[i], digit ? "p" : "");
+    }
+    if (fclose(fp) != 0 || rename(tmp, rule) != 0) {
+        int e = errno;
+        unlink(tmp);
+        errno = e;
+        return -1;
+    }
+    return 0;
+}
+
+/* The guardian: out of the job's session (an abort signals the job's
+   whole process group), holding no descriptor but the pipe. */
+static void guard(int fd) {
+    setsid();
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, SIG_IGN);
+    signal(SIGHUP, SIG_IGN);
+
+    DIR *dir = opendir("/proc/self/fd");
+    if (dir) {
+        int self = dirfd(dir);
+        struct dirent *de;
+        while ((de = readdir(dir))) {
+            int n = atoi(de->d_name);
+            if (n > STDERR_FILENO && n != fd && n != self) close(n);
+        }
+        closedir(dir);
+    }
+    int null = open("/dev/null", O_RDWR);
+    if (null >= 0) {
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        if (null > STDERR_FILENO) close(null);
+    }
+
+    char c;
+    ssize_t r;
+    while ((r = read(fd, &c, 1)) != 0)
+        if (r < 0 && errno != EINTR) break;
+    unlink(rule);
+    reload();
+    _exit(0);
+}
+
+int sdinhibit_begin(char *const *devs, int n) {
+    if (guard_fd >= 0 || n <= 0) return 0;
+    struct stat st;
+    if (stat("/run/udev", &st) != 0) return 0;
+    if (mkdir(SDINHIBIT_DIR, 0755) != 0 && errno != EEXIST) return -1;
+    sweep();
+
+    names = calloc((size_t)n, sizeof(*names));
+    if (!names) return -1;
+    for (int i = 0; i < n; i++) {
+        char *real = realpath(devs[i], NULL);
+        const char *base = strrchr(real ? real : devs[i], '/');
+        names[nnames] = strdup(base ? base + 1 : devs[i]);
+        free(real);
+        if (names[nnames]) nnames++;
+    }
+    if (write_rule((long)getpid()) != 0) return -1;
+
+    int pfd[2];
+    if (pipe2(pfd, O_CLOEXEC) != 0) {
+        unlink(rule);
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        int e = errno;
+        close(pfd[0]);
+        close(pfd[1]);
+        unlink(rule);
+        errno = e;
+        return -1;
+    }
+    if (pid == 0) {
+        close(pfd[1]);
+        guard(pfd[0]);
+    }
+    close(pfd[0]);
+    guardian = pid;
+    guard_fd = pfd[1];
+
+    reload();
+    return 0;
+}
+
+void sdinhibit_end(void) {
+    if (guard_fd < 0) return;
+    close(guard_fd);
+    guard_fd = -1;
+    int st;
+    while (waitpid(guardian, &st, 0) < 0 && errno == EINTR) {}
+    guardian = -1;
+}
@@ -0,0 +1,26 @@
+#ifndef SDINHIBIT_H
+#define SDINHIBIT_H
+
+/* ============================================================
+   sdinhibit – no automounting of a job's devices
+   A transient udev rule marks exactly the job's disks and
+   their partitions UDISKS_AUTO=0 and UDISKS_IGNORE=1, so a
+   desktop neither remounts a card the job has unmounted nor
+   mounts the partitions the job creates. A guardian process
+   removes the rule once the job's end of a pipe closes: on
+   exit, abort or crash alike.
+   ============================================================ */
+
+/* Where the rules go; udev reads this directory besides /etc and /usr. */
+#define SDINHIBIT_DIR "/run/udev/rules.d"
+
+/* Inhibit automounting of devs[0..n) until this process ends (or
+   sdinhibit_end()). Rules left by jobs that are gone are removed first.
+   -1 with errno if the rule cannot be written; without udev there is
+   nothing to inhibit and that is not an error. */
+int  sdinhibit_begin(char *const *devs, int n);
+
+/* Release now and wait until the rule is gone. */
+void sdinhibit_end(void);
+
+#endif /* SDINHIBIT_H */
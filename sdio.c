@@ -0,0 +1,1024 @@
+#define _GNU_SOURCE
+#include "sdio.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sdpool.h"
+
+/* ============================================================
+   Write engine
+   The producer (caller's thread) pulls data from the source in
+   block_size pieces into a small ring of aligned buffers;
+   queue_depth worker threads pwrite them concurrently.
+
+   Sparse jobs carry a block map: unmapped ranges are discarded
+   up front and skipped by the workers, and all-zero runs in the
+   data are handed to the device's own zeroing where it has one.
+
+   A job on an unknown model starts by running its own first
+   few hundred MiB under different parameters (calibration),
+   so tuning costs no extra writes. Throughput is then watched
+   per window and a sustained drop triggers a re-evaluation.
+
+   Buffered writes are queued for writeback as soon as they
+   land, and the producer waits for the data DIRTY_MAX behind
+   it to reach the card, so the page cache never holds more
+   than that per device and the final flush is short.
+
+   Abort is checked before every request. Requests on a device
+   of known speed are sliced so that one round in flight takes
+   about ABORT_BUDGET, which bounds how long an abort waits for
+   the drain (never below SLICE_MIN per request, though).
+   ============================================================ */
+
+#define CALIBRATE_MIN   (512 * SDIO_MIB)  /* job must be this big to calibrate */
+#define TRIAL_MIN       (16 * SDIO_MIB)
+#define TRIAL_MAX       (64 * SDIO_MIB)
+#define WINDOW_BYTES    (64 * SDIO_MIB)
+#define SLOW_RATIO      0.5               /* window below this x expected is slow */
+#define SLOW_WINDOWS    2                 /* consecutive slow windows before retune */
+#define MAX_RETUNES     2
+#define ZERO_GRAN       (64 * SDIO_KIB)   /* zero detection granule */
+#define DIRTY_MAX       (32 * SDIO_MIB)   /* buffered data allowed ahead of the media */
+#define ABORT_BUDGET    0.15              /* s of device time per round of requests */
+#define SLICE_MIN       (512 * SDIO_KIB)
+
+static const sdio_params default_params = { 1024 * SDIO_KIB, 4, true, 0.0 };
+
+typedef struct {
+    uint64_t     pos;      /* next device offset to write */
+    uint64_t     end;
+    uint64_t     base;     /* job start, for progress */
+    bool         eof;      /* source ran dry */
+    sdio_fill_fn fill;
+    void        *ctx;
+    const sdio_sparse *sp;
+} sdio_job;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sdio_logf(sdio_dev *d, const char *fmt, ...) {
+    if (!d->log) return;
+    char msg[512];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    d->log(d->log_ctx, msg);
+}
+
+void sdio_params_str(const sdio_params *p, char *out, size_t outsz) {
+    snprintf(out, outsz, "%zuKiB x QD%d %s",
+             (size_t)(p->block_size / SDIO_KIB), p->queue_depth,
+             p->direct ? "direct" : "buffered");
+}
+
+static int pwrite_full(int fd, const void *buf, size_t len, uint64_t off) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, (off_t)off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) { errno = EIO; return -1; }
+        p += n; len -= (size_t)n; off += (uint64_t)n;
+    }
+    return 0;
+}
+
+static int pread_full(int fd, void *buf, size_t len, uint64_t off) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, (off_t)off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) { errno = EIO; return -1; }
+        p += n; len -= (size_t)n; off += (uint64_t)n;
+    }
+    return 0;
+}
+
+/* ------------------------------------------------------------
+   Device identity (model key for the tuning cache)
+   ------------------------------------------------------------ */
+static void read_sysfs_str(const char *path, char *out, size_t outsz) {
+    out[0] = 0;
+    FILE *fp = fopen(path, "r");
+    if (!fp) return;
+    if (fgets(out, (int)outsz, fp)) {
+        /* Collapse whitespace so the key stays one TSV field. */
+        size_t j = 0;
+        bool prev_space = true;
+        for (size_t i = 0; out[i]; i++) {
+            unsigned char c = (unsigned char)out[i];
+            if (isspace(c)) {
+                if (!prev_space) out[j++] = ' ';
+                prev_space = true;
+            } else {
+                out[j++] = (char)c;
+                prev_space = false;
+            }
+        }
+        while (j > 0 && out[j - 1] == ' ') j--;
+        out[j] = 0;
+    }
+    fclose(fp);
+}
+
+static void build_ident(sdio_dev *d, const struct stat *st) {
+    if (S_ISREG(st->st_mode)) {
+        snprintf(d->ident, sizeof(d->ident), "file");
+        return;
+    }
+
+    char base[128], path[192];
+    char a[80], b[80], c[80];
+    snprintf(base, sizeof(base), "/sys/dev/block/%u:%u/device",
+             major(st->st_rdev), minor(st->st_rdev));
+
+    /* MMC/SD slot: the card itself is visible. */
+    snprintf(path, sizeof(path), "%s/name", base);
+    read_sysfs_str(path, a, sizeof(a));
+    if (a[0]) {
+        snprintf(path, sizeof(path), "%s/manfid", base);
+        read_sysfs_str(path, b, sizeof(b));
+        snprintf(path, sizeof(path), "%s/oemid", base);
+        read_sysfs_str(path, c, sizeof(c));
+        snprintf(d->ident, sizeof(d->ident), "mmc:%s:%s:%s", b, c, a);
+        return;
+    }
+
+    /* USB/SCSI reader: only the reader's model is known. */
+    snprintf(path, sizeof(path), "%s/vendor", base);
+    read_sysfs_str(path, a, sizeof(a));
+    snprintf(path, sizeof(path), "%s/model", base);
+    read_sysfs_str(path, b, sizeof(b));
+    if (a[0] || b[0]) {
+        snprintf(d->ident, sizeof(d->ident), "scsi:%s %s", a, b);
+        return;
+    }
+
+    snprintf(d->ident, sizeof(d->ident), "blk:%u", major(st->st_rdev));
+}
+
+/* ------------------------------------------------------------
+   Tuning cache: one "ident<TAB>bs<TAB>qd<TAB>direct<TAB>mbps"
+   line per model
+   ------------------------------------------------------------ */
+static void cache_path(char *out, size_t outsz) {
+    const char *dir = getenv("SDPREP_STATE_DIR");
+    if (!dir || !*dir) dir = SDIO_STATE_DIR;
+    snprintf(out, outsz, "%s/iotune.tsv", dir);
+}
+
+static bool cache_load(const char *ident, sdio_params *p) {
+    char path[512];
+    cache_path(path, sizeof(path));
+    FILE *fp = fopen(path, "r");
+    if (!fp) return false;
+
+    bool found = false;
+    char line[512];
+    while (fgets(line, sizeof(line), fp)) {
+        char *tab = strchr(line, '\t');
+        if (!tab) continue;
+        *tab = 0;
+        if (strcmp(line, ident) != 0) continue;
+
+        size_t bs = 0;
+        int qd = 0, direct = 0;
+        double mbps = 0.0;
+        if (sscanf(tab + 1, "%zu\t%d\t%d\t%lf", &bs, &qd, &direct, &mbps) != 4)
+            continue;
+        if (bs < 4096 || bs % 4096 || qd < 1 || qd > 64) continue;
+
+        p->block_size  = bs;
+        p->queue_depth = qd;
+        p->direct      = direct != 0;
+        p->mbps        = mbps;
+        found = true;
+    }
+    fclose(fp);
+    return found;
+}
+
+/* Parallel jobs store too: the rewrite is serialised on a lock file and
+   each process writes its own tmp file, so none renames another's
+   half-written one into place or drops its line. */
+static void cache_store(sdio_dev *d) {
+    char path[512], tmp[540], lock[528];
+    cache_path(path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    snprintf(lock, sizeof(lock), "%s.lock", path);
+
+    char dir[512];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash) {
+        *slash = 0;
+        if (mkdir(dir, 0755) != 0 && errno != EEXIST) return;
+    }
+
+    int lfd = open(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lfd < 0) {
+        sdio_logf(d, "io: cannot lock tuning cache %s: %s", lock, strerror(errno));
+        return;
+    }
+    while (flock(lfd, LOCK_EX) != 0 && errno == EINTR) {}
+
+    FILE *out = fopen(tmp, "w");
+    if (!out) {
+        sdio_logf(d, "io: cannot write tuning cache %s: %s", tmp, strerror(errno));
+        close(lfd);
+        return;
+    }
+
+    /* Carry over every other model's line unchanged. */
+    FILE *in = fopen(path, "r");
+    if (in) {
+        char line[512];
+        size_t n = strlen(d->ident);
+        while (fgets(line, sizeof(line), in)) {
+            if (strncmp(line, d->ident, n) == 0 && line[n] == '\t') continue;
+            fputs(line, out);
+        }
+        fclose(in);
+    }
+
+    const sdio_params *p = &d->params;
+    fprintf(out, "%s\t%zu\t%d\t%d\t%.1f\n",
+            d->ident, p->block_size, p->queue_depth, p->direct ? 1 : 0, p->mbps);
+
+    if (fclose(out) != 0 || rename(tmp, path) != 0) unlink(tmp);
+    close(lfd);   /* drops the lock */
+}
+
+/* Punching a hole in a block device maps to the device's write-zeroes
+   command and fails rather than falling back to writing zero pages, so
+   it is only worth trying where the queue advertises that command. */
+static sdio_zero_mode probe_zero_mode(const struct stat *st) {
+    if (S_ISREG(st->st_mode)) return SDIO_ZERO_PUNCH;
+
+    char path[128], val[32];
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/write_zeroes_max_bytes",
+             major(st->st_rdev), minor(st->st_rdev));
+    read_sysfs_str(path, val, sizeof(val));
+    return strtoull(val, NULL, 10) > 0 ? SDIO_ZERO_PUNCH : SDIO_ZERO_NONE;
+}
+
+/* ------------------------------------------------------------
+   Open / close
+   ------------------------------------------------------------ */
+static int open_dev(sdio_dev *d, const char *path, bool write) {
+    struct stat st;
+    if (stat(path, &st) != 0) return -1;
+    if (!S_ISBLK(st.st_mode) && !S_ISREG(st.st_mode)) {
+        errno = ENOTBLK;
+        return -1;
+    }
+
+    snprintf(d->path, sizeof(d->path), "%s", path);
+    d->fd = d->dfd = -1;
+    d->blockdev = S_ISBLK(st.st_mode);
+
+    /* O_EXCL on a block device fails while anything has it mounted. */
+    int mode = write ? O_RDWR : O_RDONLY;
+    int flags = mode | O_CLOEXEC | (write && S_ISBLK(st.st_mode) ? O_EXCL : 0);
+    d->fd = open(path, flags);
+    if (d->fd < 0) return -1;
+
+    /* The exclusive claim is held by fd; the direct one must not repeat it. */
+    d->dfd = open(path, mode | O_CLOEXEC | O_DIRECT);
+
+    if (S_ISBLK(st.st_mode)) {
+        int ss = 0, ro = 0;
+        if (write && ioctl(d->fd, BLKROGET, &ro) == 0 && ro) errno = EROFS;
+        if (ro || ioctl(d->fd, BLKGETSIZE64, &d->size) != 0) {
+            int e = errno;
+            sdio_close(d);
+            errno = e;
+            return -1;
+        }
+        d->sector = (ioctl(d->fd, BLKSSZGET, &ss) == 0 && ss > 0) ? (unsigned)ss : 512;
+    } else {
+        d->size = (uint64_t)st.st_size;
+        d->sector = 512;
+    }
+
+    build_ident(d, &st);
+    d->zero_mode = probe_zero_mode(&st);
+
+    d->params = default_params;
+    if (d->dfd < 0) d->params.direct = false;
+    d->tuned = false;
+    d->retunes = 0;
+    return 0;
+}
+
+int sdio_open(sdio_dev *d, const char *path) {
+    return open_dev(d, path, true);
+}
+
+int sdio_open_read(sdio_dev *d, const char *path) {
+    return open_dev(d, path, false);
+}
+
+/* What lsblk -b reports: sysfs counts 512-byte sectors whatever the
+   logical sector size is. */
+int sdio_probe(sdio_dev *d, const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0) return -1;
+    if (!S_ISBLK(st.st_mode) && !S_ISREG(st.st_mode)) {
+        errno = ENOTBLK;
+        return -1;
+    }
+
+    snprintf(d->path, sizeof(d->path), "%s", path);
+    d->fd = d->dfd = -1;
+    d->blockdev = S_ISBLK(st.st_mode);
+    d->size = (uint64_t)st.st_size;
+    d->sector = 512;
+    if (d->blockdev) {
+        char sys[128], val[32];
+        snprintf(sys, sizeof(sys), "/sys/dev/block/%u:%u/size",
+                 major(st.st_rdev), minor(st.st_rdev));
+        read_sysfs_str(sys, val, sizeof(val));
+        if (!val[0]) {
+            errno = ENODEV;
+            return -1;
+        }
+        d->size = strtoull(val, NULL, 10) * 512;
+        snprintf(sys, sizeof(sys), "/sys/dev/block/%u:%u/queue/logical_block_size",
+                 major(st.st_rdev), minor(st.st_rdev));
+        read_sysfs_str(sys, val, sizeof(val));
+        if (strtoul(val, NULL, 10) > 0) d->sector = (unsigned)strtoul(val, NULL, 10);
+    }
+
+    build_ident(d, &st);
+    d->zero_mode = probe_zero_mode(&st);
+    d->params = default_params;
+    d->tuned = cache_load(d->ident, &d->params);
+    d->retunes = 0;
+    return 0;
+}
+
+void sdio_close(sdio_dev *d) {
+    if (d->dfd >= 0) close(d->dfd);
+    if (d->fd >= 0) close(d->fd);
+    d->fd = d->dfd = -1;
+}
+
+int sdio_flush(sdio_dev *d) {
+    return fdatasync(d->fd);
+}
+
+int sdio_discard(sdio_dev *d, uint64_t off, uint64_t len) {
+    uint64_t a = (off + d->sector - 1) / d->sector * d->sector;
+    uint64_t b = (off + len) / d->sector * d->sector;
+    if (b <= a) return 0;
+
+    int rc;
+    if (d->blockdev) {
+        uint64_t range[2] = { a, b - a };
+        rc = ioctl(d->fd, BLKDISCARD, range);
+    } else {
+        rc = fallocate(d->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                       (off_t)a, (off_t)(b - a));
+    }
+    if (rc != 0 && errno == EOPNOTSUPP) return 0;
+    return rc;
+}
+
+bool sdio_is_zero(const void *buf, size_t len) {
+    /* GCC vector extension: SSE2/AVX2/NEON depending on the target. */
+    typedef unsigned long long zvec __attribute__((vector_size(32)));
+    const unsigned char *p = buf;
+
+    while (len && ((uintptr_t)p & 31)) {
+        if (*p) return false;
+        p++; len--;
+    }
+    const zvec *v = (const zvec *)(const void *)p;
+    for (; len >= 128; v += 4, len -= 128) {
+        zvec acc = v[0] | v[1] | v[2] | v[3];
+        if (acc[0] | acc[1] | acc[2] | acc[3]) return false;
+    }
+    p = (const unsigned char *)v;
+    while (len) {
+        if (*p) return false;
+        p++; len--;
+    }
+    return true;
+}
+
+/* ------------------------------------------------------------
+   One segment at fixed parameters
+   ------------------------------------------------------------ */
+typedef struct {
+    sdio_dev          *d;
+    const sdio_params *p;
+    const sdio_sparse *sp;
+    pthread_mutex_t    mu;
+    pthread_cond_t     cv_free;
+    pthread_cond_t     cv_ready;
+
+    int       nslots;
+    void    **buf;
+    size_t   *len;
+    uint64_t *off;
+
+    int      *freeq;    /* stack of free slots */
+    int       nfree;
+    int      *readyq;   /* FIFO of filled slots */
+    int       rhead, rcount;
+
+    uint64_t  completed;
+    bool      done;
+    int       err;
+
+    size_t    slice;    /* largest single pwrite */
+    uint64_t  cut;      /* lowest offset left unwritten by an abort */
+} seg_ctx;
+
+bool sdio_cancelled(const sdio_dev *d) {
+    return d->cancel && *d->cancel;
+}
+
+static void note_cut(seg_ctx *s, uint64_t off) {
+    pthread_mutex_lock(&s->mu);
+    if (off < s->cut) s->cut = off;
+    pthread_mutex_unlock(&s->mu);
+}
+
+/* Is off mapped? *edge gets the end of its mapped run, or the start of
+   the next one (UINT64_MAX if none). */
+static bool map_lookup(const sdio_sparse *sp, uint64_t off, uint64_t *edge) {
+    size_t lo = 0, hi = sp->nmap;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (sp->map[mid].off + sp->map[mid].len <= off) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == sp->nmap) {
+        *edge = UINT64_MAX;
+        return false;
+    }
+    if (sp->map[lo].off <= off) {
+        *edge = sp->map[lo].off + sp->map[lo].len;
+        return true;
+    }
+    *edge = sp->map[lo].off;
+    return false;
+}
+
+/* Start writeback of a buffered range without waiting for it. Errors
+   surface at the next wait or flush. */
+static void wb_start(int fd, uint64_t off, uint64_t len) {
+    sync_file_range(fd, (off64_t)off, (off64_t)len, SYNC_FILE_RANGE_WRITE);
+}
+
+/* Wait until a buffered range is on the media. Only a failed write is an
+   error; a descriptor without sync_file_range support is not. */
+static int wb_wait(int fd, uint64_t off, uint64_t len) {
+    if (sync_file_range(fd, (off64_t)off, (off64_t)len,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER) == 0) return 0;
+    return errno == EIO || errno == ENOSPC ? -1 : 0;
+}
+
+static int write_range(seg_ctx *s, const char *buf, size_t len, uint64_t off,
+                       sdio_stats *st) {
+    /* Sub-sector pieces cannot go through O_DIRECT. */
+    unsigned sector = s->d->sector;
+    bool aligned = len % sector == 0 && off % sector == 0;
+    int fd = (s->p->direct && aligned) ? s->d->dfd : s->d->fd;
+    for (size_t pos = 0; pos < len; ) {
+        if (sdio_cancelled(s->d)) {
+            note_cut(s, off + pos);
+            errno = ECANCELED;
+            return -1;
+        }
+        size_t n = len - pos < s->slice ? len - pos : s->slice;
+        if (pwrite_full(fd, buf + pos, n, off + pos) != 0) return -1;
+        if (fd == s->d->fd) wb_start(fd, off + pos, n);
+        st->written += n;
+        pos += n;
+    }
+    return 0;
+}
+
+static bool zero_range(sdio_dev *d, uint64_t off, uint64_t len) {
+    if (__atomic_load_n(&d->zero_mode, __ATOMIC_RELAXED) != SDIO_ZERO_PUNCH) return false;
+    if (off % 4096 || len % 4096) return false;
+    if (fallocate(d->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  (off_t)off, (off_t)len) == 0) return true;
+    if (errno == EOPNOTSUPP)
+        __atomic_store_n(&d->zero_mode, SDIO_ZERO_NONE, __ATOMIC_RELAXED);
+    return false;
+}
+
+/* Write a mapped range, letting the device zero all-zero runs. */
+static int write_mapped(seg_ctx *s, const char *buf, size_t len, uint64_t off,
+                        sdio_stats *st) {
+    if (!s->sp || !s->sp->skip_zero ||
+        __atomic_load_n(&s->d->zero_mode, __ATOMIC_RELAXED) != SDIO_ZERO_PUNCH)
+        return write_range(s, buf, len, off, st);
+
+    size_t pos = 0;
+    while (pos < len) {
+        size_t g = ZERO_GRAN - (size_t)((off + pos) % ZERO_GRAN);
+        if (g > len - pos) g = len - pos;
+        bool z = sdio_is_zero(buf + pos, g);
+
+        size_t run = g;
+        while (pos + run < len) {
+            size_t g2 = len - pos - run < ZERO_GRAN ? len - pos - run : ZERO_GRAN;
+            if (sdio_is_zero(buf + pos + run, g2) != z) break;
+            run += g2;
+        }
+
+        if (z && zero_range(s->d, off + pos, run)) {
+            st->zeroed += run;
+        } else if (write_range(s, buf + pos, run, off + pos, st) != 0) {
+            return -1;
+        }
+        pos += run;
+    }
+    return 0;
+}
+
+static int write_slot(seg_ctx *s, int i, sdio_stats *st) {
+    const char *buf = s->buf[i];
+    uint64_t off = s->off[i];
+    size_t len = s->len[i];
+
+    if (!s->sp || !s->sp->map) return write_mapped(s, buf, len, off, st);
+
+    size_t pos = 0;
+    while (pos < len) {
+        uint64_t edge;
+        bool mapped = map_lookup(s->sp, off + pos, &edge);
+        size_t run = edge - (off + pos) < len - pos ? (size_t)(edge - (off + pos)) : len - pos;
+        if (mapped) {
+            if (write_mapped(s, buf + pos, run, off + pos, st) != 0) return -1;
+        } else {
+            st->skipped += run;
+        }
+        pos += run;
+    }
+    return 0;
+}
+
+static void *seg_worker(void *arg) {
+    seg_ctx *s = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&s->mu);
+        while (s->rcount == 0 && !s->done)
+            pthread_cond_wait(&s->cv_ready, &s->mu);
+        if (s->rcount == 0) {
+            pthread_mutex_unlock(&s->mu);
+            break;
+        }
+        int i = s->readyq[s->rhead];
+        s->rhead = (s->rhead + 1) % s->nslots;
+        s->rcount--;
+        bool skip = s->err != 0;
+        if (skip && s->off[i] < s->cut) s->cut = s->off[i];
+        pthread_mutex_unlock(&s->mu);
+
+        sdio_stats st = { 0, 0, 0 };
+        int rc = 0, e = 0;
+        if (!skip && sdio_cancelled(s->d)) {
+            note_cut(s, s->off[i]);
+            rc = -1;
+            e = ECANCELED;
+        } else if (!skip) {
+            rc = write_slot(s, i, &st);
+            e = errno;
+        }
+
+        pthread_mutex_lock(&s->mu);
+        if (rc != 0 && !s->err) s->err = e ? e : EIO;
+        if (rc == 0 && !skip) s->completed += s->len[i];
+        s->d->stats.written += st.written;
+        s->d->stats.zeroed  += st.zeroed;
+        s->d->stats.skipped += st.skipped;
+        s->freeq[s->nfree++] = i;
+        pthread_cond_signal(&s->cv_free);
+        pthread_mutex_unlock(&s->mu);
+    }
+    return NULL;
+}
+
+static int run_segment(sdio_dev *d, const sdio_params *p, sdio_job *j, uint64_t len) {
+    seg_ctx s;
+    memset(&s, 0, sizeof(s));
+    s.d = d;
+    s.p = p;
+    s.sp = j->sp;
+    s.nslots = p->queue_depth * 2;
+    s.cut = UINT64_MAX;
+
+    /* One round of requests should drain within the abort budget. */
+    s.slice = p->block_size;
+    if (p->mbps > 0) {
+        double fit = p->mbps * 1e6 * ABORT_BUDGET / (p->queue_depth > 0 ? p->queue_depth : 1);
+        size_t sl = fit < (double)SLICE_MIN ? SLICE_MIN : (size_t)fit / 4096 * 4096;
+        if (sl < s.slice) s.slice = sl;
+    }
+
+    s.buf    = calloc((size_t)s.nslots, sizeof(*s.buf));
+    s.len    = calloc((size_t)s.nslots, sizeof(*s.len));
+    s.off    = calloc((size_t)s.nslots, sizeof(*s.off));
+    s.freeq  = calloc((size_t)s.nslots, sizeof(*s.freeq));
+    s.readyq = calloc((size_t)s.nslots, sizeof(*s.readyq));
+    pthread_t *tids = calloc((size_t)p->queue_depth, sizeof(*tids));
+
+    int rc = -1, e = ENOMEM;
+    if (!s.buf || !s.len || !s.off || !s.freeq || !s.readyq || !tids) goto out;
+    if (sdpool_get_many(s.buf, s.nslots, p->block_size) != 0) {
+        free(s.buf);
+        s.buf = NULL;
+        goto out;
+    }
+    for (int i = 0; i < s.nslots; i++) s.freeq[s.nfree++] = i;
+
+    pthread_mutex_init(&s.mu, NULL);
+    pthread_cond_init(&s.cv_free, NULL);
+    pthread_cond_init(&s.cv_ready, NULL);
+
+    int started = 0;
+    for (; started < p->queue_depth; started++) {
+        if (pthread_create(&tids[started], NULL, seg_worker, &s) != 0) break;
+    }
+
+    uint64_t seg_start = j->pos;
+    uint64_t end = j->pos + len;
+    int fill_err = started ? 0 : EAGAIN;
+
+    /* Every slot older than the ring is written, so data this far behind
+       the producer can be waited on. */
+    uint64_t lag = (uint64_t)s.nslots * p->block_size;
+    if (lag < DIRTY_MAX) lag = DIRTY_MAX;
+    uint64_t clean = j->pos;
+
+    while (!fill_err && j->pos < end) {
+        size_t want = (size_t)(end - j->pos < p->block_size ? end - j->pos : p->block_size);
+
+        if (sdio_cancelled(d)) {
+            fill_err = ECANCELED;
+            break;
+        }
+        if (!p->direct && j->pos > clean + lag) {
+            if (wb_wait(d->fd, clean, j->pos - lag - clean) != 0) {
+                fill_err = errno;
+                break;
+            }
+            clean = j->pos - lag;
+        }
+
+        pthread_mutex_lock(&s.mu);
+        while (s.nfree == 0 && !s.err)
+            pthread_cond_wait(&s.cv_free, &s.mu);
+        if (s.err) {
+            pthread_mutex_unlock(&s.mu);
+            break;
+        }
+        int i = s.freeq[--s.nfree];
+        uint64_t completed = s.completed;
+        pthread_mutex_unlock(&s.mu);
+
+        if (d->progress)
+            d->progress(d->progress_ctx, seg_start - j->base + completed, j->end - j->base);
+
+        ssize_t n = j->fill(j->ctx, j->pos, s.buf[i], want);
+        if (n <= 0) {
+            if (n < 0) fill_err = errno ? errno : EIO;
+            else j->eof = true;
+            pthread_mutex_lock(&s.mu);
+            s.freeq[s.nfree++] = i;
+            pthread_mutex_unlock(&s.mu);
+            break;
+        }
+
+        pthread_mutex_lock(&s.mu);
+        s.len[i] = (size_t)n;
+        s.off[i] = j->pos;
+        s.readyq[(s.rhead + s.rcount) % s.nslots] = i;
+        s.rcount++;
+        pthread_cond_signal(&s.cv_ready);
+        pthread_mutex_unlock(&s.mu);
+
+        j->pos += (uint64_t)n;
+        if ((size_t)n < want) {
+            j->eof = true;
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&s.mu);
+    s.done = true;
+    pthread_cond_broadcast(&s.cv_ready);
+    pthread_mutex_unlock(&s.mu);
+    for (int t = 0; t < started; t++) pthread_join(tids[t], NULL);
+
+    pthread_cond_destroy(&s.cv_ready);
+    pthread_cond_destroy(&s.cv_free);
+    pthread_mutex_destroy(&s.mu);
+
+    e = fill_err ? fill_err : s.err;
+    rc = e ? -1 : 0;
+    if (e == ECANCELED || (e && sdio_cancelled(d))) {
+        e = ECANCELED;
+        d->reached = s.cut < j->pos ? s.cut : j->pos;
+    }
+
+out:
+    if (s.buf) sdpool_put_many(s.buf, s.nslots, p->block_size);
+    free(s.buf); free(s.len); free(s.off);
+    free(s.freeq); free(s.readyq); free(tids);
+    if (rc != 0) errno = e;
+    return rc;
+}
+
+/* ------------------------------------------------------------
+   Calibration
+   ------------------------------------------------------------ */
+static uint64_t trial_bytes(const sdio_params *p) {
+    uint64_t n = (uint64_t)p->block_size * (uint64_t)p->queue_depth * 8;
+    if (n < TRIAL_MIN) n = TRIAL_MIN;
+    if (n > TRIAL_MAX) n = TRIAL_MAX;
+    return n;
+}
+
+/* Run the next stretch of the job under p and time it to the media.
+   Returns MB/s, 0 when the job has no room left for a fair trial,
+   -1 on I/O error. */
+static double run_trial(sdio_dev *d, const sdio_params *p, sdio_job *j) {
+    uint64_t n = trial_bytes(p);
+    if (j->eof || j->end - j->pos < n) return 0.0;
+
+    uint64_t start = j->pos, written = d->stats.written;
+    double t0 = now_sec();
+    if (run_segment(d, p, j, n) != 0) return -1.0;
+    if (sdio_flush(d) != 0) return -1.0;
+    double dt = now_sec() - t0;
+
+    /* A short or mostly skipped stretch is not comparable. */
+    uint64_t done = d->stats.written - written;
+    if (j->pos - start < n || done < n / 2) return 0.0;
+    return dt > 0 ? (double)done / dt / 1e6 : 0.0;
+}
+
+typedef struct {
+    sdio_params tried[16];   /* measured candidates, mbps filled in */
+    int         ntried;
+} trial_log;
+
+static bool same_params(const sdio_params *a, const sdio_params *b) {
+    return a->block_size == b->block_size &&
+           a->queue_depth == b->queue_depth &&
+           a->direct == b->direct;
+}
+
+/* Try cand unless already measured; keep it in *best if faster.
+   Returns -1 on I/O error, 0 when out of room, 1 otherwise. */
+static int try_candidate(sdio_dev *d, sdio_job *j, trial_log *tl,
+                         const sdio_params *cand, sdio_params *best) {
+    if (cand->direct && d->dfd < 0) return 1;
+    for (int i = 0; i < tl->ntried; i++) {
+        if (same_params(&tl->tried[i], cand)) return 1;
+    }
+
+    double mbps = run_trial(d, cand, j);
+    if (mbps < 0) return -1;
+    if (mbps == 0) return 0;
+
+    char desc[64];
+    sdio_params_str(cand, desc, sizeof(desc));
+    sdio_logf(d, "io: trial %s: %.1f MB/s", desc, mbps);
+
+    if (tl->ntried < (int)(sizeof(tl->tried) / sizeof(tl->tried[0]))) {
+        tl->tried[tl->ntried] = *cand;
+        tl->tried[tl->ntried++].mbps = mbps;
+    }
+    if (mbps > best->mbps) {
+        *best = *cand;
+        best->mbps = mbps;
+    }
+    return 1;
+}
+
+/* Coordinate descent over I/O mode, then request size, then queue depth,
+   starting from the current parameters. */
+static int calibrate(sdio_dev *d, sdio_job *j) {
+    static const size_t sizes[] = {
+        128 * SDIO_KIB, 256 * SDIO_KIB, 512 * SDIO_KIB, 1024 * SDIO_KIB, 4096 * SDIO_KIB
+    };
+    static const int depths[] = { 1, 2, 4, 8 };
+
+    sdio_params best = d->params;
+    best.mbps = 0.0;
+    sdio_params cand = best;
+    trial_log tl = { .ntried = 0 };
+    int rc = 1;
+
+    for (int m = 0; m < 2 && rc > 0; m++) {
+        cand = best.mbps > 0 ? best : d->params;
+        cand.direct = (m == 0);
+        rc = try_candidate(d, j, &tl, &cand, &best);
+    }
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]) && rc > 0; i++) {
+        cand = best;
+        cand.block_size = sizes[i];
+        rc = try_candidate(d, j, &tl, &cand, &best);
+    }
+    for (size_t i = 0; i < sizeof(depths) / sizeof(depths[0]) && rc > 0; i++) {
+        cand = best;
+        cand.queue_depth = depths[i];
+        rc = try_candidate(d, j, &tl, &cand, &best);
+    }
+
+    if (rc < 0) return -1;
+    if (best.mbps <= 0) return 0;   /* not a single complete trial */
+
+    d->params = best;
+    d->tuned = true;
+    return 1;
+}
+
+/* ------------------------------------------------------------
+   Public write path
+   ------------------------------------------------------------ */
+bool sdio_tune(sdio_dev *d) {
+    if (d->tuned) return true;
+    if (!cache_load(d->ident, &d->params)) return false;
+
+    if (d->params.direct && d->dfd < 0) d->params.direct = false;
+    d->tuned = true;
+
+    char desc[64];
+    sdio_params_str(&d->params, desc, sizeof(desc));
+    sdio_logf(d, "io: cached parameters for %s: %s (%.1f MB/s)",
+              d->ident, desc, d->params.mbps);
+    return true;
+}
+
+int sdio_write_at(sdio_dev *d, const void *buf, size_t len, uint64_t off) {
+    if (off > d->size || len > d->size - off) {
+        errno = ENOSPC;
+        return -1;
+    }
+    if (sdio_cancelled(d)) {
+        d->reached = off;
+        errno = ECANCELED;
+        return -1;
+    }
+    bool aligned = len % d->sector == 0 && off % d->sector == 0 &&
+                   (uintptr_t)buf % 4096 == 0;
+    int fd = (d->params.direct && aligned) ? d->dfd : d->fd;
+    if (pwrite_full(fd, buf, len, off) != 0) return -1;
+    if (fd == d->fd) {
+        /* Callers write mostly in order: bound what lags behind them. */
+        wb_start(fd, off, len);
+        if (off >= DIRTY_MAX && wb_wait(fd, off - DIRTY_MAX, len) != 0) return -1;
+    }
+    __atomic_add_fetch(&d->stats.written, len, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int sdio_read_at(sdio_dev *d, void *buf, size_t len, uint64_t off) {
+    if (sdio_cancelled(d)) {
+        d->reached = off;
+        errno = ECANCELED;
+        return -1;
+    }
+    bool aligned = len % d->sector == 0 && off % d->sector == 0 &&
+                   (uintptr_t)buf % 4096 == 0;
+    return pread_full(aligned && d->dfd >= 0 ? d->dfd : d->fd, buf, len, off);
+}
+
+int sdio_write(sdio_dev *d, uint64_t off, uint64_t len,
+               sdio_fill_fn fill, void *ctx) {
+    return sdio_write_sparse(d, off, len, fill, ctx, NULL);
+}
+
+int sdio_write_sparse(sdio_dev *d, uint64_t off, uint64_t len,
+                      sdio_fill_fn fill, void *ctx, const sdio_sparse *sp) {
+    if (off > d->size || (len && len > d->size - off)) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    sdio_job j = { off, len ? off + len : d->size, off, false, fill, ctx, sp };
+    char desc[64];
+
+    /* Unmapped ranges are never written: discard them in one pass. */
+    if (sp && sp->map && !sp->keep) {
+        uint64_t pos = j.pos;
+        for (size_t i = 0; i <= sp->nmap && pos < j.end; i++) {
+            uint64_t next = i < sp->nmap ? sp->map[i].off : j.end;
+            if (next > j.end) next = j.end;
+            if (next > pos && sdio_discard(d, pos, next - pos) != 0) return -1;
+            if (i < sp->nmap && sp->map[i].off + sp->map[i].len > pos)
+                pos = sp->map[i].off + sp->map[i].len;
+        }
+    }
+
+    sdio_tune(d);
+    bool batch = sp && sp->batch;
+
+    if (!batch && !d->tuned && j.end - j.pos >= CALIBRATE_MIN) {
+        sdio_logf(d, "io: calibrating %s", d->ident);
+        int rc = calibrate(d, &j);
+        if (rc < 0) return -1;
+        if (rc > 0) {
+            sdio_params_str(&d->params, desc, sizeof(desc));
+            sdio_logf(d, "io: chose %s (%.1f MB/s)", desc, d->params.mbps);
+            cache_store(d);
+        }
+    }
+
+    if (!d->tuned) {
+        sdio_params_str(&d->params, desc, sizeof(desc));
+        sdio_logf(d, "io: default parameters %s", desc);
+    }
+
+    double expect = d->params.mbps;
+    int slow = 0;
+
+    while (!j.eof && j.pos < j.end) {
+        uint64_t win = j.end - j.pos < WINDOW_BYTES ? j.end - j.pos : WINDOW_BYTES;
+        uint64_t written = d->stats.written;
+        double t0 = now_sec();
+
+        if (run_segment(d, &d->params, &j, win) != 0) return -1;
+        if (batch) continue;
+        /* Without this the window would time the page cache, not the card. */
+        if (!d->params.direct && sdio_flush(d) != 0) return -1;
+
+        /* Judge only windows that mostly carried data. */
+        double dt = now_sec() - t0;
+        uint64_t done = d->stats.written - written;
+        if (done < WINDOW_BYTES / 2 || dt <= 0) continue;
+
+        double mbps = (double)done / dt / 1e6;
+        if (expect <= 0) {
+            expect = mbps;
+            continue;
+        }
+        slow = (mbps < expect * SLOW_RATIO) ? slow + 1 : 0;
+
+        if (slow >= SLOW_WINDOWS && d->retunes < MAX_RETUNES &&
+            j.end - j.pos >= CALIBRATE_MIN / 2) {
+            d->retunes++;
+            slow = 0;
+            sdio_logf(d, "io: throughput fell to %.1f MB/s (expected %.1f), re-evaluating",
+                      mbps, expect);
+            int rc = calibrate(d, &j);
+            if (rc < 0) return -1;
+            if (rc > 0) {
+                sdio_params_str(&d->params, desc, sizeof(desc));
+                sdio_logf(d, "io: switched to %s (%.1f MB/s)", desc, d->params.mbps);
+                cache_store(d);
+            }
+            expect = d->params.mbps > 0 ? d->params.mbps : mbps;
+        }
+    }
+
+    if (d->progress) d->progress(d->progress_ctx, j.pos - j.base, j.end - j.base);
+    return 0;
+}
+
+static ssize_t fill_zero(void *ctx, uint64_t off, void *buf, size_t len) {
+    (void)ctx; (void)off;
+    memset(buf, 0, len);
+    return (ssize_t)len;
+}
+
+int sdio_zero(sdio_dev *d, uint64_t off, uint64_t len) {
+    if (len == 0) return 0;
+    return sdio_write(d, off, len, fill_zero, NULL);
+}
@@ -0,0 +1,151 @@
+#ifndef SDIO_H
+#define SDIO_H
+
+/* ============================================================
+   sdio – native block I/O engine for SDPrep
+   Large aligned requests, several in flight, buffered or
+   O_DIRECT, with per-model auto-tuning cached on disk.
+   ============================================================ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SDIO_KIB 1024ULL
+#define SDIO_MIB (1024ULL * 1024ULL)
+
+/* Default location of the tuning cache; SDPREP_STATE_DIR overrides it. */
+#define SDIO_STATE_DIR "/var/lib/sdprep"
+
+typedef struct {
+    size_t block_size;   /* bytes per write request */
+    int    queue_depth;  /* requests in flight */
+    bool   direct;       /* O_DIRECT instead of the page cache */
+    double mbps;         /* throughput measured when chosen, 0 if unknown */
+} sdio_params;
+
+/* A byte range on the device. */
+typedef struct {
+    uint64_t off;
+    uint64_t len;
+} sdio_extent;
+
+/* Sparse write options. Unmapped ranges are consumed from the source but
+   discarded on the device instead of written (contents undefined after).
+   With skip_zero, all-zero runs inside mapped ranges are zeroed by the
+   device itself when it can do so without a data transfer. With keep,
+   unmapped ranges are left exactly as they are on the device. With
+   batch the caller flushes: the write is neither flushed per window nor
+   timed, so it does not calibrate or re-evaluate the parameters. */
+typedef struct {
+    const sdio_extent *map;   /* sorted, non-overlapping; NULL = all mapped */
+    size_t             nmap;
+    bool               skip_zero;
+    bool               keep;
+    bool               batch;
+} sdio_sparse;
+
+/* Cumulative byte counters for one device. */
+typedef struct {
+    uint64_t written;   /* data transferred to the device */
+    uint64_t zeroed;    /* zero runs handed to the device's zeroing */
+    uint64_t skipped;   /* unmapped, not written */
+} sdio_stats;
+
+typedef enum {
+    SDIO_ZERO_NONE,     /* must write zeros like any data */
+    SDIO_ZERO_PUNCH     /* fallocate punch-hole reads back as zeros */
+} sdio_zero_mode;
+
+typedef void (*sdio_log_fn)(void *ctx, const char *msg);
+typedef void (*sdio_progress_fn)(void *ctx, uint64_t done, uint64_t total);
+
+/* Data source for sdio_write(). Fill buf with up to len bytes destined for
+   device offset off. Returns the byte count (short only at end of data),
+   0 at end of data, -1 on error with errno set. Called sequentially. */
+typedef ssize_t (*sdio_fill_fn)(void *ctx, uint64_t off, void *buf, size_t len);
+
+typedef struct {
+    char     path[256];
+    char     ident[256];   /* model key used for the tuning cache */
+    int      fd;           /* buffered descriptor */
+    int      dfd;          /* O_DIRECT descriptor, -1 if unsupported */
+    uint64_t size;         /* bytes */
+    unsigned sector;       /* logical sector size */
+    bool     blockdev;     /* false for a regular image file */
+
+    sdio_params params;
+    bool        tuned;     /* params came from calibration or cache */
+    int         retunes;   /* re-evaluations done in the current job */
+
+    sdio_zero_mode zero_mode;
+    sdio_stats     stats;
+
+    sdio_log_fn      log;
+    void            *log_ctx;
+    sdio_progress_fn progress;
+    void            *progress_ctx;
+
+    /* Cooperative abort: once *cancel is nonzero (a signal handler may
+       set it) no new request is started, those in flight are drained and
+       the call fails with ECANCELED. reached is then the device offset
+       below which everything the call was asked to write was written. */
+    const volatile sig_atomic_t *cancel;
+    uint64_t reached;
+} sdio_dev;
+
+/* Open a block device (exclusively) or regular file for writing.
+   Read-only devices (write-protect switch) fail with EROFS. */
+int  sdio_open(sdio_dev *d, const char *path);
+
+/* Open for reading only: no exclusive claim, works on mounted devices. */
+int  sdio_open_read(sdio_dev *d, const char *path);
+void sdio_close(sdio_dev *d);
+
+/* Fill in size, model key and cached parameters (tuned if the model is
+   in the cache) from sysfs alone: nothing is opened, no root needed.
+   The result can be planned with but not read or written. */
+int  sdio_probe(sdio_dev *d, const char *path);
+
+/* Stream len bytes from fill into [off, off+len). len == 0 means until the
+   source ends or the device does. Calibrates on first use of a model. */
+int  sdio_write(sdio_dev *d, uint64_t off, uint64_t len,
+                sdio_fill_fn fill, void *ctx);
+
+/* As sdio_write(), skipping unmapped ranges and zero runs per sp. */
+int  sdio_write_sparse(sdio_dev *d, uint64_t off, uint64_t len,
+                       sdio_fill_fn fill, void *ctx, const sdio_sparse *sp);
+
+/* Discard a range (contents undefined afterwards). Devices without
+   discard support are left untouched; that is not an error. */
+int  sdio_discard(sdio_dev *d, uint64_t off, uint64_t len);
+
+/* True if len bytes at buf are all zero (vectorised). */
+bool sdio_is_zero(const void *buf, size_t len);
+
+/* Load cached parameters for the device's model, if any. */
+bool sdio_tune(sdio_dev *d);
+
+/* One synchronous write at the device's current parameters; buf must be
+   4 KiB aligned to go through O_DIRECT. Safe to call from several threads. */
+int  sdio_write_at(sdio_dev *d, const void *buf, size_t len, uint64_t off);
+
+/* Read len bytes at off; O_DIRECT when buf, len and off allow it.
+   Short reads (past the end) fail with EIO. Thread-safe. */
+int  sdio_read_at(sdio_dev *d, void *buf, size_t len, uint64_t off);
+
+/* Overwrite a range with zeros through the same engine. */
+int  sdio_zero(sdio_dev *d, uint64_t off, uint64_t len);
+
+/* Flush everything written so far to the media. */
+int  sdio_flush(sdio_dev *d);
+
+/* Has d->cancel been raised? */
+bool sdio_cancelled(const sdio_dev *d);
+
+/* Short human-readable form of params ("1024KiB x QD4 direct"). */
+void sdio_params_str(const sdio_params *p, char *out, size_t outsz);
+
+#endif /* SDIO_H */
@@ -0,0 +1,282 @@
+#define _GNU_SOURCE
+#include "sdman.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sdfat.h"
+#include "sdpool.h"
+
+/* On-card format, little-endian, at the start of p2:
+
+     0    8  magic "SDPREPMF"
+     8    4  version
+     12   4  header size (4096)
+     16   8  created (unix time)
+     24   8  image id
+     32   8  image size (bytes hashed)
+     40   4  block size
+     44   4  reserved, 0
+     48   8  block count
+     56  32  p1 start, p1 size, p2 start, p2 size (bytes)
+     88  12  volume label, NUL padded
+     100 64  image name, NUL padded
+     164  4  reserved, 0
+     168  8  checksum: XXH64 of the block hashes, seeded with the
+             XXH64 of this header with the checksum field zeroed
+     176  8  payload: bytes of raw data at the start of p2, 0 = none
+
+   The block hashes (8 bytes each) follow the header, padded to
+   4 KiB. They are written first and the header last, so an
+   interrupted write leaves no valid-looking manifest.
+
+   With a payload, the header is the last 4 KiB-aligned 4 KiB of p2
+   and the hashes end where it starts. */
+
+#define MAGIC       "SDPREPMF"
+#define HDR_SIZE    4096
+#define OFF_CKSUM   168
+#define OFF_PAYLOAD 176
+
+static void put32(unsigned char *p, uint32_t v) { for (int i = 0; i < 4; i++) p[i] = (unsigned char)(v >> (8 * i)); }
+static void put64(unsigned char *p, uint64_t v) { for (int i = 0; i < 8; i++) p[i] = (unsigned char)(v >> (8 * i)); }
+static uint32_t get32(const unsigned char *p) { uint32_t v = 0; for (int i = 3; i >= 0; i--) v = v << 8 | p[i]; return v; }
+static uint64_t get64(const unsigned char *p) { uint64_t v = 0; for (int i = 7; i >= 0; i--) v = v << 8 | p[i]; return v; }
+
+uint64_t sdman_image_id(const sdhash_list *hl) {
+    return sdhash64(hl->h, hl->n * sizeof(*hl->h), hl->image_size);
+}
+
+static size_t hashes_bytes(size_t n) {
+    return (n * 8 + HDR_SIZE - 1) / HDR_SIZE * HDR_SIZE;
+}
+
+static uint64_t checksum(unsigned char *hdr, const void *hashes, size_t n) {
+    unsigned char saved[8];
+    memcpy(saved, hdr + OFF_CKSUM, 8);
+    memset(hdr + OFF_CKSUM, 0, 8);
+    uint64_t seed = sdhash64(hdr, HDR_SIZE, 0);
+    memcpy(hdr + OFF_CKSUM, saved, 8);
+    return sdhash64(hashes, n * 8, seed);
+}
+
+static int find_p2(sdio_dev *d, uint64_t *off, uint64_t *len) {
+    sdfat_part part[4];
+    if (sdfat_read_mbr(d, part) != 0) {
+        if (errno == EBADMSG) errno = ENOENT;   /* no partition table at all */
+        return -1;
+    }
+    if (part[1].type == 0 || part[1].size < HDR_SIZE ||
+        part[1].start + part[1].size > d->size) {
+        errno = ENOENT;
+        return -1;
+    }
+    *off = part[1].start;
+    *len = part[1].size;
+    return 0;
+}
+
+/* Header offset of a manifest behind a payload, in a p2 at [off, off + len). */
+static uint64_t tail_header(uint64_t off, uint64_t len) {
+    return (off + len - HDR_SIZE) / HDR_SIZE * HDR_SIZE;
+}
+
+uint64_t sdman_offset(uint64_t p2_start, uint64_t p2_size, uint64_t payload, size_t n) {
+    if (!payload) return p2_start;
+    return tail_header(p2_start, p2_size) - hashes_bytes(n);
+}
+
+/* Zeroed I/O buffer from the pool; give back with sdpool_put(). */
+static unsigned char *aligned(size_t len) {
+    unsigned char *p = sdpool_get(len);
+    if (p) memset(p, 0, len);
+    return p;
+}
+
+int sdman_read(sdio_dev *d, sdman *m) {
+    memset(m, 0, sizeof(*m));
+    uint64_t off, len;
+    if (find_p2(d, &off, &len) != 0) return -1;
+
+    unsigned char *hdr = aligned(HDR_SIZE);
+    if (!hdr) return -1;
+    /* At the start of p2, else behind a payload at its end */
+    uint64_t hoff = off;
+    for (int at_end = 0; at_end < 2; at_end++) {
+        if (at_end) hoff = tail_header(off, len);
+        if (sdio_read_at(d, hdr, HDR_SIZE, hoff) != 0) {
+            int e = errno;
+            sdpool_put(hdr, HDR_SIZE);
+            errno = e;
+            return -1;
+        }
+        if (memcmp(hdr, MAGIC, 8) == 0) break;
+    }
+    if (memcmp(hdr, MAGIC, 8) != 0) {
+        sdpool_put(hdr, HDR_SIZE);
+        errno = ENODATA;
+        return -1;
+    }
+
+    uint64_t n = get64(hdr + 48);
+    uint32_t bs = get32(hdr + 40);
+    uint64_t size = get64(hdr + 32);
+    uint64_t payload = get64(hdr + OFF_PAYLOAD);
+    uint64_t hashes = payload ? hoff - hashes_bytes(n) : hoff + HDR_SIZE;
+    if (get32(hdr + 8) != SDMAN_VERSION || get32(hdr + 12) != HDR_SIZE || bs == 0 ||
+        n != (size + bs - 1) / bs || HDR_SIZE + hashes_bytes(n) > len ||
+        (payload != 0) != (hoff != off) || (payload && (hashes < off || payload > hashes - off))) {
+        sdpool_put(hdr, HDR_SIZE);
+        errno = EBADMSG;
+        return -1;
+    }
+
+    size_t hb = hashes_bytes(n), rawlen = hb ? hb : HDR_SIZE;
+    unsigned char *raw = aligned(rawlen);
+    if (!raw || (hb && sdio_read_at(d, raw, hb, hashes) != 0)) {
+        int e = errno;
+        sdpool_put(raw, rawlen);
+        sdpool_put(hdr, HDR_SIZE);
+        errno = e;
+        return -1;
+    }
+    if (checksum(hdr, raw, n) != get64(hdr + OFF_CKSUM)) {
+        sdpool_put(raw, rawlen);
+        sdpool_put(hdr, HDR_SIZE);
+        errno = EBADMSG;
+        return -1;
+    }
+
+    m->hashes.h = malloc((n ? n : 1) * sizeof(uint64_t));
+    if (!m->hashes.h) {
+        sdpool_put(raw, rawlen);
+        sdpool_put(hdr, HDR_SIZE);
+        errno = ENOMEM;
+        return -1;
+    }
+    for (size_t i = 0; i < n; i++) m->hashes.h[i] = get64(raw + 8 * i);
+    m->hashes.n = n;
+    m->hashes.image_size = size;
+    m->hashes.block_size = bs;
+
+    m->created = (int64_t)get64(hdr + 16);
+    m->image_id = get64(hdr + 24);
+    m->p1_start = get64(hdr + 56);
+    m->p1_size = get64(hdr + 64);
+    m->p2_start = get64(hdr + 72);
+    m->p2_size = get64(hdr + 80);
+    memcpy(m->label, hdr + 88, 11);
+    memcpy(m->name, hdr + 100, sizeof(m->name) - 1);
+    m->payload = payload;
+
+    sdpool_put(raw, rawlen);
+    sdpool_put(hdr, HDR_SIZE);
+    return 0;
+}
+
+/* Where header and hashes go in a p2 at [off, off + len). */
+static int place(const sdman *m, uint64_t off, uint64_t len, uint64_t *hoff, uint64_t *hashes) {
+    size_t hb = hashes_bytes(m->hashes.n);
+    *hoff = m->payload ? tail_header(off, len) : off;
+    *hashes = m->payload ? *hoff - hb : *hoff + HDR_SIZE;
+    if (HDR_SIZE + hb > len || (m->payload && (*hoff < off + hb || m->payload > *hashes - off))) {
+        errno = E2BIG;
+        return -1;
+    }
+    return 0;
+}
+
+/* Header (HDR_SIZE) and hashes (hashes_bytes(n), zero padded) of m. */
+static void encode(const sdman *m, unsigned char *hdr, unsigned char *raw) {
+    const sdhash_list *hl = &m->hashes;
+    for (size_t i = 0; i < hl->n; i++) put64(raw + 8 * i, hl->h[i]);
+
+    memset(hdr, 0, HDR_SIZE);
+    memcpy(hdr, MAGIC, 8);
+    put32(hdr + 8, SDMAN_VERSION);
+    put32(hdr + 12, HDR_SIZE);
+    put64(hdr + 16, (uint64_t)(m->created ? m->created : (int64_t)time(NULL)));
+    put64(hdr + 24, m->image_id);
+    put64(hdr + 32, hl->image_size);
+    put32(hdr + 40, hl->block_size);
+    put64(hdr + 48, hl->n);
+    put64(hdr + 56, m->p1_start);
+    put64(hdr + 64, m->p1_size);
+    put64(hdr + 72, m->p2_start);
+    put64(hdr + 80, m->p2_size);
+    memcpy(hdr + 88, m->label, strnlen(m->label, 11));
+    memcpy(hdr + 100, m->name, strnlen(m->name, 63));
+    put64(hdr + OFF_PAYLOAD, m->payload);
+    put64(hdr + OFF_CKSUM, checksum(hdr, raw, hl->n));
+}
+
+int sdman_encode(const sdman *m, unsigned char **buf, uint64_t *off, size_t *len) {
+    uint64_t hoff, hashes;
+    if (place(m, m->p2_start, m->p2_size, &hoff, &hashes) != 0) return -1;
+    size_t hb = hashes_bytes(m->hashes.n);
+    *len = HDR_SIZE + hb;
+    *buf = calloc(1, *len);
+    if (!*buf) {
+        errno = ENOMEM;
+        return -1;
+    }
+    *off = hoff < hashes ? hoff : hashes;
+    encode(m, *buf + (hoff - *off), *buf + (hashes - *off));
+    return 0;
+}
+
+int sdman_write(sdio_dev *d, const sdman *m, bool force) {
+    uint64_t off, len, hoff, hashes;
+    if (find_p2(d, &off, &len) != 0 || place(m, off, len, &hoff, &hashes) != 0) return -1;
+
+    const sdhash_list *hl = &m->hashes;
+    size_t hb = hashes_bytes(hl->n), rawlen = hb ? hb : HDR_SIZE;
+
+    unsigned char *hdr = aligned(HDR_SIZE);
+    unsigned char *raw = aligned(rawlen);
+    int rc = -1, err = 0;
+    if (!hdr || !raw) {
+        err = ENOMEM;
+        goto out;
+    }
+
+    /* Never overwrite something that is not ours. */
+    if (!force) {
+        if (sdio_read_at(d, hdr, HDR_SIZE, hoff) != 0) {
+            err = errno;
+            goto out;
+        }
+        if (memcmp(hdr, MAGIC, 8) != 0 && !sdio_is_zero(hdr, HDR_SIZE)) {
+            err = EEXIST;
+            goto out;
+        }
+    }
+
+    encode(m, hdr, raw);
+
+    /* Invalidate the old header, then hashes, then the new header. */
+    static const unsigned char zero_hdr[HDR_SIZE] __attribute__((aligned(4096)));
+    if (sdio_write_at(d, zero_hdr, HDR_SIZE, hoff) != 0 || sdio_flush(d) != 0 ||
+        (hb && sdio_write_at(d, raw, hb, hashes) != 0) || sdio_flush(d) != 0 ||
+        sdio_write_at(d, hdr, HDR_SIZE, hoff) != 0 || sdio_flush(d) != 0) {
+        err = errno;
+        goto out;
+    }
+    rc = 0;
+
+out:
+    sdpool_put(raw, rawlen);
+    sdpool_put(hdr, HDR_SIZE);
+    if (rc) errno = err;
+    return rc;
+}
+
+uint64_t sdman_size(size_t n) {
+    return HDR_SIZE + hashes_bytes(n);
+}
+
+void sdman_free(sdman *m) {
+    sdhash_list_free(&m->hashes);
+}
@@ -0,0 +1,60 @@
+#ifndef SDMAN_H
+#define SDMAN_H
+
+/* ============================================================
+   sdman – provisioning manifest in the reserved partition 2
+   A few KiB at the start of p2 record what was put on the
+   card: image id, layout, and a hash per block. Verify, delta
+   reflash and "already provisioned?" read this plus a sample
+   of blocks instead of the whole card. When p2 starts with a
+   raw payload (a recovery image) the manifest sits at its end.
+   ============================================================ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sdhash.h"
+#include "sdio.h"
+
+#define SDMAN_VERSION 1
+
+typedef struct {
+    char        name[64];     /* image file name, or "fat32" for a plain format */
+    uint64_t    image_id;     /* sdman_image_id() of the hashes */
+    int64_t     created;      /* unix time */
+    uint64_t    p1_start, p1_size;
+    uint64_t    p2_start, p2_size;
+    char        label[12];
+    uint64_t    payload;      /* bytes at the start of p2 that are not ours */
+    sdhash_list hashes;       /* from offset 0 of the card */
+} sdman;
+
+/* Identifies image content independent of file name or compression. */
+uint64_t sdman_image_id(const sdhash_list *hl);
+
+/* Read the manifest from p2, at its start or after a payload at its end.
+   ENOENT if the card has no p2, ENODATA if p2 holds no manifest, EBADMSG
+   if it is damaged. */
+int  sdman_read(sdio_dev *d, sdman *m);
+
+/* Write m to p2 (its location is taken from the MBR on the card, not m):
+   at the start, or at the end if m->payload is set. E2BIG if it does not
+   fit beside the payload. Unless force, refuses with EEXIST when the spot
+   already holds something other than zeros or an earlier manifest. */
+int  sdman_write(sdio_dev *d, const sdman *m, bool force);
+
+/* m as it lies on the card, for a caller that writes it along with other
+   data: *len bytes (malloc'd) at device offset *off, placed by
+   m->p2_start, m->p2_size and m->payload. E2BIG if it does not fit. */
+int  sdman_encode(const sdman *m, unsigned char **buf, uint64_t *off, size_t *len);
+
+void sdman_free(sdman *m);
+
+/* Bytes a manifest with n block hashes occupies in p2. */
+uint64_t sdman_size(size_t n);
+
+/* Device offset of a manifest with n block hashes in a p2 at p2_start of
+   p2_size bytes, after payload bytes of raw data (0 = none). */
+uint64_t sdman_offset(uint64_t p2_start, uint64_t p2_size, uint64_t payload, size_t n);
+
+#endif /* SDMAN_H */
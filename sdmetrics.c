@@ -0,0 +1,364 @@
+#define _GNU_SOURCE
+#include "sdmetrics.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <time.h>
+#include <unistd.h>
+
+/* The .prom file is its own state: an update takes the lock, reads the
+   file back, adds this process's pending changes, drops running-job
+   lines of processes that are gone and renames a new file into place.
+   node_exporter only ever sees a complete file. */
+
+#define DEFAULT_INTERVAL 5.0
+#define KEY_MAX          640
+
+static const double buckets[] = { 0.1, 0.5, 1, 2, 5, 10, 30, 60, 120, 300, 600, 1800, 3600 };
+#define NBUCKETS (sizeof(buckets) / sizeof(buckets[0]))
+
+/* Families, in output order. */
+static const struct {
+    const char *name, *type, *help;
+} families[] = {
+    { "sdprep_cards_total", "counter", "Cards finished, by job and outcome." },
+    { "sdprep_stage_failures_total", "counter", "Failed cards, by the stage they failed in." },
+    { "sdprep_bytes_written_total", "counter", "Bytes written to cards." },
+    { "sdprep_reader_bytes_total", "counter", "Bytes written in bulk stages, by reader." },
+    { "sdprep_reader_seconds_total", "counter", "Seconds spent in bulk stages, by reader." },
+    { "sdprep_reader_last_mbps", "gauge", "Throughput of the latest bulk stage, by reader (MB/s)." },
+    { "sdprep_stage_duration_seconds", "histogram", "Time per stage." },
+    { "sdprep_jobs_in_flight", "gauge", "Jobs running now." },
+    { "sdprep_job_info", "gauge", "One per running job, with its device and stage." },
+    { "sdprep_job_progress_ratio", "gauge", "Fraction of the running job's current stage done." },
+    { "sdprep_last_update_timestamp_seconds", "gauge", "When this file was last written." },
+};
+#define NFAMILIES (sizeof(families) / sizeof(families[0]))
+
+typedef struct {
+    char   key[KEY_MAX];   /* name{labels} */
+    double v;
+    bool   set;            /* gauge: replace instead of add */
+} entry;
+
+typedef struct {
+    entry *e;
+    size_t n, cap;
+} table;
+
+static struct {
+    bool   on;
+    char   dir[512];
+    double interval;
+    char   job[32];
+    char   device[256];
+    char   stage[64];
+    double stage_t0;
+    double progress;
+    bool   running;
+    size_t cards;          /* finished since open */
+    bool   dirty;
+    double last_flush;
+    table  pending;
+} M;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static entry *find(table *t, const char *key) {
+    for (size_t i = 0; i < t->n; i++)
+        if (strcmp(t->e[i].key, key) == 0) return &t->e[i];
+    return NULL;
+}
+
+static entry *get(table *t, const char *key) {
+    entry *e = find(t, key);
+    if (e) return e;
+    if (t->n == t->cap) {
+        size_t nc = t->cap ? t->cap * 2 : 64;
+        entry *ne = realloc(t->e, nc * sizeof(*ne));
+        if (!ne) return NULL;
+        t->e = ne;
+        t->cap = nc;
+    }
+    e = &t->e[t->n++];
+    snprintf(e->key, sizeof(e->key), "%s", key);
+    e->v = 0.0;
+    e->set = false;
+    return e;
+}
+
+static void apply(table *t, const char *key, double v, bool set) {
+    entry *e = get(t, key);
+    if (!e) return;
+    e->v = set ? v : e->v + v;
+    e->set |= set;
+}
+
+/* Label value with \, " and newline escaped. */
+static void esc(char *out, size_t outsz, const char *in) {
+    size_t j = 0;
+    for (size_t i = 0; in[i] && j + 2 < outsz; i++) {
+        char c = in[i];
+        if (c == '\\' || c == '"' || c == '\n') {
+            out[j++] = '\\';
+            c = c == '\n' ? 'n' : c;
+        }
+        out[j++] = c;
+    }
+    out[j] = 0;
+}
+
+static void add(const char *name, const char *label, const char *value, double v, bool set) {
+    char key[KEY_MAX], ev[256];
+    if (label) {
+        esc(ev, sizeof(ev), value);
+        snprintf(key, sizeof(key), "%s{%s=\"%s\"}", name, label, ev);
+    } else {
+        snprintf(key, sizeof(key), "%s", name);
+    }
+    apply(&M.pending, key, v, set);
+    M.dirty = true;
+}
+
+static void observe(const char *stage, double sec) {
+    char ev[128], key[KEY_MAX];
+    esc(ev, sizeof(ev), stage);
+    for (size_t i = 0; i < NBUCKETS; i++) {
+        if (sec > buckets[i]) continue;
+        snprintf(key, sizeof(key), "sdprep_stage_duration_seconds_bucket{stage=\"%s\",le=\"%g\"}",
+                 ev, buckets[i]);
+        apply(&M.pending, key, 1, false);
+    }
+    snprintf(key, sizeof(key), "sdprep_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"}", ev);
+    apply(&M.pending, key, 1, false);
+    snprintf(key, sizeof(key), "sdprep_stage_duration_seconds_sum{stage=\"%s\"}", ev);
+    apply(&M.pending, key, sec, false);
+    snprintf(key, sizeof(key), "sdprep_stage_duration_seconds_count{stage=\"%s\"}", ev);
+    apply(&M.pending, key, 1, false);
+    M.dirty = true;
+}
+
+/* ------------------------------------------------------------
+   The file
+   ------------------------------------------------------------ */
+static int family_of(const char *key) {
+    for (size_t f = 0; f < NFAMILIES; f++) {
+        size_t n = strlen(families[f].name);
+        if (strncmp(key, families[f].name, n) != 0) continue;
+        const char *rest = key + n;
+        if (*rest == 0 || *rest == '{') return (int)f;
+        if (strcmp(families[f].type, "histogram") == 0 &&
+            (strncmp(rest, "_bucket", 7) == 0 || strncmp(rest, "_sum", 4) == 0 ||
+             strncmp(rest, "_count", 6) == 0))
+            return (int)f;
+    }
+    return -1;
+}
+
+static void load(table *t, const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) return;
+    char line[KEY_MAX + 64];
+    while (fgets(line, sizeof(line), fp)) {
+        if (line[0] == '#' || line[0] == '\n') continue;
+        char *sp = strrchr(line, ' ');
+        if (!sp) continue;
+        *sp = 0;
+        if (family_of(line) < 0) continue;
+        apply(t, line, strtod(sp + 1, NULL), false);
+    }
+    fclose(fp);
+}
+
+static pid_t pid_of(const char *key) {
+    const char *p = strstr(key, "pid=\"");
+    return p ? (pid_t)atoi(p + 5) : 0;
+}
+
+/* Lines of running jobs: ours is rebuilt, those of dead processes go. */
+static void refresh_running(table *t) {
+    pid_t self = getpid();
+    size_t k = 0;
+    for (size_t i = 0; i < t->n; i++) {
+        pid_t pid = pid_of(t->e[i].key);
+        if (pid && (pid == self || (kill(pid, 0) != 0 && errno == ESRCH))) continue;
+        t->e[k++] = t->e[i];
+    }
+    t->n = k;
+
+    if (M.running) {
+        char key[KEY_MAX], dev[256], stage[128], job[64];
+        esc(dev, sizeof(dev), M.device);
+        esc(stage, sizeof(stage), M.stage[0] ? M.stage : "startup");
+        esc(job, sizeof(job), M.job);
+        snprintf(key, sizeof(key), "sdprep_job_info{pid=\"%d\",job=\"%s\",device=\"%s\",stage=\"%s\"}",
+                 (int)self, job, dev, stage);
+        apply(t, key, 1, true);
+        snprintf(key, sizeof(key), "sdprep_job_progress_ratio{pid=\"%d\"}", (int)self);
+        apply(t, key, M.progress, true);
+    }
+
+    size_t running = 0;
+    for (size_t i = 0; i < t->n; i++)
+        if (strncmp(t->e[i].key, "sdprep_job_info{", 16) == 0) running++;
+    apply(t, "sdprep_jobs_in_flight", (double)running, true);
+    apply(t, "sdprep_last_update_timestamp_seconds", (double)time(NULL), true);
+}
+
+/* Buckets of a series in ascending le, +Inf last. */
+static double le_of(const char *key, size_t *prefix) {
+    const char *p = strstr(key, ",le=\"");
+    *prefix = p ? (size_t)(p - key) : strlen(key);
+    if (!p) return 0.0;
+    return strncmp(p + 5, "+Inf", 4) == 0 ? 1e300 : strtod(p + 5, NULL);
+}
+
+static int cmp_entry(const void *a, const void *b) {
+    const entry *x = a, *y = b;
+    int fx = family_of(x->key), fy = family_of(y->key);
+    if (fx != fy) return fx - fy;
+    size_t nx, ny;
+    double lx = le_of(x->key, &nx), ly = le_of(y->key, &ny);
+    if (nx == ny && strncmp(x->key, y->key, nx) == 0) return (lx > ly) - (lx < ly);
+    return strcmp(x->key, y->key);
+}
+
+static void flush(void) {
+    char path[600], tmp[640], lock[640];
+    snprintf(path, sizeof(path), "%s/%s", M.dir, SDMETRICS_FILE);
+    snprintf(tmp, sizeof(tmp), "%s/.%s.%d.tmp", M.dir, SDMETRICS_FILE, (int)getpid());
+    snprintf(lock, sizeof(lock), "%s/.%s.lock", M.dir, SDMETRICS_FILE);
+
+    int lfd = open(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lfd < 0) return;
+    while (flock(lfd, LOCK_EX) != 0 && errno == EINTR) {}
+
+    table t = {0};
+    load(&t, path);
+    for (size_t i = 0; i < M.pending.n; i++)
+        apply(&t, M.pending.e[i].key, M.pending.e[i].v, M.pending.e[i].set);
+    refresh_running(&t);
+    qsort(t.e, t.n, sizeof(*t.e), cmp_entry);
+
+    FILE *out = fopen(tmp, "w");
+    if (out) {
+        int last = -1;
+        for (size_t i = 0; i < t.n; i++) {
+            int f = family_of(t.e[i].key);
+            if (f != last) {
+                fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", families[f].name, families[f].help,
+                        families[f].name, families[f].type);
+                last = f;
+            }
+            fprintf(out, "%s %.17g\n", t.e[i].key, t.e[i].v);
+        }
+        if (fclose(out) == 0 && rename(tmp, path) == 0) {
+            M.pending.n = 0;
+            M.dirty = false;
+        } else {
+            unlink(tmp);
+        }
+    }
+    free(t.e);
+    flock(lfd, LOCK_UN);
+    close(lfd);
+    M.last_flush = now_sec();
+}
+
+/* ------------------------------------------------------------
+   API
+   ------------------------------------------------------------ */
+/* A process that exits with its job still open did not finish it. */
+static void at_exit(void) {
+    if (!M.on) return;
+    if (!M.cards) sdmetrics_card("failed");
+    sdmetrics_close();
+}
+
+bool sdmetrics_open(const char *job, const char *device) {
+    static bool registered;
+    const char *dir = getenv("SDPREP_METRICS_DIR");
+    if (!dir || !*dir) return false;
+    snprintf(M.dir, sizeof(M.dir), "%s", dir);
+    const char *iv = getenv("SDPREP_METRICS_INTERVAL");
+    M.interval = iv && atof(iv) > 0 ? atof(iv) : DEFAULT_INTERVAL;
+    snprintf(M.job, sizeof(M.job), "%s", job);
+    snprintf(M.device, sizeof(M.device), "%s", device);
+    M.stage[0] = 0;
+    M.progress = 0.0;
+    M.running = true;
+    M.cards = 0;
+    M.on = true;
+    if (!registered) registered = atexit(at_exit) == 0;
+    flush();   /* show the job as running right away */
+    return true;
+}
+
+static void close_stage(void) {
+    if (!M.stage[0]) return;
+    observe(M.stage, now_sec() - M.stage_t0);
+    M.stage[0] = 0;
+}
+
+void sdmetrics_tick(void) {
+    if (M.on && M.dirty && now_sec() - M.last_flush >= M.interval) flush();
+}
+
+void sdmetrics_stage(const char *stage) {
+    if (!M.on) return;
+    close_stage();
+    snprintf(M.stage, sizeof(M.stage), "%s", stage);
+    M.stage_t0 = now_sec();
+    M.progress = 0.0;
+    M.dirty = true;
+    sdmetrics_tick();
+}
+
+void sdmetrics_bytes(const char *reader, uint64_t bytes, double seconds) {
+    if (!M.on || !bytes) return;
+    add("sdprep_bytes_written_total", NULL, NULL, (double)bytes, false);
+    if (!reader || !*reader || seconds <= 0) return;
+    add("sdprep_reader_bytes_total", "reader", reader, (double)bytes, false);
+    add("sdprep_reader_seconds_total", "reader", reader, seconds, false);
+    add("sdprep_reader_last_mbps", "reader", reader, (double)bytes / seconds / 1e6, true);
+}
+
+void sdmetrics_progress(uint64_t done, uint64_t total) {
+    if (!M.on || !total) return;
+    M.progress = (double)done / (double)total;
+    M.dirty = true;
+    sdmetrics_tick();
+}
+
+void sdmetrics_card(const char *outcome) {
+    if (!M.on) return;
+    char ej[64], eo[64], key[KEY_MAX];
+    esc(ej, sizeof(ej), M.job);
+    esc(eo, sizeof(eo), outcome);
+    snprintf(key, sizeof(key), "sdprep_cards_total{job=\"%s\",outcome=\"%s\"}", ej, eo);
+    apply(&M.pending, key, 1, false);
+    M.cards++;
+    if (strcmp(outcome, "failed") == 0)
+        add("sdprep_stage_failures_total", "stage", M.stage[0] ? M.stage : "startup", 1, false);
+    M.dirty = true;
+    sdmetrics_tick();
+}
+
+void sdmetrics_close(void) {
+    if (!M.on) return;
+    close_stage();
+    M.running = false;
+    flush();
+    M.on = false;
+    free(M.pending.e);
+    memset(&M.pending, 0, sizeof(M.pending));
+}
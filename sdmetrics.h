@@ -0,0 +1,49 @@
+#ifndef SDMETRICS_H
+#define SDMETRICS_H
+
+/* ============================================================
+   sdmetrics – Prometheus textfile export for station monitoring
+   Keeps sdprep.prom in node_exporter's textfile directory:
+   cards per job and outcome, failures per stage, bytes and
+   throughput per reader, a stage duration histogram and the
+   jobs running right now. Every process on the station adds
+   to the same file under a lock, rewriting it atomically and
+   at most every few seconds. Plain C, no engine dependency,
+   so the GUI links it too.
+   ============================================================ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* The directory comes from SDPREP_METRICS_DIR; unset or empty leaves
+   every call below a no-op. SDPREP_METRICS_INTERVAL (seconds, default
+   5) bounds how often the file is rewritten mid-job. */
+#define SDMETRICS_FILE "sdprep.prom"
+
+/* Start a job on device (a path, or several joined by commas). If the
+   process exits with the job open, an unfinished card counts as failed. */
+bool sdmetrics_open(const char *job, const char *device);
+
+/* The job moved on to stage; the previous one's duration is observed. */
+void sdmetrics_stage(const char *stage);
+
+/* Bytes written through reader (any stable name for the card's path:
+   reader id or model) and the seconds the bulk transfer took. */
+void sdmetrics_bytes(const char *reader, uint64_t bytes, double seconds);
+
+/* Progress of the running job; rewrites the file if it is due. */
+void sdmetrics_progress(uint64_t done, uint64_t total);
+
+/* One card finished: outcome "ok", "failed" or "aborted". A failure is
+   charged to the current stage. */
+void sdmetrics_card(const char *outcome);
+
+/* Close the last stage, drop the job from the running set and write the
+   file now. */
+void sdmetrics_close(void);
+
+/* Rewrite the file if changes are pending and the interval has passed
+   (for callers with their own timer). */
+void sdmetrics_tick(void);
+
+#endif /* SDMETRICS_H */
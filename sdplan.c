@@ -0,0 +1,254 @@
+#define _GNU_SOURCE
+#include "sdplan.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sddb.h"
+#include "sdfat.h"
+#include "sdhash.h"
+#include "sdman.h"
+
+/* Without a cached measurement a card is assumed to be a slow one. Reads
+   are timed at the write rate, which only errs on the long side. */
+#define ASSUMED_MBPS    10.0
+#define DISCARD_MBPS    2000.0   /* a discard is bookkeeping, not a transfer */
+#define STEP_SEC        2.0      /* an external command */
+#define VERIFY_SAMPLE   64       /* blocks --verify reads without --full */
+
+int sdplan_init(sdplan *p, const char *path) {
+    memset(p, 0, sizeof(*p));
+    if (sdio_probe(&p->dev, path) != 0) return -1;
+    p->measured = p->dev.tuned && p->dev.params.mbps > 0;
+    p->write_mbps = p->measured ? p->dev.params.mbps : ASSUMED_MBPS;
+
+    /* A card seen before is timed by its own last run. */
+    sddb_id id;
+    sddb_rec last;
+    sddb_identify(path, &id);
+    if (sddb_last(&id, &last)) {
+        p->write_mbps = last.mbps;
+        p->measured = p->card_history = true;
+    }
+    p->read_mbps = p->write_mbps;
+    return 0;
+}
+
+void sdplan_free(sdplan *p) {
+    free(p->ops);
+    p->ops = NULL;
+    p->n = p->cap = 0;
+}
+
+static int add(sdplan *p, sdplan_kind kind, const char *what,
+               uint64_t off, uint64_t len, bool at_most) {
+    if (kind != SDPLAN_STEP && len == 0) return 0;
+    if (p->n == p->cap) {
+        size_t nc = p->cap ? p->cap * 2 : 16;
+        sdplan_op *no = realloc(p->ops, nc * sizeof(*no));
+        if (!no) {
+            errno = ENOMEM;
+            return -1;
+        }
+        p->ops = no;
+        p->cap = nc;
+    }
+    p->ops[p->n++] = (sdplan_op){ kind, what, off, len, at_most };
+    return 0;
+}
+
+/* End of p1 / start of p2, as the formatter computes it. */
+static uint64_t layout_split(uint64_t size) {
+    return (size / SDFAT_P1_START) * SDFAT_P1_START - SDFAT_RESERVED;
+}
+
+static uint64_t manifest_bytes(uint64_t covered) {
+    return sdman_size((size_t)((covered + SDHASH_BLOCK - 1) / SDHASH_BLOCK));
+}
+
+int sdplan_format(sdplan *p, bool erase) {
+    uint64_t size = p->dev.size;
+    if (size < SDFAT_RESERVED + 10 * SDFAT_P1_START) {
+        errno = ENOSPC;
+        return -1;
+    }
+    uint64_t split = layout_split(size);
+
+    if (erase) {
+        if (add(p, SDPLAN_WRITE, "erase", 0, size, false) != 0) return -1;
+    } else {
+        uint64_t tail = size - SDIO_MIB;
+        if (add(p, SDPLAN_WRITE, "wipe signatures", 0, SDIO_MIB, false) != 0 ||
+            add(p, SDPLAN_WRITE, "wipe signatures", tail, size - tail, false) != 0)
+            return -1;
+    }
+    /* The benchmark works where p1's data will go; half writes, half reads */
+    if (add(p, SDPLAN_WRITE, "cluster bench", SDFAT_P1_START, p->bench_bytes / 2, true) != 0 ||
+        add(p, SDPLAN_READ, "cluster bench", SDFAT_P1_START, p->bench_bytes / 2, true) != 0)
+        return -1;
+
+    /* One sweep: zeros up to p1, p1's reserved sectors, both FATs and the
+       root directory up to the next MiB, the payload, the manifest (after
+       the payload, at the end of p2). Then the commit: partition table
+       and both boot sectors. */
+    sdfat_bpb b;
+    if (sdfat_geometry(split - SDFAT_P1_START, p->cluster, &b) != 0) return -1;
+    uint64_t meta = SDFAT_P1_START + sdfat_data_offset(&b) + sdfat_cluster_bytes(&b);
+    meta = (meta + SDIO_MIB - 1) / SDIO_MIB * SDIO_MIB;
+    uint64_t covered = p->payload ? split + p->payload : meta;
+    uint64_t where = sdman_offset(split, size - split, p->payload,
+                                  (size_t)((covered + SDHASH_BLOCK - 1) / SDHASH_BLOCK));
+    if (p->payload + manifest_bytes(covered) > size - split) {
+        errno = ENOSPC;
+        return -1;
+    }
+    if (add(p, SDPLAN_WRITE, "layout", 0, meta, false) != 0 ||
+        add(p, SDPLAN_WRITE, "payload", split, p->payload, false) != 0 ||
+        add(p, SDPLAN_WRITE, "manifest", where, manifest_bytes(covered), false) != 0 ||
+        add(p, SDPLAN_WRITE, "commit", 0, 3 * 512, false) != 0)
+        return -1;
+    return 0;
+}
+
+int sdplan_image(sdplan *p, uint64_t size, const sdio_extent *map, size_t nmap, bool delta) {
+    if (size > p->dev.size) {
+        errno = EFBIG;
+        return -1;
+    }
+    bool unknown = size == 0;
+    if (unknown) size = p->dev.size;
+
+    if (delta) {
+        if (add(p, SDPLAN_READ, "compare", 0, size, unknown) != 0 ||
+            add(p, SDPLAN_WRITE, "changed blocks", 0, size, true) != 0)
+            return -1;
+    } else if (!map) {
+        if (add(p, SDPLAN_WRITE, "image", 0, size, unknown) != 0) return -1;
+    } else {
+        /* As sdio_write_sparse() splits it: mapped data, unmapped discard. */
+        uint64_t pos = 0;
+        for (size_t i = 0; i < nmap && pos < size; i++) {
+            uint64_t s = map[i].off < size ? map[i].off : size;
+            uint64_t e = map[i].off + map[i].len < size ? map[i].off + map[i].len : size;
+            if (s > pos && add(p, SDPLAN_DISCARD, "unmapped", pos, s - pos, false) != 0) return -1;
+            if (e > s && add(p, SDPLAN_WRITE, "mapped", s, e - s, false) != 0) return -1;
+            if (e > pos) pos = e;
+        }
+        if (pos < size && add(p, SDPLAN_DISCARD, "unmapped", pos, size - pos, false) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+int sdplan_manifest(sdplan *p, uint64_t covered) {
+    if (covered == 0) covered = p->dev.size;
+    uint64_t split = layout_split(p->dev.size);
+    if (split < covered) return 0;
+    return add(p, SDPLAN_WRITE, "manifest", split, manifest_bytes(covered), false);
+}
+
+int sdplan_verify(sdplan *p, bool full) {
+    if (p->dev.size < SDFAT_RESERVED + 10 * SDFAT_P1_START) {
+        errno = ENOSPC;
+        return -1;
+    }
+    uint64_t split = layout_split(p->dev.size);
+    if (add(p, SDPLAN_READ, "manifest", split, manifest_bytes(split), true) != 0) return -1;
+    if (full) return add(p, SDPLAN_READ, "blocks in use", 0, split, true);
+
+    /* sdhash_sample() spreads its picks evenly over the hashed blocks. */
+    uint64_t blocks = split / SDHASH_BLOCK;
+    uint64_t n = blocks < VERIFY_SAMPLE ? blocks : VERIFY_SAMPLE;
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t b = i * blocks / n;
+        if (add(p, SDPLAN_READ, "sample", b * SDHASH_BLOCK, SDHASH_BLOCK, false) != 0) return -1;
+    }
+    return 0;
+}
+
+double sdplan_op_seconds(const sdplan *p, const sdplan_op *op) {
+    switch (op->kind) {
+    case SDPLAN_WRITE:   return (double)op->len / (p->write_mbps * 1e6);
+    case SDPLAN_READ:    return (double)op->len / (p->read_mbps * 1e6);
+    case SDPLAN_DISCARD: return (double)op->len / (DISCARD_MBPS * 1e6);
+    case SDPLAN_STEP:    return STEP_SEC;
+    }
+    return 0.0;
+}
+
+double sdplan_seconds(const sdplan *p) {
+    double s = 0.0;
+    for (size_t i = 0; i < p->n; i++) s += sdplan_op_seconds(p, &p->ops[i]);
+    return s;
+}
+
+void sdplan_eta_str(double sec, char *out, size_t outsz) {
+    unsigned long s = (unsigned long)(sec + 0.5);
+    if (s >= 3600) snprintf(out, outsz, "%luh %02lum", s / 3600, s % 3600 / 60);
+    else if (s >= 60) snprintf(out, outsz, "%lum %02lus", s / 60, s % 60);
+    else snprintf(out, outsz, "%lus", s ? s : 1);
+}
+
+static const char *kind_name(sdplan_kind k) {
+    switch (k) {
+    case SDPLAN_WRITE:   return "write";
+    case SDPLAN_DISCARD: return "discard";
+    case SDPLAN_READ:    return "read";
+    case SDPLAN_STEP:    return "run";
+    }
+    return "?";
+}
+
+static void print_mib(FILE *out, uint64_t bytes) {
+    if (bytes % SDIO_MIB == 0) fprintf(out, "%llu MiB", (unsigned long long)(bytes / SDIO_MIB));
+    else fprintf(out, "%.2f MiB", (double)bytes / SDIO_MIB);
+}
+
+void sdplan_print(const sdplan *p, FILE *out, size_t max_ranges) {
+    fprintf(out, "%s: ", p->dev.path);
+    print_mib(out, p->dev.size);
+    fprintf(out, ", %s, %.1f MB/s %s\n", p->dev.ident, p->write_mbps,
+            p->card_history ? "(this card's last run)" :
+            p->measured ? "(cached)" : "(assumed, model not calibrated yet)");
+
+    uint64_t bytes[4] = {0}, hidden_bytes[4] = {0};
+    size_t shown[4] = {0}, hidden[4] = {0};
+    bool upper = false;
+    for (size_t i = 0; i < p->n; i++) {
+        const sdplan_op *op = &p->ops[i];
+        bytes[op->kind] += op->len;
+        upper |= op->at_most;
+        if (op->kind != SDPLAN_STEP && shown[op->kind] >= max_ranges) {
+            hidden[op->kind]++;
+            hidden_bytes[op->kind] += op->len;
+            continue;
+        }
+        shown[op->kind]++;
+        fprintf(out, "  %-8s", kind_name(op->kind));
+        if (op->kind != SDPLAN_STEP) {
+            fprintf(out, "%14llu +%-14llu %s", (unsigned long long)op->off,
+                    (unsigned long long)op->len, op->at_most ? "<= " : "");
+            print_mib(out, op->len);
+            fputs("  ", out);
+        }
+        fprintf(out, "%s (%.1f s)\n", op->what, sdplan_op_seconds(p, op));
+    }
+    for (int k = 0; k < 3; k++) {
+        if (!hidden[k]) continue;
+        fprintf(out, "  %-8s... %zu more range%s, ", kind_name((sdplan_kind)k), hidden[k],
+                hidden[k] == 1 ? "" : "s");
+        print_mib(out, hidden_bytes[k]);
+        fputc('\n', out);
+    }
+
+    char eta[32];
+    sdplan_eta_str(sdplan_seconds(p), eta, sizeof(eta));
+    fprintf(out, "  total: write ");
+    print_mib(out, bytes[SDPLAN_WRITE]);
+    fprintf(out, ", discard ");
+    print_mib(out, bytes[SDPLAN_DISCARD]);
+    fprintf(out, ", read ");
+    print_mib(out, bytes[SDPLAN_READ]);
+    fprintf(out, "; %s %s\n", upper ? "at most" : "about", eta);
+}
@@ -0,0 +1,84 @@
+#ifndef SDPLAN_H
+#define SDPLAN_H
+
+/* ============================================================
+   sdplan – dry-run operation plans with time estimates
+   What a job would do to a card, as byte ranges to write,
+   discard and read back, worked out from the card's size and
+   the SDPrep layout without touching it. The time per card
+   comes from its last run, else the model's throughput in
+   the tuning cache.
+   ============================================================ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "sdio.h"
+
+typedef enum {
+    SDPLAN_WRITE,
+    SDPLAN_DISCARD,
+    SDPLAN_READ,
+    SDPLAN_STEP          /* external command, no range of its own */
+} sdplan_kind;
+
+typedef struct {
+    sdplan_kind kind;
+    const char *what;    /* static string */
+    uint64_t    off;
+    uint64_t    len;
+    bool        at_most; /* upper bound, e.g. the blocks a delta may rewrite */
+} sdplan_op;
+
+typedef struct {
+    sdio_dev   dev;          /* probed only, see sdio_probe() */
+    double     write_mbps;
+    double     read_mbps;
+    bool       measured;     /* speeds from the tuning cache, not assumed */
+    bool       card_history; /* ... or from this card's last run */
+    uint32_t   cluster;      /* FAT32 cluster bytes for sdplan_format, 0 = mkfs.fat's */
+    uint64_t   bench_bytes;  /* cluster benchmark before the layout, 0 = none */
+    uint64_t   payload;      /* bytes sdplan_format writes to the start of p2 */
+    sdplan_op *ops;
+    size_t     n;
+    size_t     cap;
+} sdplan;
+
+/* Probe a device for planning. Unprivileged; the card is not opened. */
+int  sdplan_init(sdplan *p, const char *path);
+void sdplan_free(sdplan *p);
+
+/* The default job: wipe signatures (or erase everything), the cluster
+   benchmark if bench_bytes is set, then the layout sweep (FAT32, the p2
+   payload if any, manifest) and its commit.
+   ENOSPC if the card is too small for the layout. */
+int  sdplan_format(sdplan *p, bool erase);
+
+/* Write an image of size bytes (0 = unknown, up to the whole card). With
+   a block map, unmapped ranges are discarded instead; with delta the
+   image range is compared first and at most all of it rewritten. EFBIG
+   if the image is larger than the card. */
+int  sdplan_image(sdplan *p, uint64_t size, const sdio_extent *map, size_t nmap, bool delta);
+
+/* The manifest for covered bytes (0 = the whole card), at the start of
+   p2 where the SDPrep layout puts it; nothing if that is inside the
+   covered range. */
+int  sdplan_manifest(sdplan *p, uint64_t covered);
+
+/* --verify: the manifest plus a sample of blocks, or (at most) every
+   block; only those p1's filesystem uses are read. */
+int  sdplan_verify(sdplan *p, bool full);
+
+double sdplan_op_seconds(const sdplan *p, const sdplan_op *op);
+double sdplan_seconds(const sdplan *p);
+
+/* "1h 05m", "3m 20s", "12s". */
+void sdplan_eta_str(double sec, char *out, size_t outsz);
+
+/* Header line, then the ranges (at most max_ranges per kind, the rest
+   summed up), then totals and the estimate. */
+void sdplan_print(const sdplan *p, FILE *out, size_t max_ranges);
+
+#endif /* SDPLAN_H */
@@ -0,0 +1,289 @@
+#define _GNU_SOURCE
+#include "sdpool.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+/* ============================================================
+   Size classes and free lists
+   Class c holds buffers of 4 KiB << c. Free buffers are chained
+   through their first word. Small classes also have a short
+   per-thread list, so workers that keep reading a sector or a
+   block at a time never touch the lock.
+
+   The ceiling counts everything mapped, cached or not. A get
+   that would cross it first unmaps cached buffers of other
+   sizes, then waits for puts. If nobody holds a buffer, or
+   nothing comes back for a while (a job waiting on itself, or
+   two jobs each holding half), it goes over rather than
+   deadlock.
+   ============================================================ */
+
+#define MIN_SHIFT     12
+#define NCLASS        19              /* 4 KiB .. 1 GiB */
+#define TC_CLASSES    9               /* up to 1 MiB per thread */
+#define TC_MAX        4
+#define HUGE_MIN      (2u * 1024 * 1024)
+#define STALL_SEC     2
+
+static pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  cv = PTHREAD_COND_INITIALIZER;
+static pthread_once_t  once = PTHREAD_ONCE_INIT;
+static pthread_key_t   tc_key;
+
+static void    *free_head[NCLASS];
+static int      nfree[NCLASS];
+static uint64_t limit_bytes;
+static bool     use_huge;
+static bool     configured;
+static uint64_t mapped, in_use, peak, waits, nputs;
+static int      nwaiting;
+
+static __thread void *tc_head[TC_CLASSES];
+static __thread int   tc_n[TC_CLASSES];
+
+static int class_of(size_t len) {
+    int c = 0;
+    while (c < NCLASS - 1 && ((size_t)1 << (MIN_SHIFT + c)) < len) c++;
+    return c;
+}
+
+static size_t class_size(int c) { return (size_t)1 << (MIN_SHIFT + c); }
+
+static void *map_buf(size_t size) {
+    void *p = MAP_FAILED;
+    if (use_huge && size >= HUGE_MIN)
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p == MAP_FAILED) {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) return NULL;
+        /* No reserved hugetlb pages: transparent hugepages, if enabled. */
+        if (use_huge && size >= HUGE_MIN) madvise(p, size, MADV_HUGEPAGE);
+    }
+    return p;
+}
+
+/* Thread exit: cached buffers go back to the shared lists. */
+static void tc_flush(void *unused) {
+    (void)unused;
+    pthread_mutex_lock(&mu);
+    for (int c = 0; c < TC_CLASSES; c++) {
+        while (tc_head[c]) {
+            void *b = tc_head[c];
+            tc_head[c] = *(void **)b;
+            *(void **)b = free_head[c];
+            free_head[c] = b;
+            nfree[c]++;
+        }
+        tc_n[c] = 0;
+    }
+    pthread_mutex_unlock(&mu);
+}
+
+uint64_t sdpool_parse_size(const char *s) {
+    char *end = NULL;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (errno || end == s) return 0;
+    switch (*end) {
+    case 'k': case 'K': v <<= 10; end++; break;
+    case 'm': case 'M': v <<= 20; end++; break;
+    case 'g': case 'G': v <<= 30; end++; break;
+    default: break;
+    }
+    if (*end == 'i' || *end == 'B') end++;
+    if (*end == 'B') end++;
+    return *end ? 0 : v;
+}
+
+static void init(void) {
+    pthread_key_create(&tc_key, tc_flush);
+    if (!configured) {
+        const char *m = getenv("SDPREP_MEM_MAX");
+        const char *h = getenv("SDPREP_HUGEPAGES");
+        limit_bytes = m ? sdpool_parse_size(m) : 0;
+        use_huge = h && *h == '1';
+    }
+    if (!limit_bytes) limit_bytes = SDPOOL_LIMIT;
+}
+
+void sdpool_configure(const sdpool_config *c) {
+    pthread_mutex_lock(&mu);
+    limit_bytes = c->limit ? c->limit : SDPOOL_LIMIT;
+    use_huge = c->hugepages;
+    configured = true;
+    pthread_mutex_unlock(&mu);
+}
+
+uint64_t sdpool_limit(void) {
+    pthread_once(&once, init);
+    pthread_mutex_lock(&mu);
+    uint64_t l = limit_bytes;
+    pthread_mutex_unlock(&mu);
+    return l;
+}
+
+size_t sdpool_size(size_t len) {
+    return class_size(class_of(len));
+}
+
+/* Unmap cached buffers of every class but keep (lock held). */
+static void trim_locked(int keep) {
+    for (int c = 0; c < NCLASS; c++) {
+        if (c == keep) continue;
+        while (free_head[c]) {
+            void *b = free_head[c];
+            free_head[c] = *(void **)b;
+            munmap(b, class_size(c));
+            mapped -= class_size(c);
+        }
+        nfree[c] = 0;
+    }
+}
+
+/* Pop k buffers of class c off the shared list (lock held). */
+static void take_locked(void **bufs, int k, int c) {
+    for (int i = 0; i < k; i++) {
+        bufs[i] = free_head[c];
+        free_head[c] = *(void **)bufs[i];
+    }
+    nfree[c] -= k;
+}
+
+int sdpool_get_many(void **bufs, int n, size_t len) {
+    pthread_once(&once, init);
+    int c = class_of(len);
+    size_t size = class_size(c);
+    if (len > size || n <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (n == 1 && c < TC_CLASSES && tc_head[c]) {
+        bufs[0] = tc_head[c];
+        tc_head[c] = *(void **)bufs[0];
+        tc_n[c]--;
+        pthread_mutex_lock(&mu);
+        in_use += size;
+        pthread_mutex_unlock(&mu);
+        return 0;
+    }
+
+    /* All or nothing: a waiter holding part of what it needs could
+       block another waiter doing the same. */
+    pthread_mutex_lock(&mu);
+    uint64_t seen = nputs;
+    time_t since = 0;
+    int got;
+    uint64_t need;
+    for (;;) {
+        got = nfree[c] < n ? nfree[c] : n;
+        need = (uint64_t)(n - got) * size;
+        if (!need || mapped + need <= limit_bytes) break;
+        trim_locked(c);
+        if (mapped + need <= limit_bytes) break;
+
+        /* Nobody to wait for, or nothing coming back: go over. */
+        if (in_use == 0) break;
+        if (!since) {
+            waits++;
+            nwaiting++;
+            since = time(NULL);
+        } else if (nputs != seen) {
+            seen = nputs;
+            since = time(NULL);
+        } else if (time(NULL) - since > STALL_SEC) {
+            break;
+        }
+
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += 1;
+        pthread_cond_timedwait(&cv, &mu, &ts);
+    }
+    if (since) nwaiting--;
+    take_locked(bufs, got, c);
+    mapped += need;
+    in_use += (uint64_t)n * size;
+    if (mapped > peak) peak = mapped;
+    pthread_mutex_unlock(&mu);
+
+    for (int i = got; i < n; i++) {
+        bufs[i] = map_buf(size);
+        if (!bufs[i]) {
+            pthread_mutex_lock(&mu);
+            mapped -= (uint64_t)(n - i) * size;
+            in_use -= (uint64_t)(n - i) * size;
+            pthread_mutex_unlock(&mu);
+            sdpool_put_many(bufs, i, len);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void sdpool_put_many(void **bufs, int n, size_t len) {
+    if (n <= 0) return;
+    int c = class_of(len);
+    size_t size = class_size(c);
+    int i = 0;
+
+    /* A one-off small buffer stays with this thread. */
+    if (c < TC_CLASSES && n == 1 && bufs[0] && tc_n[c] < TC_MAX) {
+        if (!tc_n[c]) pthread_setspecific(tc_key, (void *)1);
+        *(void **)bufs[0] = tc_head[c];
+        tc_head[c] = bufs[0];
+        tc_n[c]++;
+        i = 1;
+    }
+
+    pthread_mutex_lock(&mu);
+    for (; i < n; i++) {
+        if (!bufs[i]) continue;
+        if (mapped > limit_bytes && nwaiting) {
+            munmap(bufs[i], size);   /* went over earlier; others need room */
+            mapped -= size;
+        } else {
+            *(void **)bufs[i] = free_head[c];
+            free_head[c] = bufs[i];
+            nfree[c]++;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        if (bufs[i]) in_use -= size;
+    }
+    nputs++;
+    pthread_cond_broadcast(&cv);
+    pthread_mutex_unlock(&mu);
+}
+
+void *sdpool_get(size_t len) {
+    void *b;
+    return sdpool_get_many(&b, 1, len) == 0 ? b : NULL;
+}
+
+void sdpool_put(void *buf, size_t len) {
+    if (buf) sdpool_put_many(&buf, 1, len);
+}
+
+void sdpool_trim(void) {
+    tc_flush(NULL);
+    pthread_mutex_lock(&mu);
+    trim_locked(-1);
+    pthread_mutex_unlock(&mu);
+}
+
+void sdpool_get_stats(sdpool_stats *st) {
+    pthread_mutex_lock(&mu);
+    st->mapped = mapped;
+    st->in_use = in_use;
+    st->peak = peak;
+    st->waits = waits;
+    pthread_mutex_unlock(&mu);
+}
@@ -0,0 +1,59 @@
+#ifndef SDPOOL_H
+#define SDPOOL_H
+
+/* ============================================================
+   sdpool – shared arena of aligned I/O buffers
+   Every device read and write buffer comes from here: page
+   aligned (so fine for O_DIRECT on any sector size), sized in
+   powers of two, kept on free lists for reuse, and optionally
+   hugepage backed. The memory ceiling is for the whole process,
+   so many cards in parallel share one budget.
+   ============================================================ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SDPOOL_LIMIT (1024ULL * 1024 * 1024)   /* default ceiling */
+
+typedef struct {
+    uint64_t limit;       /* bytes mapped at most, 0 = SDPOOL_LIMIT */
+    bool     hugepages;   /* back buffers of 2 MiB and up with hugepages */
+} sdpool_config;
+
+typedef struct {
+    uint64_t mapped;      /* in use plus cached */
+    uint64_t in_use;
+    uint64_t peak;        /* highest mapped */
+    uint64_t waits;       /* gets that had to wait for the ceiling */
+} sdpool_stats;
+
+/* Set the ceiling and hugepage use. Optional; otherwise SDPREP_MEM_MAX
+   (bytes, or with a K/M/G suffix) and SDPREP_HUGEPAGES=1 are read from the
+   environment on first use. */
+void   sdpool_configure(const sdpool_config *c);
+
+/* The ceiling in force, for callers that size their rings to it. */
+uint64_t sdpool_limit(void);
+
+/* "512M", "2G", "65536": bytes, 0 if malformed. */
+uint64_t sdpool_parse_size(const char *s);
+
+/* Bytes actually handed out for a request of len. */
+size_t sdpool_size(size_t len);
+
+/* n buffers of len bytes each, all or nothing. Waits while the ceiling
+   would be exceeded and others still hold buffers. */
+int    sdpool_get_many(void **bufs, int n, size_t len);
+void   sdpool_put_many(void **bufs, int n, size_t len);
+
+/* One buffer; NULL with errno set on failure. */
+void  *sdpool_get(size_t len);
+void   sdpool_put(void *buf, size_t len);
+
+/* Unmap every cached buffer. */
+void   sdpool_trim(void);
+
+void   sdpool_get_stats(sdpool_stats *st);
+
+#endif /* SDPOOL_H */
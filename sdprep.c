@@ -1,14 +1,17 @@
 #define _GNU_SOURCE
 #include <gtk/gtk.h>
-#include <json-c/json.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <signal.h>
 #include <errno.h>
 #include <ctype.h>
 
+#include "sdenum.h"
+#include "sdmetrics.h"
+
 /* ============================================================
    SDPrep – GUI SD/USB Formatter (GTK3)  
    Full stable build with icon support, perception scoring,
@@ -22,13 +25,75 @@ typedef struct {
     GtkWidget *progress_bar;
     GtkWidget *status_label;
     GtkWidget *format_button;
+    GtkWidget *dup_button;
     GtkWidget *abort_button;
     GtkWidget *refresh_button;
     GtkWidget *restrict_toggle;
+    GtkWidget *skip_toggle;
+    GtkWidget *scan_toggle;
     GPid child_pid;
     gboolean formatting;
+
+    /* Running job: its own process group, so Abort reaches whatever
+       does the I/O; "Stage:" and "Aborted:" lines from its output
+       say how far it got. Jobs that run sdprep-cli export their own
+       metrics; for the others the GUI keeps them. */
+    const char *job_name;
+    gboolean job_metrics;
+    gboolean aborting;
+    gchar *stage;
+    gchar *abort_msg;
+    GIOChannel *out;
+    guint out_watch;
+
+    /* Device list: filled in the background after the window is up.
+       A refresh bumps enum_gen so a slower earlier pass is dropped. */
+    guint enum_gen;
+    gboolean enumerating;
 } AppData;
 
+/* ------------------------------------------------------------
+   Startup timing: SDPREP_TIMING=1 prints when each step of a
+   cold start was reached, counted from exec
+   ------------------------------------------------------------ */
+static gint64 t_main;        /* g_get_monotonic_time() at main() */
+static double exec_to_main;  /* ms, from /proc/self/stat */
+
+static double since_exec_ms(void) {
+    return exec_to_main + (g_get_monotonic_time() - t_main) / 1000.0;
+}
+
+static void startup_init(void) {
+    t_main = g_get_monotonic_time();
+    const char *on = getenv("SDPREP_TIMING");
+    if (!on || *on != '1') {
+        t_main = 0;
+        return;
+    }
+
+    /* Field 22 is the start time in clock ticks since boot */
+    gchar *buf = NULL;
+    struct timespec now;
+    if (g_file_get_contents("/proc/self/stat", &buf, NULL, NULL) &&
+        clock_gettime(CLOCK_BOOTTIME, &now) == 0) {
+        const char *p = strrchr(buf, ')');
+        int field = 2;
+        while (p && field < 22) {
+            p = strchr(p + 1, ' ');
+            field++;
+        }
+        if (p) {
+            double started = g_ascii_strtod(p + 1, NULL) / sysconf(_SC_CLK_TCK);
+            exec_to_main = (now.tv_sec + now.tv_nsec / 1e9 - started) * 1000.0;
+        }
+    }
+    g_free(buf);
+}
+
+static void startup_mark(const char *what) {
+    if (t_main) g_printerr("startup: %-14s %7.1f ms\n", what, since_exec_ms());
+}
+
 /* ------------------------------------------------------------
    Show status text
    ------------------------------------------------------------ */
@@ -51,245 +116,149 @@ static gboolean require_root_dialog(GtkWindow *parent) {
     return FALSE;
 }
 
-/* ------------------------------------------------------------
-   Read command output safely
-   ------------------------------------------------------------ */
-static char *read_command_stdout(const char *cmdline) {
-    gchar *out = NULL, *err = NULL;
-    int status = 0;
-
-    gboolean ok = g_spawn_command_line_sync(
-        cmdline, &out, &err, &status, NULL
-    );
-
-    if (!ok || status != 0) {
-        if (err) {
-            g_printerr("Command failed: %s\nError: %s\n", cmdline, err);
-            g_free(err);
-        }
-        if (out) g_free(out);
-        return NULL;
-    }
-
-    if (err) g_free(err);
-    return out;
-}
-
-/* ------------------------------------------------------------
-   Detect if /dev/<disk> is the root parent device
-   ------------------------------------------------------------ */
-static gboolean is_root_parent_device(const char *devpath) {
-    char *src = read_command_stdout("df -P / | tail -1 | awk '{print $1}'");
-    if (!src) return FALSE;
-
-    g_strchomp(src);
-    char cmd[256];
-    snprintf(cmd, sizeof(cmd), "lsblk -no PKNAME %s 2>/dev/null", src);
-    g_free(src);
-
-    char *pk = read_command_stdout(cmd);
-    if (!pk) return FALSE;
-
-    g_strchomp(pk);
-    char parent[256];
-    snprintf(parent, sizeof(parent), "/dev/%s", pk);
-    g_free(pk);
-
-    return strcmp(parent, devpath) == 0;
-}
-
-/* ------------------------------------------------------------
-   Avoid system mountpoints
-   ------------------------------------------------------------ */
-static gboolean device_has_system_mount(json_object *dev) {
-    json_object *children = NULL;
-    if (!json_object_object_get_ex(dev, "children", &children)) return FALSE;
-    if (!json_object_is_type(children, json_type_array)) return FALSE;
-
-    const char *sys[] = {
-        "/", "/boot", "/boot/efi", "/usr", "/var",
-        "/opt", "/snap", "/recovery", NULL
-    };
-
-    int n = json_object_array_length(children);
-    for (int i = 0; i < n; i++) {
-        json_object *part = json_object_array_get_idx(children, i);
-        json_object *mp = NULL;
-        if (!json_object_object_get_ex(part, "mountpoint", &mp)) continue;
-        if (json_object_is_type(mp, json_type_null)) continue;
-
-        const char *val = json_object_get_string(mp);
-        if (!val) continue;
-
-        for (int k = 0; sys[k]; k++) {
-            if (strcmp(val, sys[k]) == 0)
-                return TRUE;
-        }
-    }
-    return FALSE;
-}
-
 /* ------------------------------------------------------------
    Perception scoring engine
+   Only SCSI disks and card slots reach it: sdenum drops loop,
+   dm, zram and nvme devices on their major number.
    ------------------------------------------------------------ */
-static int score_device(const char *name,
-                        const char *tran,
-                        long rm,
-                        const char *size)
+#define GIB (1024ULL * 1024ULL * 1024ULL)
+
+static int score_device(const sdenum_dev *d)
 {
     int score = 0;
 
-    if (name && g_str_has_prefix(name, "mmcblk")) score += 5;
-    if (rm == 1) score += 3;
-
-    if (tran) {
-        if (strcmp(tran, "mmc") == 0) score += 4;
-        if (strcmp(tran, "usb") == 0) score += 3;
-    }
-
-    if (size && g_str_has_suffix(size, "G")) {
-        double g = atof(size);
-        if (g < 512.0) score += 2;
-    }
+    if (d->bus == SDENUM_MMC) score += 9;   /* a slot, and mmc transport */
+    if (d->removable) score += 3;
+    if (d->bus == SDENUM_USB) score += 3;
 
-    if (size && strcmp(size, "0B") == 0) score -= 3;
-    if (name && g_str_has_prefix(name, "loop")) score -= 10;
-    if (name && g_str_has_prefix(name, "zram")) score -= 10;
-    if (name && g_str_has_prefix(name, "nvme")) score -= 7;
+    if (d->size >= GIB && d->size < 512 * GIB) score += 2;
+    if (d->size == 0) score -= 3;
 
     return score;
 }
 
 /* ------------------------------------------------------------
    Determine candidate disks (Safe or Maybe)
+   Disks holding /, /boot, /usr and the like never qualify.
    ------------------------------------------------------------ */
-static gboolean is_candidate_disk(json_object *dev,
+static gboolean is_candidate_disk(const sdenum_dev *d,
                                   gboolean restrict_mode,
                                   char *out_path, size_t out_ps,
                                   char *out_desc, size_t out_ds,
                                   int *out_score)
 {
-    json_object *jname=NULL, *jtype=NULL, *jrm=NULL, *jsize=NULL;
-    json_object *jmodel=NULL, *jtran=NULL;
+    if (d->system) return FALSE;
+    if (restrict_mode && d->size >= 1024 * GIB) return FALSE;
 
-    if (!json_object_object_get_ex(dev, "name", &jname)) return FALSE;
-    if (!json_object_object_get_ex(dev, "type", &jtype)) return FALSE;
-
-    if (strcmp(json_object_get_string(jtype), "disk") != 0) return FALSE;
-
-    const char *name  = json_object_get_string(jname);
-    const char *model = (json_object_object_get_ex(dev, "model", &jmodel) &&
-                         !json_object_is_type(jmodel, json_type_null))
-                        ? json_object_get_string(jmodel) : "";
-    const char *tran  = (json_object_object_get_ex(dev, "tran", &jtran) &&
-                         !json_object_is_type(jtran, json_type_null))
-                        ? json_object_get_string(jtran) : "";
-
-    long rm = (json_object_object_get_ex(dev, "rm", &jrm))
-              ? json_object_get_int(jrm)
-              : 0;
-
-    const char *size = (json_object_object_get_ex(dev, "size", &jsize) &&
-                        !json_object_is_type(jsize, json_type_null))
-                        ? json_object_get_string(jsize) : "";
+    int score = score_device(d);
+    if (score <= 0) return FALSE;
 
     char path[64];
-    snprintf(path, sizeof(path), "/dev/%s", name);
-
-    if (is_root_parent_device(path)) return FALSE;
-    if (device_has_system_mount(dev)) return FALSE;
-
-    int score = score_device(name, tran, rm, size);
-
-    if (restrict_mode && g_str_has_suffix(size, "T"))
-        return FALSE;
-
-    if (score <= 0) return FALSE;
+    g_snprintf(path, sizeof(path), "/dev/%s", d->name);
 
     if (out_score) *out_score = score;
     if (out_path)  g_strlcpy(out_path, path, out_ps);
 
-    if (out_desc)
+    if (out_desc) {
+        gchar *size = d->size ? g_format_size_full(d->size, G_FORMAT_SIZE_IEC_UNITS)
+                              : g_strdup("no media");
         g_snprintf(out_desc, out_ds, "%s  %s  [%s]",
-                   path,
-                   (model && *model) ? model : "Removable",
-                   size && *size ? size : "unknown");
-
+                   path, d->model[0] ? d->model : "Removable", size);
+        g_free(size);
+    }
     return TRUE;
 }
 
 /* ------------------------------------------------------------
    Populate device dropdown
+   sysfs is read on a worker thread (no lsblk, no JSON), so the
+   window never waits on enumeration; the candidates are then
+   added in one go.
    ------------------------------------------------------------ */
-static gboolean populate_devices(AppData *app) {
-    gtk_combo_box_text_remove_all(GTK_COMBO_BOX_TEXT(app->device_combo));
-
-    char *js = read_command_stdout(
-        "lsblk -J -o NAME,RM,SIZE,MODEL,TRAN,TYPE,MOUNTPOINT"
-    );
-    if (!js) {
-        set_status(app, "Failed: lsblk did not return data.");
-        return FALSE;
-    }
+#define MAX_DEVICES 256
 
-    json_object *root = json_tokener_parse(js);
-    g_free(js);
+typedef struct {
+    AppData *app;
+    guint gen;
+    gboolean restrict_mode;
+    sdenum_dev found[MAX_DEVICES];
+    int n;
+} DeviceScan;
+
+static void device_scan_thread(GTask *task, gpointer src, gpointer data,
+                               GCancellable *cancel)
+{
+    (void)src; (void)cancel;
+    DeviceScan *scan = data;
+    scan->n = sdenum_scan(NULL, scan->found, MAX_DEVICES, NULL);
+    if (scan->n > MAX_DEVICES) scan->n = MAX_DEVICES;
+    g_task_return_boolean(task, scan->n >= 0);
+}
 
-    if (!root) {
-        set_status(app, "JSON parse error.");
-        return FALSE;
-    }
+static void device_scan_done_cb(GObject *src, GAsyncResult *res, gpointer data) {
+    (void)src;
+    DeviceScan *scan = data;
+    AppData *app = scan->app;
+    gboolean ok = g_task_propagate_boolean(G_TASK(res), NULL);
 
-    json_object *arr = NULL;
-    if (!json_object_object_get_ex(root, "blockdevices", &arr)) {
-        json_object_put(root);
-        return FALSE;
+    if (scan->gen != app->enum_gen) {
+        g_free(scan);
+        return;
     }
 
-    gboolean restrict_mode =
-        gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(app->restrict_toggle));
-
-    int n = json_object_array_length(arr);
+    gtk_combo_box_text_remove_all(GTK_COMBO_BOX_TEXT(app->device_combo));
     int added = 0;
-
-    for (int i = 0; i < n; i++) {
-        json_object *dev = json_object_array_get_idx(arr, i);
-
+    for (int i = 0; ok && i < scan->n; i++) {
         char path[128], desc[256];
         int score = 0;
-
-        if (is_candidate_disk(dev, restrict_mode,
-                              path, sizeof(path),
-                              desc, sizeof(desc),
-                              &score))
-        {
-            char id[160];
-            char grade = (score >= 5) ? 'S' : 'M';
-
-            snprintf(id, sizeof(id), "%c:%s", grade, path);
-
-            gtk_combo_box_text_append(
-                GTK_COMBO_BOX_TEXT(app->device_combo),
-                id, desc
-            );
-            added++;
-        }
+        if (!is_candidate_disk(&scan->found[i], scan->restrict_mode,
+                               path, sizeof(path), desc, sizeof(desc), &score))
+            continue;
+
+        char id[160];
+        char grade = (score >= 5) ? 'S' : 'M';
+        snprintf(id, sizeof(id), "%c:%s", grade, path);
+        gtk_combo_box_text_append(GTK_COMBO_BOX_TEXT(app->device_combo), id, desc);
+        added++;
     }
-
-    json_object_put(root);
-
-    if (added == 0) {
+    if (added == 0)
         gtk_combo_box_text_append(
             GTK_COMBO_BOX_TEXT(app->device_combo),
             "",
             "— No safe removable media detected —"
         );
-        gtk_combo_box_set_active(GTK_COMBO_BOX(app->device_combo), 0);
-        return FALSE;
+    gtk_combo_box_set_active(GTK_COMBO_BOX(app->device_combo), 0);
+
+    app->enumerating = FALSE;
+    if (!app->formatting) {
+        gtk_widget_set_sensitive(app->refresh_button, TRUE);
+        set_status(app, ok ? "Ready." : "Failed: cannot read /sys/block.");
     }
+    gchar *what = g_strdup_printf("devices (%d)", added);
+    startup_mark(what);
+    g_free(what);
+    g_free(scan);
+}
 
+static void populate_devices(AppData *app) {
+    DeviceScan *scan = g_new0(DeviceScan, 1);
+    scan->app = app;
+    scan->gen = ++app->enum_gen;
+    scan->restrict_mode =
+        gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(app->restrict_toggle));
+
+    gtk_combo_box_text_remove_all(GTK_COMBO_BOX_TEXT(app->device_combo));
+    gtk_combo_box_text_append(GTK_COMBO_BOX_TEXT(app->device_combo),
+                              "", "Looking for devices…");
     gtk_combo_box_set_active(GTK_COMBO_BOX(app->device_combo), 0);
-    return TRUE;
+    gtk_widget_set_sensitive(app->refresh_button, FALSE);
+    app->enumerating = TRUE;
+    if (!app->formatting) set_status(app, "Looking for devices…");
+
+    GTask *task = g_task_new(NULL, NULL, device_scan_done_cb, scan);
+    g_task_set_task_data(task, scan, NULL);
+    g_task_run_in_thread(task, device_scan_thread);
+    g_object_unref(task);
 }
 
 /* ------------------------------------------------------------
@@ -304,39 +273,201 @@ static gboolean update_progress_cb(gpointer data) {
     if (p > 0.95) p = 0.95;
 
     gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(app->progress_bar), p);
+    if (app->job_metrics) sdmetrics_tick();
     return TRUE;
 }
 
+/* ------------------------------------------------------------
+   Job output: follow "Stage:" and keep the "Aborted:" report
+   ------------------------------------------------------------ */
+static void job_line(AppData *app, const char *line) {
+    if (g_str_has_prefix(line, "Stage: ")) {
+        g_free(app->stage);
+        app->stage = g_strdup(line + 7);
+        if (app->job_metrics) sdmetrics_stage(app->stage);
+    } else if (g_str_has_prefix(line, "Aborted: ")) {
+        g_free(app->abort_msg);
+        app->abort_msg = g_strdup(line);
+    }
+}
+
+static gboolean job_output_cb(GIOChannel *ch, GIOCondition cond, gpointer data) {
+    AppData *app = data;
+    gchar *line = NULL;
+    gsize len = 0;
+    GIOStatus st = G_IO_STATUS_NORMAL;
+
+    while ((st = g_io_channel_read_line(ch, &line, &len, NULL, NULL)) == G_IO_STATUS_NORMAL) {
+        g_strchomp(line);
+        job_line(app, line);
+        g_free(line);
+    }
+    if (st == G_IO_STATUS_AGAIN && !(cond & (G_IO_HUP | G_IO_ERR))) return TRUE;
+
+    app->out_watch = 0;
+    return G_SOURCE_REMOVE;
+}
+
+static void new_process_group(gpointer unused) {
+    (void)unused;
+    setpgid(0, 0);
+    dup2(STDOUT_FILENO, STDERR_FILENO);   /* one stream to follow */
+}
+
 /* ------------------------------------------------------------
    Child exit handler
    ------------------------------------------------------------ */
 static void child_watch_cb(GPid pid, gint status, gpointer data) {
     AppData *app = data;
 
+    /* Whatever the job printed last is still in the pipe. */
+    if (app->out) {
+        if (app->out_watch) g_source_remove(app->out_watch);
+        app->out_watch = 0;
+        job_output_cb(app->out, G_IO_HUP, app);
+        g_io_channel_unref(app->out);
+        app->out = NULL;
+    }
+
     app->formatting = FALSE;
     gtk_widget_set_sensitive(app->format_button, TRUE);
+    gtk_widget_set_sensitive(app->dup_button, TRUE);
     gtk_widget_set_sensitive(app->abort_button, FALSE);
-    gtk_widget_set_sensitive(app->refresh_button, TRUE);
+    gtk_widget_set_sensitive(app->refresh_button, !app->enumerating);
 
     gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(app->progress_bar), 1.0);
 
     if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
-        set_status(app, "Format completed.");
+        gchar *msg = g_strdup_printf("%s completed.", app->job_name);
+        set_status(app, msg);
+        g_free(msg);
+    } else if (app->aborting) {
+        gchar *msg = app->abort_msg
+            ? g_strdup_printf("%s The card is incomplete.", app->abort_msg)
+            : g_strdup_printf("Aborted during %s. The card is incomplete.",
+                              app->stage ? app->stage : "startup");
+        set_status(app, msg);
+        g_free(msg);
     } else {
-        set_status(app, "Format failed or aborted.");
+        gchar *msg = g_strdup_printf("%s failed%s%s.", app->job_name,
+                                     app->stage ? " during " : "",
+                                     app->stage ? app->stage : "");
+        set_status(app, msg);
+        g_free(msg);
     }
 
+    if (app->job_metrics) {
+        sdmetrics_card(WIFEXITED(status) && WEXITSTATUS(status) == 0 ? "ok"
+                       : app->aborting ? "aborted" : "failed");
+        sdmetrics_close();
+        app->job_metrics = FALSE;
+    }
+
+    app->aborting = FALSE;
+    g_clear_pointer(&app->stage, g_free);
+    g_clear_pointer(&app->abort_msg, g_free);
     g_spawn_close_pid(pid);
 }
 
+/* ------------------------------------------------------------
+   Start a job (bash command line) in its own process group
+   With metrics_dev the GUI records the job's metrics itself and
+   keeps sdprep-cli steps inside it from counting the card again.
+   ------------------------------------------------------------ */
+static gboolean start_job(AppData *app, const char *cmd, const char *name,
+                          const char *metrics_dev) {
+    gint out_fd = -1;
+    GError *err = NULL;
+    gchar **envp = g_get_environ();
+    if (metrics_dev) envp = g_environ_unsetenv(envp, "SDPREP_METRICS_DIR");
+    gboolean ok = g_spawn_async_with_pipes(
+        NULL,
+        (gchar *[]){ "/bin/bash", "-c", (gchar *)cmd, NULL },
+        envp,
+        G_SPAWN_DO_NOT_REAP_CHILD,
+        new_process_group, NULL,
+        &app->child_pid,
+        NULL, &out_fd, NULL,
+        &err
+    );
+    g_strfreev(envp);
+    if (!ok) {
+        set_status(app, err ? err->message : "Failed to start process.");
+        if (err) g_error_free(err);
+        return FALSE;
+    }
+
+    app->job_name = name;
+    app->aborting = FALSE;
+    if (metrics_dev) {
+        gchar *job = g_ascii_strdown(name, -1);
+        app->job_metrics = sdmetrics_open(job, metrics_dev);
+        g_free(job);
+    }
+    app->out = g_io_channel_unix_new(out_fd);
+    g_io_channel_set_close_on_unref(app->out, TRUE);
+    g_io_channel_set_encoding(app->out, NULL, NULL);
+    g_io_channel_set_flags(app->out, G_IO_FLAG_NONBLOCK, NULL);
+    app->out_watch = g_io_add_watch(app->out, G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                    job_output_cb, app);
+
+    gtk_widget_set_sensitive(app->format_button, FALSE);
+    gtk_widget_set_sensitive(app->dup_button, FALSE);
+    gtk_widget_set_sensitive(app->refresh_button, FALSE);
+    gtk_widget_set_sensitive(app->abort_button, TRUE);
+    gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(app->progress_bar), 0.0);
+    app->formatting = TRUE;
+
+    g_child_watch_add(app->child_pid, child_watch_cb, app);
+    g_timeout_add(200, update_progress_cb, app);
+    return TRUE;
+}
+
 /* ------------------------------------------------------------
    Abort
    ------------------------------------------------------------ */
 static void on_abort_clicked(GtkButton *btn, AppData *app) {
     if (app->formatting && app->child_pid > 0) {
-        kill(app->child_pid, SIGTERM);
-        set_status(app, "Aborting…");
+        /* The whole group: bash, and sdprep-cli or mkfs.fat under it.
+           sdprep-cli stops at its next request and reports the offset. */
+        kill(-app->child_pid, SIGTERM);
+        app->aborting = TRUE;
+        gchar *msg = g_strdup_printf("Aborting %s…", app->stage ? app->stage : "");
+        set_status(app, msg);
+        g_free(msg);
+    }
+}
+
+/* ------------------------------------------------------------
+   Locate the command-line engine (next to us, then PATH)
+   ------------------------------------------------------------ */
+static gchar *find_sdprep_cli(void) {
+    gchar *self = g_file_read_link("/proc/self/exe", NULL);
+    if (self) {
+        gchar *dir = g_path_get_dirname(self);
+        gchar *cli = g_build_filename(dir, "sdprep-cli", NULL);
+        g_free(dir);
+        g_free(self);
+        if (access(cli, X_OK) == 0) return cli;
+        g_free(cli);
     }
+    return g_find_program_in_path("sdprep-cli");
+}
+
+/* ------------------------------------------------------------
+   Already prepared? (layout, FAT32 and label; a few sectors)
+   ------------------------------------------------------------ */
+static gboolean card_is_provisioned(const char *devpath, const char *label) {
+    gchar *cli = find_sdprep_cli();
+    if (!cli) return FALSE;
+
+    gchar *argv[] = { cli, "--check", "--label", (gchar *)label, (gchar *)devpath, NULL };
+    gint status = 0;
+    gboolean ok = g_spawn_sync(NULL, argv, NULL,
+                               G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL,
+                               NULL, NULL, NULL, NULL, &status, NULL);
+    g_free(cli);
+    return ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
 }
 
 /* ------------------------------------------------------------
@@ -344,7 +475,7 @@ static void on_abort_clicked(GtkButton *btn, AppData *app) {
    ------------------------------------------------------------ */
 static void on_format_clicked(GtkButton *btn, AppData *app) {
     const gchar *raw_id_c = gtk_combo_box_get_active_id(GTK_COMBO_BOX(app->device_combo));
-    if (!raw_id_c) {
+    if (!raw_id_c || !*raw_id_c) {
         set_status(app, "Select a valid removable device.");
         return;
     }
@@ -369,6 +500,17 @@ static void on_format_clicked(GtkButton *btn, AppData *app) {
         }
     }
 
+    /* Station mode: leave cards that are already prepared alone */
+    const char *label = gtk_entry_get_text(GTK_ENTRY(app->label_entry));
+    if (!label || !*label) label = "MICROPYTHON";
+
+    if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(app->skip_toggle)) &&
+        card_is_provisioned(devpath, label)) {
+        set_status(app, "Already prepared (layout and label match), skipped.");
+        g_free(raw_id);
+        return;
+    }
+
     /* Confirm erase */
     GtkWidget *dlg = gtk_message_dialog_new(GTK_WINDOW(app->window),
         GTK_DIALOG_MODAL, GTK_MESSAGE_WARNING, GTK_BUTTONS_OK_CANCEL,
@@ -381,10 +523,25 @@ static void on_format_clicked(GtkButton *btn, AppData *app) {
         return;
     }
 
-    /* Build command */
-    const char *label = gtk_entry_get_text(GTK_ENTRY(app->label_entry));
-    if (!label || !*label) label = "MICROPYTHON";
+    /* Surface check ahead of wipefs: a card with unreadable regions
+       stops the job before anything is written to it */
+    gchar *scan_step = g_strdup("");
+    if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(app->scan_toggle))) {
+        gchar *cli = find_sdprep_cli();
+        if (!cli) {
+            set_status(app, "sdprep-cli not found (make sdprep-cli).");
+            g_free(scan_step);
+            g_free(raw_id);
+            return;
+        }
+        gchar *qcli = g_shell_quote(cli);
+        g_free(scan_step);
+        scan_step = g_strdup_printf("%s --scan sample --scan-only \"$dev\"; ", qcli);
+        g_free(qcli);
+        g_free(cli);
+    }
 
+    /* Build command */
     gchar *qdev = g_shell_quote(devpath);
     gchar *qlabel = g_shell_quote(label);
 
@@ -392,7 +549,31 @@ static void on_format_clicked(GtkButton *btn, AppData *app) {
         "bash -c '"
         "set -e; "
         "dev=%s; "
+
+        /* keep udisks off the card and its new partitions until the
+           script ends; the rule is named after this shell so sdprep-cli
+           sweeps it if the shell is killed outright */
+        "n=$(basename \"$(readlink -f \"$dev\")\"); "
+        "case $n in *[0-9]) pn=${n}p ;; *) pn=$n ;; esac; "
+        "rule=/run/udev/rules.d/90-sdprep-$$.rules; "
+        "if [ -d /run/udev ]; then "
+        "mkdir -p /run/udev/rules.d; "
+        "echo \"SUBSYSTEM==\\\"block\\\", KERNEL==\\\"$n|$pn[0-9]*\\\", "
+        "ENV{UDISKS_AUTO}=\\\"0\\\", ENV{UDISKS_IGNORE}=\\\"1\\\"\" > \"$rule\"; "
+        "reload() { udevadm control --reload; "
+        "udevadm trigger --action=change --sysname-match=\"$n\" --sysname-match=\"$n*\"; "
+        "udevadm settle; } >/dev/null 2>&1; "
+        "trap \"rm -f $rule; reload || true\" EXIT; "
+        "trap \"exit 130\" INT TERM HUP; "
+        "reload || true; "
+        "fi; "
+        "lsblk -nrpo NAME \"$dev\" | tail -n +2 | "
+        "while read -r p; do umount \"$p\" 2>/dev/null || true; done; "
+
+        "%s"
+        "echo \"Stage: wipefs\"; "
         "wipefs -a \"$dev\"; "
+        "echo \"Stage: partition\"; "
         "parted -s \"$dev\" mklabel msdos; "
 
         "bytes=$(lsblk -nbdo SIZE \"$dev\"); "
@@ -406,48 +587,137 @@ static void on_format_clicked(GtkButton *btn, AppData *app) {
         "partprobe \"$dev\"; udevadm settle; "
 
         "if echo \"$dev\" | grep -Eq \"[0-9]$\"; then P1=\"${dev}p1\"; else P1=\"${dev}1\"; fi; "
+        "echo \"Stage: mkfs.fat\"; "
         "mkfs.fat -F32 -I -n %s \"$P1\"; "
-        "'", qdev, qlabel
+        "'", qdev, scan_step, qlabel
     );
 
     g_free(qdev);
     g_free(qlabel);
-    g_free(raw_id);
+    g_free(scan_step);
 
-    gtk_widget_set_sensitive(app->format_button, FALSE);
-    gtk_widget_set_sensitive(app->refresh_button, FALSE);
-    gtk_widget_set_sensitive(app->abort_button, TRUE);
+    if (start_job(app, cmd, "Format", devpath)) set_status(app, "Formatting…");
+    g_free(cmd);
+    g_free(raw_id);
+}
 
-    gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(app->progress_bar), 0.0);
-    set_status(app, "Formatting…");
-    app->formatting = TRUE;
+/* ------------------------------------------------------------
+   Duplicate one image or card to several devices
+   Targets are the candidates populate_devices() accepted.
+   ------------------------------------------------------------ */
+static void on_duplicate_clicked(GtkButton *btn, AppData *app) {
+    gchar *cli = find_sdprep_cli();
+    if (!cli) {
+        set_status(app, "sdprep-cli not found (make sdprep-cli).");
+        return;
+    }
 
-    GError *err = NULL;
-    gboolean ok = g_spawn_async(
-        NULL,
-        (gchar *[]){ "/bin/bash", "-c", cmd, NULL },
-        NULL,
-        G_SPAWN_DO_NOT_REAP_CHILD,
-        NULL, NULL,
-        &app->child_pid,
-        &err
+    GtkWidget *dlg = gtk_dialog_new_with_buttons(
+        "Duplicate", GTK_WINDOW(app->window), GTK_DIALOG_MODAL,
+        "_Cancel", GTK_RESPONSE_CANCEL,
+        "_Duplicate", GTK_RESPONSE_OK,
+        NULL
     );
-    g_free(cmd);
+    GtkWidget *box = gtk_dialog_get_content_area(GTK_DIALOG(dlg));
+    gtk_box_set_spacing(GTK_BOX(box), 6);
+    gtk_container_set_border_width(GTK_CONTAINER(box), 12);
+
+    gtk_box_pack_start(GTK_BOX(box),
+                       gtk_label_new("Source image (raw, .xz or .zst):"), FALSE, FALSE, 0);
+    GtkWidget *chooser = gtk_file_chooser_button_new(
+        "Source image", GTK_FILE_CHOOSER_ACTION_OPEN
+    );
+    gtk_box_pack_start(GTK_BOX(box), chooser, FALSE, FALSE, 0);
+
+    gtk_box_pack_start(GTK_BOX(box), gtk_label_new("Targets:"), FALSE, FALSE, 0);
+
+    /* One check box per device in the dropdown */
+    GtkTreeModel *model = gtk_combo_box_get_model(GTK_COMBO_BOX(app->device_combo));
+    int id_col = gtk_combo_box_get_id_column(GTK_COMBO_BOX(app->device_combo));
+    GPtrArray *checks = g_ptr_array_new();
+    GtkTreeIter it;
+    gboolean valid = gtk_tree_model_get_iter_first(model, &it);
+    while (valid) {
+        gchar *id = NULL, *text = NULL;
+        gtk_tree_model_get(model, &it, id_col, &id, 0, &text, -1);
+        if (id && *id) {
+            GtkWidget *cb = gtk_check_button_new_with_label(text);
+            g_object_set_data_full(G_OBJECT(cb), "dev-id", g_strdup(id), g_free);
+            gtk_box_pack_start(GTK_BOX(box), cb, FALSE, FALSE, 0);
+            g_ptr_array_add(checks, cb);
+        }
+        g_free(id);
+        g_free(text);
+        valid = gtk_tree_model_iter_next(model, &it);
+    }
+    gtk_widget_show_all(dlg);
 
-    if (!ok) {
-        set_status(app, err ? err->message : "Failed to start process.");
-        if (err) g_error_free(err);
-        return;
+    gint resp = gtk_dialog_run(GTK_DIALOG(dlg));
+    gchar *image = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(chooser));
+
+    GString *devs = g_string_new(NULL);
+    GString *names = g_string_new(NULL);
+    int ndev = 0;
+    gboolean maybe = FALSE;
+    for (guint i = 0; i < checks->len; i++) {
+        GtkWidget *cb = g_ptr_array_index(checks, i);
+        if (!gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(cb))) continue;
+        const char *id = g_object_get_data(G_OBJECT(cb), "dev-id");
+        gchar *q = g_shell_quote(id + 2);
+        g_string_append_printf(devs, " %s", q);
+        g_string_append_printf(names, "  %s\n", id + 2);
+        g_free(q);
+        if (id[0] == 'M') maybe = TRUE;
+        ndev++;
     }
+    g_ptr_array_free(checks, TRUE);
+    gtk_widget_destroy(dlg);
 
-    g_child_watch_add(app->child_pid, child_watch_cb, app);
-    g_timeout_add(200, update_progress_cb, app);
+    if (resp != GTK_RESPONSE_OK || !image || ndev == 0) {
+        if (resp == GTK_RESPONSE_OK) set_status(app, "Pick an image and at least one target.");
+        goto out;
+    }
+
+    /* Confirm erase */
+    dlg = gtk_message_dialog_new(GTK_WINDOW(app->window),
+        GTK_DIALOG_MODAL, GTK_MESSAGE_WARNING, GTK_BUTTONS_OK_CANCEL,
+        "This will ERASE ALL DATA on %d device%s:\n\n%s%s\nProceed?",
+        ndev, ndev == 1 ? "" : "s", names->str,
+        maybe ? "\nSome may be portable HDDs or SSDs.\n" : "");
+    resp = gtk_dialog_run(GTK_DIALOG(dlg));
+    gtk_widget_destroy(dlg);
+    if (resp != GTK_RESPONSE_OK) goto out;
+
+    gchar *qcli = g_shell_quote(cli);
+    gchar *qimg = g_shell_quote(image);
+    gchar *cmd = g_strdup_printf("echo %d | %s --image %s%s",
+                                 ndev, qcli, qimg, devs->str);
+    g_free(qcli);
+    g_free(qimg);
+
+    if (start_job(app, cmd, "Duplicate", NULL)) set_status(app, "Duplicating…");
+    g_free(cmd);
+
+out:
+    g_string_free(devs, TRUE);
+    g_string_free(names, TRUE);
+    g_free(image);
+    g_free(cli);
 }
 
 /* ------------------------------------------------------------
    GTK UI setup
    ------------------------------------------------------------ */
+static gboolean first_frame_cb(GtkWidget *w, cairo_t *cr, gpointer unused) {
+    (void)cr;
+    (void)unused;
+    startup_mark("first frame");
+    g_signal_handlers_disconnect_by_func(w, G_CALLBACK(first_frame_cb), NULL);
+    return FALSE;
+}
+
 static void activate(GtkApplication *gapp, gpointer user_data) {
+    startup_mark("activate");
     if (!require_root_dialog(NULL)) {
         g_application_quit(G_APPLICATION(gapp));
         return;
@@ -470,12 +740,12 @@ static void activate(GtkApplication *gapp, gpointer user_data) {
     GtkWidget *head = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 6);
     gtk_box_pack_start(GTK_BOX(outer), head, FALSE, FALSE, 0);
 
-    /* Load icon (safe mode) */
+    /* Load icon (safe mode); compiled in from sdprep.gresource.xml */
     GtkWidget *icon = NULL;
     {
         GError *img_err = NULL;
-        GdkPixbuf *pb = gdk_pixbuf_new_from_file_at_scale(
-            "icons/sdprep.png", 48, 48, TRUE, &img_err
+        GdkPixbuf *pb = gdk_pixbuf_new_from_resource_at_scale(
+            "/com/drflores/sdprep/icons/sdprep.png", 48, 48, TRUE, &img_err
         );
         if (pb) {
             icon = gtk_image_new_from_pixbuf(pb);
@@ -517,6 +787,18 @@ static void activate(GtkApplication *gapp, gpointer user_data) {
     gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(app->restrict_toggle), TRUE);
     gtk_grid_attach(GTK_GRID(grid), app->restrict_toggle, 1, 1, 3, 1);
 
+    app->skip_toggle =
+        gtk_check_button_new_with_label(
+            "Skip cards that are already prepared"
+        );
+    gtk_grid_attach(GTK_GRID(grid), app->skip_toggle, 1, 4, 3, 1);
+
+    app->scan_toggle =
+        gtk_check_button_new_with_label(
+            "Check the card surface first (reads a sample)"
+        );
+    gtk_grid_attach(GTK_GRID(grid), app->scan_toggle, 1, 5, 3, 1);
+
     /* Label */
     gtk_grid_attach(GTK_GRID(grid),
                     gtk_label_new("Volume label:"), 0, 2, 1, 1);
@@ -534,11 +816,13 @@ static void activate(GtkApplication *gapp, gpointer user_data) {
     gtk_box_pack_start(GTK_BOX(outer), row, FALSE, FALSE, 0);
 
     app->format_button  = gtk_button_new_with_label("Format");
+    app->dup_button     = gtk_button_new_with_label("Duplicate…");
     app->abort_button   = gtk_button_new_with_label("Abort");
     app->refresh_button = gtk_button_new_with_label("Refresh");
     GtkWidget *quitbtn  = gtk_button_new_with_label("Quit");
 
     gtk_box_pack_start(GTK_BOX(row), app->format_button,  FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(row), app->dup_button,     FALSE, FALSE, 0);
     gtk_box_pack_start(GTK_BOX(row), app->abort_button,   FALSE, FALSE, 0);
     gtk_box_pack_start(GTK_BOX(row), app->refresh_button, FALSE, FALSE, 0);
     gtk_box_pack_start(GTK_BOX(row), quitbtn,             FALSE, FALSE, 0);
@@ -552,6 +836,8 @@ static void activate(GtkApplication *gapp, gpointer user_data) {
     /* Connect signals */
     g_signal_connect(app->format_button, "clicked",
                      G_CALLBACK(on_format_clicked), app);
+    g_signal_connect(app->dup_button, "clicked",
+                     G_CALLBACK(on_duplicate_clicked), app);
     g_signal_connect(app->abort_button, "clicked",
                      G_CALLBACK(on_abort_clicked), app);
     g_signal_connect_swapped(app->refresh_button, "clicked",
@@ -561,14 +847,20 @@ static void activate(GtkApplication *gapp, gpointer user_data) {
 
     app->window = win;
 
-    populate_devices(app);
+    /* Show the window first; devices fill in when the sdenum scan on a
+       worker thread comes back */
+    g_signal_connect(win, "draw", G_CALLBACK(first_frame_cb), NULL);
     gtk_widget_show_all(win);
+    startup_mark("window shown");
+    populate_devices(app);
 }
 
 /* ------------------------------------------------------------
    Main
    ------------------------------------------------------------ */
 int main(int argc, char **argv) {
+    startup_init();
+    startup_mark("main");
     GtkApplication *app =
         gtk_application_new("com.drflores.sdprep", 0);
     g_signal_connect(app, "activate", G_CALLBACK(activate), NULL);
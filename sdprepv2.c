@@ -19,6 +19,7 @@ typedef struct {
     GtkWidget *window;
     GtkWidget *device_combo;
     GtkWidget *label_entry;
+    GtkWidget *scan_toggle;
     GtkWidget *progress_bar;
     GtkWidget *status_label;
     GtkWidget *details_view;
@@ -124,11 +125,10 @@ static void sanitize_fat_label(const char *in, char out[12]) {
 
 static gboolean str_contains_ci(const char *hay, const char *needle) {
     if (!hay || !needle) return FALSE;
-    char *h = g_ascii_strdown(hay, -1);
-    char *n = g_ascii_strdown(needle, -1);
-    gboolean ok = (strstr(h, n) != NULL);
-    g_free(h); g_free(n);
-    return ok;
+    size_t n = strlen(needle);
+    for (; *hay; hay++)
+        if (g_ascii_strncasecmp(hay, needle, n) == 0) return TRUE;
+    return n == 0;
 }
 
 static gboolean looks_like_sd_device(const char *name,
@@ -158,49 +158,44 @@ static gboolean looks_like_sd_device(const char *name,
     return FALSE;
 }
 
+/* One pass: the privileged script keeps udisks away from the device
+   before it unmounts again, so nothing has to be retried here. */
 static gboolean auto_unmount_partitions(AppData *app, const char *disk) {
-    for (int attempt = 1; attempt <= 3; attempt++) {
-        char cmd[512];
-        snprintf(cmd, sizeof(cmd), "lsblk -nrpo NAME,TYPE,MOUNTPOINT %s", disk);
-
-        char *err = NULL;
-        char *out = run_capture(cmd, &err);
-        if (!out) {
-            details_append(app, "Auto-unmount: lsblk failed.");
-            if (err) { details_append(app, err); g_free(err); }
-            return FALSE;
-        }
-        if (err) g_free(err);
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "lsblk -nrpo NAME,TYPE,MOUNTPOINT %s", disk);
 
-        gboolean any = FALSE;
-        gchar **lines = g_strsplit(out, "\n", -1);
-        g_free(out);
+    char *err = NULL;
+    char *out = run_capture(cmd, &err);
+    if (!out) {
+        details_append(app, "Auto-unmount: lsblk failed.");
+        if (err) { details_append(app, err); g_free(err); }
+        return FALSE;
+    }
+    if (err) g_free(err);
 
-        for (int i = 0; lines[i]; i++) {
-            char name[256] = {0}, type[64] = {0}, mp[256] = {0};
-            int n = sscanf(lines[i], "%255s %63s %255[^\n]", name, type, mp);
-            if (n < 2) continue;
-            if (strcmp(type, "part") != 0) continue;
-            if (n == 2 || !mp[0]) continue;
+    gchar **lines = g_strsplit(out, "\n", -1);
+    g_free(out);
 
-            any = TRUE;
-            details_append(app, "Auto-unmount:");
-            details_append(app, name);
+    for (int i = 0; lines[i]; i++) {
+        char name[256] = {0}, type[64] = {0}, mp[256] = {0};
+        int n = sscanf(lines[i], "%255s %63s %255[^\n]", name, type, mp);
+        if (n < 2) continue;
+        if (strcmp(type, "part") != 0) continue;
+        if (n == 2 || !mp[0]) continue;
 
-            char um1[512];
-            snprintf(um1, sizeof(um1), "udisksctl unmount -b %s >/dev/null 2>&1", name);
-            system(um1);
+        details_append(app, "Auto-unmount:");
+        details_append(app, name);
 
-            char um2[512];
-            snprintf(um2, sizeof(um2), "umount %s >/dev/null 2>&1", name);
-            system(um2);
-        }
+        char um1[512];
+        snprintf(um1, sizeof(um1), "udisksctl unmount -b %s >/dev/null 2>&1", name);
+        system(um1);
 
-        g_strfreev(lines);
-        if (!any) return TRUE;
-
-        usleep(250 * 1000);
+        char um2[512];
+        snprintf(um2, sizeof(um2), "umount %s >/dev/null 2>&1", name);
+        system(um2);
     }
+
+    g_strfreev(lines);
     return TRUE;
 }
 
@@ -457,6 +452,16 @@ static void on_format_clicked(GtkButton *btn, AppData *app) {
     gchar *qdev = g_shell_quote(devpath);
     gchar *qlabel = g_shell_quote(label11);
 
+    /* Surface check ahead of wipefs, opted into as in the main GUI */
+    const gchar *scan_step = "";
+    if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(app->scan_toggle)))
+        scan_step =
+            "if ! command -v sdprep-cli >/dev/null 2>&1; then "
+            "  echo \"ERROR: sdprep-cli not found for the surface scan.\"; exit 1; "
+            "fi; "
+            "echo \"    -> surface scan (sample)...\"; "
+            "sdprep-cli --scan sample --scan-only \"$dev\"; ";
+
     /* FIX: trim whitespace from dtype/dro */
     gchar *script = g_strdup_printf(
         "set -euo pipefail; "
@@ -482,14 +487,31 @@ static void on_format_clicked(GtkButton *btn, AppData *app) {
         "    umount \"$p\" >/dev/null 2>&1 || true; "
         "  done; "
         "}; "
+        "echo \"    -> inhibiting automount...\"; "
+        "n=$(basename \"$(readlink -f \"$dev\")\"); "
+        "case $n in *[0-9]) pn=${n}p ;; *) pn=$n ;; esac; "
+        "rule=/run/udev/rules.d/90-sdprep-$$.rules; "
+        "if [ -d /run/udev ]; then "
+        "  mkdir -p /run/udev/rules.d; "
+        "  printf 'SUBSYSTEM==\"block\", KERNEL==\"%%s|%%s[0-9]*\", "
+        "ENV{UDISKS_AUTO}=\"0\", ENV{UDISKS_IGNORE}=\"1\"\\n' \"$n\" \"$pn\" > \"$rule\"; "
+        "  reload(){ udevadm control --reload; "
+        "    udevadm trigger --action=change --sysname-match=\"$n\" --sysname-match=\"$n*\"; "
+        "    udevadm settle; } >/dev/null 2>&1; "
+        "  trap 'rm -f \"$rule\"; reload || true' EXIT; "
+        "  trap 'exit 130' INT TERM HUP; "
+        "  reload || true; "
+        "fi; "
         "echo \"    -> ensuring unmounted...\"; "
-        "for i in 1 2 3; do unmount_all; udevadm settle >/dev/null 2>&1 || true; sleep 0.2; done; "
+        "unmount_all; "
         "mp=$(lsblk -nrpo NAME,MOUNTPOINT \"$dev\" | awk '$2!=\"\"{print}'); "
         "if [ -n \"$mp\" ]; then "
         "  echo \"ERROR: still mounted:\"; echo \"$mp\"; "
         "  exit 1; "
         "fi; "
         ""
+        "%s"
+        ""
         "echo \"[2/7] wipefs...\"; "
         "wipefs -a \"$dev\"; "
         "echo \"[3/7] partition table...\"; "
@@ -506,9 +528,9 @@ static void on_format_clicked(GtkButton *btn, AppData *app) {
         "if echo \"$dev\" | grep -Eq \"[0-9]$\"; then p1=\"${dev}p1\"; else p1=\"${dev}1\"; fi; "
         "echo \"[6/7] mkfs.fat...\"; "
         "mkfs.fat -F32 -n %s \"$p1\"; "
-        "echo \"[7/7] sync...\"; "
-        "sync; echo DONE;",
-        qdev, qlabel
+        "echo \"[7/7] flush...\"; "
+        "blockdev --flushbufs \"$p1\" \"$dev\"; echo DONE;",
+        qdev, scan_step, qlabel
     );
 
     g_free(qdev);
@@ -594,9 +616,13 @@ static void activate(GtkApplication *gapp, gpointer user_data) {
     gtk_entry_set_text(GTK_ENTRY(app->label_entry), "MICROPYTHON");
     gtk_grid_attach(GTK_GRID(grid), app->label_entry, 1, 1, 3, 1);
 
+    app->scan_toggle =
+        gtk_check_button_new_with_label("Check the card surface first (reads a sample)");
+    gtk_grid_attach(GTK_GRID(grid), app->scan_toggle, 1, 2, 3, 1);
+
     app->progress_bar = gtk_progress_bar_new();
     gtk_progress_bar_set_show_text(GTK_PROGRESS_BAR(app->progress_bar), TRUE);
-    gtk_grid_attach(GTK_GRID(grid), app->progress_bar, 0, 2, 4, 1);
+    gtk_grid_attach(GTK_GRID(grid), app->progress_bar, 0, 3, 4, 1);
 
     GtkWidget *row = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 10);
     gtk_box_pack_start(GTK_BOX(outer), row, FALSE, FALSE, 0);
@@ -0,0 +1,266 @@
+#define _GNU_SOURCE
+#include "sdresume.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sddb.h"
+#include "sdpool.h"
+
+/* resume.tsv holds "card<TAB>image" per card with a checkpoint; the
+   prefix hashes are in resume-<hash of card>.hashes beside it, in the
+   sdhash text format. The hashes are saved before the line, so a crash
+   in between leaves a line whose image no longer matches its hashes,
+   which sdresume_skip() catches. */
+
+#define READ_THREADS 4
+
+static const char *state_dir(void) {
+    const char *dir = getenv("SDPREP_STATE_DIR");
+    return dir && *dir ? dir : SDIO_STATE_DIR;
+}
+
+static void index_path(char *out, size_t outsz) {
+    snprintf(out, outsz, "%s/resume.tsv", state_dir());
+}
+
+static void hashes_path(const char *card, char *out, size_t outsz) {
+    snprintf(out, outsz, "%s/resume-%016llx.hashes", state_dir(),
+             (unsigned long long)sdhash64(card, strlen(card), 0));
+}
+
+/* Tabs and newlines would break the line format. */
+static void squash(char *s) {
+    for (; *s; s++)
+        if (*s == '\t' || *s == '\n') *s = ' ';
+}
+
+void sdresume_card_key(const sdio_dev *d, char *out, size_t outsz) {
+    out[0] = 0;
+    if (!d->blockdev) return;
+    sddb_id id;
+    sddb_identify(d->path, &id);
+    if (id.card[0]) snprintf(out, outsz, "%s", id.card);
+    else snprintf(out, outsz, "%s:%s:%llu", id.reader[0] ? id.reader : "-", d->ident,
+                  (unsigned long long)d->size);
+    squash(out);
+}
+
+static int file_key(const char *path, char *out, size_t outsz) {
+    struct stat st;
+    char *real = realpath(path, NULL);
+    int rc = real && stat(real, &st) == 0 ? 0 : -1;
+    if (rc == 0)
+        snprintf(out, outsz, "%s:%llu:%lld", real, (unsigned long long)st.st_size,
+                 (long long)st.st_mtime);
+    free(real);
+    return rc;
+}
+
+void sdresume_image_key(const char *image, const char *bmap, char *out, size_t outsz) {
+    out[0] = 0;
+    char a[2048], b[2048] = "";
+    if (file_key(image, a, sizeof(a)) != 0) return;
+    if (bmap && file_key(bmap, b, sizeof(b)) != 0) return;
+    snprintf(out, outsz, "%s%s%s", a, bmap ? "+" : "", b);
+    squash(out);
+}
+
+bool sdresume_load(const char *card, const char *image, sdhash_list *hl) {
+    memset(hl, 0, sizeof(*hl));
+    if (!card[0] || !image[0]) return false;
+
+    char path[512];
+    index_path(path, sizeof(path));
+    FILE *fp = fopen(path, "r");
+    if (!fp) return false;
+
+    bool found = false;
+    char line[4608];
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = 0;
+        char *tab = strchr(line, '\t');
+        if (!tab) continue;
+        *tab = 0;
+        if (strcmp(line, card) == 0) found = strcmp(tab + 1, image) == 0;
+    }
+    fclose(fp);
+    if (!found) return false;
+
+    hashes_path(card, path, sizeof(path));
+    if (sdhash_list_load(path, hl) != 0) return false;
+    if (hl->image_size == 0 || hl->block_size == 0 || hl->image_size % hl->block_size) {
+        sdhash_list_free(hl);
+        return false;
+    }
+    return true;
+}
+
+/* Rewrite the index without card's line, plus image's if given. --jobs
+   workers checkpoint at once, so the rewrite holds a lock and each
+   process writes its own tmp file. */
+static int store_line(const char *card, const char *image) {
+    char path[512], tmp[540], lock[528];
+    index_path(path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    snprintf(lock, sizeof(lock), "%s.lock", path);
+    if (mkdir(state_dir(), 0755) != 0 && errno != EEXIST) return -1;
+
+    int lfd = open(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lfd < 0) return -1;
+    while (flock(lfd, LOCK_EX) != 0 && errno == EINTR) {}
+
+    FILE *out = fopen(tmp, "w");
+    if (!out) {
+        int e = errno;
+        close(lfd);
+        errno = e;
+        return -1;
+    }
+    size_t klen = strlen(card);
+    FILE *in = fopen(path, "r");
+    if (in) {
+        char line[4608];
+        while (fgets(line, sizeof(line), in))
+            if (strncmp(line, card, klen) != 0 || line[klen] != '\t') fputs(line, out);
+        fclose(in);
+    }
+    if (image) fprintf(out, "%s\t%s\n", card, image);
+
+    int rc = 0;
+    if (fclose(out) != 0 || rename(tmp, path) != 0) {
+        int e = errno;
+        unlink(tmp);
+        errno = e;
+        rc = -1;
+    }
+    int e = errno;
+    close(lfd);   /* drops the lock */
+    errno = e;
+    return rc;
+}
+
+int sdresume_save(const char *card, const char *image, const sdhash_list *prefix) {
+    if (!card[0] || !image[0]) return 0;
+    if (mkdir(state_dir(), 0755) != 0 && errno != EEXIST) return -1;
+    char path[512];
+    hashes_path(card, path, sizeof(path));
+    if (sdhash_list_save(path, prefix) != 0) return -1;
+    return store_line(card, image);
+}
+
+void sdresume_drop(const char *card) {
+    if (!card[0]) return;
+    char path[512];
+    hashes_path(card, path, sizeof(path));
+    unlink(path);
+    store_line(card, NULL);
+}
+
+int sdresume_check(sdio_dev *d, const sdhash_list *ck, const sdio_extent *map, size_t nmap) {
+    sdhash_list hl = *ck;
+    hl.h = malloc(ck->n * sizeof(*hl.h));
+    if (!hl.h) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(hl.h, ck->h, ck->n * sizeof(*hl.h));
+    /* Unmapped blocks were discarded, not written. */
+    if (map) sdhash_list_mask(&hl, map, nmap);
+
+    size_t checked, bad;
+    int rc = sdhash_sample(d, &hl, SDRESUME_SAMPLES, READ_THREADS, &checked, &bad);
+    sdhash_list_free(&hl);
+    return rc == 0 ? (int)bad : -1;
+}
+
+bool sdresume_skip(sdhash_tee *tee, const sdhash_list *ck) {
+    if (tee->hl.image_size != 0 || tee->hl.block_size != ck->block_size) return false;
+    void *buf = sdpool_get(SDIO_MIB);
+    if (!buf) return false;
+
+    bool ok = true;
+    while (ok && tee->hl.image_size < ck->image_size) {
+        uint64_t left = ck->image_size - tee->hl.image_size;
+        size_t want = left < SDIO_MIB ? (size_t)left : SDIO_MIB;
+        ok = sdhash_tee_fill(tee, tee->hl.image_size, buf, want) == (ssize_t)want;
+    }
+    sdpool_put(buf, SDIO_MIB);
+
+    for (size_t i = 0; ok && i < ck->n; i++) ok = i < tee->hl.n && tee->hl.h[i] == ck->h[i];
+    return ok;
+}
+
+/* Progress of one stretch, as part of the whole write. */
+typedef struct {
+    sdio_progress_fn fn;
+    void            *ctx;
+    uint64_t         base;
+    uint64_t         total;
+} resume_progress;
+
+static void on_progress(void *ctx, uint64_t done, uint64_t total) {
+    (void)total;
+    resume_progress *w = ctx;
+    if (w->fn) w->fn(w->ctx, w->base + done, w->total);
+}
+
+/* The tee's hashes of its first upto bytes (whole blocks). */
+static int checkpoint(const sdhash_tee *tee, uint64_t upto, const char *card, const char *image) {
+    sdhash_list prefix = tee->hl;
+    prefix.n = (size_t)(upto / prefix.block_size);
+    prefix.image_size = (uint64_t)prefix.n * prefix.block_size;
+    if (prefix.n == 0 || prefix.n > tee->hl.n) return 0;
+    return sdresume_save(card, image, &prefix);
+}
+
+int sdresume_write(sdio_dev *d, uint64_t off, uint64_t len, sdhash_tee *tee,
+                   const sdio_sparse *sp, const char *card, const char *image) {
+    uint64_t end = len ? off + len : d->size;
+    if (off > d->size || end > d->size) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    resume_progress w = { d->progress, d->progress_ctx, 0, end - off };
+    d->progress = on_progress;
+    d->progress_ctx = &w;
+
+    /* Stretches end on multiples of SDRESUME_EVERY, so every checkpoint
+       is a whole number of hash blocks. */
+    int rc = 0;
+    uint64_t pos = off;
+    while (pos < end) {
+        uint64_t n = SDRESUME_EVERY - pos % SDRESUME_EVERY;
+        if (n > end - pos) n = end - pos;
+        uint64_t before = tee->hl.image_size;
+        w.base = pos - off;
+
+        if ((rc = sdio_write_sparse(d, pos, n, sdhash_tee_fill, tee, sp)) != 0) {
+            int e = errno;
+            if (e == ECANCELED && sdio_flush(d) == 0)
+                checkpoint(tee, d->reached, card, image);
+            errno = e;
+            break;
+        }
+        uint64_t got = tee->hl.image_size - before;
+        pos += got;
+        if (got < n || pos == end) break;   /* the image or the range ended */
+
+        if ((rc = sdio_flush(d)) != 0) break;
+        if (checkpoint(tee, pos, card, image) != 0 && d->log)
+            d->log(d->log_ctx, "resume: checkpoint not saved");
+    }
+
+    int e = errno;
+    d->progress = w.fn;
+    d->progress_ctx = w.ctx;
+    errno = e;
+    return rc;
+}
@@ -0,0 +1,58 @@
+#ifndef SDRESUME_H
+#define SDRESUME_H
+
+/* ============================================================
+   sdresume – checkpointed image writes
+   A long image write flushes every so often and records how
+   far the card is durably written, with the hash of every
+   block up to there, under the card's identity. When the same
+   card comes back with the same image, the image prefix is
+   re-hashed, a sample of the card's prefix is read back, and
+   the write carries on from the checkpoint.
+   ============================================================ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sdhash.h"
+#include "sdio.h"
+
+#define SDRESUME_EVERY   (256 * SDIO_MIB)   /* bytes between checkpoints */
+#define SDRESUME_SAMPLES 32                 /* prefix blocks read back */
+
+/* Identity of the card in d: its CID when the slot shows one, otherwise
+   the reader, model and size (the read-back sample tells such cards
+   apart). Empty for a regular file. */
+void sdresume_card_key(const sdio_dev *d, char *out, size_t outsz);
+
+/* Identity of an image (and its block map, if any): path, size, mtime. */
+void sdresume_image_key(const char *image, const char *bmap, char *out, size_t outsz);
+
+/* The checkpoint for this card and image: hashes of the written prefix,
+   hl->image_size being its length. False if there is none. */
+bool sdresume_load(const char *card, const char *image, sdhash_list *hl);
+
+/* Record prefix (flushed to the media) as the card's checkpoint. */
+int  sdresume_save(const char *card, const char *image, const sdhash_list *prefix);
+
+/* Forget the card's checkpoint. */
+void sdresume_drop(const char *card);
+
+/* Check a checkpoint against the card: a sample of its blocks (the last
+   one among them) read back, those outside map not counted. Returns the
+   blocks that no longer match, -1 on a read error. */
+int  sdresume_check(sdio_dev *d, const sdhash_list *ck, const sdio_extent *map, size_t nmap);
+
+/* Consume the image prefix of ck through tee (which must be at offset
+   0) and compare its hashes. False if the image no longer matches. */
+bool sdresume_skip(sdhash_tee *tee, const sdhash_list *ck);
+
+/* sdio_write_sparse() of [off, off + len) from tee (len 0: until the
+   image or the device ends), flushed and checkpointed every
+   SDRESUME_EVERY bytes. On abort the flushed part is checkpointed too.
+   Progress through d->progress covers the whole range. */
+int  sdresume_write(sdio_dev *d, uint64_t off, uint64_t len, sdhash_tee *tee,
+                    const sdio_sparse *sp, const char *card, const char *image);
+
+#endif /* SDRESUME_H */
@@ -0,0 +1,279 @@
+#define _GNU_SOURCE
+#include "sdscan.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sdpool.h"
+
+/* Workers take regions from a shared counter, as the hash scans do.
+   Reads go through O_DIRECT (the pool's buffers are aligned), so a
+   region's time is the card's, not the page cache's. A sample is one
+   region picked at random from each of n equal strata, plus the first
+   and last region, where the partition table and FATs live. */
+
+#define MAX_THREADS   16
+#define SLOW_FLOOR_MS 20.0    /* never flag a request faster than this */
+#define BUCKET0_MS    0.25
+
+typedef struct {
+    sdio_dev          *d;
+    const sdscan_opts *o;
+    size_t             region;
+    const uint64_t    *offs;
+    size_t             n;
+    float             *rms;     /* read time per region, -1 = not read */
+    float             *wms;
+    int               *err;
+    signed char       *flag;    /* -1 = fine, else sdscan_flag */
+    uint64_t           total;
+    size_t             next;    /* atomic */
+    uint64_t           done;    /* atomic */
+    int                fatal;   /* atomic: ENOMEM or ECANCELED */
+} scan_ctx;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static uint32_t region_len(const scan_ctx *c, uint64_t off) {
+    uint64_t left = c->d->size - off;
+    return (uint32_t)(left < c->region ? left : c->region);
+}
+
+/* Different for every offset, so a card that maps two regions onto the
+   same flash (a fake capacity) fails the compare. */
+static void pattern(unsigned char *buf, size_t len, uint64_t off) {
+    uint64_t x = off * 0x9E3779B97F4A7C15ULL | 1;
+    for (size_t i = 0; i + 8 <= len; i += 8) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        memcpy(buf + i, &x, 8);
+    }
+}
+
+static void set_fatal(scan_ctx *c, int e) {
+    int zero = 0;
+    __atomic_compare_exchange_n(&c->fatal, &zero, e, false,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static void scan_regions(scan_ctx *c, bool report) {
+    unsigned char *buf = sdpool_get(c->region);
+    unsigned char *pat = c->o->write ? sdpool_get(c->region) : NULL;
+    if (!buf || (c->o->write && !pat)) {
+        set_fatal(c, ENOMEM);
+        goto out;
+    }
+
+    for (;;) {
+        if (__atomic_load_n(&c->fatal, __ATOMIC_RELAXED)) break;
+        size_t i = __atomic_fetch_add(&c->next, 1, __ATOMIC_RELAXED);
+        if (i >= c->n) break;
+
+        uint64_t off = c->offs[i];
+        uint32_t len = region_len(c, off);
+        double t;
+        if (pat) {
+            pattern(pat, len, off);
+            t = now_ms();
+            int rc = sdio_write_at(c->d, pat, len, off);
+            c->wms[i] = (float)(now_ms() - t);
+            if (rc != 0) {
+                if (errno == ECANCELED) {
+                    set_fatal(c, ECANCELED);
+                    break;
+                }
+                c->err[i] = errno;
+                c->flag[i] = SDSCAN_UNWRITABLE;
+                goto next;
+            }
+        }
+
+        t = now_ms();
+        int rc = sdio_read_at(c->d, buf, len, off);
+        c->rms[i] = (float)(now_ms() - t);
+        if (rc != 0) {
+            if (errno == ECANCELED) {
+                set_fatal(c, ECANCELED);
+                break;
+            }
+            c->err[i] = errno;
+            c->flag[i] = SDSCAN_UNREADABLE;
+            c->rms[i] = -1.0f;
+        } else if (pat && memcmp(buf, pat, len) != 0) {
+            c->flag[i] = SDSCAN_MISMATCH;
+        }
+
+    next:;
+        uint64_t done = __atomic_add_fetch(&c->done, len, __ATOMIC_RELAXED);
+        if (report && c->d->progress)
+            c->d->progress(c->d->progress_ctx, done, c->total);
+    }
+out:
+    sdpool_put(pat, c->region);
+    sdpool_put(buf, c->region);
+}
+
+static void *scan_worker(void *arg) {
+    scan_regions(arg, false);
+    return NULL;
+}
+
+/* Regions to visit, ascending. */
+static uint64_t *pick_regions(uint64_t size, size_t region, const sdscan_opts *o, size_t *n) {
+    uint64_t nreg = (size + region - 1) / region;
+    size_t want = o->samples ? o->samples : SDSCAN_SAMPLES;
+    if (o->full || want >= nreg) want = (size_t)nreg;
+    uint64_t *offs = malloc((want ? want : 1) * sizeof(*offs));
+    if (!offs) return NULL;
+
+    if (want == nreg) {
+        for (size_t i = 0; i < want; i++) offs[i] = (uint64_t)i * region;
+    } else {
+        uint64_t seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+        for (size_t i = 0; i < want; i++) {
+            uint64_t lo = nreg * i / want, hi = nreg * (i + 1) / want;
+            seed ^= seed << 13;
+            seed ^= seed >> 7;
+            seed ^= seed << 17;
+            uint64_t r = lo + seed % (hi - lo);
+            if (i == 0) r = 0;
+            if (i == want - 1) r = nreg - 1;
+            offs[i] = r * region;
+        }
+    }
+    *n = want;
+    return offs;
+}
+
+static int cmp_float(const void *a, const void *b) {
+    float x = *(const float *)a, y = *(const float *)b;
+    return (x > y) - (x < y);
+}
+
+/* Median, 99th percentile and maximum of the times that are >= 0. */
+static void percentiles(const float *ms, size_t n, double *med, double *p99, double *max) {
+    *med = *p99 = *max = 0.0;
+    float *v = malloc((n ? n : 1) * sizeof(*v));
+    if (!v) return;
+    size_t k = 0;
+    for (size_t i = 0; i < n; i++)
+        if (ms[i] >= 0) v[k++] = ms[i];
+    if (k) {
+        qsort(v, k, sizeof(*v), cmp_float);
+        *med = v[k / 2];
+        *p99 = v[(k * 99) / 100 < k ? (k * 99) / 100 : k - 1];
+        *max = v[k - 1];
+    }
+    free(v);
+}
+
+double sdscan_bucket_ms(int i) {
+    return BUCKET0_MS * (double)(1u << i);
+}
+
+static int bucket_of(double ms) {
+    int b = 0;
+    while (b < SDSCAN_BUCKETS - 1 && ms >= sdscan_bucket_ms(b)) b++;
+    return b;
+}
+
+int sdscan_run(sdio_dev *d, const sdscan_opts *o, sdscan_result *r) {
+    memset(r, 0, sizeof(*r));
+    size_t region = o->region ? o->region : SDSCAN_REGION;
+    int threads = o->threads > 0 ? o->threads : 4;
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+    double factor = o->slow_factor > 0 ? o->slow_factor : 8.0;
+
+    scan_ctx c;
+    memset(&c, 0, sizeof(c));
+    c.d = d;
+    c.o = o;
+    c.region = region;
+    c.offs = pick_regions(d->size, region, o, &c.n);
+    c.rms = calloc(c.n ? c.n : 1, sizeof(*c.rms));
+    c.wms = calloc(c.n ? c.n : 1, sizeof(*c.wms));
+    c.err = calloc(c.n ? c.n : 1, sizeof(*c.err));
+    c.flag = malloc(c.n ? c.n : 1);
+    int rc = -1;
+    if (!c.offs || !c.rms || !c.wms || !c.err || !c.flag) {
+        errno = ENOMEM;
+        goto out;
+    }
+    memset(c.flag, -1, c.n);
+    for (size_t i = 0; i < c.n; i++) c.total += region_len(&c, c.offs[i]);
+
+    double t0 = now_ms();
+    pthread_t tids[MAX_THREADS];
+    int started = 0;
+    for (int i = 1; i < threads; i++)
+        if (pthread_create(&tids[started], NULL, scan_worker, &c) == 0) started++;
+    scan_regions(&c, true);   /* the caller's thread reports progress */
+    for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+    if (c.fatal) {
+        errno = c.fatal;
+        goto out;
+    }
+
+    r->regions = c.n;
+    r->bytes = c.total;
+    r->seconds = (now_ms() - t0) / 1e3;
+    r->mbps = r->seconds > 0 ? (double)c.total / r->seconds / 1e6 : 0.0;
+    percentiles(c.rms, c.n, &r->median_ms, &r->p99_ms, &r->max_ms);
+    double wp99, wmax;
+    if (o->write) percentiles(c.wms, c.n, &r->write_median_ms, &wp99, &wmax);
+
+    size_t cap = 0;
+    for (size_t i = 0; i < c.n; i++) {
+        if (c.rms[i] >= 0) r->hist[bucket_of(c.rms[i])]++;
+        if (o->write && c.flag[i] != SDSCAN_UNWRITABLE) r->write_hist[bucket_of(c.wms[i])]++;
+
+        double ms = c.rms[i] > c.wms[i] ? c.rms[i] : c.wms[i];
+        int flag = c.flag[i];
+        if (flag < 0 &&
+            ((c.rms[i] > factor * r->median_ms && c.rms[i] > SLOW_FLOOR_MS) ||
+             (o->write && c.wms[i] > factor * r->write_median_ms && c.wms[i] > SLOW_FLOOR_MS)))
+            flag = SDSCAN_SLOW;
+        if (flag < 0) continue;
+
+        if (r->nflagged == cap) {
+            size_t nc = cap ? cap * 2 : 16;
+            sdscan_region *nf = realloc(r->flagged, nc * sizeof(*nf));
+            if (!nf) {
+                errno = ENOMEM;
+                sdscan_free(r);
+                goto out;
+            }
+            r->flagged = nf;
+            cap = nc;
+        }
+        r->flagged[r->nflagged++] = (sdscan_region){
+            c.offs[i], region_len(&c, c.offs[i]), (sdscan_flag)flag, c.err[i], ms
+        };
+        if (flag == SDSCAN_SLOW) r->slow++;
+        else r->bad++;
+    }
+    rc = 0;
+
+out:
+    free((void *)c.offs);
+    free(c.rms);
+    free(c.wms);
+    free(c.err);
+    free(c.flag);
+    return rc;
+}
+
+void sdscan_free(sdscan_result *r) {
+    free(r->flagged);
+    r->flagged = NULL;
+    r->nflagged = 0;
+}
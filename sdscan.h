@@ -0,0 +1,72 @@
+#ifndef SDSCAN_H
+#define SDSCAN_H
+
+/* ============================================================
+   sdscan – surface scan before a card is provisioned
+   Reads (or writes a pattern to and reads back) the whole
+   card or a spread-out sample of it, several aligned requests
+   in flight, and times every region. Unreadable regions and
+   those far slower than the card's median are flagged.
+   ============================================================ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sdio.h"
+
+#define SDSCAN_REGION   (1024 * 1024)   /* default bytes per request */
+#define SDSCAN_SAMPLES  256             /* default regions in a sample */
+#define SDSCAN_BUCKETS  16              /* latency histogram, see sdscan_bucket_ms() */
+
+typedef struct {
+    bool   full;          /* every region, else a sample */
+    bool   write;         /* write a pattern first and compare (destroys data) */
+    size_t region;        /* bytes per request, 0 = SDSCAN_REGION */
+    size_t samples;       /* regions in a sample, 0 = SDSCAN_SAMPLES */
+    int    threads;       /* requests in flight, 0 = 4 */
+    double slow_factor;   /* slower than this x the median is flagged, 0 = 8 */
+} sdscan_opts;
+
+typedef enum {
+    SDSCAN_UNREADABLE,
+    SDSCAN_UNWRITABLE,
+    SDSCAN_MISMATCH,      /* read back differs from what was written */
+    SDSCAN_SLOW
+} sdscan_flag;
+
+typedef struct {
+    uint64_t    off;
+    uint32_t    len;
+    sdscan_flag flag;
+    int         err;      /* errno when unreadable or unwritable */
+    double      ms;       /* slowest request on the region */
+} sdscan_region;
+
+typedef struct {
+    size_t         regions;          /* scanned */
+    uint64_t       bytes;
+    double         seconds;
+    double         mbps;             /* bytes scanned per second */
+    double         median_ms;        /* per read request */
+    double         p99_ms;
+    double         max_ms;
+    double         write_median_ms;  /* with write, else 0 */
+    uint64_t       hist[SDSCAN_BUCKETS];        /* reads */
+    uint64_t       write_hist[SDSCAN_BUCKETS];
+    sdscan_region *flagged;          /* sorted by offset (malloc'd) */
+    size_t         nflagged;
+    size_t         bad;              /* unreadable, unwritable or mismatching */
+    size_t         slow;
+} sdscan_result;
+
+/* Scan d. Regions that fail are recorded, not fatal; the call fails only
+   for lack of memory or on abort (ECANCELED). Progress goes through
+   d->progress. */
+int  sdscan_run(sdio_dev *d, const sdscan_opts *o, sdscan_result *r);
+void sdscan_free(sdscan_result *r);
+
+/* Upper edge of histogram bucket i in ms (the last one is open). */
+double sdscan_bucket_ms(int i);
+
+#endif /* SDSCAN_H */
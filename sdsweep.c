@@ -0,0 +1,211 @@
+#define _GNU_SOURCE
+#include "sdsweep.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Runs are written with sdio_write() and a fill that walks the run's
+   pieces, with skip_zero set: the FATs and padding are mostly zeros, and
+   a card that can zero ranges itself gets those without a transfer. They
+   are batch writes, so the two flushes here are the only ones. */
+
+void sdsweep_init(sdsweep *s) {
+    memset(s, 0, sizeof(*s));
+}
+
+void sdsweep_free(sdsweep *s) {
+    for (size_t i = 0; i < s->n; i++) free(s->p[i].buf);
+    free(s->p);
+    memset(s, 0, sizeof(*s));
+}
+
+static int push(sdsweep *s, uint64_t off, uint64_t len, unsigned char *buf, bool commit) {
+    if (s->n == s->cap) {
+        size_t nc = s->cap ? s->cap * 2 : 16;
+        sdsweep_piece *np = realloc(s->p, nc * sizeof(*np));
+        if (!np) {
+            errno = ENOMEM;
+            return -1;
+        }
+        s->p = np;
+        s->cap = nc;
+    }
+    s->p[s->n++] = (sdsweep_piece){ off, len, buf, commit };
+    return 0;
+}
+
+int sdsweep_add(sdsweep *s, uint64_t off, const void *buf, size_t len, bool commit) {
+    if (len == 0) return 0;
+    unsigned char *copy = malloc(len);
+    if (!copy) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(copy, buf, len);
+    if (push(s, off, len, copy, commit) != 0) {
+        free(copy);
+        return -1;
+    }
+    return 0;
+}
+
+int sdsweep_zero(sdsweep *s, uint64_t off, uint64_t len) {
+    return len ? push(s, off, len, NULL, false) : 0;
+}
+
+uint64_t sdsweep_bytes(const sdsweep *s) {
+    uint64_t b = 0;
+    for (size_t i = 0; i < s->n; i++) b += s->p[i].len;
+    return b;
+}
+
+/* Copy the part of piece p inside [off, off + len) into buf. Returns the
+   bytes it covers there. */
+static uint64_t overlay(const sdsweep_piece *p, uint64_t off, unsigned char *buf, uint64_t len) {
+    uint64_t s = p->off > off ? p->off : off;
+    uint64_t e = p->off + p->len < off + len ? p->off + p->len : off + len;
+    if (s >= e) return 0;
+    if (p->buf) memcpy(buf + (s - off), p->buf + (s - p->off), e - s);
+    else memset(buf + (s - off), 0, e - s);
+    return e - s;
+}
+
+/* overlay(), also setting the bytes it covers in mask. */
+static void mark(const sdsweep_piece *p, uint64_t off, unsigned char *buf,
+                 unsigned char *mask, uint64_t len) {
+    if (overlay(p, off, buf, len) == 0) return;
+    uint64_t s = p->off > off ? p->off : off;
+    uint64_t e = p->off + p->len < off + len ? p->off + p->len : off + len;
+    memset(mask + (s - off), 1, e - s);
+}
+
+int sdsweep_hash(const sdsweep *s, uint64_t len, uint32_t block_size, sdhash_list *hl) {
+    memset(hl, 0, sizeof(*hl));
+    size_t n = (size_t)((len + block_size - 1) / block_size);
+    hl->h = calloc(n ? n : 1, sizeof(*hl->h));
+    unsigned char *buf = malloc(block_size);
+    unsigned char *mask = malloc(block_size);
+    if (!hl->h || !buf || !mask) {
+        free(buf);
+        free(mask);
+        sdhash_list_free(hl);
+        errno = ENOMEM;
+        return -1;
+    }
+    hl->n = n;
+    hl->image_size = len;
+    hl->block_size = block_size;
+
+    /* Commit pieces land on top of the sweep, so they are laid last. A
+       block is covered by the union of both: the MBR sector is a commit
+       piece with the sweep's zeros after it. */
+    for (size_t b = 0; b < n; b++) {
+        uint64_t off = (uint64_t)b * block_size;
+        uint64_t blen = len - off < block_size ? len - off : block_size;
+        memset(mask, 0, (size_t)blen);
+        for (int commit = 0; commit < 2; commit++)
+            for (size_t i = 0; i < s->n; i++)
+                if (s->p[i].commit == commit) mark(&s->p[i], off, buf, mask, blen);
+        if (memchr(mask, 0, (size_t)blen)) continue;
+        hl->h[b] = sdhash64(buf, (size_t)blen, 0);
+    }
+    free(buf);
+    free(mask);
+    return 0;
+}
+
+static int cmp_piece(const void *a, const void *b) {
+    const sdsweep_piece *x = a, *y = b;
+    if (x->commit != y->commit) return x->commit - y->commit;
+    return (x->off > y->off) - (x->off < y->off);
+}
+
+/* Fill for one run: its pieces back to back. */
+typedef struct {
+    const sdsweep_piece *p;
+    size_t               i, end;
+    uint64_t             at;     /* bytes of p[i] consumed */
+} run_src;
+
+static ssize_t run_fill(void *ctx, uint64_t off, void *buf, size_t len) {
+    (void)off;
+    run_src *r = ctx;
+    size_t got = 0;
+    while (got < len && r->i < r->end) {
+        const sdsweep_piece *p = &r->p[r->i];
+        uint64_t left = p->len - r->at;
+        size_t k = left < len - got ? (size_t)left : len - got;
+        if (p->buf) memcpy((char *)buf + got, p->buf + r->at, k);
+        else memset((char *)buf + got, 0, k);
+        got += k;
+        r->at += k;
+        if (r->at == p->len) {
+            r->i++;
+            r->at = 0;
+        }
+    }
+    return (ssize_t)got;
+}
+
+/* Progress of one run, as part of the whole sweep. */
+typedef struct {
+    sdio_progress_fn fn;
+    void            *ctx;
+    uint64_t         base;
+    uint64_t         total;
+} sweep_progress;
+
+static void on_progress(void *ctx, uint64_t done, uint64_t total) {
+    (void)total;
+    sweep_progress *w = ctx;
+    if (w->fn) w->fn(w->ctx, w->base + done, w->total);
+}
+
+/* Write the pieces [from, to) of the sorted list, merged into runs. */
+static int write_phase(sdio_dev *d, const sdsweep *s, size_t from, size_t to, sweep_progress *w) {
+    static const sdio_sparse sp = { .skip_zero = true, .batch = true };
+    size_t i = from;
+    while (i < to) {
+        size_t j = i + 1;
+        uint64_t end = s->p[i].off + s->p[i].len;
+        for (; j < to && s->p[j].off <= end; j++) {
+            if (s->p[j].off < end) {
+                errno = EINVAL;
+                return -1;
+            }
+            end += s->p[j].len;
+        }
+        run_src r = { s->p, i, j, 0 };
+        if (sdio_write_sparse(d, s->p[i].off, end - s->p[i].off, run_fill, &r, &sp) != 0) return -1;
+        w->base += end - s->p[i].off;
+        i = j;
+    }
+    return 0;
+}
+
+int sdsweep_write(sdio_dev *d, sdsweep *s) {
+    qsort(s->p, s->n, sizeof(*s->p), cmp_piece);
+    size_t ncommit = 0;
+    while (ncommit < s->n && s->p[s->n - 1 - ncommit].commit) ncommit++;
+    size_t split = s->n - ncommit;
+
+    sweep_progress w = { d->progress, d->progress_ctx, 0, sdsweep_bytes(s) };
+    d->progress = on_progress;
+    d->progress_ctx = &w;
+
+    int rc = write_phase(d, s, 0, split, &w);
+    if (rc == 0) rc = sdio_flush(d);
+    if (rc == 0 && sdio_cancelled(d)) {
+        errno = ECANCELED;
+        rc = -1;
+    }
+    if (rc == 0) rc = write_phase(d, s, split, s->n, &w);
+    if (rc == 0) rc = sdio_flush(d);
+
+    int e = errno;
+    d->progress = w.fn;
+    d->progress_ctx = w.ctx;
+    errno = e;
+    return rc;
+}
@@ -0,0 +1,54 @@
+#ifndef SDSWEEP_H
+#define SDSWEEP_H
+
+/* ============================================================
+   sdsweep – everything a job writes, in one ascending sweep
+   Pieces (data or zeros) are queued in any order, sorted,
+   and adjacent ones merged into runs; each run is one engine
+   write with large requests. One flush then puts the sweep on
+   the media before the commit pieces (partition table, boot
+   sectors) go out, followed by a last flush. Until the commit
+   lands the card holds nothing that looks valid.
+   ============================================================ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sdhash.h"
+#include "sdio.h"
+
+typedef struct {
+    uint64_t       off;
+    uint64_t       len;
+    unsigned char *buf;      /* NULL = zeros */
+    bool           commit;   /* written after the sweep is on the media */
+} sdsweep_piece;
+
+typedef struct {
+    sdsweep_piece *p;
+    size_t         n;
+    size_t         cap;
+} sdsweep;
+
+void sdsweep_init(sdsweep *s);
+void sdsweep_free(sdsweep *s);
+
+/* Queue len bytes of buf (copied) at device offset off. Pieces of the
+   same phase must not overlap; a commit piece may overwrite the sweep. */
+int  sdsweep_add(sdsweep *s, uint64_t off, const void *buf, size_t len, bool commit);
+int  sdsweep_zero(sdsweep *s, uint64_t off, uint64_t len);
+
+/* Hash list of the card's first len bytes as the sweep and commit leave
+   them. Blocks not wholly covered by pieces are not recorded (0). */
+int  sdsweep_hash(const sdsweep *s, uint64_t len, uint32_t block_size, sdhash_list *hl);
+
+/* Bytes the sweep and the commit write. */
+uint64_t sdsweep_bytes(const sdsweep *s);
+
+/* Sweep, flush, commit, flush. Progress through d->progress covers all
+   of it. EINVAL if pieces of one phase overlap; ECANCELED on abort,
+   before the commit. */
+int  sdsweep_write(sdio_dev *d, sdsweep *s);
+
+#endif /* SDSWEEP_H */